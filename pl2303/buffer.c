@@ -0,0 +1,153 @@
+/*
+ * PL2303 Driver ring buffer routines
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "pl2303.h"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, Pl2303InitializeRingBuffer)
+#pragma alloc_text(PAGE, Pl2303FreeRingBuffer)
+#endif /* defined ALLOC_PRAGMA */
+
+NTSTATUS
+Pl2303InitializeRingBuffer(
+    _Out_ PRING_BUFFER RingBuffer,
+    _In_ ULONG Size)
+{
+    PAGED_CODE();
+    NT_ASSERT(Size != 0);
+
+    Pl2303Debug(         "%s. RingBuffer=%p, Size=%lu\n",
+                __FUNCTION__, RingBuffer,    Size);
+
+    RingBuffer->Buffer = ExAllocatePoolWithTag(NonPagedPool, Size, PL2303_BUFFER_TAG);
+    if (!RingBuffer->Buffer)
+    {
+        Pl2303Error(         "%s. Allocating ring buffer of size %lu failed\n",
+                    __FUNCTION__, Size);
+        RingBuffer->Size = 0;
+        RingBuffer->ReadIndex = 0;
+        RingBuffer->Count = 0;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RingBuffer->Size = Size;
+    RingBuffer->ReadIndex = 0;
+    RingBuffer->Count = 0;
+    return STATUS_SUCCESS;
+}
+
+VOID
+Pl2303FreeRingBuffer(
+    _Inout_ PRING_BUFFER RingBuffer)
+{
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. RingBuffer=%p\n",
+                __FUNCTION__, RingBuffer);
+
+    if (RingBuffer->Buffer)
+        ExFreePoolWithTag(RingBuffer->Buffer, PL2303_BUFFER_TAG);
+    RingBuffer->Buffer = NULL;
+    RingBuffer->Size = 0;
+    RingBuffer->ReadIndex = 0;
+    RingBuffer->Count = 0;
+}
+
+ULONG
+Pl2303RingBufferWrite(
+    _Inout_ PRING_BUFFER RingBuffer,
+    _In_reads_bytes_(Length) const UCHAR *Data,
+    _In_ ULONG Length)
+{
+    ULONG WriteIndex;
+    ULONG Chunk;
+
+    if (Length > RingBuffer->Size - RingBuffer->Count)
+        Length = RingBuffer->Size - RingBuffer->Count;
+    if (!Length)
+        return 0;
+
+    WriteIndex = RingBuffer->ReadIndex + RingBuffer->Count;
+    if (WriteIndex >= RingBuffer->Size)
+        WriteIndex -= RingBuffer->Size;
+
+    Chunk = min(Length, RingBuffer->Size - WriteIndex);
+    RtlCopyMemory(RingBuffer->Buffer + WriteIndex, Data, Chunk);
+    if (Chunk < Length)
+        RtlCopyMemory(RingBuffer->Buffer, Data + Chunk, Length - Chunk);
+
+    RingBuffer->Count += Length;
+    return Length;
+}
+
+ULONG
+Pl2303RingBufferRead(
+    _Inout_ PRING_BUFFER RingBuffer,
+    _Out_writes_bytes_to_(Length, return) PUCHAR Data,
+    _In_ ULONG Length)
+{
+    ULONG Chunk;
+
+    if (Length > RingBuffer->Count)
+        Length = RingBuffer->Count;
+    if (!Length)
+        return 0;
+
+    Chunk = min(Length, RingBuffer->Size - RingBuffer->ReadIndex);
+    RtlCopyMemory(Data, RingBuffer->Buffer + RingBuffer->ReadIndex, Chunk);
+    if (Chunk < Length)
+        RtlCopyMemory(Data + Chunk, RingBuffer->Buffer, Length - Chunk);
+
+    RingBuffer->ReadIndex += Length;
+    if (RingBuffer->ReadIndex >= RingBuffer->Size)
+        RingBuffer->ReadIndex -= RingBuffer->Size;
+    RingBuffer->Count -= Length;
+    return Length;
+}
+
+VOID
+Pl2303RingBufferPurge(
+    _Inout_ PRING_BUFFER RingBuffer)
+{
+    RingBuffer->ReadIndex = 0;
+    RingBuffer->Count = 0;
+}
+
+/*
+ * Moves the contents of RingBuffer to the start of NewBuffer, which must be
+ * empty and large enough to hold them, and swaps the two. NewBuffer is left
+ * with the old storage for the caller to free.
+ */
+VOID
+Pl2303RingBufferExchange(
+    _Inout_ PRING_BUFFER RingBuffer,
+    _Inout_ PRING_BUFFER NewBuffer)
+{
+    RING_BUFFER OldBuffer;
+
+    NT_ASSERT(NewBuffer->Count == 0);
+    NT_ASSERT(NewBuffer->Size >= RingBuffer->Count);
+
+    NewBuffer->ReadIndex = 0;
+    NewBuffer->Count = Pl2303RingBufferRead(RingBuffer, NewBuffer->Buffer, RingBuffer->Count);
+
+    OldBuffer = *RingBuffer;
+    *RingBuffer = *NewBuffer;
+    *NewBuffer = OldBuffer;
+}
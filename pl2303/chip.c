@@ -0,0 +1,395 @@
+/*
+ * PL2303 Driver chip variants
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#define PL2303_TRACE_COMPONENT PL2303_TRACE_USB
+#include "pl2303.h"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, Pl2303ClassifyChip)
+#endif /* defined ALLOC_PRAGMA */
+
+/*
+ * Vendor initialization sequences, as sent by the vendor's driver. The values
+ * read back are not used, but the reads are part of the sequence the chip
+ * expects. None of the steps depend on each other, so each sequence is sent
+ * as a batch. The G series has none of these registers; it only needs its
+ * data pipes reset.
+ */
+static const PL2303_VENDOR_STEP Pl2303LegacyInitSequence[] =
+{
+    { TRUE,  0x8484, 0 },
+    { FALSE, 0x0404, 0 },
+    { TRUE,  0x8484, 0 },
+    { TRUE,  0x8383, 0 },
+    { TRUE,  0x8484, 0 },
+    { FALSE, 0x0404, 0 },
+    { TRUE,  0x8484, 0 },
+    { TRUE,  0x8383, 0 },
+    { FALSE, 0,      1 },
+    { FALSE, 1,      0 },
+    { FALSE, 2,      0x24 },
+};
+
+static const PL2303_VENDOR_STEP Pl2303HxInitSequence[] =
+{
+    { TRUE,  0x8484, 0 },
+    { FALSE, 0x0404, 0 },
+    { TRUE,  0x8484, 0 },
+    { TRUE,  0x8383, 0 },
+    { TRUE,  0x8484, 0 },
+    { FALSE, 0x0404, 0 },
+    { TRUE,  0x8484, 0 },
+    { TRUE,  0x8383, 0 },
+    { FALSE, 0,      1 },
+    { FALSE, 1,      0 },
+    { FALSE, 2,      0x44 },
+};
+
+static const PL2303_VENDOR_STEP Pl2303GInitSequence[] =
+{
+    { FALSE, PL2303_G_RESET_REGISTER, PL2303_G_RESET_PIPES },
+};
+
+/*
+ * Rates that can be set directly, by chip. Any other rate is set through the
+ * baud rate divisor, if the chip has one.
+ */
+static const ULONG Pl2303LegacyBaudRates[] =
+{
+    75, 150, 300, 600, 1200, 1800, 2400, 3600, 4800, 7200, 9600, 14400,
+    19200, 28800, 38400, 57600, 115200, 230400, 460800, 614400, 921600,
+    1228800,
+};
+
+static const ULONG Pl2303BaudRates[] =
+{
+    75, 150, 300, 600, 1200, 1800, 2400, 3600, 4800, 7200, 9600, 14400,
+    19200, 28800, 38400, 57600, 115200, 230400, 460800, 614400, 921600,
+    1228800, 2457600, 3000000, 6000000,
+};
+
+static const ULONG Pl2303GBaudRates[] =
+{
+    75, 150, 300, 600, 1200, 1800, 2400, 3600, 4800, 7200, 9600, 14400,
+    19200, 28800, 38400, 57600, 115200, 230400, 460800, 614400, 921600,
+    1228800, 2457600, 3000000, 6000000, 12000000,
+};
+
+/* Rates with a SERIAL_BAUD_* flag. 134.5 baud cannot be set, 134 is close */
+static const struct
+{
+    ULONG BaudRate;
+    ULONG Flag;
+} Pl2303SettableBaudRates[] =
+{
+    { 75,       SERIAL_BAUD_075 },
+    { 110,      SERIAL_BAUD_110 },
+    { 134,      SERIAL_BAUD_134_5 },
+    { 150,      SERIAL_BAUD_150 },
+    { 300,      SERIAL_BAUD_300 },
+    { 600,      SERIAL_BAUD_600 },
+    { 1200,     SERIAL_BAUD_1200 },
+    { 1800,     SERIAL_BAUD_1800 },
+    { 2400,     SERIAL_BAUD_2400 },
+    { 4800,     SERIAL_BAUD_4800 },
+    { 7200,     SERIAL_BAUD_7200 },
+    { 9600,     SERIAL_BAUD_9600 },
+    { 14400,    SERIAL_BAUD_14400 },
+    { 19200,    SERIAL_BAUD_19200 },
+    { 38400,    SERIAL_BAUD_38400 },
+    { 56000,    SERIAL_BAUD_56K },
+    { 57600,    SERIAL_BAUD_57600 },
+    { 115200,   SERIAL_BAUD_115200 },
+    { 128000,   SERIAL_BAUD_128K },
+};
+
+#define PL2303_INIT_SEQUENCE(Sequence) Sequence, RTL_NUMBER_OF(Sequence)
+#define PL2303_BAUD_RATES(Rates) Rates, RTL_NUMBER_OF(Rates)
+
+/*
+ * XON/XOFF is done by the driver on every chip, and the chip's FIFO size does
+ * not matter to it, so neither is recorded here.
+ */
+const PL2303_CHIP_INFO Pl2303Chips[Pl2303ChipTypes] =
+{
+    {
+        Pl2303ChipLegacy, "PL2303H",
+        1228800, PL2303_CHIP_RTS_CTS,
+        Pl2303BaudDivisor, PL2303_BAUD_RATES(Pl2303LegacyBaudRates),
+        PL2303_VENDOR_READ_REQUEST, PL2303_VENDOR_WRITE_REQUEST,
+        PL2303_INIT_SEQUENCE(Pl2303LegacyInitSequence),
+        PL2303_FLOW_CONTROL_REGISTER, PL2303_FLOW_CONTROL_MASK,
+        PL2303_FLOW_CONTROL_NONE, PL2303_LEGACY_FLOW_CONTROL_RTS_CTS
+    },
+    {
+        Pl2303ChipHx, "PL2303HX",
+        6000000, PL2303_CHIP_RTS_CTS,
+        Pl2303BaudDivisor, PL2303_BAUD_RATES(Pl2303BaudRates),
+        PL2303_VENDOR_READ_REQUEST, PL2303_VENDOR_WRITE_REQUEST,
+        PL2303_INIT_SEQUENCE(Pl2303HxInitSequence),
+        PL2303_FLOW_CONTROL_REGISTER, PL2303_FLOW_CONTROL_MASK,
+        PL2303_FLOW_CONTROL_NONE, PL2303_FLOW_CONTROL_RTS_CTS
+    },
+    {
+        Pl2303ChipHxd, "PL2303HXD",
+        12000000, PL2303_CHIP_RTS_CTS,
+        Pl2303BaudDivisor, PL2303_BAUD_RATES(Pl2303BaudRates),
+        PL2303_VENDOR_READ_REQUEST, PL2303_VENDOR_WRITE_REQUEST,
+        PL2303_INIT_SEQUENCE(Pl2303HxInitSequence),
+        PL2303_FLOW_CONTROL_REGISTER, PL2303_FLOW_CONTROL_MASK,
+        PL2303_FLOW_CONTROL_NONE, PL2303_FLOW_CONTROL_RTS_CTS
+    },
+    {
+        Pl2303ChipTa, "PL2303TA",
+        6000000, PL2303_CHIP_RTS_CTS,
+        Pl2303BaudAltDivisor, PL2303_BAUD_RATES(Pl2303BaudRates),
+        PL2303_VENDOR_READ_REQUEST, PL2303_VENDOR_WRITE_REQUEST,
+        PL2303_INIT_SEQUENCE(Pl2303HxInitSequence),
+        PL2303_FLOW_CONTROL_REGISTER, PL2303_FLOW_CONTROL_MASK,
+        PL2303_FLOW_CONTROL_NONE, PL2303_FLOW_CONTROL_RTS_CTS
+    },
+    {
+        Pl2303ChipTb, "PL2303TB",
+        12000000, PL2303_CHIP_RTS_CTS,
+        Pl2303BaudAltDivisor, PL2303_BAUD_RATES(Pl2303BaudRates),
+        PL2303_VENDOR_READ_REQUEST, PL2303_VENDOR_WRITE_REQUEST,
+        PL2303_INIT_SEQUENCE(Pl2303HxInitSequence),
+        PL2303_FLOW_CONTROL_REGISTER, PL2303_FLOW_CONTROL_MASK,
+        PL2303_FLOW_CONTROL_NONE, PL2303_FLOW_CONTROL_RTS_CTS
+    },
+    {
+        Pl2303ChipG, "PL2303G",
+        12000000, PL2303_CHIP_RTS_CTS,
+        Pl2303BaudDirect, PL2303_BAUD_RATES(Pl2303GBaudRates),
+        PL2303_G_VENDOR_READ_REQUEST, PL2303_G_VENDOR_WRITE_REQUEST,
+        PL2303_INIT_SEQUENCE(Pl2303GInitSequence),
+        PL2303_G_FLOW_CONTROL_REGISTER, PL2303_G_FLOW_CONTROL_MASK,
+        PL2303_G_FLOW_CONTROL_NONE, PL2303_G_FLOW_CONTROL_RTS_CTS
+    },
+};
+
+/*
+ * Classifies the chip by its device descriptor. The TA and TB share their
+ * revisions with G series parts; the caller tells them apart by whether the
+ * HX status register can be read.
+ */
+PL2303_CHIP_TYPE
+Pl2303ClassifyChip(
+    _In_ const USB_DEVICE_DESCRIPTOR *DeviceDescriptor)
+{
+    PAGED_CODE();
+
+    /* Older chips have 8 byte control packets, or are CDC class devices */
+    if (DeviceDescriptor->bDeviceClass == USB_DEVICE_CLASS_COMMUNICATIONS ||
+        DeviceDescriptor->bMaxPacketSize0 != 64)
+        return Pl2303ChipLegacy;
+
+    if (DeviceDescriptor->bcdUSB == 0x110)
+    {
+        if (DeviceDescriptor->bcdDevice == 0x400)
+            return Pl2303ChipHxd;
+        return Pl2303ChipHx;
+    }
+
+    if (DeviceDescriptor->bcdUSB == 0x200)
+    {
+        switch (DeviceDescriptor->bcdDevice)
+        {
+            case 0x300:
+                return Pl2303ChipTa;
+            case 0x500:
+                return Pl2303ChipTb;
+            case 0x100:
+            case 0x105:
+            case 0x305:
+            case 0x400:
+            case 0x405:
+            case 0x505:
+            case 0x600:
+            case 0x605:
+            case 0x700:
+            case 0x705:
+            case 0x905:
+            case 0x1005:
+                return Pl2303ChipG;
+        }
+    }
+
+    Pl2303Warn(         "%s. Unknown chip (bcdUSB 0x%x, bcdDevice 0x%x), assuming HX\n",
+               __FUNCTION__, DeviceDescriptor->bcdUSB, DeviceDescriptor->bcdDevice);
+    return Pl2303ChipHx;
+}
+
+/*
+ * Divisor encoding: rate = 12 MHz * 32 / (mantissa * 4^exponent), with a
+ * 9 bit mantissa and 3 bit exponent.
+ */
+static
+ULONG
+Pl2303EncodeBaudRateDivisor(
+    _In_ ULONG BaudRate,
+    _Out_ PULONG ActualBaudRate)
+{
+    const ULONG Baseline = 12000000 * 32;
+    ULONG Mantissa;
+    ULONG Exponent = 0;
+
+    Mantissa = Baseline / BaudRate;
+    if (Mantissa == 0)
+        Mantissa = 1;
+    while (Mantissa >= 512)
+    {
+        if (Exponent < 7)
+        {
+            Mantissa >>= 2;
+            Exponent++;
+        }
+        else
+        {
+            Mantissa = 511;
+            break;
+        }
+    }
+
+    *ActualBaudRate = (Baseline / Mantissa) >> (Exponent << 1);
+    return 0x80000000 | Exponent << 9 | Mantissa;
+}
+
+/*
+ * Divisor encoding of the TA and TB: rate = 12 MHz * 32 / (mantissa *
+ * 2^exponent), with an 11 bit mantissa and 4 bit exponent whose lowest bit
+ * is kept apart from the others.
+ */
+static
+ULONG
+Pl2303EncodeBaudRateAltDivisor(
+    _In_ ULONG BaudRate,
+    _Out_ PULONG ActualBaudRate)
+{
+    const ULONG Baseline = 12000000 * 32;
+    ULONG Mantissa;
+    ULONG Exponent = 0;
+
+    Mantissa = Baseline / BaudRate;
+    if (Mantissa == 0)
+        Mantissa = 1;
+    while (Mantissa >= 2048)
+    {
+        if (Exponent < 15)
+        {
+            Mantissa >>= 1;
+            Exponent++;
+        }
+        else
+        {
+            Mantissa = 2047;
+            break;
+        }
+    }
+
+    *ActualBaudRate = (Baseline / Mantissa) >> Exponent;
+    return 0x80000000 | (Exponent & 1) << 16 | (Exponent & ~1) << 12 | Mantissa;
+}
+
+/*
+ * Returns the value to send in SET_LINE for the given rate. Rates in the
+ * chip's table are sent as they are; others use the divisor, or the nearest
+ * rate in the table on chips without one. Optionally returns the rate the
+ * chip will actually run at.
+ */
+ULONG
+Pl2303EncodeBaudRate(
+    _In_ const PL2303_CHIP_INFO *Chip,
+    _In_ ULONG BaudRate,
+    _Out_opt_ PULONG ActualBaudRate)
+{
+    ULONG Low = 0;
+    ULONG High = Chip->BaudRateCount - 1;
+    ULONG Middle;
+    ULONG Nearest;
+    ULONG Actual;
+    ULONG Encoded;
+
+    BaudRate = max(BaudRate, 1);
+    BaudRate = min(BaudRate, Chip->MaxBaudRate);
+
+    /* Find the first table entry not below the rate */
+    while (Low < High)
+    {
+        Middle = (Low + High) / 2;
+        if (Chip->BaudRates[Middle] < BaudRate)
+            Low = Middle + 1;
+        else
+            High = Middle;
+    }
+    Nearest = Chip->BaudRates[Low];
+    if (Low > 0 &&
+        Nearest > BaudRate &&
+        BaudRate - Chip->BaudRates[Low - 1] < Nearest - BaudRate)
+    {
+        Nearest = Chip->BaudRates[Low - 1];
+    }
+
+    if (Nearest == BaudRate || Chip->BaudEncoding == Pl2303BaudDirect)
+    {
+        Actual = Nearest;
+        Encoded = Nearest;
+    }
+    else if (Chip->BaudEncoding == Pl2303BaudAltDivisor)
+    {
+        Encoded = Pl2303EncodeBaudRateAltDivisor(BaudRate, &Actual);
+    }
+    else
+    {
+        Encoded = Pl2303EncodeBaudRateDivisor(BaudRate, &Actual);
+    }
+
+    if (ActualBaudRate)
+        *ActualBaudRate = Actual;
+    return Encoded;
+}
+
+/*
+ * Returns the SERIAL_BAUD_* flags of the rates the chip runs at within 1% of
+ * the nominal rate, plus SERIAL_BAUD_USER if it takes arbitrary rates.
+ */
+ULONG
+Pl2303GetSettableBaud(
+    _In_ const PL2303_CHIP_INFO *Chip)
+{
+    ULONG SettableBaud = 0;
+    ULONG BaudRate;
+    ULONG Actual;
+    ULONG i;
+
+    for (i = 0; i < RTL_NUMBER_OF(Pl2303SettableBaudRates); i++)
+    {
+        BaudRate = Pl2303SettableBaudRates[i].BaudRate;
+        if (BaudRate > Chip->MaxBaudRate)
+            continue;
+        (VOID)Pl2303EncodeBaudRate(Chip, BaudRate, &Actual);
+        if ((Actual > BaudRate ? Actual - BaudRate : BaudRate - Actual) <= BaudRate / 100)
+            SettableBaud |= Pl2303SettableBaudRates[i].Flag;
+    }
+
+    if (Chip->BaudEncoding != Pl2303BaudDirect)
+        SettableBaud |= SERIAL_BAUD_USER;
+
+    return SettableBaud;
+}
@@ -0,0 +1,215 @@
+/*
+ * PL2303 USB-Serial Driver
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#define PL2303_TRACE_COMPONENT PL2303_TRACE_IOCTL
+#include "pl2303.h"
+
+/*
+ * Every port gets a control device next to it, \\.\Pl2303Control<n>, that
+ * serves the driver's private IOCTLs. The port itself is opened exclusively
+ * and opening it keeps the device out of selective suspend, so diagnostic
+ * tools should not have to open it. The control device is not part of the
+ * PnP stack; the port creates it in AddDevice and deletes it when removed.
+ * Only administrators and the system may open it, since the flight recorder
+ * shows the port's traffic.
+ */
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, Pl2303CreateControlDevice)
+#pragma alloc_text(PAGE, Pl2303DeleteControlDevice)
+#endif /* defined ALLOC_PRAGMA */
+
+NTSTATUS
+Pl2303CreateControlDevice(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ ULONG DeviceNumber)
+{
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PDEVICE_OBJECT ControlDevice;
+    PCONTROL_EXTENSION ControlExtension;
+    UNICODE_STRING DeviceName;
+    WCHAR DeviceNameBuffer[RTL_NUMBER_OF(L"\\Device\\Pl2303Control4294967295")];
+    UNICODE_STRING LinkName;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p, DeviceNumber=%lu\n",
+                __FUNCTION__, DeviceObject,    DeviceNumber);
+
+    NT_ASSERT(DeviceExtension->ControlDevice == NULL);
+
+    RtlInitEmptyUnicodeString(&DeviceName, DeviceNameBuffer, sizeof(DeviceNameBuffer));
+    Status = RtlUnicodeStringPrintf(&DeviceName,
+                                    L"\\Device\\Pl2303Control%lu",
+                                    DeviceNumber);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. RtlUnicodeStringPrintf failed with %08lx\n",
+                    __FUNCTION__, Status);
+        return Status;
+    }
+
+    LinkName.MaximumLength = sizeof(L"\\DosDevices\\Pl2303Control4294967295");
+    LinkName.Length = 0;
+    LinkName.Buffer = ExAllocatePoolWithTag(PagedPool,
+                                            LinkName.MaximumLength,
+                                            PL2303_TAG);
+    if (!LinkName.Buffer)
+    {
+        Pl2303Error(         "%s. Allocating link name buffer failed\n",
+                    __FUNCTION__);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    Status = RtlUnicodeStringPrintf(&LinkName,
+                                    L"\\DosDevices\\Pl2303Control%lu",
+                                    DeviceNumber);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. RtlUnicodeStringPrintf failed with %08lx\n",
+                    __FUNCTION__, Status);
+        ExFreePoolWithTag(LinkName.Buffer, PL2303_TAG);
+        return Status;
+    }
+
+    Status = IoCreateDeviceSecure(DeviceObject->DriverObject,
+                                  sizeof(CONTROL_EXTENSION),
+                                  &DeviceName,
+                                  FILE_DEVICE_UNKNOWN,
+                                  FILE_DEVICE_SECURE_OPEN,
+                                  FALSE,
+                                  &SDDL_DEVOBJ_SYS_ALL_ADM_ALL,
+                                  &GUID_DEVCLASS_PL2303_CONTROL,
+                                  &ControlDevice);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. IoCreateDeviceSecure failed with %08lx\n",
+                    __FUNCTION__, Status);
+        ExFreePoolWithTag(LinkName.Buffer, PL2303_TAG);
+        return Status;
+    }
+
+    ControlExtension = ControlDevice->DeviceExtension;
+    RtlZeroMemory(ControlExtension, sizeof(*ControlExtension));
+    ControlExtension->IsControlDevice = TRUE;
+    ControlExtension->PortDevice = DeviceObject;
+    IoInitializeRemoveLock(&ControlExtension->RemoveLock, PL2303_TAG, 0, 0);
+
+    Status = IoCreateSymbolicLink(&LinkName, &DeviceName);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. IoCreateSymbolicLink failed with %08lx\n",
+                    __FUNCTION__, Status);
+        IoDeleteDevice(ControlDevice);
+        ExFreePoolWithTag(LinkName.Buffer, PL2303_TAG);
+        return Status;
+    }
+
+    Pl2303Debug(         "%s. Control device is '%wZ'\n",
+                __FUNCTION__, &LinkName);
+
+    ControlDevice->Flags |= DO_BUFFERED_IO;
+    ControlDevice->Flags &= ~DO_DEVICE_INITIALIZING;
+
+    DeviceExtension->ControlDevice = ControlDevice;
+    DeviceExtension->ControlLinkName = LinkName;
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Deletes the control device once requests already passed to the port have
+ * finished. Handles that are still open keep the device object, but no
+ * longer reach the port.
+ */
+VOID
+Pl2303DeleteControlDevice(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PDEVICE_OBJECT ControlDevice = DeviceExtension->ControlDevice;
+    PCONTROL_EXTENSION ControlExtension;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p\n",
+                __FUNCTION__, DeviceObject);
+
+    if (!ControlDevice)
+        return;
+
+    (VOID)IoDeleteSymbolicLink(&DeviceExtension->ControlLinkName);
+    ExFreePoolWithTag(DeviceExtension->ControlLinkName.Buffer, PL2303_TAG);
+    RtlInitEmptyUnicodeString(&DeviceExtension->ControlLinkName, NULL, 0);
+
+    ControlExtension = ControlDevice->DeviceExtension;
+    Status = IoAcquireRemoveLock(&ControlExtension->RemoveLock, DeviceObject);
+    NT_ASSERT(NT_SUCCESS(Status));
+    IoReleaseRemoveLockAndWait(&ControlExtension->RemoveLock, DeviceObject);
+
+    DeviceExtension->ControlDevice = NULL;
+    IoDeleteDevice(ControlDevice);
+}
+
+/*
+ * Handles every request sent to a control device. Opening and closing it
+ * always succeeds, device control requests are passed on to the port's
+ * private IOCTL handler, and anything else is refused.
+ */
+NTSTATUS
+NTAPI
+Pl2303DispatchControlDevice(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp)
+{
+    NTSTATUS Status;
+    PCONTROL_EXTENSION ControlExtension = DeviceObject->DeviceExtension;
+    PIO_STACK_LOCATION IoStack;
+
+    NT_ASSERT(ControlExtension->IsControlDevice);
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                __FUNCTION__, DeviceObject,    Irp);
+
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    switch (IoStack->MajorFunction)
+    {
+        case IRP_MJ_CREATE:
+        case IRP_MJ_CLEANUP:
+        case IRP_MJ_CLOSE:
+            Status = STATUS_SUCCESS;
+            break;
+        case IRP_MJ_DEVICE_CONTROL:
+            Status = IoAcquireRemoveLock(&ControlExtension->RemoveLock, Irp);
+            if (!NT_SUCCESS(Status))
+                break;
+            Status = Pl2303PrivateDeviceControl(ControlExtension->PortDevice, Irp);
+            IoReleaseRemoveLock(&ControlExtension->RemoveLock, Irp);
+            break;
+        default:
+            Status = STATUS_INVALID_DEVICE_REQUEST;
+            break;
+    }
+
+    NT_ASSERT(Status != STATUS_PENDING);
+    Irp->IoStatus.Status = Status;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    return Status;
+}
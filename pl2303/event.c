@@ -0,0 +1,286 @@
+/*
+ * PL2303 Driver communication event handling
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#define PL2303_TRACE_COMPONENT PL2303_TRACE_EVENT
+#include "pl2303.h"
+
+/*
+ * At most one IOCTL_SERIAL_WAIT_ON_MASK request is pending at a time. Events
+ * selected by the wait mask complete it; if none is pending, they are
+ * collected in the event history and complete the next wait immediately.
+ * Events outside the wait mask are discarded.
+ */
+
+#define PL2303_VALID_EVENTS (SERIAL_EV_RXCHAR | SERIAL_EV_RXFLAG | SERIAL_EV_TXEMPTY | \
+                             SERIAL_EV_CTS | SERIAL_EV_DSR | SERIAL_EV_RLSD |          \
+                             SERIAL_EV_BREAK | SERIAL_EV_ERR | SERIAL_EV_RING |        \
+                             SERIAL_EV_PERR | SERIAL_EV_RX80FULL |                     \
+                             SERIAL_EV_EVENT1 | SERIAL_EV_EVENT2)
+
+_Function_class_(DRIVER_CANCEL)
+static DRIVER_CANCEL Pl2303CancelWait;
+
+/*
+ * Takes ownership of the pending wait, if there is one and it is not being
+ * cancelled. Must be called with the event spin lock held.
+ */
+_Requires_lock_held_(DeviceExtension->EventSpinLock)
+static
+PIRP
+Pl2303TakeWaitIrp(
+    _In_ PDEVICE_EXTENSION DeviceExtension)
+{
+    PIRP Irp = DeviceExtension->WaitIrp;
+
+    if (!Irp || !IoSetCancelRoutine(Irp, NULL))
+        return NULL;
+
+    DeviceExtension->WaitIrp = NULL;
+    return Irp;
+}
+
+static
+VOID
+Pl2303CompleteWait(
+    _In_ PIRP Irp,
+    _In_ NTSTATUS Status,
+    _In_ ULONG Events)
+{
+    if (NT_SUCCESS(Status))
+    {
+        *(PULONG)Irp->AssociatedIrp.SystemBuffer = Events;
+        Irp->IoStatus.Information = sizeof(ULONG);
+    }
+    else
+    {
+        Irp->IoStatus.Information = 0;
+    }
+    Irp->IoStatus.Status = Status;
+    IoCompleteRequest(Irp, NT_SUCCESS(Status) ? IO_SERIAL_INCREMENT : IO_NO_INCREMENT);
+}
+
+_Function_class_(DRIVER_CANCEL)
+static
+VOID
+NTAPI
+Pl2303CancelWait(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PIRP Irp)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    KIRQL OldIrql;
+
+    IoReleaseCancelSpinLock(Irp->CancelIrql);
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                __FUNCTION__, DeviceObject,    Irp);
+
+    KeAcquireSpinLock(&DeviceExtension->EventSpinLock, &OldIrql);
+    NT_ASSERT(DeviceExtension->WaitIrp == Irp);
+    DeviceExtension->WaitIrp = NULL;
+    KeReleaseSpinLock(&DeviceExtension->EventSpinLock, OldIrql);
+
+    Pl2303CompleteWait(Irp, STATUS_CANCELLED, 0);
+}
+
+NTSTATUS
+Pl2303GetWaitMask(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp)
+{
+    PIO_STACK_LOCATION IoStack;
+    PDEVICE_EXTENSION DeviceExtension;
+    KIRQL OldIrql;
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                __FUNCTION__, DeviceObject,    Irp);
+
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    DeviceExtension = DeviceObject->DeviceExtension;
+
+    if (IoStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(ULONG))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    KeAcquireSpinLock(&DeviceExtension->EventSpinLock, &OldIrql);
+    *(PULONG)Irp->AssociatedIrp.SystemBuffer = DeviceExtension->WaitMask;
+    KeReleaseSpinLock(&DeviceExtension->EventSpinLock, OldIrql);
+    Irp->IoStatus.Information = sizeof(ULONG);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+Pl2303SetWaitMask(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp)
+{
+    PIO_STACK_LOCATION IoStack;
+    PDEVICE_EXTENSION DeviceExtension;
+    ULONG WaitMask;
+    KIRQL OldIrql;
+    PIRP WaitIrp;
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                __FUNCTION__, DeviceObject,    Irp);
+
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    DeviceExtension = DeviceObject->DeviceExtension;
+
+    if (IoStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(ULONG))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    WaitMask = *(PULONG)Irp->AssociatedIrp.SystemBuffer;
+    if (WaitMask & ~PL2303_VALID_EVENTS)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    /* A pending wait completes with no events when the mask changes */
+    KeAcquireSpinLock(&DeviceExtension->EventSpinLock, &OldIrql);
+    DeviceExtension->WaitMask = WaitMask;
+    DeviceExtension->EventHistory = 0;
+    WaitIrp = Pl2303TakeWaitIrp(DeviceExtension);
+    KeReleaseSpinLock(&DeviceExtension->EventSpinLock, OldIrql);
+
+    if (WaitIrp)
+        Pl2303CompleteWait(WaitIrp, STATUS_SUCCESS, 0);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+Pl2303WaitOnMask(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp)
+{
+    PIO_STACK_LOCATION IoStack;
+    PDEVICE_EXTENSION DeviceExtension;
+    ULONG Events;
+    KIRQL OldIrql;
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                __FUNCTION__, DeviceObject,    Irp);
+
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    DeviceExtension = DeviceObject->DeviceExtension;
+
+    if (IoStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(ULONG))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    KeAcquireSpinLock(&DeviceExtension->EventSpinLock, &OldIrql);
+    if (!DeviceExtension->WaitMask || DeviceExtension->WaitIrp)
+    {
+        KeReleaseSpinLock(&DeviceExtension->EventSpinLock, OldIrql);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    Events = DeviceExtension->EventHistory;
+    if (Events)
+    {
+        DeviceExtension->EventHistory = 0;
+        KeReleaseSpinLock(&DeviceExtension->EventSpinLock, OldIrql);
+        *(PULONG)Irp->AssociatedIrp.SystemBuffer = Events;
+        Irp->IoStatus.Information = sizeof(ULONG);
+        return STATUS_SUCCESS;
+    }
+
+    IoMarkIrpPending(Irp);
+    (VOID)IoSetCancelRoutine(Irp, Pl2303CancelWait);
+    if (Irp->Cancel && IoSetCancelRoutine(Irp, NULL))
+    {
+        KeReleaseSpinLock(&DeviceExtension->EventSpinLock, OldIrql);
+        Pl2303CompleteWait(Irp, STATUS_CANCELLED, 0);
+        return STATUS_PENDING;
+    }
+    DeviceExtension->WaitIrp = Irp;
+    KeReleaseSpinLock(&DeviceExtension->EventSpinLock, OldIrql);
+    return STATUS_PENDING;
+}
+
+/*
+ * Returns whether any of Events is in the wait mask. This is only a hint for
+ * skipping work that would detect unwanted events; it takes no lock.
+ */
+BOOLEAN
+Pl2303IsWaitingForEvents(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ ULONG Events)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+
+    return (*(volatile ULONG *)&DeviceExtension->WaitMask & Events) != 0;
+}
+
+VOID
+Pl2303SignalEvents(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ ULONG Events)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    KIRQL OldIrql;
+    PIRP WaitIrp;
+
+    NT_ASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
+
+    /* Most events are not waited for; don't take the lock for those */
+    if (!Pl2303IsWaitingForEvents(DeviceObject, Events))
+        return;
+
+    KeAcquireSpinLock(&DeviceExtension->EventSpinLock, &OldIrql);
+    Events &= DeviceExtension->WaitMask;
+    DeviceExtension->EventHistory |= Events;
+    Events = DeviceExtension->EventHistory;
+    WaitIrp = Events ? Pl2303TakeWaitIrp(DeviceExtension) : NULL;
+    if (WaitIrp)
+        DeviceExtension->EventHistory = 0;
+    KeReleaseSpinLock(&DeviceExtension->EventSpinLock, OldIrql);
+
+    if (WaitIrp)
+    {
+        Pl2303Debug(         "%s. Irp=%p, Events=0x%lx\n",
+                    __FUNCTION__, WaitIrp, Events);
+        Pl2303CompleteWait(WaitIrp, STATUS_SUCCESS, Events);
+    }
+}
+
+VOID
+Pl2303FlushEvents(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ NTSTATUS Status)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    KIRQL OldIrql;
+    PIRP WaitIrp;
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Status=%08lx\n",
+                __FUNCTION__, DeviceObject,    Status);
+
+    KeAcquireSpinLock(&DeviceExtension->EventSpinLock, &OldIrql);
+    DeviceExtension->EventHistory = 0;
+    WaitIrp = Pl2303TakeWaitIrp(DeviceExtension);
+    KeReleaseSpinLock(&DeviceExtension->EventSpinLock, OldIrql);
+
+    if (WaitIrp)
+        Pl2303CompleteWait(WaitIrp, Status, 0);
+}
@@ -1,413 +1,1277 @@
-/*
- * PL2303 Driver Serial IOCTL handling
- * Copyright (C) 2012-2019  Thomas Faber
- *
- * This library is free software; you can redistribute it and/or
- * modify it under the terms of the GNU Lesser General Public
- * License as published by the Free Software Foundation; either
- * version 2.1 of the License, or (at your option) any later version.
- *
- * This library is distributed in the hope that it will be useful,
- * but WITHOUT ANY WARRANTY; without even the implied warranty of
- * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
- * Lesser General Public License for more details.
- *
- * You should have received a copy of the GNU Lesser General Public
- * License along with this library; if not, write to the Free Software
- * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
- */
-
-#include "pl2303.h"
-
-static NTSTATUS Pl2303GetBaudRate(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
-static NTSTATUS Pl2303SetBaudRate(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
-static NTSTATUS Pl2303GetLineControl(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
-static NTSTATUS Pl2303SetLineControl(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
-
-#ifdef ALLOC_PRAGMA
-#pragma alloc_text(PAGE, Pl2303GetBaudRate)
-#pragma alloc_text(PAGE, Pl2303SetBaudRate)
-#pragma alloc_text(PAGE, Pl2303GetLineControl)
-#pragma alloc_text(PAGE, Pl2303SetLineControl)
-#pragma alloc_text(PAGE, Pl2303DispatchDeviceControl)
-#endif /* defined ALLOC_PRAGMA */
-
-NTSTATUS
-Pl2303SetLine(
-    _In_ PDEVICE_OBJECT DeviceObject)
-{
-    PDEVICE_EXTENSION DeviceExtension;
-
-    PAGED_CODE();
-
-    Pl2303Debug(         "%s. DeviceObject=%p\n",
-                __FUNCTION__, DeviceObject);
-
-    DeviceExtension = DeviceObject->DeviceExtension;
-
-    return Pl2303UsbSetLine(DeviceObject,
-                            DeviceExtension->BaudRate,
-                            DeviceExtension->StopBits,
-                            DeviceExtension->Parity,
-                            DeviceExtension->DataBits);
-}
-
-static
-NTSTATUS
-Pl2303GetBaudRate(
-    _In_ PDEVICE_OBJECT DeviceObject,
-    _Inout_ PIRP Irp)
-{
-    PIO_STACK_LOCATION IoStack;
-    PDEVICE_EXTENSION DeviceExtension;
-    PSERIAL_BAUD_RATE BaudRate;
-
-    PAGED_CODE();
-
-    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
-                __FUNCTION__, DeviceObject,    Irp);
-
-    IoStack = IoGetCurrentIrpStackLocation(Irp);
-    DeviceExtension = DeviceObject->DeviceExtension;
-
-    if (IoStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(*BaudRate))
-    {
-        return STATUS_BUFFER_TOO_SMALL;
-    }
-
-    BaudRate = Irp->AssociatedIrp.SystemBuffer;
-    ExAcquireFastMutex(&DeviceExtension->LineStateMutex);
-    BaudRate->BaudRate = DeviceExtension->BaudRate;
-    ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
-    Irp->IoStatus.Information = sizeof(*BaudRate);
-    return STATUS_SUCCESS;
-}
-
-static
-NTSTATUS
-Pl2303SetBaudRate(
-    _In_ PDEVICE_OBJECT DeviceObject,
-    _Inout_ PIRP Irp)
-{
-    PIO_STACK_LOCATION IoStack;
-    PDEVICE_EXTENSION DeviceExtension;
-    const SERIAL_BAUD_RATE *BaudRate;
-
-    PAGED_CODE();
-
-    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
-                __FUNCTION__, DeviceObject,    Irp);
-
-    IoStack = IoGetCurrentIrpStackLocation(Irp);
-    DeviceExtension = DeviceObject->DeviceExtension;
-
-    if (IoStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(*BaudRate))
-    {
-        return STATUS_BUFFER_TOO_SMALL;
-    }
-
-    BaudRate = Irp->AssociatedIrp.SystemBuffer;
-    ExAcquireFastMutex(&DeviceExtension->LineStateMutex);
-    DeviceExtension->BaudRate = BaudRate->BaudRate;
-    ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
-    return Pl2303SetLine(DeviceObject);
-}
-
-static
-NTSTATUS
-Pl2303GetLineControl(
-    _In_ PDEVICE_OBJECT DeviceObject,
-    _Inout_ PIRP Irp)
-{
-    PIO_STACK_LOCATION IoStack;
-    PDEVICE_EXTENSION DeviceExtension;
-    PSERIAL_LINE_CONTROL LineControl;
-
-    PAGED_CODE();
-
-    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
-                __FUNCTION__, DeviceObject,    Irp);
-
-    IoStack = IoGetCurrentIrpStackLocation(Irp);
-    DeviceExtension = DeviceObject->DeviceExtension;
-
-    if (IoStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(*LineControl))
-    {
-        return STATUS_BUFFER_TOO_SMALL;
-    }
-
-    LineControl = Irp->AssociatedIrp.SystemBuffer;
-    ExAcquireFastMutex(&DeviceExtension->LineStateMutex);
-    LineControl->StopBits = DeviceExtension->StopBits;
-    LineControl->Parity = DeviceExtension->Parity;
-    LineControl->WordLength = DeviceExtension->DataBits;
-    ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
-    Irp->IoStatus.Information = sizeof(*LineControl);
-    return STATUS_SUCCESS;
-}
-
-static
-NTSTATUS
-Pl2303SetLineControl(
-    _In_ PDEVICE_OBJECT DeviceObject,
-    _Inout_ PIRP Irp)
-{
-    PIO_STACK_LOCATION IoStack;
-    PDEVICE_EXTENSION DeviceExtension;
-    const SERIAL_LINE_CONTROL *LineControl;
-
-    PAGED_CODE();
-
-    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
-                __FUNCTION__, DeviceObject,    Irp);
-
-    IoStack = IoGetCurrentIrpStackLocation(Irp);
-    DeviceExtension = DeviceObject->DeviceExtension;
-
-    if (IoStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(*LineControl))
-    {
-        return STATUS_BUFFER_TOO_SMALL;
-    }
-
-    LineControl = Irp->AssociatedIrp.SystemBuffer;
-    ExAcquireFastMutex(&DeviceExtension->LineStateMutex);
-    DeviceExtension->StopBits = LineControl->StopBits;
-    DeviceExtension->Parity = LineControl->Parity;
-    DeviceExtension->DataBits = LineControl->WordLength;
-    ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
-    return Pl2303SetLine(DeviceObject);
-}
-
-static
-NTSTATUS
-Pl2303GetChars(
-    _In_ PDEVICE_OBJECT DeviceObject,
-    _Inout_ PIRP Irp)
-{
-    PIO_STACK_LOCATION IoStack;
-    PDEVICE_EXTENSION DeviceExtension;
-    PSERIAL_CHARS Chars;
-
-    PAGED_CODE();
-
-    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
-                __FUNCTION__, DeviceObject,    Irp);
-
-    IoStack = IoGetCurrentIrpStackLocation(Irp);
-    DeviceExtension = DeviceObject->DeviceExtension;
-
-    if (IoStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(*Chars))
-    {
-        return STATUS_BUFFER_TOO_SMALL;
-    }
-
-    Chars = Irp->AssociatedIrp.SystemBuffer;
-    ExAcquireFastMutex(&DeviceExtension->LineStateMutex);
-    RtlCopyMemory(Chars,
-                  &DeviceExtension->Chars,
-                  sizeof(Chars));
-    ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
-    Irp->IoStatus.Information = sizeof(*Chars);
-    return STATUS_SUCCESS;
-}
-
-static
-NTSTATUS
-Pl2303GetHandFlow(
-    _In_ PDEVICE_OBJECT DeviceObject,
-    _Inout_ PIRP Irp)
-{
-    PIO_STACK_LOCATION IoStack;
-    PDEVICE_EXTENSION DeviceExtension;
-    PSERIAL_HANDFLOW HandFlow;
-
-    PAGED_CODE();
-
-    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
-                __FUNCTION__, DeviceObject,    Irp);
-
-    IoStack = IoGetCurrentIrpStackLocation(Irp);
-    DeviceExtension = DeviceObject->DeviceExtension;
-
-    if (IoStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(*HandFlow))
-    {
-        return STATUS_BUFFER_TOO_SMALL;
-    }
-
-    HandFlow = Irp->AssociatedIrp.SystemBuffer;
-    ExAcquireFastMutex(&DeviceExtension->LineStateMutex);
-    RtlCopyMemory(HandFlow,
-                  &DeviceExtension->HandFlow,
-                  sizeof(HandFlow));
-    ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
-    Irp->IoStatus.Information = sizeof(*HandFlow);
-    return STATUS_SUCCESS;
-}
-
-static
-PCSTR
-SerialGetIoctlName(
-    _In_ ULONG IoControlCode)
-{
-    switch (IoControlCode)
-    {
-        case IOCTL_SERIAL_SET_BAUD_RATE: return "IOCTL_SERIAL_SET_BAUD_RATE";
-        case IOCTL_SERIAL_GET_BAUD_RATE: return "IOCTL_SERIAL_GET_BAUD_RATE";
-        case IOCTL_SERIAL_GET_MODEM_CONTROL: return "IOCTL_SERIAL_GET_MODEM_CONTROL";
-        case IOCTL_SERIAL_SET_MODEM_CONTROL: return "IOCTL_SERIAL_SET_MODEM_CONTROL";
-        case IOCTL_SERIAL_SET_FIFO_CONTROL: return "IOCTL_SERIAL_SET_FIFO_CONTROL";
-        case IOCTL_SERIAL_SET_LINE_CONTROL: return "IOCTL_SERIAL_SET_LINE_CONTROL";
-        case IOCTL_SERIAL_GET_LINE_CONTROL: return "IOCTL_SERIAL_GET_LINE_CONTROL";
-        case IOCTL_SERIAL_SET_TIMEOUTS: return "IOCTL_SERIAL_SET_TIMEOUTS";
-        case IOCTL_SERIAL_GET_TIMEOUTS: return "IOCTL_SERIAL_GET_TIMEOUTS";
-        case IOCTL_SERIAL_SET_CHARS: return "IOCTL_SERIAL_SET_CHARS";
-        case IOCTL_SERIAL_GET_CHARS: return "IOCTL_SERIAL_GET_CHARS";
-        case IOCTL_SERIAL_SET_DTR: return "IOCTL_SERIAL_SET_DTR";
-        case IOCTL_SERIAL_CLR_DTR: return "IOCTL_SERIAL_SET_DTR";
-        case IOCTL_SERIAL_RESET_DEVICE: return "IOCTL_SERIAL_RESET_DEVICE";
-        case IOCTL_SERIAL_SET_RTS: return "IOCTL_SERIAL_SET_RTS";
-        case IOCTL_SERIAL_CLR_RTS: return "IOCTL_SERIAL_CLR_RTS";
-        case IOCTL_SERIAL_SET_XOFF: return "IOCTL_SERIAL_SET_XOFF";
-        case IOCTL_SERIAL_SET_XON: return "IOCTL_SERIAL_SET_XON";
-        case IOCTL_SERIAL_SET_BREAK_ON: return "IOCTL_SERIAL_SET_BREAK_ON";
-        case IOCTL_SERIAL_SET_BREAK_OFF: return "IOCTL_SERIAL_SET_BREAK_OFF";
-        case IOCTL_SERIAL_SET_QUEUE_SIZE: return "IOCTL_SERIAL_SET_QUEUE_SIZE";
-        case IOCTL_SERIAL_GET_WAIT_MASK: return "IOCTL_SERIAL_GET_WAIT_MASK";
-        case IOCTL_SERIAL_SET_WAIT_MASK: return "IOCTL_SERIAL_SET_WAIT_MASK";
-        case IOCTL_SERIAL_WAIT_ON_MASK: return "IOCTL_SERIAL_WAIT_ON_MASK";
-        case IOCTL_SERIAL_IMMEDIATE_CHAR: return "IOCTL_SERIAL_IMMEDIATE_CHAR";
-        case IOCTL_SERIAL_PURGE: return "IOCTL_SERIAL_PURGE";
-        case IOCTL_SERIAL_GET_HANDFLOW: return "IOCTL_SERIAL_GET_HANDFLOW";
-        case IOCTL_SERIAL_SET_HANDFLOW: return "IOCTL_SERIAL_SET_HANDFLOW";
-        case IOCTL_SERIAL_GET_MODEMSTATUS: return "IOCTL_SERIAL_GET_MODEMSTATUS";
-        case IOCTL_SERIAL_GET_DTRRTS: return "IOCTL_SERIAL_GET_DTRRTS";
-        case IOCTL_SERIAL_GET_COMMSTATUS: return "IOCTL_SERIAL_GET_COMMSTATUS";
-        case IOCTL_SERIAL_GET_PROPERTIES: return "IOCTL_SERIAL_GET_PROPERTIES";
-        case IOCTL_SERIAL_XOFF_COUNTER: return "IOCTL_SERIAL_XOFF_COUNTER";
-        case IOCTL_SERIAL_LSRMST_INSERT: return "IOCTL_SERIAL_LSRMST_INSERT";
-        case IOCTL_SERIAL_CONFIG_SIZE: return "IOCTL_SERIAL_CONFIG_SIZE";
-        case IOCTL_SERIAL_GET_STATS: return "IOCTL_SERIAL_GET_STATS";
-        case IOCTL_SERIAL_CLEAR_STATS: return "IOCTL_SERIAL_CLEAR_STATS";
-        default: return "Unknown ioctl";
-    }
-}
-
-NTSTATUS
-NTAPI
-Pl2303DispatchDeviceControl(
-    _In_ PDEVICE_OBJECT DeviceObject,
-    _Inout_ PIRP Irp)
-{
-    NTSTATUS Status;
-    PIO_STACK_LOCATION IoStack;
-    PDEVICE_EXTENSION DeviceExtension;
-    ULONG IoControlCode;
-
-    PAGED_CODE();
-
-    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
-                __FUNCTION__, DeviceObject,    Irp);
-
-    IoStack = IoGetCurrentIrpStackLocation(Irp);
-    NT_ASSERT(IoStack->MajorFunction == IRP_MJ_DEVICE_CONTROL ||
-              IoStack->MajorFunction == IRP_MJ_INTERNAL_DEVICE_CONTROL);
-
-    DeviceExtension = DeviceObject->DeviceExtension;
-
-    if (DeviceExtension->PnpState == Deleted)
-    {
-        Pl2303Warn(         "%s. Device already deleted\n",
-                   __FUNCTION__);
-        Status = STATUS_NO_SUCH_DEVICE;
-        Irp->IoStatus.Status = Status;
-        IoCompleteRequest(Irp, IO_NO_INCREMENT);
-        return Status;
-    }
-
-    IoControlCode = IoStack->Parameters.DeviceIoControl.IoControlCode;
-    switch (IoControlCode)
-    {
-        case IOCTL_SERIAL_GET_BAUD_RATE:
-            Status = Pl2303GetBaudRate(DeviceObject, Irp);
-            break;
-        case IOCTL_SERIAL_SET_BAUD_RATE:
-            Status = Pl2303SetBaudRate(DeviceObject, Irp);
-            break;
-        case IOCTL_SERIAL_GET_LINE_CONTROL:
-            Status = Pl2303GetLineControl(DeviceObject, Irp);
-            break;
-        case IOCTL_SERIAL_SET_LINE_CONTROL:
-            Status = Pl2303SetLineControl(DeviceObject, Irp);
-            break;
-        case IOCTL_SERIAL_GET_CHARS:
-            Status = Pl2303GetChars(DeviceObject, Irp);
-            break;
-        case IOCTL_SERIAL_SET_CHARS:
-            if (IoStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(SERIAL_CHARS))
-            {
-                Status = STATUS_BUFFER_TOO_SMALL;
-            }
-            else
-            {
-                RtlCopyMemory(&DeviceExtension->Chars,
-                              Irp->AssociatedIrp.SystemBuffer,
-                              sizeof(SERIAL_CHARS));
-            }
-            Status = STATUS_SUCCESS;
-            break;
-        case IOCTL_SERIAL_GET_HANDFLOW:
-            Status = Pl2303GetHandFlow(DeviceObject, Irp);
-            break;
-        case IOCTL_SERIAL_SET_HANDFLOW:
-            if (IoStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(SERIAL_HANDFLOW))
-            {
-                Status = STATUS_BUFFER_TOO_SMALL;
-            }
-            else
-            {
-                RtlCopyMemory(&DeviceExtension->HandFlow,
-                              Irp->AssociatedIrp.SystemBuffer,
-                              sizeof(SERIAL_HANDFLOW));
-            }
-            Status = STATUS_SUCCESS;
-            break;
-        case IOCTL_SERIAL_CLR_DTR:
-            DeviceExtension->DtrRts &= ~SERIAL_DTR_STATE;
-            Status = Pl2303UsbSetControlLines(DeviceObject, DeviceExtension->DtrRts);
-            break;
-        case IOCTL_SERIAL_SET_DTR:
-            DeviceExtension->DtrRts |= SERIAL_DTR_STATE;
-            Status = Pl2303UsbSetControlLines(DeviceObject, DeviceExtension->DtrRts);
-            break;
-        case IOCTL_SERIAL_CLR_RTS:
-            DeviceExtension->DtrRts &= ~SERIAL_RTS_STATE;
-            Status = Pl2303UsbSetControlLines(DeviceObject, DeviceExtension->DtrRts);
-            break;
-        case IOCTL_SERIAL_SET_RTS:
-            DeviceExtension->DtrRts |= SERIAL_RTS_STATE;
-            Status = Pl2303UsbSetControlLines(DeviceObject, DeviceExtension->DtrRts);
-            break;
-        case IOCTL_SERIAL_GET_DTRRTS:
-            if (IoStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(ULONG))
-            {
-                Status = STATUS_BUFFER_TOO_SMALL;
-            }
-            else
-            {
-                *(PULONG)Irp->AssociatedIrp.SystemBuffer = DeviceExtension->DtrRts;
-            }
-        case IOCTL_SERIAL_CLEAR_STATS:
-        default:
-            Pl2303Debug(         "%s. DeviceControl %x, code %s (%08lx)\n",
-                        __FUNCTION__, IoStack->MajorFunction, SerialGetIoctlName(IoControlCode), IoControlCode);
-            Status = STATUS_NOT_SUPPORTED;
-    }
-
-    ASSERT(Status != STATUS_PENDING);
-    Irp->IoStatus.Status = Status;
-    IoCompleteRequest(Irp, IO_NO_INCREMENT);
-    return Status;
-
-    //IoSkipCurrentIrpStackLocation(Irp);
-    //return IoCallDriver(DeviceExtension->LowerDevice, Irp);
-}
+/*
+ * PL2303 Driver Serial IOCTL handling
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#define PL2303_TRACE_COMPONENT PL2303_TRACE_IOCTL
+#include "pl2303.h"
+
+static NTSTATUS Pl2303SetControlLines(_In_ PDEVICE_OBJECT DeviceObject,
+                                      _Inout_ PIRP Irp,
+                                      _In_ USHORT Set,
+                                      _In_ USHORT Clear);
+static NTSTATUS Pl2303GetBaudRate(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+static NTSTATUS Pl2303SetBaudRate(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+static NTSTATUS Pl2303GetLineControl(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+static NTSTATUS Pl2303SetLineControl(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+static NTSTATUS Pl2303SetChars(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+static NTSTATUS Pl2303SetHandFlow(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+static NTSTATUS Pl2303SetQueueSize(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+static NTSTATUS Pl2303GetTimeouts(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+static NTSTATUS Pl2303SetTimeouts(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+static NTSTATUS Pl2303GetModemStatus(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+static NTSTATUS Pl2303LsrMstInsert(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+static NTSTATUS Pl2303GetPoolStatistics(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+static NTSTATUS Pl2303GetFlightRecorder(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+static NTSTATUS Pl2303GetLatency(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+static NTSTATUS Pl2303GetStats(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+static NTSTATUS Pl2303ClearStats(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+static NTSTATUS Pl2303GetCommStatus(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+static NTSTATUS Pl2303GetProperties(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+static NTSTATUS Pl2303Purge(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+static NTSTATUS Pl2303DispatchConfigControl(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, Pl2303SetLine)
+#pragma alloc_text(PAGE, Pl2303SetControlLines)
+#pragma alloc_text(PAGE, Pl2303SetFlowControl)
+#pragma alloc_text(PAGE, Pl2303RestoreLine)
+#pragma alloc_text(PAGE, Pl2303SetBaudRate)
+#pragma alloc_text(PAGE, Pl2303SetLineControl)
+#pragma alloc_text(PAGE, Pl2303SetChars)
+#pragma alloc_text(PAGE, Pl2303SetHandFlow)
+#pragma alloc_text(PAGE, Pl2303SetQueueSize)
+#pragma alloc_text(PAGE, Pl2303SetTimeouts)
+#pragma alloc_text(PAGE, Pl2303LsrMstInsert)
+#pragma alloc_text(PAGE, Pl2303DispatchConfigControl)
+#endif /* defined ALLOC_PRAGMA */
+
+/*
+ * Sends the current line settings to the device. If Irp is given, the
+ * request is queued and Irp completed once it is done; otherwise this waits
+ * for the result. The settings are captured and queued under the line state
+ * mutex, which all writers hold, so the last request queued always carries
+ * the latest settings.
+ */
+NTSTATUS
+Pl2303SetLine(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_opt_ PIRP Irp)
+{
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                __FUNCTION__, DeviceObject,    Irp);
+
+    DeviceExtension = DeviceObject->DeviceExtension;
+
+    ExAcquireFastMutex(&DeviceExtension->LineStateMutex);
+    Status = Pl2303UsbSetLine(DeviceObject,
+                              Irp,
+                              DeviceExtension->LineState.BaudRate,
+                              DeviceExtension->LineState.StopBits,
+                              DeviceExtension->LineState.Parity,
+                              DeviceExtension->LineState.DataBits);
+    ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
+
+    return Status;
+}
+
+/*
+ * Updates the DTR and RTS state and queues sending it to the device, which
+ * completes Irp.
+ */
+static
+NTSTATUS
+Pl2303SetControlLines(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp,
+    _In_ USHORT Set,
+    _In_ USHORT Clear)
+{
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p, Set=%x, Clear=%x\n",
+                __FUNCTION__, DeviceObject,    Irp,    Set,    Clear);
+
+    DeviceExtension = DeviceObject->DeviceExtension;
+
+    ExAcquireFastMutex(&DeviceExtension->LineStateMutex);
+    /* Lines used for handshaking are not under the application's control */
+    if ((((Set | Clear) & SERIAL_DTR_STATE) &&
+         (DeviceExtension->LineState.HandFlow.ControlHandShake & SERIAL_DTR_MASK) == SERIAL_DTR_HANDSHAKE) ||
+        (((Set | Clear) & SERIAL_RTS_STATE) &&
+         (DeviceExtension->LineState.HandFlow.FlowReplace & SERIAL_RTS_MASK) == SERIAL_RTS_HANDSHAKE))
+    {
+        ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
+        return STATUS_INVALID_PARAMETER;
+    }
+    DeviceExtension->DtrRts = (DeviceExtension->DtrRts & ~Clear) | Set;
+    Status = Pl2303UsbSetControlLines(DeviceObject, Irp);
+    ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
+
+    return Status;
+}
+
+/*
+ * Applies the current handshake and flow control settings. CTS handshaking
+ * is left to the chip; with RTS handshaking, the receive path drops RTS when
+ * its buffer runs full. XON/XOFF flow control is done by the driver in both
+ * directions. The resulting DTR and RTS state is sent like in Pl2303SetLine.
+ */
+NTSTATUS
+Pl2303SetFlowControl(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_opt_ PIRP Irp)
+{
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension;
+    const SERIAL_HANDFLOW *HandFlow;
+    USHORT DtrRts = 0;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                __FUNCTION__, DeviceObject,    Irp);
+
+    DeviceExtension = DeviceObject->DeviceExtension;
+    HandFlow = &DeviceExtension->LineState.HandFlow;
+
+    ExAcquireFastMutex(&DeviceExtension->LineStateMutex);
+    Status = Pl2303UsbSetFlowControl(DeviceObject,
+                                     (HandFlow->ControlHandShake & SERIAL_CTS_HANDSHAKE) != 0);
+    if (!NT_SUCCESS(Status))
+    {
+        ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
+        Pl2303Error(         "%s. Pl2303UsbSetFlowControl failed with %08lx\n",
+                    __FUNCTION__, Status);
+        return Status;
+    }
+
+    if (HandFlow->ControlHandShake & SERIAL_DTR_MASK)
+        DtrRts |= SERIAL_DTR_STATE;
+    if (HandFlow->FlowReplace & SERIAL_RTS_MASK)
+        DtrRts |= SERIAL_RTS_STATE;
+    DeviceExtension->DtrRts = DtrRts;
+
+    Pl2303SetReadFlowControl(DeviceObject, HandFlow, &DeviceExtension->LineState.Chars);
+
+    Status = Pl2303UsbSetControlLines(DeviceObject, Irp);
+    ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
+
+    Pl2303SendFlowControlChar(DeviceObject);
+
+    return Status;
+}
+
+/*
+ * Sends all current line settings to the device again, for a device that has
+ * lost them. The DTR and RTS state is sent as last set, rather than derived
+ * from the handshake settings like in Pl2303SetFlowControl.
+ */
+NTSTATUS
+Pl2303RestoreLine(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension;
+    const LINE_STATE *LineState;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p\n",
+                __FUNCTION__, DeviceObject);
+
+    DeviceExtension = DeviceObject->DeviceExtension;
+    LineState = &DeviceExtension->LineState;
+
+    ExAcquireFastMutex(&DeviceExtension->LineStateMutex);
+    Status = Pl2303UsbRestoreLine(DeviceObject,
+                                  LineState->BaudRate,
+                                  LineState->StopBits,
+                                  LineState->Parity,
+                                  LineState->DataBits,
+                                  (LineState->HandFlow.ControlHandShake & SERIAL_CTS_HANDSHAKE) != 0);
+    ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
+
+    return Status;
+}
+
+static
+NTSTATUS
+Pl2303GetBaudRate(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp)
+{
+    PIO_STACK_LOCATION IoStack;
+    PDEVICE_EXTENSION DeviceExtension;
+    PPL2303_BAUD_RATE BaudRate;
+    LINE_STATE LineState;
+    ULONG ActualBaudRate;
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                __FUNCTION__, DeviceObject,    Irp);
+
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    DeviceExtension = DeviceObject->DeviceExtension;
+
+    if (IoStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(SERIAL_BAUD_RATE))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    BaudRate = Irp->AssociatedIrp.SystemBuffer;
+    Pl2303QueryLineState(DeviceExtension, &LineState);
+    BaudRate->BaudRate = LineState.BaudRate;
+    Irp->IoStatus.Information = sizeof(SERIAL_BAUD_RATE);
+
+    /* Callers that know about it also get the rate the chip really uses */
+    if (IoStack->Parameters.DeviceIoControl.OutputBufferLength >= sizeof(*BaudRate))
+    {
+        (VOID)Pl2303EncodeBaudRate(DeviceExtension->Chip, LineState.BaudRate, &ActualBaudRate);
+        BaudRate->ActualBaudRate = ActualBaudRate;
+        BaudRate->ErrorPpm = (LONG)(((LONGLONG)ActualBaudRate - LineState.BaudRate) * 1000000 /
+                                    LineState.BaudRate);
+        Irp->IoStatus.Information = sizeof(*BaudRate);
+    }
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+Pl2303SetBaudRate(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp)
+{
+    PIO_STACK_LOCATION IoStack;
+    PDEVICE_EXTENSION DeviceExtension;
+    const SERIAL_BAUD_RATE *BaudRate;
+    PLINE_STATE LineState;
+    KIRQL OldIrql;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                __FUNCTION__, DeviceObject,    Irp);
+
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    DeviceExtension = DeviceObject->DeviceExtension;
+
+    if (IoStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(*BaudRate))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    BaudRate = Irp->AssociatedIrp.SystemBuffer;
+    if (BaudRate->BaudRate == 0 ||
+        BaudRate->BaudRate > DeviceExtension->Chip->MaxBaudRate)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ExAcquireFastMutex(&DeviceExtension->LineStateMutex);
+    LineState = Pl2303BeginLineStateUpdate(DeviceExtension, &OldIrql);
+    LineState->BaudRate = BaudRate->BaudRate;
+    Pl2303EndLineStateUpdate(DeviceExtension, OldIrql);
+    ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
+    return Pl2303SetLine(DeviceObject, Irp);
+}
+
+static
+NTSTATUS
+Pl2303GetLineControl(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp)
+{
+    PIO_STACK_LOCATION IoStack;
+    PDEVICE_EXTENSION DeviceExtension;
+    PSERIAL_LINE_CONTROL LineControl;
+    LINE_STATE LineState;
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                __FUNCTION__, DeviceObject,    Irp);
+
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    DeviceExtension = DeviceObject->DeviceExtension;
+
+    if (IoStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(*LineControl))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    LineControl = Irp->AssociatedIrp.SystemBuffer;
+    Pl2303QueryLineState(DeviceExtension, &LineState);
+    LineControl->StopBits = LineState.StopBits;
+    LineControl->Parity = LineState.Parity;
+    LineControl->WordLength = LineState.DataBits;
+    Irp->IoStatus.Information = sizeof(*LineControl);
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+Pl2303SetLineControl(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp)
+{
+    PIO_STACK_LOCATION IoStack;
+    PDEVICE_EXTENSION DeviceExtension;
+    const SERIAL_LINE_CONTROL *LineControl;
+    PLINE_STATE LineState;
+    KIRQL OldIrql;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                __FUNCTION__, DeviceObject,    Irp);
+
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    DeviceExtension = DeviceObject->DeviceExtension;
+
+    if (IoStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(*LineControl))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    LineControl = Irp->AssociatedIrp.SystemBuffer;
+    ExAcquireFastMutex(&DeviceExtension->LineStateMutex);
+    LineState = Pl2303BeginLineStateUpdate(DeviceExtension, &OldIrql);
+    LineState->StopBits = LineControl->StopBits;
+    LineState->Parity = LineControl->Parity;
+    LineState->DataBits = LineControl->WordLength;
+    Pl2303EndLineStateUpdate(DeviceExtension, OldIrql);
+    ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
+    return Pl2303SetLine(DeviceObject, Irp);
+}
+
+static
+NTSTATUS
+Pl2303GetChars(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp)
+{
+    PIO_STACK_LOCATION IoStack;
+    PDEVICE_EXTENSION DeviceExtension;
+    PSERIAL_CHARS Chars;
+    LINE_STATE LineState;
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                __FUNCTION__, DeviceObject,    Irp);
+
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    DeviceExtension = DeviceObject->DeviceExtension;
+
+    if (IoStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(*Chars))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    Chars = Irp->AssociatedIrp.SystemBuffer;
+    Pl2303QueryLineState(DeviceExtension, &LineState);
+    *Chars = LineState.Chars;
+    Irp->IoStatus.Information = sizeof(*Chars);
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+Pl2303SetChars(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp)
+{
+    PIO_STACK_LOCATION IoStack;
+    PDEVICE_EXTENSION DeviceExtension;
+    const SERIAL_CHARS *Chars;
+    PLINE_STATE LineState;
+    KIRQL OldIrql;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                __FUNCTION__, DeviceObject,    Irp);
+
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    DeviceExtension = DeviceObject->DeviceExtension;
+
+    if (IoStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(*Chars))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    Chars = Irp->AssociatedIrp.SystemBuffer;
+    ExAcquireFastMutex(&DeviceExtension->LineStateMutex);
+    /* XON and XOFF must be distinguishable while they are in use */
+    if (Chars->XonChar == Chars->XoffChar &&
+        (DeviceExtension->LineState.HandFlow.FlowReplace & (SERIAL_AUTO_TRANSMIT | SERIAL_AUTO_RECEIVE)))
+    {
+        ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
+        return STATUS_INVALID_PARAMETER;
+    }
+    LineState = Pl2303BeginLineStateUpdate(DeviceExtension, &OldIrql);
+    LineState->Chars = *Chars;
+    Pl2303EndLineStateUpdate(DeviceExtension, OldIrql);
+    /* Only the receive path uses the characters, the device is not involved */
+    Pl2303SetReadFlowControl(DeviceObject,
+                             &DeviceExtension->LineState.HandFlow,
+                             &DeviceExtension->LineState.Chars);
+    ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
+
+    Pl2303SendFlowControlChar(DeviceObject);
+
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+Pl2303GetHandFlow(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp)
+{
+    PIO_STACK_LOCATION IoStack;
+    PDEVICE_EXTENSION DeviceExtension;
+    PSERIAL_HANDFLOW HandFlow;
+    LINE_STATE LineState;
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                __FUNCTION__, DeviceObject,    Irp);
+
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    DeviceExtension = DeviceObject->DeviceExtension;
+
+    if (IoStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(*HandFlow))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    HandFlow = Irp->AssociatedIrp.SystemBuffer;
+    Pl2303QueryLineState(DeviceExtension, &LineState);
+    *HandFlow = LineState.HandFlow;
+    Irp->IoStatus.Information = sizeof(*HandFlow);
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+Pl2303SetHandFlow(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp)
+{
+    PIO_STACK_LOCATION IoStack;
+    PDEVICE_EXTENSION DeviceExtension;
+    const SERIAL_HANDFLOW *HandFlow;
+    PLINE_STATE LineState;
+    KIRQL OldIrql;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                __FUNCTION__, DeviceObject,    Irp);
+
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    DeviceExtension = DeviceObject->DeviceExtension;
+
+    if (IoStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(*HandFlow))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    HandFlow = Irp->AssociatedIrp.SystemBuffer;
+    if ((HandFlow->ControlHandShake & SERIAL_CONTROL_INVALID) ||
+        (HandFlow->FlowReplace & SERIAL_FLOW_INVALID) ||
+        (HandFlow->ControlHandShake & SERIAL_DTR_MASK) == SERIAL_DTR_MASK ||
+        HandFlow->XonLimit < 0 ||
+        HandFlow->XoffLimit < 0 ||
+        (ULONG)HandFlow->XonLimit > DeviceExtension->ReadBuffer.Size ||
+        (ULONG)HandFlow->XoffLimit > DeviceExtension->ReadBuffer.Size)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if ((HandFlow->FlowReplace & SERIAL_RTS_MASK) == SERIAL_TRANSMIT_TOGGLE)
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    ExAcquireFastMutex(&DeviceExtension->LineStateMutex);
+    if (DeviceExtension->LineState.Chars.XonChar == DeviceExtension->LineState.Chars.XoffChar &&
+        (HandFlow->FlowReplace & (SERIAL_AUTO_TRANSMIT | SERIAL_AUTO_RECEIVE)))
+    {
+        ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
+        return STATUS_INVALID_PARAMETER;
+    }
+    LineState = Pl2303BeginLineStateUpdate(DeviceExtension, &OldIrql);
+    LineState->HandFlow = *HandFlow;
+    Pl2303EndLineStateUpdate(DeviceExtension, OldIrql);
+    ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
+    return Pl2303SetFlowControl(DeviceObject, Irp);
+}
+
+/*
+ * Grows the receive buffer to at least the requested size; like the inbox
+ * serial driver, it is never shrunk here. Writes are passed to the device
+ * without being buffered, so a transmit size is accepted but dropped, as
+ * MaxTxQueue of 0 in IOCTL_SERIAL_GET_PROPERTIES tells the caller.
+ */
+static
+NTSTATUS
+Pl2303SetQueueSize(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp)
+{
+    NTSTATUS Status;
+    PIO_STACK_LOCATION IoStack;
+    PDEVICE_EXTENSION DeviceExtension;
+    const SERIAL_QUEUE_SIZE *QueueSize;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                __FUNCTION__, DeviceObject,    Irp);
+
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    DeviceExtension = DeviceObject->DeviceExtension;
+
+    if (IoStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(*QueueSize))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    QueueSize = Irp->AssociatedIrp.SystemBuffer;
+    if (QueueSize->InSize > PL2303_MAX_READ_BUFFER_SIZE)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (QueueSize->OutSize)
+    {
+        Pl2303Warn(         "%s. Ignoring OutSize=%lu, writes are not buffered\n",
+                   __FUNCTION__, QueueSize->OutSize);
+    }
+
+    ExAcquireFastMutex(&DeviceExtension->LineStateMutex);
+    Status = STATUS_SUCCESS;
+    if (QueueSize->InSize > DeviceExtension->ReadBuffer.Size)
+        Status = Pl2303ResizeReadBuffer(DeviceObject, QueueSize->InSize, TRUE);
+    ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
+
+    return Status;
+}
+
+static
+NTSTATUS
+Pl2303GetTimeouts(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp)
+{
+    PIO_STACK_LOCATION IoStack;
+    PDEVICE_EXTENSION DeviceExtension;
+    PSERIAL_TIMEOUTS Timeouts;
+    LINE_STATE LineState;
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                __FUNCTION__, DeviceObject,    Irp);
+
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    DeviceExtension = DeviceObject->DeviceExtension;
+
+    if (IoStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(*Timeouts))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    Timeouts = Irp->AssociatedIrp.SystemBuffer;
+    Pl2303QueryLineState(DeviceExtension, &LineState);
+    *Timeouts = LineState.Timeouts;
+    Irp->IoStatus.Information = sizeof(*Timeouts);
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+Pl2303SetTimeouts(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp)
+{
+    PIO_STACK_LOCATION IoStack;
+    PDEVICE_EXTENSION DeviceExtension;
+    const SERIAL_TIMEOUTS *Timeouts;
+    PLINE_STATE LineState;
+    KIRQL OldIrql;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                __FUNCTION__, DeviceObject,    Irp);
+
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    DeviceExtension = DeviceObject->DeviceExtension;
+
+    if (IoStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(*Timeouts))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    Timeouts = Irp->AssociatedIrp.SystemBuffer;
+    if (Timeouts->ReadIntervalTimeout == MAXULONG &&
+        Timeouts->ReadTotalTimeoutMultiplier == MAXULONG &&
+        Timeouts->ReadTotalTimeoutConstant == MAXULONG)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    /* Reads and writes that already started keep the timeouts they captured */
+    ExAcquireFastMutex(&DeviceExtension->LineStateMutex);
+    LineState = Pl2303BeginLineStateUpdate(DeviceExtension, &OldIrql);
+    LineState->Timeouts = *Timeouts;
+    Pl2303EndLineStateUpdate(DeviceExtension, OldIrql);
+    ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+Pl2303GetModemStatus(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp)
+{
+    PIO_STACK_LOCATION IoStack;
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                __FUNCTION__, DeviceObject,    Irp);
+
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+
+    if (IoStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(ULONG))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    *(PULONG)Irp->AssociatedIrp.SystemBuffer = Pl2303QueryModemStatus(DeviceObject);
+    Irp->IoStatus.Information = sizeof(ULONG);
+    return STATUS_SUCCESS;
+}
+
+/*
+ * A non-zero escape character enables insertion of line and modem status
+ * changes into the received data; received escape characters are then
+ * followed by SERIAL_LSRMST_ESCAPE.
+ */
+static
+NTSTATUS
+Pl2303LsrMstInsert(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp)
+{
+    PIO_STACK_LOCATION IoStack;
+    PDEVICE_EXTENSION DeviceExtension;
+    UCHAR EscapeChar;
+    KIRQL OldIrql;
+
+    PAGED_CODE();
+
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    DeviceExtension = DeviceObject->DeviceExtension;
+
+    if (IoStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(UCHAR))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    EscapeChar = *(PUCHAR)Irp->AssociatedIrp.SystemBuffer;
+
+    Pl2303Debug(         "%s. DeviceObject=%p, EscapeChar=0x%02x\n",
+                __FUNCTION__, DeviceObject,    EscapeChar);
+
+    KeAcquireSpinLock(&DeviceExtension->ReadSpinLock, &OldIrql);
+    DeviceExtension->ReadEscapeChar = EscapeChar;
+    KeReleaseSpinLock(&DeviceExtension->ReadSpinLock, OldIrql);
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+Pl2303GetPoolStatistics(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp)
+{
+    PIO_STACK_LOCATION IoStack;
+    PDEVICE_EXTENSION DeviceExtension;
+    PPL2303_POOL_STATISTICS Statistics;
+    KIRQL OldIrql;
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                __FUNCTION__, DeviceObject,    Irp);
+
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    DeviceExtension = DeviceObject->DeviceExtension;
+
+    if (IoStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(*Statistics))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    Statistics = Irp->AssociatedIrp.SystemBuffer;
+    KeAcquireSpinLock(&DeviceExtension->ControlSpinLock, &OldIrql);
+    *Statistics = DeviceExtension->ControlPoolStatistics;
+    KeReleaseSpinLock(&DeviceExtension->ControlSpinLock, OldIrql);
+    Irp->IoStatus.Information = sizeof(*Statistics);
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+Pl2303GetFlightRecorder(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp)
+{
+    PIO_STACK_LOCATION IoStack;
+    PPL2303_FLIGHT_RECORDER Recorder;
+    ULONG Length;
+    LARGE_INTEGER Frequency;
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                __FUNCTION__, DeviceObject,    Irp);
+
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    Length = IoStack->Parameters.DeviceIoControl.OutputBufferLength;
+
+    if (Length < FIELD_OFFSET(PL2303_FLIGHT_RECORDER, Records))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    Recorder = Irp->AssociatedIrp.SystemBuffer;
+    (VOID)KeQueryPerformanceCounter(&Frequency);
+    Recorder->Frequency = Frequency.QuadPart;
+    Recorder->RecordCount = PL2303_RECORDER_SIZE;
+    Recorder->Reserved = 0;
+
+    if (Length < FIELD_OFFSET(PL2303_FLIGHT_RECORDER, Records[PL2303_RECORDER_SIZE]))
+    {
+        Irp->IoStatus.Information = FIELD_OFFSET(PL2303_FLIGHT_RECORDER, Records);
+        return STATUS_BUFFER_OVERFLOW;
+    }
+
+    Pl2303CopyRecords(DeviceObject->DeviceExtension, Recorder->Records);
+    Irp->IoStatus.Information = FIELD_OFFSET(PL2303_FLIGHT_RECORDER, Records[PL2303_RECORDER_SIZE]);
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+Pl2303GetLatency(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp)
+{
+    PIO_STACK_LOCATION IoStack;
+    PPL2303_LATENCY_STATISTICS Latency;
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                __FUNCTION__, DeviceObject,    Irp);
+
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+
+    if (IoStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(*Latency))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    Latency = Irp->AssociatedIrp.SystemBuffer;
+    Pl2303QueryLatency(DeviceObject->DeviceExtension, Latency);
+    Irp->IoStatus.Information = sizeof(*Latency);
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+Pl2303GetStats(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp)
+{
+    PIO_STACK_LOCATION IoStack;
+    PSERIALPERF_STATS Stats;
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                __FUNCTION__, DeviceObject,    Irp);
+
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+
+    if (IoStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(*Stats))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    Stats = Irp->AssociatedIrp.SystemBuffer;
+    Pl2303QueryStatistics(DeviceObject->DeviceExtension, Stats);
+    Irp->IoStatus.Information = sizeof(*Stats);
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+Pl2303ClearStats(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp)
+{
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                __FUNCTION__, DeviceObject,    Irp);
+
+    Pl2303ClearStatistics(DeviceObject->DeviceExtension);
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Reports and clears the accumulated receive errors. CTS handshaking is done
+ * by the device itself, so a transmit held by CTS is inferred from the last
+ * reported modem status.
+ */
+static
+NTSTATUS
+Pl2303GetCommStatus(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp)
+{
+    PIO_STACK_LOCATION IoStack;
+    PDEVICE_EXTENSION DeviceExtension;
+    PSERIAL_STATUS SerialStatus;
+    LINE_STATE LineState;
+    ULONG HoldReasons;
+    ULONG AmountInOutQueue;
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                __FUNCTION__, DeviceObject,    Irp);
+
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    DeviceExtension = DeviceObject->DeviceExtension;
+
+    if (IoStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(*SerialStatus))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    Pl2303QueryLineState(DeviceExtension, &LineState);
+    Pl2303QueryWriteStatus(DeviceObject, &HoldReasons, &AmountInOutQueue);
+    if ((LineState.HandFlow.ControlHandShake & SERIAL_CTS_HANDSHAKE) &&
+        !(*(volatile ULONG *)&DeviceExtension->ModemStatus & SERIAL_MSR_CTS))
+    {
+        HoldReasons |= SERIAL_TX_WAITING_FOR_CTS;
+    }
+
+    SerialStatus = Irp->AssociatedIrp.SystemBuffer;
+    RtlZeroMemory(SerialStatus, sizeof(*SerialStatus));
+    SerialStatus->Errors = Pl2303QueryErrors(DeviceObject, TRUE);
+    SerialStatus->HoldReasons = HoldReasons;
+    SerialStatus->AmountInInQueue = Pl2303QueryReadBufferCount(DeviceObject);
+    SerialStatus->AmountInOutQueue = AmountInOutQueue;
+    Irp->IoStatus.Information = sizeof(*SerialStatus);
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Reports what the port supports, from the chip's capabilities and the
+ * driver's buffer sizes. Writes are not buffered, so there is no transmit
+ * queue size to report.
+ */
+static
+NTSTATUS
+Pl2303GetProperties(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp)
+{
+    PIO_STACK_LOCATION IoStack;
+    PDEVICE_EXTENSION DeviceExtension;
+    PSERIAL_COMMPROP Properties;
+    const PL2303_CHIP_INFO *Chip;
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                __FUNCTION__, DeviceObject,    Irp);
+
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    DeviceExtension = DeviceObject->DeviceExtension;
+    Chip = DeviceExtension->Chip;
+
+    if (IoStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(*Properties))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    Properties = Irp->AssociatedIrp.SystemBuffer;
+    RtlZeroMemory(Properties, sizeof(*Properties));
+    Properties->PacketLength = sizeof(*Properties);
+    Properties->PacketVersion = 2;
+    Properties->ServiceMask = SERIAL_SP_SERIALCOMM;
+    /* Writes go straight to the device, reads are buffered up to the limit */
+    Properties->MaxTxQueue = 0;
+    Properties->MaxRxQueue = PL2303_MAX_READ_BUFFER_SIZE;
+    Properties->MaxBaud = Chip->MaxBaudRate;
+    Properties->ProvSubType = SERIAL_SP_RS232;
+    Properties->ProvCapabilities = SERIAL_PCF_CD |
+                                   SERIAL_PCF_PARITY_CHECK |
+                                   SERIAL_PCF_XONXOFF |
+                                   SERIAL_PCF_SETXCHAR |
+                                   SERIAL_PCF_TOTALTIMEOUTS |
+                                   SERIAL_PCF_INTTIMEOUTS |
+                                   SERIAL_PCF_SPECIALCHARS;
+    if (Chip->Flags & PL2303_CHIP_RTS_CTS)
+        Properties->ProvCapabilities |= SERIAL_PCF_RTSCTS;
+    Properties->SettableParams = SERIAL_SP_PARITY |
+                                 SERIAL_SP_BAUD |
+                                 SERIAL_SP_DATABITS |
+                                 SERIAL_SP_STOPBITS |
+                                 SERIAL_SP_HANDSHAKING |
+                                 SERIAL_SP_PARITY_CHECK |
+                                 SERIAL_SP_CARRIER_DETECT;
+    Properties->SettableBaud = Pl2303GetSettableBaud(Chip);
+    Properties->SettableData = SERIAL_DATABITS_5 |
+                               SERIAL_DATABITS_6 |
+                               SERIAL_DATABITS_7 |
+                               SERIAL_DATABITS_8;
+    Properties->SettableStopParity = SERIAL_STOPBITS_10 |
+                                     SERIAL_STOPBITS_15 |
+                                     SERIAL_STOPBITS_20 |
+                                     SERIAL_PARITY_NONE |
+                                     SERIAL_PARITY_ODD |
+                                     SERIAL_PARITY_EVEN |
+                                     SERIAL_PARITY_MARK |
+                                     SERIAL_PARITY_SPACE;
+    Properties->CurrentTxQueue = 0;
+    Properties->CurrentRxQueue = *(volatile ULONG *)&DeviceExtension->ReadBuffer.Size;
+    Irp->IoStatus.Information = sizeof(*Properties);
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+Pl2303Purge(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp)
+{
+    PIO_STACK_LOCATION IoStack;
+    ULONG Mask;
+
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+
+    if (IoStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(ULONG))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    Mask = *(PULONG)Irp->AssociatedIrp.SystemBuffer;
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p, Mask=0x%lx\n",
+                __FUNCTION__, DeviceObject,    Irp,    Mask);
+
+    if (!Mask || (Mask & ~(SERIAL_PURGE_TXABORT | SERIAL_PURGE_RXABORT |
+                           SERIAL_PURGE_TXCLEAR | SERIAL_PURGE_RXCLEAR)))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    /* There is no transmit buffer to clear; queued writes are only aborted */
+    if (Mask & SERIAL_PURGE_TXABORT)
+        Pl2303FlushWrites(DeviceObject, STATUS_CANCELLED);
+    if (Mask & SERIAL_PURGE_RXABORT)
+        Pl2303FlushReads(DeviceObject, STATUS_CANCELLED);
+    if (Mask & SERIAL_PURGE_RXCLEAR)
+        Pl2303PurgeReadBuffer(DeviceObject);
+
+    return STATUS_SUCCESS;
+}
+
+static
+PCSTR
+SerialGetIoctlName(
+    _In_ ULONG IoControlCode)
+{
+    switch (IoControlCode)
+    {
+        case IOCTL_SERIAL_SET_BAUD_RATE: return "IOCTL_SERIAL_SET_BAUD_RATE";
+        case IOCTL_SERIAL_GET_BAUD_RATE: return "IOCTL_SERIAL_GET_BAUD_RATE";
+        case IOCTL_SERIAL_GET_MODEM_CONTROL: return "IOCTL_SERIAL_GET_MODEM_CONTROL";
+        case IOCTL_SERIAL_SET_MODEM_CONTROL: return "IOCTL_SERIAL_SET_MODEM_CONTROL";
+        case IOCTL_SERIAL_SET_FIFO_CONTROL: return "IOCTL_SERIAL_SET_FIFO_CONTROL";
+        case IOCTL_SERIAL_SET_LINE_CONTROL: return "IOCTL_SERIAL_SET_LINE_CONTROL";
+        case IOCTL_SERIAL_GET_LINE_CONTROL: return "IOCTL_SERIAL_GET_LINE_CONTROL";
+        case IOCTL_SERIAL_SET_TIMEOUTS: return "IOCTL_SERIAL_SET_TIMEOUTS";
+        case IOCTL_SERIAL_GET_TIMEOUTS: return "IOCTL_SERIAL_GET_TIMEOUTS";
+        case IOCTL_SERIAL_SET_CHARS: return "IOCTL_SERIAL_SET_CHARS";
+        case IOCTL_SERIAL_GET_CHARS: return "IOCTL_SERIAL_GET_CHARS";
+        case IOCTL_SERIAL_SET_DTR: return "IOCTL_SERIAL_SET_DTR";
+        case IOCTL_SERIAL_CLR_DTR: return "IOCTL_SERIAL_SET_DTR";
+        case IOCTL_SERIAL_RESET_DEVICE: return "IOCTL_SERIAL_RESET_DEVICE";
+        case IOCTL_SERIAL_SET_RTS: return "IOCTL_SERIAL_SET_RTS";
+        case IOCTL_SERIAL_CLR_RTS: return "IOCTL_SERIAL_CLR_RTS";
+        case IOCTL_SERIAL_SET_XOFF: return "IOCTL_SERIAL_SET_XOFF";
+        case IOCTL_SERIAL_SET_XON: return "IOCTL_SERIAL_SET_XON";
+        case IOCTL_SERIAL_SET_BREAK_ON: return "IOCTL_SERIAL_SET_BREAK_ON";
+        case IOCTL_SERIAL_SET_BREAK_OFF: return "IOCTL_SERIAL_SET_BREAK_OFF";
+        case IOCTL_SERIAL_SET_QUEUE_SIZE: return "IOCTL_SERIAL_SET_QUEUE_SIZE";
+        case IOCTL_SERIAL_GET_WAIT_MASK: return "IOCTL_SERIAL_GET_WAIT_MASK";
+        case IOCTL_SERIAL_SET_WAIT_MASK: return "IOCTL_SERIAL_SET_WAIT_MASK";
+        case IOCTL_SERIAL_WAIT_ON_MASK: return "IOCTL_SERIAL_WAIT_ON_MASK";
+        case IOCTL_SERIAL_IMMEDIATE_CHAR: return "IOCTL_SERIAL_IMMEDIATE_CHAR";
+        case IOCTL_SERIAL_PURGE: return "IOCTL_SERIAL_PURGE";
+        case IOCTL_SERIAL_GET_HANDFLOW: return "IOCTL_SERIAL_GET_HANDFLOW";
+        case IOCTL_SERIAL_SET_HANDFLOW: return "IOCTL_SERIAL_SET_HANDFLOW";
+        case IOCTL_SERIAL_GET_MODEMSTATUS: return "IOCTL_SERIAL_GET_MODEMSTATUS";
+        case IOCTL_SERIAL_GET_DTRRTS: return "IOCTL_SERIAL_GET_DTRRTS";
+        case IOCTL_SERIAL_GET_COMMSTATUS: return "IOCTL_SERIAL_GET_COMMSTATUS";
+        case IOCTL_SERIAL_GET_PROPERTIES: return "IOCTL_SERIAL_GET_PROPERTIES";
+        case IOCTL_SERIAL_XOFF_COUNTER: return "IOCTL_SERIAL_XOFF_COUNTER";
+        case IOCTL_SERIAL_LSRMST_INSERT: return "IOCTL_SERIAL_LSRMST_INSERT";
+        case IOCTL_SERIAL_CONFIG_SIZE: return "IOCTL_SERIAL_CONFIG_SIZE";
+        case IOCTL_SERIAL_GET_STATS: return "IOCTL_SERIAL_GET_STATS";
+        case IOCTL_SERIAL_CLEAR_STATS: return "IOCTL_SERIAL_CLEAR_STATS";
+        case IOCTL_PL2303_GET_POOL_STATISTICS: return "IOCTL_PL2303_GET_POOL_STATISTICS";
+        case IOCTL_PL2303_GET_FLIGHT_RECORDER: return "IOCTL_PL2303_GET_FLIGHT_RECORDER";
+        case IOCTL_PL2303_GET_LATENCY: return "IOCTL_PL2303_GET_LATENCY";
+        case IOCTL_PL2303_RESET_LATENCY: return "IOCTL_PL2303_RESET_LATENCY";
+        default: return "Unknown ioctl";
+    }
+}
+
+/*
+ * Configuration changes take the line state mutex and may wait for the
+ * device, so they are handled here, in pageable code, below DISPATCH_LEVEL.
+ */
+static
+NTSTATUS
+Pl2303DispatchConfigControl(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp)
+{
+    NTSTATUS Status;
+    PIO_STACK_LOCATION IoStack;
+    ULONG IoControlCode;
+
+    PAGED_CODE();
+
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    IoControlCode = IoStack->Parameters.DeviceIoControl.IoControlCode;
+    switch (IoControlCode)
+    {
+        case IOCTL_SERIAL_SET_BAUD_RATE:
+            Status = Pl2303SetBaudRate(DeviceObject, Irp);
+            break;
+        case IOCTL_SERIAL_SET_LINE_CONTROL:
+            Status = Pl2303SetLineControl(DeviceObject, Irp);
+            break;
+        case IOCTL_SERIAL_SET_TIMEOUTS:
+            Status = Pl2303SetTimeouts(DeviceObject, Irp);
+            break;
+        case IOCTL_SERIAL_SET_CHARS:
+            Status = Pl2303SetChars(DeviceObject, Irp);
+            break;
+        case IOCTL_SERIAL_SET_HANDFLOW:
+            Status = Pl2303SetHandFlow(DeviceObject, Irp);
+            break;
+        case IOCTL_SERIAL_SET_QUEUE_SIZE:
+            Status = Pl2303SetQueueSize(DeviceObject, Irp);
+            break;
+        case IOCTL_SERIAL_CLR_DTR:
+            Status = Pl2303SetControlLines(DeviceObject, Irp, 0, SERIAL_DTR_STATE);
+            break;
+        case IOCTL_SERIAL_SET_DTR:
+            Status = Pl2303SetControlLines(DeviceObject, Irp, SERIAL_DTR_STATE, 0);
+            break;
+        case IOCTL_SERIAL_CLR_RTS:
+            Status = Pl2303SetControlLines(DeviceObject, Irp, 0, SERIAL_RTS_STATE);
+            break;
+        case IOCTL_SERIAL_SET_RTS:
+            Status = Pl2303SetControlLines(DeviceObject, Irp, SERIAL_RTS_STATE, 0);
+            break;
+        case IOCTL_SERIAL_LSRMST_INSERT:
+            Status = Pl2303LsrMstInsert(DeviceObject, Irp);
+            break;
+        default:
+            Pl2303Debug(         "%s. DeviceControl %x, code %s (%08lx)\n",
+                        __FUNCTION__, IoStack->MajorFunction, SerialGetIoctlName(IoControlCode), IoControlCode);
+            Status = STATUS_NOT_SUPPORTED;
+    }
+
+    return Status;
+}
+
+/*
+ * Handles the driver's private IOCTLs for the given port. They are sent to
+ * the port's control device, so that diagnostic tools do not have to open
+ * the port itself. The request is not completed here.
+ */
+NTSTATUS
+Pl2303PrivateDeviceControl(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp)
+{
+    NTSTATUS Status;
+    PIO_STACK_LOCATION IoStack;
+    ULONG IoControlCode;
+
+    NT_ASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                __FUNCTION__, DeviceObject,    Irp);
+
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    IoControlCode = IoStack->Parameters.DeviceIoControl.IoControlCode;
+    switch (IoControlCode)
+    {
+        case IOCTL_PL2303_GET_POOL_STATISTICS:
+            Status = Pl2303GetPoolStatistics(DeviceObject, Irp);
+            break;
+        case IOCTL_PL2303_GET_FLIGHT_RECORDER:
+            Status = Pl2303GetFlightRecorder(DeviceObject, Irp);
+            break;
+        case IOCTL_PL2303_GET_LATENCY:
+            Status = Pl2303GetLatency(DeviceObject, Irp);
+            break;
+        case IOCTL_PL2303_RESET_LATENCY:
+            Pl2303ResetLatency(DeviceObject->DeviceExtension);
+            Status = STATUS_SUCCESS;
+            break;
+        default:
+            Status = STATUS_INVALID_DEVICE_REQUEST;
+            break;
+    }
+
+    return Status;
+}
+
+/*
+ * Requests on the data path and queries of cached state are handled without
+ * touching pageable code, so kernel-mode clients may send them at up to
+ * DISPATCH_LEVEL. Anything else requires an IRQL of at most APC_LEVEL.
+ */
+NTSTATUS
+NTAPI
+Pl2303DispatchDeviceControl(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp)
+{
+    NTSTATUS Status;
+    PIO_STACK_LOCATION IoStack;
+    PDEVICE_EXTENSION DeviceExtension;
+    ULONG IoControlCode;
+
+    NT_ASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
+
+    if (Pl2303IsControlDevice(DeviceObject))
+        return Pl2303DispatchControlDevice(DeviceObject, Irp);
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                __FUNCTION__, DeviceObject,    Irp);
+
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    NT_ASSERT(IoStack->MajorFunction == IRP_MJ_DEVICE_CONTROL ||
+              IoStack->MajorFunction == IRP_MJ_INTERNAL_DEVICE_CONTROL);
+
+    DeviceExtension = DeviceObject->DeviceExtension;
+    Pl2303RecordIrp(DeviceObject, Irp);
+
+    if (DeviceExtension->PnpState == Deleted)
+    {
+        Pl2303Warn(         "%s. Device already deleted\n",
+                   __FUNCTION__);
+        Status = STATUS_NO_SUCH_DEVICE;
+        Irp->IoStatus.Status = Status;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        return Status;
+    }
+
+    IoControlCode = IoStack->Parameters.DeviceIoControl.IoControlCode;
+    switch (IoControlCode)
+    {
+        case IOCTL_SERIAL_GET_BAUD_RATE:
+            Status = Pl2303GetBaudRate(DeviceObject, Irp);
+            break;
+        case IOCTL_SERIAL_GET_LINE_CONTROL:
+            Status = Pl2303GetLineControl(DeviceObject, Irp);
+            break;
+        case IOCTL_SERIAL_GET_TIMEOUTS:
+            Status = Pl2303GetTimeouts(DeviceObject, Irp);
+            break;
+        case IOCTL_SERIAL_GET_CHARS:
+            Status = Pl2303GetChars(DeviceObject, Irp);
+            break;
+        case IOCTL_SERIAL_GET_HANDFLOW:
+            Status = Pl2303GetHandFlow(DeviceObject, Irp);
+            break;
+        case IOCTL_SERIAL_GET_WAIT_MASK:
+            Status = Pl2303GetWaitMask(DeviceObject, Irp);
+            break;
+        case IOCTL_SERIAL_SET_WAIT_MASK:
+            Status = Pl2303SetWaitMask(DeviceObject, Irp);
+            break;
+        case IOCTL_SERIAL_WAIT_ON_MASK:
+            Status = Pl2303WaitOnMask(DeviceObject, Irp);
+            break;
+        case IOCTL_SERIAL_GET_MODEMSTATUS:
+            Status = Pl2303GetModemStatus(DeviceObject, Irp);
+            break;
+        case IOCTL_SERIAL_PURGE:
+            Status = Pl2303Purge(DeviceObject, Irp);
+            break;
+        case IOCTL_SERIAL_GET_COMMSTATUS:
+            Status = Pl2303GetCommStatus(DeviceObject, Irp);
+            break;
+        case IOCTL_SERIAL_GET_PROPERTIES:
+            Status = Pl2303GetProperties(DeviceObject, Irp);
+            break;
+        case IOCTL_SERIAL_GET_STATS:
+            Status = Pl2303GetStats(DeviceObject, Irp);
+            break;
+        case IOCTL_SERIAL_CLEAR_STATS:
+            Status = Pl2303ClearStats(DeviceObject, Irp);
+            break;
+        case IOCTL_SERIAL_GET_DTRRTS:
+            if (IoStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(ULONG))
+            {
+                Status = STATUS_BUFFER_TOO_SMALL;
+            }
+            else
+            {
+                *(PULONG)Irp->AssociatedIrp.SystemBuffer = DeviceExtension->DtrRts;
+                Irp->IoStatus.Information = sizeof(ULONG);
+                Status = STATUS_SUCCESS;
+            }
+            break;
+        default:
+            if (KeGetCurrentIrql() > APC_LEVEL)
+            {
+                Pl2303Warn(         "%s. %s (%08lx) not allowed at IRQL %u\n",
+                           __FUNCTION__, SerialGetIoctlName(IoControlCode), IoControlCode, KeGetCurrentIrql());
+                Status = STATUS_INVALID_DEVICE_REQUEST;
+                break;
+            }
+            Status = Pl2303DispatchConfigControl(DeviceObject, Irp);
+    }
+
+    if (Status == STATUS_PENDING)
+        return Status;
+
+    Irp->IoStatus.Status = Status;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    return Status;
+
+    //IoSkipCurrentIrpStackLocation(Irp);
+    //return IoCallDriver(DeviceExtension->LowerDevice, Irp);
+}
@@ -0,0 +1,81 @@
+/*
+ * PL2303 Driver line state snapshots
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "pl2303.h"
+
+/*
+ * The line state is protected by a sequence counter. Writers hold the line
+ * state mutex, which also keeps the device programming that follows a change
+ * in order, and make the counter odd while they modify the state. Readers take
+ * no lock: they copy the state and retry if the counter was odd or changed
+ * meanwhile. Writers run at DISPATCH_LEVEL during the update, so a reader in
+ * a DPC cannot spin on an update that was interrupted on the same processor.
+ */
+
+VOID
+Pl2303QueryLineState(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _Out_ PLINE_STATE LineState)
+{
+    LONG Sequence;
+
+    for (;;)
+    {
+        Sequence = *(volatile LONG *)&DeviceExtension->LineStateSequence;
+        if (Sequence & 1)
+        {
+            YieldProcessor();
+            continue;
+        }
+
+        KeMemoryBarrier();
+        RtlCopyMemory(LineState, &DeviceExtension->LineState, sizeof(*LineState));
+        KeMemoryBarrier();
+
+        if (*(volatile LONG *)&DeviceExtension->LineStateSequence == Sequence)
+            break;
+    }
+}
+
+_Requires_lock_held_(DeviceExtension->LineStateMutex)
+PLINE_STATE
+Pl2303BeginLineStateUpdate(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _Out_ PKIRQL OldIrql)
+{
+    KeRaiseIrql(DISPATCH_LEVEL, OldIrql);
+
+    NT_ASSERT(!(DeviceExtension->LineStateSequence & 1));
+    *(volatile LONG *)&DeviceExtension->LineStateSequence = DeviceExtension->LineStateSequence + 1;
+    KeMemoryBarrier();
+
+    return &DeviceExtension->LineState;
+}
+
+_Requires_lock_held_(DeviceExtension->LineStateMutex)
+VOID
+Pl2303EndLineStateUpdate(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ KIRQL OldIrql)
+{
+    KeMemoryBarrier();
+    *(volatile LONG *)&DeviceExtension->LineStateSequence = DeviceExtension->LineStateSequence + 1;
+
+    KeLowerIrql(OldIrql);
+}
@@ -1,162 +1,741 @@
-/*
- * PL2303 USB-Serial Driver Declarations
- * Copyright (C) 2012-2019  Thomas Faber
- *
- * This library is free software; you can redistribute it and/or
- * modify it under the terms of the GNU Lesser General Public
- * License as published by the Free Software Foundation; either
- * version 2.1 of the License, or (at your option) any later version.
- *
- * This library is distributed in the hope that it will be useful,
- * but WITHOUT ANY WARRANTY; without even the implied warranty of
- * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
- * Lesser General Public License for more details.
- *
- * You should have received a copy of the GNU Lesser General Public
- * License along with this library; if not, write to the Free Software
- * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
- */
-
-#pragma once
-
-#include <ntddk.h>
-#include <ntstrsafe.h>
-#include <ntddser.h>
-#include <usb.h>
-#include <usbdlib.h>
-#include <usbioctl.h>
-
-/* Pool tags */
-#define PL2303_TAG      '32LP'
-#define PL2303_URB_TAG  'U2LP'
-
-/* USB requests */
-#define PL2303_VENDOR_READ_REQUEST  0x01
-#define PL2303_VENDOR_WRITE_REQUEST 0x01
-#define PL2303_SET_LINE_REQUEST     0x20
-#define PL2303_SET_CONTROL_REQUEST  0x22
-
-/* Misc defines */
-#if defined(_MSC_VER) && !defined(inline)
-#define inline __inline
-#endif
-
-#ifndef __WARNING_USING_VARIABLE_FROM_FAILED_FUNCTION_CALL
-#define __WARNING_USING_VARIABLE_FROM_FAILED_FUNCTION_CALL 6102
-#endif
-
-/* Types */
-typedef enum _DEVICE_PNP_STATE
-{
-    NotStarted,
-    Started,
-    StopPending,
-    Stopped,
-    RemovePending,
-    SurpriseRemovePending,
-    Deleted
-} DEVICE_PNP_STATE, *PDEVICE_PNP_STATE;
-
-typedef struct _QUEUE
-{
-    IO_CSQ Csq;
-    LIST_ENTRY QueueHead;
-    KSPIN_LOCK QueueSpinLock;
-} QUEUE, *PQUEUE;
-
-typedef struct _DEVICE_EXTENSION
-{
-    PDEVICE_OBJECT LowerDevice;
-    DEVICE_PNP_STATE PnpState;
-    DEVICE_PNP_STATE PreviousPnpState;
-    UNICODE_STRING DeviceName;
-    UNICODE_STRING InterfaceLinkName;
-    UNICODE_STRING ComPortName;
-    USBD_PIPE_HANDLE BulkInPipe;
-    USBD_PIPE_HANDLE BulkOutPipe;
-    USBD_PIPE_HANDLE InterruptInPipe;
-    FAST_MUTEX LineStateMutex;
-    ULONG BaudRate;
-    UCHAR StopBits;
-    UCHAR Parity;
-    UCHAR DataBits;
-    SERIAL_CHARS Chars;
-    SERIAL_HANDFLOW HandFlow;
-    USHORT DtrRts;
-} DEVICE_EXTENSION, *PDEVICE_EXTENSION;
-
-/* Debugging functions */
-static
-inline
-VOID
-Pl2303Debug(
-    _In_ PCSTR Format,
-    ...)
-{
-    va_list Arguments;
-    va_start(Arguments, Format);
-    (VOID)vDbgPrintExWithPrefix("Pl2303: ",
-                                DPFLTR_IHVDRIVER_ID,
-                                DPFLTR_TRACE_LEVEL,
-                                Format,
-                                Arguments);
-    va_end(Arguments);
-}
-
-static
-inline
-VOID
-Pl2303Warn(
-    _In_ PCSTR Format,
-    ...)
-{
-    va_list Arguments;
-    va_start(Arguments, Format);
-    (VOID)vDbgPrintExWithPrefix("Pl2303: ",
-                                DPFLTR_IHVDRIVER_ID,
-                                DPFLTR_WARNING_LEVEL,
-                                Format,
-                                Arguments);
-    va_end(Arguments);
-}
-
-static
-inline
-VOID
-Pl2303Error(
-    _In_ PCSTR Format,
-    ...)
-{
-    va_list Arguments;
-    va_start(Arguments, Format);
-    (VOID)vDbgPrintExWithPrefix("Pl2303: ",
-                                DPFLTR_IHVDRIVER_ID,
-                                DPFLTR_ERROR_LEVEL,
-                                Format,
-                                Arguments);
-    va_end(Arguments);
-}
-
-/* ioctl.c */
-__drv_dispatchType(IRP_MJ_DEVICE_CONTROL)
-__drv_dispatchType(IRP_MJ_INTERNAL_DEVICE_CONTROL)
-DRIVER_DISPATCH Pl2303DispatchDeviceControl;
-NTSTATUS Pl2303SetLine(_In_ PDEVICE_OBJECT DeviceObject);
-
-/* pnp.c */
-DRIVER_ADD_DEVICE Pl2303AddDevice;
-__drv_dispatchType(IRP_MJ_PNP)
-DRIVER_DISPATCH Pl2303DispatchPnp;
-
-/* usb.c */
-NTSTATUS Pl2303UsbStart(_In_ PDEVICE_OBJECT DeviceObject);
-NTSTATUS Pl2303UsbStop(_In_ PDEVICE_OBJECT DeviceObject);
-NTSTATUS Pl2303UsbSetLine(_In_ PDEVICE_OBJECT DeviceObject,
-                          _In_ ULONG BaudRate,
-                          _In_ UCHAR StopBits,
-                          _In_ UCHAR Parity,
-                          _In_ UCHAR DataBits);
-NTSTATUS Pl2303UsbSetControlLines(_In_ PDEVICE_OBJECT DeviceObject,
-                                  _In_ USHORT DtrRts);
-NTSTATUS Pl2303UsbRead(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp);
-NTSTATUS Pl2303UsbWrite(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp);
+/*
+ * PL2303 USB-Serial Driver Declarations
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include <ntddk.h>
+#include <ntstrsafe.h>
+#include <ntddser.h>
+#include <usb.h>
+#include <usbdlib.h>
+#include <usbioctl.h>
+#include <wdmsec.h>
+#include "pl2303ioctl.h"
+
+/* Device class of the control devices, {D575FF66-1457-485D-8460-438820DC0BA5} */
+DEFINE_GUID(GUID_DEVCLASS_PL2303_CONTROL,
+            0xd575ff66, 0x1457, 0x485d, 0x84, 0x60, 0x43, 0x88, 0x20, 0xdc, 0x0b, 0xa5);
+
+/* Pool tags */
+#define PL2303_TAG      '32LP'
+#define PL2303_URB_TAG  'U2LP'
+#define PL2303_BUFFER_TAG 'B2LP'
+#define PL2303_STATS_TAG 'S2LP'
+
+/* USB requests */
+#define PL2303_VENDOR_READ_REQUEST  0x01
+#define PL2303_VENDOR_WRITE_REQUEST 0x01
+#define PL2303_SET_LINE_REQUEST     0x20
+#define PL2303_SET_CONTROL_REQUEST  0x22
+
+/* Vendor requests of the G series */
+#define PL2303_G_VENDOR_READ_REQUEST    0x81
+#define PL2303_G_VENDOR_WRITE_REQUEST   0x80
+
+/* Vendor register only HX-compatible chips can read, telling TA/TB from G */
+#define PL2303_HX_STATUS_REGISTER   0x8080
+
+/*
+ * Vendor register selecting the chip's flow control. Bits outside the mask
+ * are kept; with a full mask the register only holds the flow control mode
+ * and is written without reading it first.
+ */
+#define PL2303_FLOW_CONTROL_REGISTER        0x00
+#define PL2303_FLOW_CONTROL_MASK            0xff
+#define PL2303_FLOW_CONTROL_NONE            0x00
+#define PL2303_FLOW_CONTROL_RTS_CTS         0x61
+#define PL2303_LEGACY_FLOW_CONTROL_RTS_CTS  0x41
+#define PL2303_G_FLOW_CONTROL_REGISTER      0x0a
+#define PL2303_G_FLOW_CONTROL_MASK          0x1c
+#define PL2303_G_FLOW_CONTROL_NONE          0x1c
+#define PL2303_G_FLOW_CONTROL_RTS_CTS       0x18
+
+/* Vendor write resetting the G series' data pipes */
+#define PL2303_G_RESET_REGISTER     0x07
+#define PL2303_G_RESET_PIPES        0x03
+
+/* Control requests */
+#define PL2303_CONTROL_REQUEST_COUNT    4
+#define PL2303_CONTROL_BUFFER_SIZE      8
+/* Large enough for the whole configuration descriptor of known chips */
+#define PL2303_CONFIG_DESCRIPTOR_SIZE   64
+
+/* Receive path */
+#define PL2303_READ_TRANSFER_COUNT  4
+#define PL2303_READ_TRANSFER_SIZE   4096
+/* Receive buffer size while the port is closed or not in heavy use
+ * (ReadBufferSize registry value) */
+#define PL2303_READ_BUFFER_SIZE     16384
+#define PL2303_MIN_READ_BUFFER_SIZE 4096
+#define PL2303_MAX_READ_BUFFER_SIZE 1048576
+/* With adaptive sizing (AdaptiveReadBuffer registry value), the number of
+ * times the receive buffer fills past three quarters before it is doubled */
+#define PL2303_READ_BUFFER_GROW_COUNT   4
+
+/* Transmit path */
+#define PL2303_WRITE_TRANSFER_COUNT         4
+#define PL2303_MAX_WRITE_TRANSFER_COUNT     32
+
+/* Small write coalescing modes (WriteCoalescing registry value) */
+#define PL2303_WRITE_COALESCE_NONE          0
+#define PL2303_WRITE_COALESCE_PACKET        1
+#define PL2303_WRITE_COALESCE_TRANSFER      2
+/* Milliseconds a partially filled coalescing buffer may wait for more data */
+#define PL2303_WRITE_COALESCE_TIMEOUT       1
+#define PL2303_MAX_WRITE_COALESCE_TIMEOUT   1000
+
+/* Seconds the port must be closed before the device is suspended
+ * (IdleTimeout registry value), zero to never suspend it */
+#define PL2303_IDLE_TIMEOUT                 0
+#define PL2303_MAX_IDLE_TIMEOUT             86400
+
+/* Pipe resets in a row after which a failing read or status pump gives up,
+ * and milliseconds before the first one, doubled for each further one */
+#define PL2303_PIPE_RESET_LIMIT         3
+#define PL2303_PIPE_RESET_DELAY         10
+
+/* Interrupt-IN status notification */
+#define PL2303_STATUS_TRANSFER_SIZE     10
+#define PL2303_STATUS_STATE_INDEX       8
+
+/* Line and error state bits of the status notification */
+#define PL2303_STATE_DCD                0x01
+#define PL2303_STATE_DSR                0x02
+#define PL2303_STATE_BREAK              0x04
+#define PL2303_STATE_RING               0x08
+#define PL2303_STATE_FRAMING_ERROR      0x10
+#define PL2303_STATE_PARITY_ERROR       0x20
+#define PL2303_STATE_OVERRUN_ERROR      0x40
+#define PL2303_STATE_CTS                0x80
+
+/* Current read timeout state */
+#define PL2303_READ_TOTAL_TIMEOUT       0x01
+#define PL2303_READ_INTERVAL_TIMEOUT    0x02
+#define PL2303_READ_RETURN_ON_DATA      0x04
+#define PL2303_READ_RETURN_IMMEDIATELY  0x08
+
+/* Trace components (TraceMask registry value) */
+#define PL2303_TRACE_GENERAL            0x01
+#define PL2303_TRACE_PNP                0x02
+#define PL2303_TRACE_IOCTL              0x04
+#define PL2303_TRACE_EVENT              0x08
+#define PL2303_TRACE_READ               0x10
+#define PL2303_TRACE_WRITE              0x20
+#define PL2303_TRACE_USB                0x40
+#define PL2303_TRACE_ALL                0x7f
+
+/* Highest trace level compiled in (TraceLevel registry value can lower it) */
+#ifndef PL2303_TRACE_MAX_LEVEL
+#if DBG
+#define PL2303_TRACE_MAX_LEVEL          DPFLTR_TRACE_LEVEL
+#else
+#define PL2303_TRACE_MAX_LEVEL          DPFLTR_WARNING_LEVEL
+#endif
+#endif
+
+/* Component of the including source file */
+#ifndef PL2303_TRACE_COMPONENT
+#define PL2303_TRACE_COMPONENT          PL2303_TRACE_GENERAL
+#endif
+
+/* Flight recorder records per device, a power of two */
+#define PL2303_RECORDER_SIZE            256
+
+/* Per-processor statistics slots are padded to this size */
+#define PL2303_CACHE_LINE_SIZE          64
+
+/* Misc defines */
+#if defined(_MSC_VER) && !defined(inline)
+#define inline __inline
+#endif
+
+#ifndef __WARNING_USING_VARIABLE_FROM_FAILED_FUNCTION_CALL
+#define __WARNING_USING_VARIABLE_FROM_FAILED_FUNCTION_CALL 6102
+#endif
+
+/* Types */
+typedef enum _DEVICE_PNP_STATE
+{
+    NotStarted,
+    Started,
+    StopPending,
+    Stopped,
+    RemovePending,
+    SurpriseRemovePending,
+    Deleted
+} DEVICE_PNP_STATE, *PDEVICE_PNP_STATE;
+
+typedef enum _PL2303_CHIP_TYPE
+{
+    Pl2303ChipLegacy,
+    Pl2303ChipHx,
+    Pl2303ChipHxd,
+    Pl2303ChipTa,
+    Pl2303ChipTb,
+    Pl2303ChipG,
+    Pl2303ChipTypes
+} PL2303_CHIP_TYPE, *PPL2303_CHIP_TYPE;
+
+/* How the chip takes the baud rate in SET_LINE */
+typedef enum _PL2303_BAUD_ENCODING
+{
+    Pl2303BaudDirect,
+    Pl2303BaudDivisor,
+    Pl2303BaudAltDivisor
+} PL2303_BAUD_ENCODING, *PPL2303_BAUD_ENCODING;
+
+typedef struct _PL2303_VENDOR_STEP
+{
+    BOOLEAN Read;
+    USHORT Value;
+    USHORT Index;
+} PL2303_VENDOR_STEP, *PPL2303_VENDOR_STEP;
+
+/* Capability flags */
+#define PL2303_CHIP_RTS_CTS         0x01
+
+typedef struct _PL2303_CHIP_INFO
+{
+    PL2303_CHIP_TYPE Type;
+    PCSTR Name;
+    ULONG MaxBaudRate;
+    ULONG Flags;
+    PL2303_BAUD_ENCODING BaudEncoding;
+    /* Rates the chip supports with direct encoding, in ascending order */
+    const ULONG *BaudRates;
+    ULONG BaudRateCount;
+    UCHAR VendorReadRequest;
+    UCHAR VendorWriteRequest;
+    const PL2303_VENDOR_STEP *InitSequence;
+    ULONG InitSequenceLength;
+    USHORT FlowControlRegister;
+    USHORT FlowControlMask;
+    USHORT FlowControlNone;
+    USHORT FlowControlRtsCts;
+} PL2303_CHIP_INFO, *PPL2303_CHIP_INFO;
+
+typedef struct _QUEUE
+{
+    IO_CSQ Csq;
+    LIST_ENTRY QueueHead;
+    KSPIN_LOCK QueueSpinLock;
+} QUEUE, *PQUEUE;
+
+typedef struct _RING_BUFFER
+{
+    PUCHAR Buffer;
+    ULONG Size;
+    ULONG ReadIndex;
+    ULONG Count;
+} RING_BUFFER, *PRING_BUFFER;
+
+typedef struct _PIPE_TRANSFER
+{
+    PDEVICE_OBJECT DeviceObject;
+    PIRP Irp;
+    PUCHAR Buffer;
+    PIRP Request;
+    LONG References;
+    ULONG SubmitTime;
+    ULONG RecordCookie;
+    LIST_ENTRY ListEntry;
+    struct _URB_BULK_OR_INTERRUPT_TRANSFER Urb;
+} PIPE_TRANSFER, *PPIPE_TRANSFER;
+
+typedef struct _LINE_CODING
+{
+    ULONG BaudRate;
+    UCHAR StopBits;
+    UCHAR Parity;
+    UCHAR DataBits;
+} LINE_CODING, *PLINE_CODING;
+
+typedef struct _LINE_STATE
+{
+    ULONG BaudRate;
+    UCHAR StopBits;
+    UCHAR Parity;
+    UCHAR DataBits;
+    SERIAL_CHARS Chars;
+    SERIAL_HANDFLOW HandFlow;
+    SERIAL_TIMEOUTS Timeouts;
+} LINE_STATE, *PLINE_STATE;
+
+typedef struct _CONTROL_REQUEST
+{
+    LIST_ENTRY ListEntry;
+    PDEVICE_OBJECT DeviceObject;
+    PIRP Irp;
+    LIST_ENTRY CallerIrps;
+    PURB SubmitUrb;
+    NTSTATUS Status;
+    ULONG QueueTime;
+    ULONG SubmitTime;
+    ULONG RecordCookie;
+    KEVENT Event;
+    URB Urb;
+    UCHAR Buffer[PL2303_CONTROL_BUFFER_SIZE];
+    BOOLEAN Preallocated;
+    BOOLEAN Started;
+    BOOLEAN SetsLine;
+    BOOLEAN SetsControlLines;
+    BOOLEAN Detached;
+} CONTROL_REQUEST, *PCONTROL_REQUEST;
+
+typedef union _CPU_STATISTICS
+{
+    SERIALPERF_STATS Stats;
+    UCHAR Padding[PL2303_CACHE_LINE_SIZE];
+} CPU_STATISTICS, *PCPU_STATISTICS;
+
+/*
+ * Device extension of the per-port control device that serves the private
+ * IOCTLs. Both extensions start with IsControlDevice, so that the shared
+ * dispatch routines can tell them apart.
+ */
+typedef struct _CONTROL_EXTENSION
+{
+    BOOLEAN IsControlDevice;
+    PDEVICE_OBJECT PortDevice;
+    IO_REMOVE_LOCK RemoveLock;
+} CONTROL_EXTENSION, *PCONTROL_EXTENSION;
+
+typedef struct _DEVICE_EXTENSION
+{
+    BOOLEAN IsControlDevice;
+    PDEVICE_OBJECT LowerDevice;
+    PDEVICE_OBJECT PhysicalDevice;
+    DEVICE_PNP_STATE PnpState;
+    DEVICE_PNP_STATE PreviousPnpState;
+    UNICODE_STRING DeviceName;
+    UNICODE_STRING InterfaceLinkName;
+    UNICODE_STRING ComPortName;
+    PDEVICE_OBJECT ControlDevice;
+    UNICODE_STRING ControlLinkName;
+    USBD_PIPE_HANDLE BulkInPipe;
+    USBD_PIPE_HANDLE BulkOutPipe;
+    USBD_PIPE_HANDLE InterruptInPipe;
+    BOOLEAN PipeFailed;
+    const PL2303_CHIP_INFO *Chip;
+    PVOID StatisticsBuffer;
+    PCPU_STATISTICS Statistics;
+    ULONG StatisticsCount;
+    KSPIN_LOCK ControlSpinLock;
+    LIST_ENTRY ControlPool;
+    PCONTROL_REQUEST ControlRequests;
+    PL2303_POOL_STATISTICS ControlPoolStatistics;
+    LIST_ENTRY ControlQueue;
+    BOOLEAN ControlBusy;
+    BOOLEAN ControlStarting;
+    PCONTROL_REQUEST LineRequest;
+    LINE_CODING LineCoding;
+    BOOLEAN LineCodingValid;
+    BOOLEAN FlowControlEnabled;
+    BOOLEAN FlowControlValid;
+    PCONTROL_REQUEST ControlLinesRequest;
+    FAST_MUTEX LineStateMutex;
+    LONG LineStateSequence;
+    LINE_STATE LineState;
+    USHORT DtrRts;
+    KSPIN_LOCK StatusSpinLock;
+    ULONG ModemStatus;
+    ULONG Errors;
+    PPIPE_TRANSFER StatusTransfer;
+    BOOLEAN StatusPumpRunning;
+    KEVENT StatusPumpStoppedEvent;
+    PIO_WORKITEM StatusResetWorkItem;
+    KTIMER StatusResetTimer;
+    KDPC StatusResetDpc;
+    ULONG StatusResetCount;
+    KSPIN_LOCK EventSpinLock;
+    ULONG WaitMask;
+    ULONG EventHistory;
+    PIRP WaitIrp;
+    KSPIN_LOCK ReadSpinLock;
+    RING_BUFFER ReadBuffer;
+    ULONG ReadBufferDefaultSize;
+    BOOLEAN ReadBufferAdaptive;
+    BOOLEAN ReadBufferHigh;
+    BOOLEAN ReadBufferGrowing;
+    ULONG ReadBufferHighCount;
+    ULONG ReadBufferGrowSize;
+    PIO_WORKITEM ReadBufferWorkItem;
+    KEVENT ReadBufferGrowDoneEvent;
+    QUEUE ReadQueue;
+    PIRP CurrentReadIrp;
+    PPIPE_TRANSFER ReadTransfers;
+    BOOLEAN ReadPumpRunning;
+    LONG ReadTransfersPending;
+    KEVENT ReadPumpStoppedEvent;
+    PIO_WORKITEM ReadResetWorkItem;
+    KTIMER ReadResetTimer;
+    KDPC ReadResetDpc;
+    ULONG ReadResetCount;
+    LIST_ENTRY ReadResetList;
+    BOOLEAN ReadResetQueued;
+    ULONG ReadFlags;
+    ULONG ReadTotalDeadline;
+    ULONG ReadIntervalDeadline;
+    ULONG ReadIntervalTimeout;
+    BOOLEAN ReadRtsHandshake;
+    BOOLEAN ReadAutoReceive;
+    BOOLEAN ReadAutoTransmit;
+    BOOLEAN ReadThrottled;
+    ULONG ReadXonLimit;
+    ULONG ReadXoffLimit;
+    UCHAR ReadXonChar;
+    UCHAR ReadXoffChar;
+    BOOLEAN ReadNullStripping;
+    BOOLEAN ReadErrorReplace;
+    BOOLEAN ReadErrorPending;
+    UCHAR ReadErrorChar;
+    UCHAR ReadEventChar;
+    UCHAR ReadEscapeChar;
+    KSPIN_LOCK WriteSpinLock;
+    QUEUE WriteQueue;
+    LIST_ENTRY ActiveWrites;
+    PPIPE_TRANSFER WriteTransfers;
+    ULONG WriteTransferCount;
+    ULONG WriteTransferSize;
+    LONG WriteTransferReferences;
+    BOOLEAN WritesRunning;
+    KEVENT WriteIdleEvent;
+    LIST_ENTRY WriteSubmitList;
+    BOOLEAN WriteSubmitting;
+    ULONG WriteMaxPacketSize;
+    ULONG WriteCoalescing;
+    ULONG WriteCoalesceTimeout;
+    ULONG WriteCoalesceSize;
+    PPIPE_TRANSFER WriteStaging;
+    ULONG WriteStagedLength;
+    ULONG WriteStagingDeadline;
+    ULONG WriteHoldReasons;
+    PPIPE_TRANSFER WriteFlowTransfer;
+    BOOLEAN WriteFlowBusy;
+    BOOLEAN WriteXoffSent;
+    KSPIN_LOCK TimeoutSpinLock;
+    KTIMER TimeoutTimer;
+    KDPC TimeoutDpc;
+    BOOLEAN TimeoutTimerArmed;
+    ULONG TimeoutTimerDeadline;
+    KSPIN_LOCK PowerSpinLock;
+    DEVICE_POWER_STATE DevicePower;
+    ULONG OpenCount;
+    BOOLEAN Suspended;
+    ULONG IdleTimeout;
+    KTIMER IdleTimer;
+    KDPC IdleDpc;
+    PIRP IdleIrp;
+    BOOLEAN IdleIrpPending;
+    KEVENT IdleIrpDoneEvent;
+    USB_IDLE_CALLBACK_INFO IdleCallbackInfo;
+    PL2303_LATENCY_HISTOGRAM RequestLatency[PL2303_LATENCY_CLASSES];
+    PL2303_LATENCY_HISTOGRAM UrbLatency[PL2303_LATENCY_CLASSES];
+    LONG RecorderSequence;
+    PL2303_RECORD Recorder[PL2303_RECORDER_SIZE];
+} DEVICE_EXTENSION, *PDEVICE_EXTENSION;
+
+/* Debugging functions */
+extern ULONG Pl2303TraceLevel;
+extern ULONG Pl2303TraceMask;
+
+static
+inline
+VOID
+Pl2303TracePrint(
+    _In_ ULONG Level,
+    _In_ PCSTR Format,
+    ...)
+{
+    va_list Arguments;
+    va_start(Arguments, Format);
+    (VOID)vDbgPrintExWithPrefix("Pl2303: ",
+                                DPFLTR_IHVDRIVER_ID,
+                                Level,
+                                Format,
+                                Arguments);
+    va_end(Arguments);
+}
+
+/*
+ * The level check against PL2303_TRACE_MAX_LEVEL is constant, so messages
+ * above it are compiled out along with their arguments. The others are only
+ * formatted if their level and component are enabled at run time.
+ */
+#define Pl2303TraceEnabled(Component, Level)            \
+    ((Level) <= PL2303_TRACE_MAX_LEVEL &&               \
+     (Level) <= Pl2303TraceLevel &&                     \
+     (Pl2303TraceMask & (Component)) != 0)
+
+#define Pl2303Trace(Level, ...)                                         \
+    ((VOID)(Pl2303TraceEnabled(PL2303_TRACE_COMPONENT, Level) &&        \
+            (Pl2303TracePrint(Level, __VA_ARGS__), TRUE)))
+
+#define Pl2303Debug(...)    Pl2303Trace(DPFLTR_TRACE_LEVEL, __VA_ARGS__)
+#define Pl2303Warn(...)     Pl2303Trace(DPFLTR_WARNING_LEVEL, __VA_ARGS__)
+#define Pl2303Error(...)    Pl2303Trace(DPFLTR_ERROR_LEVEL, __VA_ARGS__)
+
+/* Statistics functions */
+static
+inline
+VOID
+Pl2303CountStatistic(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ LONG Offset,
+    _In_ ULONG Count)
+{
+    PCPU_STATISTICS Statistics;
+
+    if (!DeviceExtension->Statistics || !Count)
+        return;
+
+    Statistics = &DeviceExtension->Statistics[KeGetCurrentProcessorNumber() %
+                                              DeviceExtension->StatisticsCount];
+    (VOID)InterlockedExchangeAdd((volatile LONG *)((PUCHAR)&Statistics->Stats + Offset),
+                                 (LONG)Count);
+}
+
+#define PL2303_COUNT(DeviceExtension, Counter, Count)                   \
+    Pl2303CountStatistic(DeviceExtension,                               \
+                         FIELD_OFFSET(SERIALPERF_STATS, Counter),       \
+                         Count)
+
+extern ULONG Pl2303LatencyShift;
+
+/* Returns the current time in latency units, for Pl2303CountLatency */
+static
+inline
+ULONG
+Pl2303QueryLatencyTime(VOID)
+{
+    return (ULONG)(KeQueryPerformanceCounter(NULL).QuadPart >> Pl2303LatencyShift);
+}
+
+static
+inline
+VOID
+Pl2303CountLatency(
+    _Inout_ PPL2303_LATENCY_HISTOGRAM Histogram,
+    _In_ ULONG StartTime)
+{
+    ULONG Bucket;
+
+    if (BitScanReverse(&Bucket, Pl2303QueryLatencyTime() - StartTime))
+    {
+        Bucket++;
+        if (Bucket >= PL2303_LATENCY_BUCKETS)
+            Bucket = PL2303_LATENCY_BUCKETS - 1;
+    }
+    else
+    {
+        Bucket = 0;
+    }
+
+    (VOID)InterlockedIncrement((volatile LONG *)&Histogram->Buckets[Bucket]);
+}
+
+/* buffer.c */
+NTSTATUS Pl2303InitializeRingBuffer(_Out_ PRING_BUFFER RingBuffer, _In_ ULONG Size);
+VOID Pl2303FreeRingBuffer(_Inout_ PRING_BUFFER RingBuffer);
+ULONG Pl2303RingBufferWrite(_Inout_ PRING_BUFFER RingBuffer,
+                            _In_reads_bytes_(Length) const UCHAR *Data,
+                            _In_ ULONG Length);
+ULONG Pl2303RingBufferRead(_Inout_ PRING_BUFFER RingBuffer,
+                           _Out_writes_bytes_to_(Length, return) PUCHAR Data,
+                           _In_ ULONG Length);
+VOID Pl2303RingBufferPurge(_Inout_ PRING_BUFFER RingBuffer);
+VOID Pl2303RingBufferExchange(_Inout_ PRING_BUFFER RingBuffer,
+                              _Inout_ PRING_BUFFER NewBuffer);
+
+/* chip.c */
+extern const PL2303_CHIP_INFO Pl2303Chips[Pl2303ChipTypes];
+PL2303_CHIP_TYPE Pl2303ClassifyChip(_In_ const USB_DEVICE_DESCRIPTOR *DeviceDescriptor);
+ULONG Pl2303EncodeBaudRate(_In_ const PL2303_CHIP_INFO *Chip,
+                           _In_ ULONG BaudRate,
+                           _Out_opt_ PULONG ActualBaudRate);
+ULONG Pl2303GetSettableBaud(_In_ const PL2303_CHIP_INFO *Chip);
+
+/* control.c */
+NTSTATUS Pl2303CreateControlDevice(_In_ PDEVICE_OBJECT DeviceObject, _In_ ULONG DeviceNumber);
+VOID Pl2303DeleteControlDevice(_In_ PDEVICE_OBJECT DeviceObject);
+DRIVER_DISPATCH Pl2303DispatchControlDevice;
+
+static
+inline
+BOOLEAN
+Pl2303IsControlDevice(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    return ((PCONTROL_EXTENSION)DeviceObject->DeviceExtension)->IsControlDevice;
+}
+
+/* event.c */
+NTSTATUS Pl2303GetWaitMask(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+NTSTATUS Pl2303SetWaitMask(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+NTSTATUS Pl2303WaitOnMask(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+BOOLEAN Pl2303IsWaitingForEvents(_In_ PDEVICE_OBJECT DeviceObject, _In_ ULONG Events);
+VOID Pl2303SignalEvents(_In_ PDEVICE_OBJECT DeviceObject, _In_ ULONG Events);
+VOID Pl2303FlushEvents(_In_ PDEVICE_OBJECT DeviceObject, _In_ NTSTATUS Status);
+
+/* ioctl.c */
+__drv_dispatchType(IRP_MJ_DEVICE_CONTROL)
+__drv_dispatchType(IRP_MJ_INTERNAL_DEVICE_CONTROL)
+DRIVER_DISPATCH Pl2303DispatchDeviceControl;
+NTSTATUS Pl2303SetLine(_In_ PDEVICE_OBJECT DeviceObject, _In_opt_ PIRP Irp);
+NTSTATUS Pl2303SetFlowControl(_In_ PDEVICE_OBJECT DeviceObject, _In_opt_ PIRP Irp);
+NTSTATUS Pl2303RestoreLine(_In_ PDEVICE_OBJECT DeviceObject);
+NTSTATUS Pl2303PrivateDeviceControl(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+
+/* linestate.c */
+VOID Pl2303QueryLineState(_In_ PDEVICE_EXTENSION DeviceExtension, _Out_ PLINE_STATE LineState);
+_Requires_lock_held_(DeviceExtension->LineStateMutex)
+PLINE_STATE Pl2303BeginLineStateUpdate(_In_ PDEVICE_EXTENSION DeviceExtension, _Out_ PKIRQL OldIrql);
+_Requires_lock_held_(DeviceExtension->LineStateMutex)
+VOID Pl2303EndLineStateUpdate(_In_ PDEVICE_EXTENSION DeviceExtension, _In_ KIRQL OldIrql);
+
+/* pnp.c */
+ULONG Pl2303QueryRegistryDword(_In_ HANDLE KeyHandle,
+                               _In_ PCWSTR Name,
+                               _In_ ULONG DefaultValue);
+DRIVER_ADD_DEVICE Pl2303AddDevice;
+__drv_dispatchType(IRP_MJ_PNP)
+DRIVER_DISPATCH Pl2303DispatchPnp;
+
+/* power.c */
+VOID Pl2303InitializePower(_In_ PDEVICE_OBJECT DeviceObject);
+NTSTATUS Pl2303AllocateIdleRequest(_In_ PDEVICE_OBJECT DeviceObject);
+VOID Pl2303FreeIdleRequest(_In_ PDEVICE_OBJECT DeviceObject);
+VOID Pl2303StartIdle(_In_ PDEVICE_OBJECT DeviceObject);
+VOID Pl2303StopIdle(_In_ PDEVICE_OBJECT DeviceObject);
+NTSTATUS Pl2303OpenPort(_In_ PDEVICE_OBJECT DeviceObject);
+VOID Pl2303ClosePort(_In_ PDEVICE_OBJECT DeviceObject);
+__drv_dispatchType(IRP_MJ_POWER)
+DRIVER_DISPATCH Pl2303DispatchPower;
+
+/* queue.c */
+NTSTATUS Pl2303InitializeQueue(_In_ PQUEUE Queue);
+NTSTATUS Pl2303QueueIrp(_In_ PQUEUE Queue, _In_ PIRP Irp);
+PIRP Pl2303DequeueIrp(_In_ PQUEUE Queue);
+ULONG Pl2303QueryQueueLength(_In_ PQUEUE Queue);
+
+/* read.c */
+NTSTATUS Pl2303Read(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp);
+VOID Pl2303FlushReads(_In_ PDEVICE_OBJECT DeviceObject, _In_ NTSTATUS Status);
+VOID Pl2303PurgeReadBuffer(_In_ PDEVICE_OBJECT DeviceObject);
+ULONG Pl2303QueryReadBufferCount(_In_ PDEVICE_OBJECT DeviceObject);
+NTSTATUS Pl2303ResizeReadBuffer(_In_ PDEVICE_OBJECT DeviceObject,
+                                _In_ ULONG Size,
+                                _In_ BOOLEAN Grow);
+VOID Pl2303ShrinkReadBuffer(_In_ PDEVICE_OBJECT DeviceObject);
+VOID Pl2303WaitForReadBufferGrowth(_In_ PDEVICE_OBJECT DeviceObject);
+VOID Pl2303ReceiveData(_In_ PDEVICE_OBJECT DeviceObject,
+                       _In_reads_bytes_(Length) const UCHAR *Data,
+                       _In_ ULONG Length);
+VOID Pl2303ReceiveLineStatus(_In_ PDEVICE_OBJECT DeviceObject, _In_ UCHAR LineStatus);
+VOID Pl2303ReceiveModemStatus(_In_ PDEVICE_OBJECT DeviceObject, _In_ UCHAR ModemStatus);
+VOID Pl2303ReadTimeout(_In_ PDEVICE_OBJECT DeviceObject);
+VOID Pl2303SetReadFlowControl(_In_ PDEVICE_OBJECT DeviceObject,
+                              _In_ const SERIAL_HANDFLOW *HandFlow,
+                              _In_ const SERIAL_CHARS *Chars);
+
+/* recorder.c */
+VOID Pl2303Record(_In_ PDEVICE_EXTENSION DeviceExtension,
+                  _In_ UCHAR Type,
+                  _In_ UCHAR Code,
+                  _In_ ULONG Size,
+                  _In_ ULONG Status,
+                  _Inout_opt_ PULONG Cookie,
+                  _In_ ULONG Data);
+VOID Pl2303RecordIrp(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp);
+VOID Pl2303CopyRecords(_In_ PDEVICE_EXTENSION DeviceExtension,
+                       _Out_writes_(PL2303_RECORDER_SIZE) PPL2303_RECORD Records);
+
+/* stats.c */
+NTSTATUS Pl2303AllocateStatistics(_In_ PDEVICE_EXTENSION DeviceExtension);
+VOID Pl2303FreeStatistics(_In_ PDEVICE_EXTENSION DeviceExtension);
+VOID Pl2303QueryStatistics(_In_ PDEVICE_EXTENSION DeviceExtension, _Out_ PSERIALPERF_STATS Stats);
+VOID Pl2303ClearStatistics(_In_ PDEVICE_EXTENSION DeviceExtension);
+VOID Pl2303InitializeLatency(VOID);
+VOID Pl2303QueryLatency(_In_ PDEVICE_EXTENSION DeviceExtension,
+                        _Out_ PPL2303_LATENCY_STATISTICS Latency);
+VOID Pl2303ResetLatency(_In_ PDEVICE_EXTENSION DeviceExtension);
+
+/* status.c */
+VOID Pl2303UpdateStatus(_In_ PDEVICE_OBJECT DeviceObject, _In_ UCHAR State);
+ULONG Pl2303QueryModemStatus(_In_ PDEVICE_OBJECT DeviceObject);
+VOID Pl2303AddErrors(_In_ PDEVICE_OBJECT DeviceObject, _In_ ULONG Errors);
+ULONG Pl2303QueryErrors(_In_ PDEVICE_OBJECT DeviceObject, _In_ BOOLEAN Clear);
+
+/* timeout.c */
+VOID Pl2303InitializeTimeouts(_In_ PDEVICE_OBJECT DeviceObject);
+VOID Pl2303StopTimeouts(_In_ PDEVICE_OBJECT DeviceObject);
+ULONG Pl2303QueryTime(VOID);
+ULONG Pl2303TimeoutToDeadline(_In_ ULONGLONG Timeout);
+BOOLEAN Pl2303DeadlineExpired(_In_ ULONG Deadline, _In_ ULONG Now);
+VOID Pl2303ArmTimeoutTimer(_In_ PDEVICE_EXTENSION DeviceExtension, _In_ ULONG Deadline);
+
+/* usb.c */
+NTSTATUS Pl2303UsbStart(_In_ PDEVICE_OBJECT DeviceObject);
+NTSTATUS Pl2303UsbStop(_In_ PDEVICE_OBJECT DeviceObject);
+NTSTATUS Pl2303UsbSetLine(_In_ PDEVICE_OBJECT DeviceObject,
+                          _In_opt_ PIRP Irp,
+                          _In_ ULONG BaudRate,
+                          _In_ UCHAR StopBits,
+                          _In_ UCHAR Parity,
+                          _In_ UCHAR DataBits);
+NTSTATUS Pl2303UsbSetControlLines(_In_ PDEVICE_OBJECT DeviceObject, _In_opt_ PIRP Irp);
+VOID Pl2303UsbUpdateControlLines(_In_ PDEVICE_OBJECT DeviceObject);
+NTSTATUS Pl2303UsbSetFlowControl(_In_ PDEVICE_OBJECT DeviceObject, _In_ BOOLEAN Enable);
+NTSTATUS Pl2303UsbRestoreLine(_In_ PDEVICE_OBJECT DeviceObject,
+                              _In_ ULONG BaudRate,
+                              _In_ UCHAR StopBits,
+                              _In_ UCHAR Parity,
+                              _In_ UCHAR DataBits,
+                              _In_ BOOLEAN FlowControl);
+NTSTATUS Pl2303UsbAllocateControlPool(_In_ PDEVICE_OBJECT DeviceObject);
+VOID Pl2303UsbFreeControlPool(_In_ PDEVICE_OBJECT DeviceObject);
+NTSTATUS Pl2303UsbAllocateTransfers(_In_ PDEVICE_OBJECT DeviceObject,
+                                    _In_ ULONG Count,
+                                    _In_ ULONG BufferSize,
+                                    _Out_ PPIPE_TRANSFER *Transfers);
+VOID Pl2303UsbFreeTransfers(_In_ PPIPE_TRANSFER Transfers, _In_ ULONG Count);
+VOID Pl2303UsbSubmitTransfer(_In_ PPIPE_TRANSFER Transfer);
+NTSTATUS Pl2303UsbStartReadPump(_In_ PDEVICE_OBJECT DeviceObject);
+VOID Pl2303UsbStopReadPump(_In_ PDEVICE_OBJECT DeviceObject);
+NTSTATUS Pl2303UsbStartStatusPump(_In_ PDEVICE_OBJECT DeviceObject);
+VOID Pl2303UsbStopStatusPump(_In_ PDEVICE_OBJECT DeviceObject);
+VOID Pl2303UsbPrepareWriteTransfer(_In_ PPIPE_TRANSFER Transfer,
+                                   _In_reads_bytes_(Length) PVOID Buffer,
+                                   _In_ ULONG Length);
+
+/* write.c */
+NTSTATUS Pl2303Write(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp);
+VOID Pl2303FlushWrites(_In_ PDEVICE_OBJECT DeviceObject, _In_ NTSTATUS Status);
+VOID Pl2303WriteTransferComplete(_In_ PPIPE_TRANSFER Transfer,
+                                 _In_ NTSTATUS Status,
+                                 _In_ ULONG Length);
+VOID Pl2303WriteTimeout(_In_ PDEVICE_OBJECT DeviceObject);
+NTSTATUS Pl2303StartWrites(_In_ PDEVICE_OBJECT DeviceObject);
+VOID Pl2303StopWrites(_In_ PDEVICE_OBJECT DeviceObject, _In_ NTSTATUS Status);
+BOOLEAN Pl2303SetWriteHold(_In_ PDEVICE_OBJECT DeviceObject, _In_ ULONG Reason, _In_ BOOLEAN Hold);
+VOID Pl2303ResumeWrites(_In_ PDEVICE_OBJECT DeviceObject);
+VOID Pl2303SendFlowControlChar(_In_ PDEVICE_OBJECT DeviceObject);
+VOID Pl2303QueryWriteStatus(_In_ PDEVICE_OBJECT DeviceObject,
+                            _Out_ PULONG HoldReasons,
+                            _Out_ PULONG AmountInOutQueue);
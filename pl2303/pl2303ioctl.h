@@ -0,0 +1,147 @@
+/*
+ * PL2303 Driver private I/O control interface
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * This header is shared with user mode tools. It only depends on the
+ * definitions from winioctl.h (user mode) or ntddk.h (kernel mode).
+ */
+
+#pragma once
+
+#define IOCTL_PL2303_GET_POOL_STATISTICS \
+    CTL_CODE(FILE_DEVICE_SERIAL_PORT, 0x800, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define IOCTL_PL2303_GET_FLIGHT_RECORDER \
+    CTL_CODE(FILE_DEVICE_SERIAL_PORT, 0x801, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define IOCTL_PL2303_GET_LATENCY \
+    CTL_CODE(FILE_DEVICE_SERIAL_PORT, 0x802, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define IOCTL_PL2303_RESET_LATENCY \
+    CTL_CODE(FILE_DEVICE_SERIAL_PORT, 0x803, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+typedef struct _PL2303_POOL_STATISTICS
+{
+    /* Preallocated control requests */
+    ULONG ControlRequests;
+    /* Requests served from the preallocated set */
+    ULONG ControlRequestHits;
+    /* Requests that had to be allocated because the set was exhausted */
+    ULONG ControlRequestMisses;
+    /* Misses where the allocation failed as well */
+    ULONG ControlRequestFailures;
+} PL2303_POOL_STATISTICS, *PPL2303_POOL_STATISTICS;
+
+/* Flight recorder record types */
+#define PL2303_RECORD_IRP           1   /* Dispatch of a request to the driver */
+#define PL2303_RECORD_URB_SUBMIT    2   /* URB passed to the USB stack */
+#define PL2303_RECORD_URB_COMPLETE  3   /* URB completed by the USB stack */
+#define PL2303_RECORD_STATUS        4   /* Modem status or line error change */
+#define PL2303_RECORD_PNP           5   /* PnP state transition */
+
+/* Pipes reported in the Code of URB records */
+#define PL2303_RECORD_PIPE_CONTROL      0
+#define PL2303_RECORD_PIPE_BULK_IN      1
+#define PL2303_RECORD_PIPE_BULK_OUT     2
+#define PL2303_RECORD_PIPE_INTERRUPT_IN 3
+
+/*
+ * Field use per record type:
+ *
+ *                  Code            Size            Status          Data
+ * IRP              major function  buffer length   -               minor function or I/O control code
+ * URB_SUBMIT       pipe            buffer length   -               URB function
+ * URB_COMPLETE     pipe            bytes done      USBD status     IRP status
+ * STATUS           state byte      -               modem status    SERIAL_ERROR_* bits
+ * PNP              minor function  -               -               new DEVICE_PNP_STATE
+ */
+typedef struct _PL2303_RECORD
+{
+    /* Performance counter value at the time of the event */
+    LONGLONG Timestamp;
+    /* Counts up by one per record. Zero if unused or being overwritten */
+    ULONG Sequence;
+    UCHAR Type;
+    UCHAR Code;
+    USHORT Reserved;
+    ULONG Size;
+    ULONG Status;
+    /* Sequence of the IRP or URB_SUBMIT record that started the operation,
+     * to pair submits with completions. Zero for other records */
+    ULONG Object;
+    ULONG Data;
+} PL2303_RECORD, *PPL2303_RECORD;
+
+/*
+ * Output of IOCTL_PL2303_GET_FLIGHT_RECORDER. If the buffer only fits the
+ * header, STATUS_BUFFER_OVERFLOW is returned along with the header, so the
+ * caller can retry with room for RecordCount records. Records are in ring
+ * order; sort them by Sequence for a timeline.
+ */
+typedef struct _PL2303_FLIGHT_RECORDER
+{
+    /* Performance counter ticks per second */
+    LONGLONG Frequency;
+    ULONG RecordCount;
+    ULONG Reserved;
+    PL2303_RECORD Records[1];
+} PL2303_FLIGHT_RECORDER, *PPL2303_FLIGHT_RECORDER;
+
+/* Operation classes of the latency histograms */
+#define PL2303_LATENCY_READ                 0
+#define PL2303_LATENCY_WRITE                1
+#define PL2303_LATENCY_SET_LINE             2
+#define PL2303_LATENCY_SET_CONTROL_LINES    3
+#define PL2303_LATENCY_VENDOR               4
+#define PL2303_LATENCY_CLASSES              5
+
+/*
+ * Bucket 0 counts latencies of zero units, bucket n (n > 0) those of at
+ * least 2^(n-1) and less than 2^n units. The last bucket also counts
+ * anything longer.
+ */
+#define PL2303_LATENCY_BUCKETS              32
+
+typedef struct _PL2303_LATENCY_HISTOGRAM
+{
+    ULONG Buckets[PL2303_LATENCY_BUCKETS];
+} PL2303_LATENCY_HISTOGRAM, *PPL2303_LATENCY_HISTOGRAM;
+
+/* Output of IOCTL_PL2303_GET_LATENCY, indexed by PL2303_LATENCY_* */
+typedef struct _PL2303_LATENCY_STATISTICS
+{
+    /* Latency units per second */
+    LONGLONG Frequency;
+    /* From dispatch of a request to its completion. Control requests
+     * count from being queued for the device */
+    PL2303_LATENCY_HISTOGRAM Request[PL2303_LATENCY_CLASSES];
+    /* From submitting a URB to its completion */
+    PL2303_LATENCY_HISTOGRAM Urb[PL2303_LATENCY_CLASSES];
+} PL2303_LATENCY_STATISTICS, *PPL2303_LATENCY_STATISTICS;
+
+/*
+ * Output of IOCTL_SERIAL_GET_BAUD_RATE if the buffer is large enough. The
+ * first member matches SERIAL_BAUD_RATE.
+ */
+typedef struct _PL2303_BAUD_RATE
+{
+    /* Rate as set */
+    ULONG BaudRate;
+    /* Rate the chip actually runs at */
+    ULONG ActualBaudRate;
+    /* Deviation of the actual rate from the one set, in parts per million */
+    LONG ErrorPpm;
+} PL2303_BAUD_RATE, *PPL2303_BAUD_RATE;
@@ -1,585 +1,848 @@
-/*
- * PL2303 Driver PnP routines
- * Copyright (C) 2012-2019  Thomas Faber
- *
- * This library is free software; you can redistribute it and/or
- * modify it under the terms of the GNU Lesser General Public
- * License as published by the Free Software Foundation; either
- * version 2.1 of the License, or (at your option) any later version.
- *
- * This library is distributed in the hope that it will be useful,
- * but WITHOUT ANY WARRANTY; without even the implied warranty of
- * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
- * Lesser General Public License for more details.
- *
- * You should have received a copy of the GNU Lesser General Public
- * License along with this library; if not, write to the Free Software
- * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
- */
-
-#include "pl2303.h"
-
-static NTSTATUS Pl2303InitializeDevice(_In_ PDEVICE_OBJECT DeviceObject,
-                                       _In_ PDEVICE_OBJECT PhysicalDeviceObject);
-static NTSTATUS Pl2303DestroyDevice(_In_ PDEVICE_OBJECT DeviceObject);
-static NTSTATUS Pl2303StartDevice(_In_ PDEVICE_OBJECT DeviceObject);
-static NTSTATUS Pl2303StopDevice(_In_ PDEVICE_OBJECT DeviceObject);
-
-#ifdef ALLOC_PRAGMA
-#pragma alloc_text(PAGE, Pl2303InitializeDevice)
-#pragma alloc_text(PAGE, Pl2303DestroyDevice)
-#pragma alloc_text(PAGE, Pl2303StartDevice)
-#pragma alloc_text(PAGE, Pl2303StopDevice)
-#pragma alloc_text(PAGE, Pl2303AddDevice)
-#pragma alloc_text(PAGE, Pl2303DispatchPnp)
-#endif /* defined ALLOC_PRAGMA */
-
-static
-NTSTATUS
-Pl2303InitializeDevice(
-    _In_ PDEVICE_OBJECT DeviceObject,
-    _In_ PDEVICE_OBJECT PhysicalDeviceObject)
-{
-    NTSTATUS Status;
-    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
-    HANDLE KeyHandle;
-    UNICODE_STRING ValueName;
-    PKEY_VALUE_PARTIAL_INFORMATION ValueInformation;
-    ULONG ValueInformationLength;
-    ULONG SkipExternalNaming;
-    USHORT ComPortNameLength;
-    PWCHAR ComPortNameBuffer = NULL;
-    const UNICODE_STRING DosDevices = RTL_CONSTANT_STRING(L"\\DosDevices\\");
-    PCONFIGURATION_INFORMATION ConfigInfo;
-
-    PAGED_CODE();
-
-    Pl2303Debug(         "%s. DeviceObject=%p, PhysicalDeviceObject=%p\n",
-                __FUNCTION__, DeviceObject,    PhysicalDeviceObject);
-
-    ExInitializeFastMutex(&DeviceExtension->LineStateMutex);
-
-    Status = IoRegisterDeviceInterface(PhysicalDeviceObject,
-                                       &GUID_DEVINTERFACE_COMPORT,
-                                       NULL,
-                                       &DeviceExtension->InterfaceLinkName);
-    if (!NT_SUCCESS(Status))
-    {
-        Pl2303Error(         "%s. IoRegisterDeviceInterface failed with %08lx\n",
-                    __FUNCTION__, Status);
-        return Status;
-    }
-
-    Pl2303Debug(         "%s. Device Interface is '%wZ'\n",
-                __FUNCTION__, &DeviceExtension->InterfaceLinkName);
-
-    Status = IoOpenDeviceRegistryKey(PhysicalDeviceObject,
-                                     PLUGPLAY_REGKEY_DEVICE,
-                                     KEY_QUERY_VALUE,
-                                     &KeyHandle);
-    if (!NT_SUCCESS(Status))
-    {
-        Pl2303Error(         "%s. IoOpenDeviceRegistryKey failed with %08lx\n",
-                    __FUNCTION__, Status);
-        RtlFreeUnicodeString(&DeviceExtension->InterfaceLinkName);
-        return Status;
-    }
-
-    ValueInformationLength = FIELD_OFFSET(KEY_VALUE_PARTIAL_INFORMATION, Data[sizeof(ULONG)]);
-    ValueInformation = ExAllocatePoolWithTag(PagedPool, ValueInformationLength, PL2303_TAG);
-    if (!ValueInformation)
-    {
-        Pl2303Error(         "%s. Allocating registry value information failed\n",
-                    __FUNCTION__);
-        RtlFreeUnicodeString(&DeviceExtension->InterfaceLinkName);
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
-    RtlInitUnicodeString(&ValueName, L"SkipExternalNaming");
-    Status = ZwQueryValueKey(KeyHandle,
-                             &ValueName,
-                             KeyValuePartialInformation,
-                             ValueInformation,
-                             ValueInformationLength,
-                             &ValueInformationLength);
-
-    if (NT_SUCCESS(Status) &&
-        ValueInformationLength == (ULONG)FIELD_OFFSET(KEY_VALUE_PARTIAL_INFORMATION,
-                                                      Data[sizeof(ULONG)]) &&
-        ValueInformation->Type == REG_DWORD &&
-        ValueInformation->DataLength == sizeof(ULONG))
-    {
-        SkipExternalNaming = *(const ULONG *)ValueInformation->Data;
-    }
-    else
-    {
-        SkipExternalNaming = 0;
-    }
-    ExFreePoolWithTag(ValueInformation, PL2303_TAG);
-
-    if (!SkipExternalNaming)
-    {
-        RtlInitUnicodeString(&ValueName, L"PortName");
-        Status = ZwQueryValueKey(KeyHandle,
-                                 &ValueName,
-                                 KeyValuePartialInformation,
-                                 NULL,
-                                 0,
-                                 &ValueInformationLength);
-        if (Status == STATUS_BUFFER_TOO_SMALL)
-        {
-#pragma prefast(suppress: __WARNING_USING_VARIABLE_FROM_FAILED_FUNCTION_CALL, "ZwQueryValueKey sets ResultLength if buffer too small")
-            NT_ASSERT(ValueInformationLength != 0);
-            ValueInformation = ExAllocatePoolWithTag(PagedPool,
-                                                     ValueInformationLength,
-                                                     PL2303_TAG);
-            if (!ValueInformation)
-            {
-                Pl2303Error(         "%s. Allocating registry value information failed\n",
-                            __FUNCTION__);
-                RtlFreeUnicodeString(&DeviceExtension->InterfaceLinkName);
-                return STATUS_INSUFFICIENT_RESOURCES;
-            }
-            Status = ZwQueryValueKey(KeyHandle,
-                                     &ValueName,
-                                     KeyValuePartialInformation,
-                                     ValueInformation,
-                                     ValueInformationLength,
-                                     &ValueInformationLength);
-            if (!NT_SUCCESS(Status))
-            {
-                Pl2303Error(         "%s. ZwQueryValueKey failed with %08lx\n",
-                            __FUNCTION__, Status);
-                ExFreePoolWithTag(ValueInformation, PL2303_TAG);
-                RtlFreeUnicodeString(&DeviceExtension->InterfaceLinkName);
-                return Status;
-            }
-            if (ValueInformation->Type != REG_SZ ||
-                ValueInformation->Data[ValueInformation->DataLength - 1] != 0 ||
-                ValueInformation->Data[ValueInformation->DataLength - 2] != 0 ||
-                ValueInformation->DataLength >= MAXUSHORT)
-            {
-                Pl2303Error("%s. PortName registry key is invalid\n",
-                    __FUNCTION__);
-                ExFreePoolWithTag(ValueInformation, PL2303_TAG);
-                RtlFreeUnicodeString(&DeviceExtension->InterfaceLinkName);
-                return STATUS_INVALID_PARAMETER;
-            }
-            ComPortNameLength = DosDevices.Length + (USHORT)ValueInformation->DataLength;
-            ComPortNameBuffer = ExAllocatePoolWithTag(PagedPool,
-                                                      ComPortNameLength,
-                                                      PL2303_TAG);
-            if (!ComPortNameBuffer)
-            {
-                Pl2303Error(         "%s. Allocating COM port name failed\n",
-                            __FUNCTION__);
-                ExFreePoolWithTag(ValueInformation, PL2303_TAG);
-                RtlFreeUnicodeString(&DeviceExtension->InterfaceLinkName);
-                return STATUS_INSUFFICIENT_RESOURCES;
-            }
-            RtlInitEmptyUnicodeString(&DeviceExtension->ComPortName,
-                                      ComPortNameBuffer,
-                                      ComPortNameLength);
-            RtlCopyUnicodeString(&DeviceExtension->ComPortName, &DosDevices);
-            (VOID)RtlAppendUnicodeToString(&DeviceExtension->ComPortName,
-                                           (PCWSTR)ValueInformation->Data);
-
-            ExFreePoolWithTag(ValueInformation, PL2303_TAG);
-        }
-        else
-        {
-            Pl2303Debug(         "%s. ZwQueryValueKey failed with %08lx\n",
-                        __FUNCTION__, Status);
-            Status = STATUS_SUCCESS;
-        }
-    }
-    NT_ASSERT(DeviceExtension->ComPortName.Buffer == ComPortNameBuffer);
-
-    Pl2303Debug(         "%s. COM Port name is is '%wZ'\n",
-                __FUNCTION__, &DeviceExtension->ComPortName);
-
-    ConfigInfo = IoGetConfigurationInformation();
-    ConfigInfo->SerialCount++;
-
-    Pl2303Debug(         "%s. New serial port count: %lu\n",
-                __FUNCTION__, ConfigInfo->SerialCount);
-
-    return Status;
-}
-
-static
-NTSTATUS
-Pl2303DestroyDevice(
-    _In_ PDEVICE_OBJECT DeviceObject)
-{
-    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
-    PCONFIGURATION_INFORMATION ConfigInfo;
-
-    PAGED_CODE();
-
-    Pl2303Debug(         "%s. DeviceObject=%p\n",
-                __FUNCTION__, DeviceObject);
-
-    ConfigInfo = IoGetConfigurationInformation();
-    ConfigInfo->SerialCount--;
-
-    Pl2303Debug(         "%s. New serial port count: %lu\n",
-                __FUNCTION__, ConfigInfo->SerialCount);
-
-    if (DeviceExtension->ComPortName.Buffer)
-        ExFreePoolWithTag(DeviceExtension->ComPortName.Buffer, PL2303_TAG);
-
-    RtlFreeUnicodeString(&DeviceExtension->InterfaceLinkName);
-
-    ExFreePoolWithTag(DeviceExtension->DeviceName.Buffer, PL2303_TAG);
-
-    return STATUS_SUCCESS;
-}
-
-static
-NTSTATUS
-Pl2303StartDevice(
-    _In_ PDEVICE_OBJECT DeviceObject)
-{
-    NTSTATUS Status;
-    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
-
-    PAGED_CODE();
-
-    Pl2303Debug(         "%s. DeviceObject=%p\n",
-                __FUNCTION__, DeviceObject);
-
-    Status = Pl2303UsbStart(DeviceObject);
-    if (!NT_SUCCESS(Status))
-    {
-        Pl2303Error(         "%s. Pl2303UsbStart failed with %08lx\n",
-                    __FUNCTION__, Status);
-        return Status;
-    }
-
-    DeviceExtension->BaudRate = 115200;
-    DeviceExtension->StopBits = 0;
-    DeviceExtension->Parity = 0;
-    DeviceExtension->DataBits = 0;
-    DeviceExtension->Chars.XonChar = 0x11;
-    DeviceExtension->Chars.XoffChar = 0x13;
-    DeviceExtension->HandFlow.ControlHandShake = SERIAL_DTR_CONTROL;
-    DeviceExtension->HandFlow.FlowReplace = SERIAL_RTS_CONTROL;
-    DeviceExtension->HandFlow.XonLimit = 2048;
-    DeviceExtension->HandFlow.XoffLimit = 512;
-    Status = Pl2303SetLine(DeviceObject);
-    if (!NT_SUCCESS(Status))
-    {
-        Pl2303Error(         "%s. Pl2303UsbSetLine failed with %08lx\n",
-                    __FUNCTION__, Status);
-    }
-
-    Status = IoSetDeviceInterfaceState(&DeviceExtension->InterfaceLinkName,
-                                       TRUE);
-    if (!NT_SUCCESS(Status))
-    {
-        Pl2303Error(         "%s. IoSetDeviceInterfaceState failed with %08lx\n",
-                    __FUNCTION__, Status);
-        return Status;
-    }
-
-    if (DeviceExtension->ComPortName.Buffer)
-    {
-        Status = IoCreateSymbolicLink(&DeviceExtension->ComPortName,
-                                      &DeviceExtension->DeviceName);
-        if (!NT_SUCCESS(Status))
-        {
-            Pl2303Error(         "%s. IoCreateSymbolicLink failed with %08lx\n",
-                        __FUNCTION__, Status);
-            (VOID)IoSetDeviceInterfaceState(&DeviceExtension->InterfaceLinkName,
-                                            FALSE);
-            return Status;
-        }
-
-        /* FIXME */
-#if 0
-        Status = RtlWriteRegistryValue(RTL_REGISTRY_DEVICEMAP,
-                                       SERIAL_DEVICE_MAP,
-                                       DeviceExtension->DeviceName.Buffer,
-                                       DeviceExtension->ComPortName.Buffer + xxx,
-                                       DeviceExtension->ComPortName.Length - xxx * sizeof(WCHAR));
-#endif
-    }
-
-    return Status;
-}
-
-static
-NTSTATUS
-Pl2303StopDevice(
-    _In_ PDEVICE_OBJECT DeviceObject)
-{
-    NTSTATUS Status;
-    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
-
-    PAGED_CODE();
-
-    Pl2303Debug(         "%s. DeviceObject=%p\n",
-                __FUNCTION__, DeviceObject);
-
-    if (DeviceExtension->ComPortName.Buffer)
-        (VOID)IoDeleteSymbolicLink(&DeviceExtension->ComPortName);
-
-    Status = IoSetDeviceInterfaceState(&DeviceExtension->InterfaceLinkName,
-                                       FALSE);
-
-    return Status;
-}
-
-NTSTATUS
-NTAPI
-Pl2303AddDevice(
-    _In_ PDRIVER_OBJECT DriverObject,
-    _In_ PDEVICE_OBJECT PhysicalDeviceObject)
-{
-    NTSTATUS Status;
-    PDEVICE_OBJECT DeviceObject;
-    PDEVICE_EXTENSION DeviceExtension;
-    UNICODE_STRING DeviceName;
-    static INT DeviceNumber = 0;
-
-    PAGED_CODE();
-
-    Pl2303Debug(         "%s. DriverObject=%p, PhysicalDeviceObject=%p\n",
-                __FUNCTION__, DriverObject,    PhysicalDeviceObject);
-
-    DeviceName.MaximumLength = sizeof(L"\\Device\\Pl2303Serial999");
-    DeviceName.Length = 0;
-    DeviceName.Buffer = ExAllocatePoolWithTag(PagedPool,
-                                              DeviceName.MaximumLength,
-                                              PL2303_TAG);
-    if (!DeviceName.Buffer)
-    {
-        Pl2303Error(         "%s. Allocating device name buffer failed\n",
-                    __FUNCTION__);
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
-
-    Status = RtlUnicodeStringPrintf(&DeviceName,
-                                    L"\\Device\\Pl2303Serial%d",
-                                    DeviceNumber++);
-    if (!NT_SUCCESS(Status))
-    {
-        Pl2303Error(         "%s. RtlUnicodeStringPrintf failed with %08lx\n",
-                    __FUNCTION__, Status);
-        ExFreePoolWithTag(DeviceName.Buffer, PL2303_TAG);
-        return Status;
-    }
-
-    Pl2303Debug(         "%s. Device Name is '%wZ'\n",
-                __FUNCTION__, &DeviceName);
-    Status = IoCreateDevice(DriverObject,
-                            sizeof(DEVICE_EXTENSION),
-                            &DeviceName,
-                            FILE_DEVICE_SERIAL_PORT,
-                            FILE_DEVICE_SECURE_OPEN,
-                            TRUE,
-                            &DeviceObject);
-    if (!NT_SUCCESS(Status))
-    {
-        Pl2303Error(         "%s. IoCreateDevice failed with %08lx\n",
-                    __FUNCTION__, Status);
-        return Status;
-    }
-
-    DeviceExtension = DeviceObject->DeviceExtension;
-    RtlZeroMemory(DeviceExtension, sizeof(*DeviceExtension));
-    DeviceExtension->DeviceName = DeviceName;
-
-    NT_ASSERT(DeviceExtension->LowerDevice == NULL);
-    Status = IoAttachDeviceToDeviceStackSafe(DeviceObject,
-                                             PhysicalDeviceObject,
-                                             &DeviceExtension->LowerDevice);
-    if (!NT_SUCCESS(Status))
-    {
-        Pl2303Error(         "%s. IoAttachDeviceToDeviceStackSafe failed with %08lx\n",
-                    __FUNCTION__, Status);
-        IoDeleteDevice(DeviceObject);
-        return STATUS_NO_SUCH_DEVICE;
-    }
-    NT_ASSERT(DeviceExtension->LowerDevice);
-    NT_ASSERT(DeviceExtension->LowerDevice->Flags & DO_POWER_PAGABLE);
-
-    if (DeviceExtension->LowerDevice->Flags & DO_POWER_PAGABLE)
-        DeviceObject->Flags |= DO_POWER_PAGABLE;
-
-    DeviceObject->Flags |= DO_BUFFERED_IO;
-
-    Status = Pl2303InitializeDevice(DeviceObject, PhysicalDeviceObject);
-    if (!NT_SUCCESS(Status))
-    {
-        Pl2303Error(         "%s. Pl2303InitializeDevice failed with %08lx\n",
-                    __FUNCTION__, Status);
-        IoDetachDevice(DeviceExtension->LowerDevice);
-        IoDeleteDevice(DeviceObject);
-        return Status;
-    }
-
-    DeviceObject->Flags &= ~DO_DEVICE_INITIALIZING;
-
-    return STATUS_SUCCESS;
-}
-
-static const PCSTR PnpMinorFunctionNames[] =
-{
-    "IRP_MN_START_DEVICE",
-    "IRP_MN_QUERY_REMOVE_DEVICE",
-    "IRP_MN_REMOVE_DEVICE",
-    "IRP_MN_CANCEL_REMOVE_DEVICE",
-    "IRP_MN_STOP_DEVICE",
-    "IRP_MN_QUERY_STOP_DEVICE",
-    "IRP_MN_CANCEL_STOP_DEVICE",
-    "IRP_MN_QUERY_DEVICE_RELATIONS",
-    "IRP_MN_QUERY_INTERFACE",
-    "IRP_MN_QUERY_CAPABILITIES",
-    "IRP_MN_QUERY_RESOURCES",
-    "IRP_MN_QUERY_RESOURCE_REQUIREMENTS",
-    "IRP_MN_QUERY_DEVICE_TEXT",
-    "IRP_MN_FILTER_RESOURCE_REQUIREMENTS",
-    "0x0E",
-    "IRP_MN_READ_CONFIG",
-    "IRP_MN_WRITE_CONFIG",
-    "IRP_MN_EJECT",
-    "IRP_MN_SET_LOCK",
-    "IRP_MN_QUERY_ID",
-    "IRP_MN_QUERY_PNP_DEVICE_STATE",
-    "IRP_MN_QUERY_BUS_INFORMATION",
-    "IRP_MN_DEVICE_USAGE_NOTIFICATION",
-    "IRP_MN_SURPRISE_REMOVAL",
-    "IRP_MN_QUERY_LEGACY_BUS_INFORMATION",
-    "IRP_MN_DEVICE_ENUMERATED"
-};
-
-static
-PCSTR
-Pl2303GetPnpMinorFunctionName(
-    _In_ UCHAR MinorFunction)
-{
-    if (MinorFunction < RTL_NUMBER_OF(PnpMinorFunctionNames))
-        return PnpMinorFunctionNames[MinorFunction];
-    return "Unknown";
-}
-
-NTSTATUS
-NTAPI
-Pl2303DispatchPnp(
-    _In_ PDEVICE_OBJECT DeviceObject,
-    _Inout_ PIRP Irp)
-{
-    NTSTATUS Status;
-    PIO_STACK_LOCATION IoStack;
-    PDEVICE_EXTENSION DeviceExtension;
-
-    PAGED_CODE();
-
-    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
-                __FUNCTION__, DeviceObject,    Irp);
-
-    IoStack = IoGetCurrentIrpStackLocation(Irp);
-    NT_ASSERT(IoStack->MajorFunction == IRP_MJ_PNP);
-
-    DeviceExtension = DeviceObject->DeviceExtension;
-
-    if (DeviceExtension->PnpState == Deleted)
-    {
-        Pl2303Warn(         "%s. Device already deleted\n",
-                   __FUNCTION__);
-        Status = STATUS_NO_SUCH_DEVICE;
-        Irp->IoStatus.Status = Status;
-        IoCompleteRequest(Irp, IO_NO_INCREMENT);
-        return Status;
-    }
-
-    Pl2303Debug(         "%s. MinorFunction=%s (0x%x)\n",
-                __FUNCTION__, Pl2303GetPnpMinorFunctionName(IoStack->MinorFunction),
-                              IoStack->MinorFunction);
-
-    switch (IoStack->MinorFunction)
-    {
-        case IRP_MN_START_DEVICE:
-            if (IoForwardIrpSynchronously(DeviceExtension->LowerDevice, Irp))
-                Status = Irp->IoStatus.Status;
-            else
-            {
-                Pl2303Error(         "%s. IoForwardIrpSynchronously failed\n",
-                            __FUNCTION__);
-                Status = STATUS_UNSUCCESSFUL;
-            }
-
-            if (!NT_SUCCESS(Status))
-            {
-                Pl2303Warn(         "%s. IRP_MN_START_DEVICE failed with %08lx\n",
-                           __FUNCTION__, Status);
-                Irp->IoStatus.Status = Status;
-                IoCompleteRequest(Irp, IO_NO_INCREMENT);
-                return Status;
-            }
-
-            Status = Pl2303StartDevice(DeviceObject);
-            if (!NT_SUCCESS(Status))
-            {
-                Pl2303Error(         "%s. Pl2303StartDevice failed with %08lx\n",
-                            __FUNCTION__, Status);
-                Irp->IoStatus.Status = Status;
-                IoCompleteRequest(Irp, IO_NO_INCREMENT);
-                return Status;
-            }
-
-            DeviceExtension->PnpState = Started;
-            Irp->IoStatus.Status = Status;
-            IoCompleteRequest(Irp, IO_NO_INCREMENT);
-            return Status;
-        case IRP_MN_QUERY_STOP_DEVICE:
-            DeviceExtension->PreviousPnpState = DeviceExtension->PnpState;
-            DeviceExtension->PnpState = StopPending;
-            break;
-        case IRP_MN_QUERY_REMOVE_DEVICE:
-            DeviceExtension->PreviousPnpState = DeviceExtension->PnpState;
-            DeviceExtension->PnpState = RemovePending;
-            break;
-        case IRP_MN_CANCEL_REMOVE_DEVICE:
-        case IRP_MN_CANCEL_STOP_DEVICE:
-            DeviceExtension->PnpState = DeviceExtension->PreviousPnpState;
-            break;
-        case IRP_MN_STOP_DEVICE:
-            DeviceExtension->PnpState = Stopped;
-            (VOID)Pl2303UsbStop(DeviceObject);
-            break;
-        case IRP_MN_SURPRISE_REMOVAL:
-            DeviceExtension->PnpState = SurpriseRemovePending;
-            Status = Pl2303StopDevice(DeviceObject);
-            if (!NT_SUCCESS(Status))
-                Pl2303Warn(         "%s. Pl2303StopDevice failed with %08lx\n",
-                           __FUNCTION__, Status);
-            break;
-        case IRP_MN_REMOVE_DEVICE:
-            DeviceExtension->PreviousPnpState = DeviceExtension->PnpState;
-            DeviceExtension->PnpState = Deleted;
-            if (DeviceExtension->PreviousPnpState != SurpriseRemovePending)
-            {
-                Status = Pl2303StopDevice(DeviceObject);
-                if (!NT_SUCCESS(Status))
-                    Pl2303Warn(         "%s. Pl2303StopDevice failed with %08lx\n",
-                               __FUNCTION__, Status);
-            }
-            Irp->IoStatus.Status = STATUS_SUCCESS;
-            IoSkipCurrentIrpStackLocation(Irp);
-            Status = IoCallDriver(DeviceExtension->LowerDevice, Irp);
-            IoDetachDevice(DeviceExtension->LowerDevice);
-            (VOID)Pl2303DestroyDevice(DeviceObject);
-            IoDeleteDevice(DeviceObject);
-            return Status;
-        default:
-            /* Unsupported request - leave Irp->IoStack.Status untouched */
-            IoSkipCurrentIrpStackLocation(Irp);
-            return IoCallDriver(DeviceExtension->LowerDevice, Irp);
-    }
-
-    Irp->IoStatus.Status = STATUS_SUCCESS;
-    IoSkipCurrentIrpStackLocation(Irp);
-    return IoCallDriver(DeviceExtension->LowerDevice, Irp);
-}
+/*
+ * PL2303 Driver PnP routines
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#define PL2303_TRACE_COMPONENT PL2303_TRACE_PNP
+#include "pl2303.h"
+
+static NTSTATUS Pl2303InitializeDevice(_In_ PDEVICE_OBJECT DeviceObject,
+                                       _In_ PDEVICE_OBJECT PhysicalDeviceObject);
+static NTSTATUS Pl2303DestroyDevice(_In_ PDEVICE_OBJECT DeviceObject);
+static NTSTATUS Pl2303StartDevice(_In_ PDEVICE_OBJECT DeviceObject);
+static NTSTATUS Pl2303StopDevice(_In_ PDEVICE_OBJECT DeviceObject);
+static VOID Pl2303RecordPnpState(_In_ PDEVICE_EXTENSION DeviceExtension, _In_ UCHAR MinorFunction);
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, Pl2303QueryRegistryDword)
+#pragma alloc_text(PAGE, Pl2303InitializeDevice)
+#pragma alloc_text(PAGE, Pl2303DestroyDevice)
+#pragma alloc_text(PAGE, Pl2303StartDevice)
+#pragma alloc_text(PAGE, Pl2303StopDevice)
+#pragma alloc_text(PAGE, Pl2303RecordPnpState)
+#pragma alloc_text(PAGE, Pl2303AddDevice)
+#pragma alloc_text(PAGE, Pl2303DispatchPnp)
+#endif /* defined ALLOC_PRAGMA */
+
+ULONG
+Pl2303QueryRegistryDword(
+    _In_ HANDLE KeyHandle,
+    _In_ PCWSTR Name,
+    _In_ ULONG DefaultValue)
+{
+    NTSTATUS Status;
+    UNICODE_STRING ValueName;
+    union
+    {
+        KEY_VALUE_PARTIAL_INFORMATION Information;
+        UCHAR Buffer[FIELD_OFFSET(KEY_VALUE_PARTIAL_INFORMATION, Data[sizeof(ULONG)])];
+    } ValueBuffer;
+    PKEY_VALUE_PARTIAL_INFORMATION ValueInformation = &ValueBuffer.Information;
+    ULONG ValueInformationLength;
+    ULONG Value;
+
+    PAGED_CODE();
+
+    RtlInitUnicodeString(&ValueName, Name);
+    Status = ZwQueryValueKey(KeyHandle,
+                             &ValueName,
+                             KeyValuePartialInformation,
+                             ValueInformation,
+                             sizeof(ValueBuffer.Buffer),
+                             &ValueInformationLength);
+
+    if (NT_SUCCESS(Status) &&
+        ValueInformationLength == sizeof(ValueBuffer.Buffer) &&
+        ValueInformation->Type == REG_DWORD &&
+        ValueInformation->DataLength == sizeof(ULONG))
+    {
+        Value = *(const ULONG *)ValueInformation->Data;
+    }
+    else
+    {
+        Value = DefaultValue;
+    }
+
+    Pl2303Debug(         "%s. %ls=%lu\n",
+                __FUNCTION__, Name, Value);
+
+    return Value;
+}
+
+static
+NTSTATUS
+Pl2303InitializeDevice(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PDEVICE_OBJECT PhysicalDeviceObject)
+{
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    HANDLE KeyHandle;
+    UNICODE_STRING ValueName;
+    PKEY_VALUE_PARTIAL_INFORMATION ValueInformation;
+    ULONG ValueInformationLength;
+    ULONG SkipExternalNaming;
+    USHORT ComPortNameLength;
+    PWCHAR ComPortNameBuffer = NULL;
+    const UNICODE_STRING DosDevices = RTL_CONSTANT_STRING(L"\\DosDevices\\");
+    PCONFIGURATION_INFORMATION ConfigInfo;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p, PhysicalDeviceObject=%p\n",
+                __FUNCTION__, DeviceObject,    PhysicalDeviceObject);
+
+    DeviceExtension->PhysicalDevice = PhysicalDeviceObject;
+    ExInitializeFastMutex(&DeviceExtension->LineStateMutex);
+    KeInitializeSpinLock(&DeviceExtension->ControlSpinLock);
+    InitializeListHead(&DeviceExtension->ControlPool);
+    InitializeListHead(&DeviceExtension->ControlQueue);
+    KeInitializeSpinLock(&DeviceExtension->StatusSpinLock);
+    KeInitializeSpinLock(&DeviceExtension->EventSpinLock);
+    KeInitializeSpinLock(&DeviceExtension->ReadSpinLock);
+    KeInitializeEvent(&DeviceExtension->ReadBufferGrowDoneEvent, NotificationEvent, TRUE);
+    KeInitializeSpinLock(&DeviceExtension->WriteSpinLock);
+    InitializeListHead(&DeviceExtension->ActiveWrites);
+    InitializeListHead(&DeviceExtension->WriteSubmitList);
+    /* Until the device is started and its chip is known */
+    DeviceExtension->Chip = &Pl2303Chips[Pl2303ChipHx];
+    Pl2303InitializeTimeouts(DeviceObject);
+    Pl2303InitializePower(DeviceObject);
+
+    Status = Pl2303InitializeQueue(&DeviceExtension->ReadQueue);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. Pl2303InitializeQueue failed with %08lx\n",
+                    __FUNCTION__, Status);
+        return Status;
+    }
+
+    Status = Pl2303InitializeQueue(&DeviceExtension->WriteQueue);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. Pl2303InitializeQueue failed with %08lx\n",
+                    __FUNCTION__, Status);
+        return Status;
+    }
+
+    Status = IoRegisterDeviceInterface(PhysicalDeviceObject,
+                                       &GUID_DEVINTERFACE_COMPORT,
+                                       NULL,
+                                       &DeviceExtension->InterfaceLinkName);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. IoRegisterDeviceInterface failed with %08lx\n",
+                    __FUNCTION__, Status);
+        return Status;
+    }
+
+    Pl2303Debug(         "%s. Device Interface is '%wZ'\n",
+                __FUNCTION__, &DeviceExtension->InterfaceLinkName);
+
+    Status = IoOpenDeviceRegistryKey(PhysicalDeviceObject,
+                                     PLUGPLAY_REGKEY_DEVICE,
+                                     KEY_QUERY_VALUE,
+                                     &KeyHandle);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. IoOpenDeviceRegistryKey failed with %08lx\n",
+                    __FUNCTION__, Status);
+        RtlFreeUnicodeString(&DeviceExtension->InterfaceLinkName);
+        return Status;
+    }
+
+    SkipExternalNaming = Pl2303QueryRegistryDword(KeyHandle, L"SkipExternalNaming", 0);
+
+    DeviceExtension->WriteTransferCount = Pl2303QueryRegistryDword(KeyHandle,
+                                                                   L"WriteTransferCount",
+                                                                   PL2303_WRITE_TRANSFER_COUNT);
+    if (DeviceExtension->WriteTransferCount < 1)
+        DeviceExtension->WriteTransferCount = 1;
+    if (DeviceExtension->WriteTransferCount > PL2303_MAX_WRITE_TRANSFER_COUNT)
+        DeviceExtension->WriteTransferCount = PL2303_MAX_WRITE_TRANSFER_COUNT;
+
+    DeviceExtension->WriteCoalescing = Pl2303QueryRegistryDword(KeyHandle,
+                                                                L"WriteCoalescing",
+                                                                PL2303_WRITE_COALESCE_NONE);
+    DeviceExtension->WriteCoalesceTimeout = Pl2303QueryRegistryDword(KeyHandle,
+                                                                     L"WriteCoalesceTimeout",
+                                                                     PL2303_WRITE_COALESCE_TIMEOUT);
+    if (DeviceExtension->WriteCoalesceTimeout > PL2303_MAX_WRITE_COALESCE_TIMEOUT)
+        DeviceExtension->WriteCoalesceTimeout = PL2303_MAX_WRITE_COALESCE_TIMEOUT;
+
+    DeviceExtension->IdleTimeout = Pl2303QueryRegistryDword(KeyHandle,
+                                                            L"IdleTimeout",
+                                                            PL2303_IDLE_TIMEOUT);
+    if (DeviceExtension->IdleTimeout > PL2303_MAX_IDLE_TIMEOUT)
+        DeviceExtension->IdleTimeout = PL2303_MAX_IDLE_TIMEOUT;
+
+    DeviceExtension->ReadBufferDefaultSize = Pl2303QueryRegistryDword(KeyHandle,
+                                                                      L"ReadBufferSize",
+                                                                      PL2303_READ_BUFFER_SIZE);
+    if (DeviceExtension->ReadBufferDefaultSize < PL2303_MIN_READ_BUFFER_SIZE)
+        DeviceExtension->ReadBufferDefaultSize = PL2303_MIN_READ_BUFFER_SIZE;
+    if (DeviceExtension->ReadBufferDefaultSize > PL2303_MAX_READ_BUFFER_SIZE)
+        DeviceExtension->ReadBufferDefaultSize = PL2303_MAX_READ_BUFFER_SIZE;
+    DeviceExtension->ReadBufferAdaptive = Pl2303QueryRegistryDword(KeyHandle,
+                                                                   L"AdaptiveReadBuffer",
+                                                                   0) != 0;
+
+    if (!SkipExternalNaming)
+    {
+        RtlInitUnicodeString(&ValueName, L"PortName");
+        Status = ZwQueryValueKey(KeyHandle,
+                                 &ValueName,
+                                 KeyValuePartialInformation,
+                                 NULL,
+                                 0,
+                                 &ValueInformationLength);
+        if (Status == STATUS_BUFFER_TOO_SMALL)
+        {
+#pragma prefast(suppress: __WARNING_USING_VARIABLE_FROM_FAILED_FUNCTION_CALL, "ZwQueryValueKey sets ResultLength if buffer too small")
+            NT_ASSERT(ValueInformationLength != 0);
+            ValueInformation = ExAllocatePoolWithTag(PagedPool,
+                                                     ValueInformationLength,
+                                                     PL2303_TAG);
+            if (!ValueInformation)
+            {
+                Pl2303Error(         "%s. Allocating registry value information failed\n",
+                            __FUNCTION__);
+                RtlFreeUnicodeString(&DeviceExtension->InterfaceLinkName);
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+            Status = ZwQueryValueKey(KeyHandle,
+                                     &ValueName,
+                                     KeyValuePartialInformation,
+                                     ValueInformation,
+                                     ValueInformationLength,
+                                     &ValueInformationLength);
+            if (!NT_SUCCESS(Status))
+            {
+                Pl2303Error(         "%s. ZwQueryValueKey failed with %08lx\n",
+                            __FUNCTION__, Status);
+                ExFreePoolWithTag(ValueInformation, PL2303_TAG);
+                RtlFreeUnicodeString(&DeviceExtension->InterfaceLinkName);
+                return Status;
+            }
+            if (ValueInformation->Type != REG_SZ ||
+                ValueInformation->Data[ValueInformation->DataLength - 1] != 0 ||
+                ValueInformation->Data[ValueInformation->DataLength - 2] != 0 ||
+                ValueInformation->DataLength >= MAXUSHORT)
+            {
+                Pl2303Error("%s. PortName registry key is invalid\n",
+                    __FUNCTION__);
+                ExFreePoolWithTag(ValueInformation, PL2303_TAG);
+                RtlFreeUnicodeString(&DeviceExtension->InterfaceLinkName);
+                return STATUS_INVALID_PARAMETER;
+            }
+            ComPortNameLength = DosDevices.Length + (USHORT)ValueInformation->DataLength;
+            ComPortNameBuffer = ExAllocatePoolWithTag(PagedPool,
+                                                      ComPortNameLength,
+                                                      PL2303_TAG);
+            if (!ComPortNameBuffer)
+            {
+                Pl2303Error(         "%s. Allocating COM port name failed\n",
+                            __FUNCTION__);
+                ExFreePoolWithTag(ValueInformation, PL2303_TAG);
+                RtlFreeUnicodeString(&DeviceExtension->InterfaceLinkName);
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+            RtlInitEmptyUnicodeString(&DeviceExtension->ComPortName,
+                                      ComPortNameBuffer,
+                                      ComPortNameLength);
+            RtlCopyUnicodeString(&DeviceExtension->ComPortName, &DosDevices);
+            (VOID)RtlAppendUnicodeToString(&DeviceExtension->ComPortName,
+                                           (PCWSTR)ValueInformation->Data);
+
+            ExFreePoolWithTag(ValueInformation, PL2303_TAG);
+        }
+        else
+        {
+            Pl2303Debug(         "%s. ZwQueryValueKey failed with %08lx\n",
+                        __FUNCTION__, Status);
+            Status = STATUS_SUCCESS;
+        }
+    }
+    NT_ASSERT(DeviceExtension->ComPortName.Buffer == ComPortNameBuffer);
+
+    Pl2303Debug(         "%s. COM Port name is is '%wZ'\n",
+                __FUNCTION__, &DeviceExtension->ComPortName);
+
+    ConfigInfo = IoGetConfigurationInformation();
+    ConfigInfo->SerialCount++;
+
+    Pl2303Debug(         "%s. New serial port count: %lu\n",
+                __FUNCTION__, ConfigInfo->SerialCount);
+
+    return Status;
+}
+
+static
+NTSTATUS
+Pl2303DestroyDevice(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PCONFIGURATION_INFORMATION ConfigInfo;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p\n",
+                __FUNCTION__, DeviceObject);
+
+    Pl2303DeleteControlDevice(DeviceObject);
+
+    ConfigInfo = IoGetConfigurationInformation();
+    ConfigInfo->SerialCount--;
+
+    Pl2303Debug(         "%s. New serial port count: %lu\n",
+                __FUNCTION__, ConfigInfo->SerialCount);
+
+    if (DeviceExtension->ComPortName.Buffer)
+        ExFreePoolWithTag(DeviceExtension->ComPortName.Buffer, PL2303_TAG);
+
+    Pl2303FreeRingBuffer(&DeviceExtension->ReadBuffer);
+    if (DeviceExtension->ReadBufferWorkItem)
+        IoFreeWorkItem(DeviceExtension->ReadBufferWorkItem);
+    Pl2303UsbFreeControlPool(DeviceObject);
+    Pl2303FreeStatistics(DeviceExtension);
+    Pl2303FreeIdleRequest(DeviceObject);
+
+    RtlFreeUnicodeString(&DeviceExtension->InterfaceLinkName);
+
+    ExFreePoolWithTag(DeviceExtension->DeviceName.Buffer, PL2303_TAG);
+
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+Pl2303StartDevice(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PLINE_STATE LineState;
+    KIRQL OldIrql;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p\n",
+                __FUNCTION__, DeviceObject);
+
+    if (!DeviceExtension->ControlRequests)
+    {
+        Status = Pl2303UsbAllocateControlPool(DeviceObject);
+        if (!NT_SUCCESS(Status))
+        {
+            Pl2303Error(         "%s. Pl2303UsbAllocateControlPool failed with %08lx\n",
+                        __FUNCTION__, Status);
+            return Status;
+        }
+    }
+
+    if (!DeviceExtension->Statistics)
+    {
+        Status = Pl2303AllocateStatistics(DeviceExtension);
+        if (!NT_SUCCESS(Status))
+        {
+            Pl2303Error(         "%s. Pl2303AllocateStatistics failed with %08lx\n",
+                        __FUNCTION__, Status);
+            return Status;
+        }
+    }
+
+    if (!DeviceExtension->ReadBufferWorkItem)
+    {
+        DeviceExtension->ReadBufferWorkItem = IoAllocateWorkItem(DeviceObject);
+        if (!DeviceExtension->ReadBufferWorkItem)
+        {
+            Pl2303Error(         "%s. IoAllocateWorkItem failed\n",
+                        __FUNCTION__);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    Status = Pl2303AllocateIdleRequest(DeviceObject);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. Pl2303AllocateIdleRequest failed with %08lx\n",
+                    __FUNCTION__, Status);
+        return Status;
+    }
+
+    /* The device is in D0 once it has been started */
+    DeviceExtension->DevicePower = PowerDeviceD0;
+    DeviceExtension->Suspended = FALSE;
+
+    Status = Pl2303UsbStart(DeviceObject);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. Pl2303UsbStart failed with %08lx\n",
+                    __FUNCTION__, Status);
+        return Status;
+    }
+
+    if (!DeviceExtension->ReadBuffer.Buffer)
+    {
+        Status = Pl2303InitializeRingBuffer(&DeviceExtension->ReadBuffer,
+                                            DeviceExtension->ReadBufferDefaultSize);
+        if (!NT_SUCCESS(Status))
+        {
+            Pl2303Error(         "%s. Pl2303InitializeRingBuffer failed with %08lx\n",
+                        __FUNCTION__, Status);
+            return Status;
+        }
+    }
+
+    ExAcquireFastMutex(&DeviceExtension->LineStateMutex);
+    LineState = Pl2303BeginLineStateUpdate(DeviceExtension, &OldIrql);
+    LineState->BaudRate = 115200;
+    LineState->StopBits = 0;
+    LineState->Parity = 0;
+    LineState->DataBits = 0;
+    LineState->Chars.XonChar = 0x11;
+    LineState->Chars.XoffChar = 0x13;
+    LineState->HandFlow.ControlHandShake = SERIAL_DTR_CONTROL;
+    LineState->HandFlow.FlowReplace = SERIAL_RTS_CONTROL;
+    LineState->HandFlow.XonLimit = 2048;
+    LineState->HandFlow.XoffLimit = 512;
+    Pl2303EndLineStateUpdate(DeviceExtension, OldIrql);
+    ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
+    Status = Pl2303SetLine(DeviceObject, NULL);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. Pl2303UsbSetLine failed with %08lx\n",
+                    __FUNCTION__, Status);
+    }
+    Status = Pl2303SetFlowControl(DeviceObject, NULL);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. Pl2303SetFlowControl failed with %08lx\n",
+                    __FUNCTION__, Status);
+    }
+
+    Status = Pl2303UsbStartReadPump(DeviceObject);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. Pl2303UsbStartReadPump failed with %08lx\n",
+                    __FUNCTION__, Status);
+        return Status;
+    }
+
+    Status = Pl2303UsbStartStatusPump(DeviceObject);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. Pl2303UsbStartStatusPump failed with %08lx\n",
+                    __FUNCTION__, Status);
+        Pl2303UsbStopReadPump(DeviceObject);
+        return Status;
+    }
+
+    Status = Pl2303StartWrites(DeviceObject);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. Pl2303StartWrites failed with %08lx\n",
+                    __FUNCTION__, Status);
+        Pl2303UsbStopStatusPump(DeviceObject);
+        Pl2303UsbStopReadPump(DeviceObject);
+        return Status;
+    }
+
+    Status = IoSetDeviceInterfaceState(&DeviceExtension->InterfaceLinkName,
+                                       TRUE);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. IoSetDeviceInterfaceState failed with %08lx\n",
+                    __FUNCTION__, Status);
+        Pl2303StopWrites(DeviceObject, STATUS_CANCELLED);
+        Pl2303UsbStopStatusPump(DeviceObject);
+        Pl2303UsbStopReadPump(DeviceObject);
+        return Status;
+    }
+
+    if (DeviceExtension->ComPortName.Buffer)
+    {
+        Status = IoCreateSymbolicLink(&DeviceExtension->ComPortName,
+                                      &DeviceExtension->DeviceName);
+        if (!NT_SUCCESS(Status))
+        {
+            Pl2303Error(         "%s. IoCreateSymbolicLink failed with %08lx\n",
+                        __FUNCTION__, Status);
+            (VOID)IoSetDeviceInterfaceState(&DeviceExtension->InterfaceLinkName,
+                                            FALSE);
+            Pl2303StopWrites(DeviceObject, STATUS_CANCELLED);
+            Pl2303UsbStopStatusPump(DeviceObject);
+            Pl2303UsbStopReadPump(DeviceObject);
+            return Status;
+        }
+
+        /* FIXME */
+#if 0
+        Status = RtlWriteRegistryValue(RTL_REGISTRY_DEVICEMAP,
+                                       SERIAL_DEVICE_MAP,
+                                       DeviceExtension->DeviceName.Buffer,
+                                       DeviceExtension->ComPortName.Buffer + xxx,
+                                       DeviceExtension->ComPortName.Length - xxx * sizeof(WCHAR));
+#endif
+    }
+
+    return Status;
+}
+
+static
+NTSTATUS
+Pl2303StopDevice(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p\n",
+                __FUNCTION__, DeviceObject);
+
+    Pl2303StopIdle(DeviceObject);
+    Pl2303StopWrites(DeviceObject, STATUS_NO_SUCH_DEVICE);
+    Pl2303UsbStopStatusPump(DeviceObject);
+    Pl2303UsbStopReadPump(DeviceObject);
+    Pl2303WaitForReadBufferGrowth(DeviceObject);
+    Pl2303FlushReads(DeviceObject, STATUS_NO_SUCH_DEVICE);
+    Pl2303FlushEvents(DeviceObject, STATUS_NO_SUCH_DEVICE);
+    Pl2303StopTimeouts(DeviceObject);
+
+    if (DeviceExtension->ComPortName.Buffer)
+        (VOID)IoDeleteSymbolicLink(&DeviceExtension->ComPortName);
+
+    Status = IoSetDeviceInterfaceState(&DeviceExtension->InterfaceLinkName,
+                                       FALSE);
+
+    return Status;
+}
+
+NTSTATUS
+NTAPI
+Pl2303AddDevice(
+    _In_ PDRIVER_OBJECT DriverObject,
+    _In_ PDEVICE_OBJECT PhysicalDeviceObject)
+{
+    NTSTATUS Status;
+    PDEVICE_OBJECT DeviceObject;
+    PDEVICE_EXTENSION DeviceExtension;
+    UNICODE_STRING DeviceName;
+    static ULONG DeviceNumber = 0;
+    ULONG Number;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DriverObject=%p, PhysicalDeviceObject=%p\n",
+                __FUNCTION__, DriverObject,    PhysicalDeviceObject);
+
+    DeviceName.MaximumLength = sizeof(L"\\Device\\Pl2303Serial999");
+    DeviceName.Length = 0;
+    DeviceName.Buffer = ExAllocatePoolWithTag(PagedPool,
+                                              DeviceName.MaximumLength,
+                                              PL2303_TAG);
+    if (!DeviceName.Buffer)
+    {
+        Pl2303Error(         "%s. Allocating device name buffer failed\n",
+                    __FUNCTION__);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    Number = DeviceNumber++;
+    Status = RtlUnicodeStringPrintf(&DeviceName,
+                                    L"\\Device\\Pl2303Serial%lu",
+                                    Number);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. RtlUnicodeStringPrintf failed with %08lx\n",
+                    __FUNCTION__, Status);
+        ExFreePoolWithTag(DeviceName.Buffer, PL2303_TAG);
+        return Status;
+    }
+
+    Pl2303Debug(         "%s. Device Name is '%wZ'\n",
+                __FUNCTION__, &DeviceName);
+    Status = IoCreateDevice(DriverObject,
+                            sizeof(DEVICE_EXTENSION),
+                            &DeviceName,
+                            FILE_DEVICE_SERIAL_PORT,
+                            FILE_DEVICE_SECURE_OPEN,
+                            TRUE,
+                            &DeviceObject);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. IoCreateDevice failed with %08lx\n",
+                    __FUNCTION__, Status);
+        return Status;
+    }
+
+    DeviceExtension = DeviceObject->DeviceExtension;
+    RtlZeroMemory(DeviceExtension, sizeof(*DeviceExtension));
+    DeviceExtension->DeviceName = DeviceName;
+
+    NT_ASSERT(DeviceExtension->LowerDevice == NULL);
+    Status = IoAttachDeviceToDeviceStackSafe(DeviceObject,
+                                             PhysicalDeviceObject,
+                                             &DeviceExtension->LowerDevice);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. IoAttachDeviceToDeviceStackSafe failed with %08lx\n",
+                    __FUNCTION__, Status);
+        IoDeleteDevice(DeviceObject);
+        return STATUS_NO_SUCH_DEVICE;
+    }
+    NT_ASSERT(DeviceExtension->LowerDevice);
+    NT_ASSERT(DeviceExtension->LowerDevice->Flags & DO_POWER_PAGABLE);
+
+    if (DeviceExtension->LowerDevice->Flags & DO_POWER_PAGABLE)
+        DeviceObject->Flags |= DO_POWER_PAGABLE;
+
+    DeviceObject->Flags |= DO_BUFFERED_IO;
+
+    Status = Pl2303InitializeDevice(DeviceObject, PhysicalDeviceObject);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. Pl2303InitializeDevice failed with %08lx\n",
+                    __FUNCTION__, Status);
+        IoDetachDevice(DeviceExtension->LowerDevice);
+        IoDeleteDevice(DeviceObject);
+        return Status;
+    }
+
+    /* The port works without it, only the private IOCTLs are unavailable */
+    Status = Pl2303CreateControlDevice(DeviceObject, Number);
+    if (!NT_SUCCESS(Status))
+        Pl2303Warn(         "%s. Pl2303CreateControlDevice failed with %08lx\n",
+                   __FUNCTION__, Status);
+
+    DeviceObject->Flags &= ~DO_DEVICE_INITIALIZING;
+
+    return STATUS_SUCCESS;
+}
+
+static const PCSTR PnpMinorFunctionNames[] =
+{
+    "IRP_MN_START_DEVICE",
+    "IRP_MN_QUERY_REMOVE_DEVICE",
+    "IRP_MN_REMOVE_DEVICE",
+    "IRP_MN_CANCEL_REMOVE_DEVICE",
+    "IRP_MN_STOP_DEVICE",
+    "IRP_MN_QUERY_STOP_DEVICE",
+    "IRP_MN_CANCEL_STOP_DEVICE",
+    "IRP_MN_QUERY_DEVICE_RELATIONS",
+    "IRP_MN_QUERY_INTERFACE",
+    "IRP_MN_QUERY_CAPABILITIES",
+    "IRP_MN_QUERY_RESOURCES",
+    "IRP_MN_QUERY_RESOURCE_REQUIREMENTS",
+    "IRP_MN_QUERY_DEVICE_TEXT",
+    "IRP_MN_FILTER_RESOURCE_REQUIREMENTS",
+    "0x0E",
+    "IRP_MN_READ_CONFIG",
+    "IRP_MN_WRITE_CONFIG",
+    "IRP_MN_EJECT",
+    "IRP_MN_SET_LOCK",
+    "IRP_MN_QUERY_ID",
+    "IRP_MN_QUERY_PNP_DEVICE_STATE",
+    "IRP_MN_QUERY_BUS_INFORMATION",
+    "IRP_MN_DEVICE_USAGE_NOTIFICATION",
+    "IRP_MN_SURPRISE_REMOVAL",
+    "IRP_MN_QUERY_LEGACY_BUS_INFORMATION",
+    "IRP_MN_DEVICE_ENUMERATED"
+};
+
+static
+PCSTR
+Pl2303GetPnpMinorFunctionName(
+    _In_ UCHAR MinorFunction)
+{
+    if (MinorFunction < RTL_NUMBER_OF(PnpMinorFunctionNames))
+        return PnpMinorFunctionNames[MinorFunction];
+    return "Unknown";
+}
+
+static
+VOID
+Pl2303RecordPnpState(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ UCHAR MinorFunction)
+{
+    PAGED_CODE();
+
+    Pl2303Record(DeviceExtension,
+                 PL2303_RECORD_PNP,
+                 MinorFunction,
+                 0,
+                 0,
+                 NULL,
+                 DeviceExtension->PnpState);
+}
+
+NTSTATUS
+NTAPI
+Pl2303DispatchPnp(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp)
+{
+    NTSTATUS Status;
+    PIO_STACK_LOCATION IoStack;
+    PDEVICE_EXTENSION DeviceExtension;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                __FUNCTION__, DeviceObject,    Irp);
+
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    NT_ASSERT(IoStack->MajorFunction == IRP_MJ_PNP);
+    Pl2303RecordIrp(DeviceObject, Irp);
+
+    DeviceExtension = DeviceObject->DeviceExtension;
+
+    if (DeviceExtension->PnpState == Deleted)
+    {
+        Pl2303Warn(         "%s. Device already deleted\n",
+                   __FUNCTION__);
+        Status = STATUS_NO_SUCH_DEVICE;
+        Irp->IoStatus.Status = Status;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        return Status;
+    }
+
+    Pl2303Debug(         "%s. MinorFunction=%s (0x%x)\n",
+                __FUNCTION__, Pl2303GetPnpMinorFunctionName(IoStack->MinorFunction),
+                              IoStack->MinorFunction);
+
+    switch (IoStack->MinorFunction)
+    {
+        case IRP_MN_START_DEVICE:
+            if (IoForwardIrpSynchronously(DeviceExtension->LowerDevice, Irp))
+                Status = Irp->IoStatus.Status;
+            else
+            {
+                Pl2303Error(         "%s. IoForwardIrpSynchronously failed\n",
+                            __FUNCTION__);
+                Status = STATUS_UNSUCCESSFUL;
+            }
+
+            if (!NT_SUCCESS(Status))
+            {
+                Pl2303Warn(         "%s. IRP_MN_START_DEVICE failed with %08lx\n",
+                           __FUNCTION__, Status);
+                Irp->IoStatus.Status = Status;
+                IoCompleteRequest(Irp, IO_NO_INCREMENT);
+                return Status;
+            }
+
+            Status = Pl2303StartDevice(DeviceObject);
+            if (!NT_SUCCESS(Status))
+            {
+                Pl2303Error(         "%s. Pl2303StartDevice failed with %08lx\n",
+                            __FUNCTION__, Status);
+                Irp->IoStatus.Status = Status;
+                IoCompleteRequest(Irp, IO_NO_INCREMENT);
+                return Status;
+            }
+
+            DeviceExtension->PnpState = Started;
+            Pl2303RecordPnpState(DeviceExtension, IoStack->MinorFunction);
+            Pl2303StartIdle(DeviceObject);
+            Irp->IoStatus.Status = Status;
+            IoCompleteRequest(Irp, IO_NO_INCREMENT);
+            return Status;
+        case IRP_MN_QUERY_STOP_DEVICE:
+            DeviceExtension->PreviousPnpState = DeviceExtension->PnpState;
+            DeviceExtension->PnpState = StopPending;
+            Pl2303RecordPnpState(DeviceExtension, IoStack->MinorFunction);
+            break;
+        case IRP_MN_QUERY_REMOVE_DEVICE:
+            DeviceExtension->PreviousPnpState = DeviceExtension->PnpState;
+            DeviceExtension->PnpState = RemovePending;
+            Pl2303RecordPnpState(DeviceExtension, IoStack->MinorFunction);
+            break;
+        case IRP_MN_CANCEL_REMOVE_DEVICE:
+        case IRP_MN_CANCEL_STOP_DEVICE:
+            DeviceExtension->PnpState = DeviceExtension->PreviousPnpState;
+            Pl2303RecordPnpState(DeviceExtension, IoStack->MinorFunction);
+            break;
+        case IRP_MN_STOP_DEVICE:
+            DeviceExtension->PnpState = Stopped;
+            Pl2303RecordPnpState(DeviceExtension, IoStack->MinorFunction);
+            Pl2303StopIdle(DeviceObject);
+            Pl2303StopWrites(DeviceObject, STATUS_CANCELLED);
+            (VOID)Pl2303UsbStop(DeviceObject);
+            break;
+        case IRP_MN_SURPRISE_REMOVAL:
+            DeviceExtension->PnpState = SurpriseRemovePending;
+            Pl2303RecordPnpState(DeviceExtension, IoStack->MinorFunction);
+            Status = Pl2303StopDevice(DeviceObject);
+            if (!NT_SUCCESS(Status))
+                Pl2303Warn(         "%s. Pl2303StopDevice failed with %08lx\n",
+                           __FUNCTION__, Status);
+            break;
+        case IRP_MN_REMOVE_DEVICE:
+            DeviceExtension->PreviousPnpState = DeviceExtension->PnpState;
+            DeviceExtension->PnpState = Deleted;
+            Pl2303RecordPnpState(DeviceExtension, IoStack->MinorFunction);
+            if (DeviceExtension->PreviousPnpState != SurpriseRemovePending)
+            {
+                Status = Pl2303StopDevice(DeviceObject);
+                if (!NT_SUCCESS(Status))
+                    Pl2303Warn(         "%s. Pl2303StopDevice failed with %08lx\n",
+                               __FUNCTION__, Status);
+            }
+            Irp->IoStatus.Status = STATUS_SUCCESS;
+            IoSkipCurrentIrpStackLocation(Irp);
+            Status = IoCallDriver(DeviceExtension->LowerDevice, Irp);
+            IoDetachDevice(DeviceExtension->LowerDevice);
+            (VOID)Pl2303DestroyDevice(DeviceObject);
+            IoDeleteDevice(DeviceObject);
+            return Status;
+        case IRP_MN_QUERY_PNP_DEVICE_STATE:
+            if (!DeviceExtension->PipeFailed)
+            {
+                IoSkipCurrentIrpStackLocation(Irp);
+                return IoCallDriver(DeviceExtension->LowerDevice, Irp);
+            }
+
+            /* A pump gave up on its pipe, so have the device restarted */
+            if (IoForwardIrpSynchronously(DeviceExtension->LowerDevice, Irp))
+                Status = Irp->IoStatus.Status;
+            else
+                Status = STATUS_NOT_SUPPORTED;
+            if (Status == STATUS_NOT_SUPPORTED)
+                Irp->IoStatus.Information = 0;
+            if (NT_SUCCESS(Status) || Status == STATUS_NOT_SUPPORTED)
+            {
+                Irp->IoStatus.Information |= PNP_DEVICE_FAILED;
+                Status = STATUS_SUCCESS;
+            }
+            Irp->IoStatus.Status = Status;
+            IoCompleteRequest(Irp, IO_NO_INCREMENT);
+            return Status;
+        default:
+            /* Unsupported request - leave Irp->IoStack.Status untouched */
+            IoSkipCurrentIrpStackLocation(Irp);
+            return IoCallDriver(DeviceExtension->LowerDevice, Irp);
+    }
+
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    IoSkipCurrentIrpStackLocation(Irp);
+    return IoCallDriver(DeviceExtension->LowerDevice, Irp);
+}
@@ -0,0 +1,674 @@
+/*
+ * PL2303 Driver power management
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#define PL2303_TRACE_COMPONENT PL2303_TRACE_PNP
+#include "pl2303.h"
+
+/*
+ * Selective suspend is enabled by a non-zero IdleTimeout registry value. Once
+ * the port has been closed for that many seconds, an idle notification
+ * request is sent to the hub; when the hub calls back, the device is put into
+ * D2. Opening the port cancels the idle request and brings the device back
+ * to D0, and the line settings and control lines are restored before the open
+ * completes, so no I/O can reach the device before it is set up again.
+ *
+ * PowerSpinLock protects OpenCount, IdleIrpPending and DevicePower, which
+ * together decide whether the device may be suspended.
+ */
+
+typedef struct _POWER_REQUEST
+{
+    KEVENT Event;
+    NTSTATUS Status;
+} POWER_REQUEST, *PPOWER_REQUEST;
+
+_Function_class_(KDEFERRED_ROUTINE)
+static KDEFERRED_ROUTINE Pl2303IdleDpc;
+_Function_class_(IO_COMPLETION_ROUTINE)
+static NTSTATUS NTAPI Pl2303IdleCompletion(_In_ PDEVICE_OBJECT DeviceObject,
+                                           _In_ PIRP Irp,
+                                           _In_reads_(sizeof(DEVICE_OBJECT)) PVOID Context);
+static USB_IDLE_CALLBACK Pl2303IdleCallback;
+_Function_class_(REQUEST_POWER_COMPLETE)
+static REQUEST_POWER_COMPLETE Pl2303PowerRequestComplete;
+static NTSTATUS Pl2303RequestDevicePower(_In_ PDEVICE_OBJECT DeviceObject,
+                                         _In_ DEVICE_POWER_STATE State);
+_Function_class_(IO_COMPLETION_ROUTINE)
+static NTSTATUS NTAPI Pl2303PowerUpCompletion(_In_ PDEVICE_OBJECT DeviceObject,
+                                              _In_ PIRP Irp,
+                                              _In_reads_(sizeof(KEVENT)) PVOID Context);
+static NTSTATUS Pl2303SetDevicePower(_In_ PDEVICE_OBJECT DeviceObject,
+                                     _Inout_ PIRP Irp,
+                                     _In_ DEVICE_POWER_STATE State);
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, Pl2303InitializePower)
+#pragma alloc_text(PAGE, Pl2303AllocateIdleRequest)
+#pragma alloc_text(PAGE, Pl2303FreeIdleRequest)
+#pragma alloc_text(PAGE, Pl2303IdleCallback)
+#pragma alloc_text(PAGE, Pl2303RequestDevicePower)
+#pragma alloc_text(PAGE, Pl2303StopIdle)
+#pragma alloc_text(PAGE, Pl2303OpenPort)
+#pragma alloc_text(PAGE, Pl2303ClosePort)
+#pragma alloc_text(PAGE, Pl2303SetDevicePower)
+#pragma alloc_text(PAGE, Pl2303DispatchPower)
+#endif /* defined ALLOC_PRAGMA */
+
+VOID
+Pl2303InitializePower(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+
+    PAGED_CODE();
+
+    KeInitializeSpinLock(&DeviceExtension->PowerSpinLock);
+    DeviceExtension->DevicePower = PowerDeviceD0;
+    KeInitializeTimer(&DeviceExtension->IdleTimer);
+    KeInitializeDpc(&DeviceExtension->IdleDpc,
+                    Pl2303IdleDpc,
+                    DeviceObject);
+    KeInitializeEvent(&DeviceExtension->IdleIrpDoneEvent, NotificationEvent, TRUE);
+    DeviceExtension->IdleCallbackInfo.IdleCallback = Pl2303IdleCallback;
+    DeviceExtension->IdleCallbackInfo.IdleContext = DeviceObject;
+}
+
+/*
+ * Allocates the idle request if selective suspend is enabled. Without it,
+ * the idle timeout is never started.
+ */
+NTSTATUS
+Pl2303AllocateIdleRequest(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+
+    PAGED_CODE();
+
+    if (!DeviceExtension->IdleTimeout || DeviceExtension->IdleIrp)
+        return STATUS_SUCCESS;
+
+    DeviceExtension->IdleIrp = IoAllocateIrp(DeviceExtension->LowerDevice->StackSize, FALSE);
+    if (!DeviceExtension->IdleIrp)
+    {
+        Pl2303Error(         "%s. Allocating idle request failed\n",
+                    __FUNCTION__);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+Pl2303FreeIdleRequest(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+
+    PAGED_CODE();
+
+    if (DeviceExtension->IdleIrp)
+    {
+        IoFreeIrp(DeviceExtension->IdleIrp);
+        DeviceExtension->IdleIrp = NULL;
+    }
+}
+
+_Function_class_(KDEFERRED_ROUTINE)
+static
+VOID
+NTAPI
+Pl2303IdleDpc(
+    _In_ PKDPC Dpc,
+    _In_opt_ PVOID DeferredContext,
+    _In_opt_ PVOID SystemArgument1,
+    _In_opt_ PVOID SystemArgument2)
+{
+    PDEVICE_OBJECT DeviceObject = DeferredContext;
+    PDEVICE_EXTENSION DeviceExtension;
+    PIO_STACK_LOCATION IoStack;
+    BOOLEAN Submit;
+    PIRP Irp;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+    NT_ASSERT(DeviceObject);
+
+    DeviceExtension = DeviceObject->DeviceExtension;
+
+    KeAcquireSpinLockAtDpcLevel(&DeviceExtension->PowerSpinLock);
+    Submit = DeviceExtension->OpenCount == 0 &&
+             !DeviceExtension->IdleIrpPending &&
+             DeviceExtension->DevicePower == PowerDeviceD0;
+    if (Submit)
+    {
+        DeviceExtension->IdleIrpPending = TRUE;
+        KeClearEvent(&DeviceExtension->IdleIrpDoneEvent);
+    }
+    KeReleaseSpinLockFromDpcLevel(&DeviceExtension->PowerSpinLock);
+
+    if (!Submit)
+        return;
+
+    Pl2303Debug(         "%s. Port idle, requesting suspend\n",
+                __FUNCTION__);
+
+    Irp = DeviceExtension->IdleIrp;
+    IoReuseIrp(Irp, STATUS_NOT_SUPPORTED);
+    IoStack = IoGetNextIrpStackLocation(Irp);
+    IoStack->MajorFunction = IRP_MJ_INTERNAL_DEVICE_CONTROL;
+    IoStack->Parameters.DeviceIoControl.IoControlCode = IOCTL_INTERNAL_USB_SUBMIT_IDLE_NOTIFICATION;
+    IoStack->Parameters.DeviceIoControl.Type3InputBuffer = &DeviceExtension->IdleCallbackInfo;
+    IoStack->Parameters.DeviceIoControl.InputBufferLength = sizeof(DeviceExtension->IdleCallbackInfo);
+    IoSetCompletionRoutine(Irp,
+                           Pl2303IdleCompletion,
+                           DeviceObject,
+                           TRUE,
+                           TRUE,
+                           TRUE);
+    (VOID)IoCallDriver(DeviceExtension->LowerDevice, Irp);
+}
+
+/*
+ * The hub completes the idle request when it is canceled, or when it resumes
+ * the port on its own, e.g. for remote wakeup. In the latter case, the device
+ * is brought back to D0 here, and will be suspended again once the idle
+ * timeout expires. A canceled request leaves the device as it is. If the hub
+ * rejects the request, the idle timeout is started again to retry later.
+ */
+_Function_class_(IO_COMPLETION_ROUTINE)
+static
+NTSTATUS
+NTAPI
+Pl2303IdleCompletion(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PIRP Irp,
+    _In_reads_(sizeof(DEVICE_OBJECT)) PVOID Context)
+{
+    PDEVICE_EXTENSION DeviceExtension;
+    POWER_STATE PowerState;
+    NTSTATUS Status;
+    KIRQL OldIrql;
+    BOOLEAN PowerUp;
+    BOOLEAN Retry;
+
+    DeviceObject = Context;
+    NT_ASSERT(DeviceObject);
+    DeviceExtension = DeviceObject->DeviceExtension;
+
+    Status = Irp->IoStatus.Status;
+    if (!NT_SUCCESS(Status) && Status != STATUS_CANCELLED)
+    {
+        Pl2303Warn(         "%s. Idle request failed with %08lx\n",
+                   __FUNCTION__, Status);
+    }
+
+    KeAcquireSpinLock(&DeviceExtension->PowerSpinLock, &OldIrql);
+    DeviceExtension->IdleIrpPending = FALSE;
+    /* Whoever canceled the request decides about powering up */
+    PowerUp = Status != STATUS_CANCELLED &&
+              DeviceExtension->OpenCount == 0 &&
+              DeviceExtension->DevicePower != PowerDeviceD0;
+    Retry = !NT_SUCCESS(Status) && Status != STATUS_CANCELLED &&
+            DeviceExtension->OpenCount == 0 &&
+            DeviceExtension->PnpState == Started;
+    KeReleaseSpinLock(&DeviceExtension->PowerSpinLock, OldIrql);
+
+    /* Before the done event is set, so that Pl2303StopIdle sees the timer */
+    if (Retry)
+        Pl2303StartIdle(DeviceObject);
+
+    if (PowerUp)
+    {
+        PowerState.DeviceState = PowerDeviceD0;
+        Status = PoRequestPowerIrp(DeviceObject,
+                                   IRP_MN_SET_POWER,
+                                   PowerState,
+                                   NULL,
+                                   NULL,
+                                   NULL);
+        if (!NT_SUCCESS(Status))
+        {
+            Pl2303Error(         "%s. PoRequestPowerIrp failed with %08lx\n",
+                        __FUNCTION__, Status);
+        }
+    }
+
+    KeSetEvent(&DeviceExtension->IdleIrpDoneEvent, IO_NO_INCREMENT, FALSE);
+
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+/*
+ * Called by the hub when the device may be suspended. The idle request is
+ * not completed before this returns, so a concurrent open waiting for it
+ * will find the device in D2 and power it up again.
+ */
+static
+VOID
+NTAPI
+Pl2303IdleCallback(
+    _In_ PVOID Context)
+{
+    PDEVICE_OBJECT DeviceObject = Context;
+    PDEVICE_EXTENSION DeviceExtension;
+    NTSTATUS Status;
+    KIRQL OldIrql;
+    BOOLEAN Suspend;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p\n",
+                __FUNCTION__, DeviceObject);
+
+    NT_ASSERT(DeviceObject);
+    DeviceExtension = DeviceObject->DeviceExtension;
+
+    KeAcquireSpinLock(&DeviceExtension->PowerSpinLock, &OldIrql);
+    Suspend = DeviceExtension->OpenCount == 0;
+    KeReleaseSpinLock(&DeviceExtension->PowerSpinLock, OldIrql);
+
+    if (!Suspend)
+        return;
+
+    Status = Pl2303RequestDevicePower(DeviceObject, PowerDeviceD2);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. Pl2303RequestDevicePower failed with %08lx\n",
+                    __FUNCTION__, Status);
+    }
+}
+
+_Function_class_(REQUEST_POWER_COMPLETE)
+static
+VOID
+NTAPI
+Pl2303PowerRequestComplete(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ UCHAR MinorFunction,
+    _In_ POWER_STATE PowerState,
+    _In_opt_ PVOID Context,
+    _In_ PIO_STATUS_BLOCK IoStatus)
+{
+    PPOWER_REQUEST Request = Context;
+
+    UNREFERENCED_PARAMETER(DeviceObject);
+    UNREFERENCED_PARAMETER(MinorFunction);
+    UNREFERENCED_PARAMETER(PowerState);
+    NT_ASSERT(Request);
+
+    Request->Status = IoStatus->Status;
+    KeSetEvent(&Request->Event, IO_NO_INCREMENT, FALSE);
+}
+
+/*
+ * Sends a device set-power request to the top of our stack, and waits for
+ * the device to reach State.
+ */
+static
+NTSTATUS
+Pl2303RequestDevicePower(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ DEVICE_POWER_STATE State)
+{
+    NTSTATUS Status;
+    POWER_STATE PowerState;
+    POWER_REQUEST Request;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p, State=D%d\n",
+                __FUNCTION__, DeviceObject,    State - PowerDeviceD0);
+
+    KeInitializeEvent(&Request.Event, NotificationEvent, FALSE);
+    Request.Status = STATUS_UNSUCCESSFUL;
+    PowerState.DeviceState = State;
+    Status = PoRequestPowerIrp(DeviceObject,
+                               IRP_MN_SET_POWER,
+                               PowerState,
+                               Pl2303PowerRequestComplete,
+                               &Request,
+                               NULL);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    (VOID)KeWaitForSingleObject(&Request.Event,
+                                Executive,
+                                KernelMode,
+                                FALSE,
+                                NULL);
+    return Request.Status;
+}
+
+/*
+ * Starts the idle timeout. Does nothing if selective suspend is disabled, the
+ * port is open or the device is not in D0.
+ */
+VOID
+Pl2303StartIdle(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    LARGE_INTEGER DueTime;
+    KIRQL OldIrql;
+
+    if (!DeviceExtension->IdleIrp)
+        return;
+
+    KeAcquireSpinLock(&DeviceExtension->PowerSpinLock, &OldIrql);
+    if (DeviceExtension->OpenCount == 0 &&
+        DeviceExtension->DevicePower == PowerDeviceD0)
+    {
+        DueTime.QuadPart = -10000000LL * DeviceExtension->IdleTimeout;
+        (VOID)KeSetTimer(&DeviceExtension->IdleTimer,
+                         DueTime,
+                         &DeviceExtension->IdleDpc);
+    }
+    KeReleaseSpinLock(&DeviceExtension->PowerSpinLock, OldIrql);
+}
+
+/*
+ * Stops the idle timeout and cancels an outstanding idle request. A device
+ * that has already been suspended stays in D2.
+ */
+VOID
+Pl2303StopIdle(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    KIRQL OldIrql;
+    BOOLEAN Pending;
+
+    PAGED_CODE();
+
+    if (!DeviceExtension->IdleIrp)
+        return;
+
+    (VOID)KeCancelTimer(&DeviceExtension->IdleTimer);
+    KeFlushQueuedDpcs();
+
+    KeAcquireSpinLock(&DeviceExtension->PowerSpinLock, &OldIrql);
+    Pending = DeviceExtension->IdleIrpPending;
+    KeReleaseSpinLock(&DeviceExtension->PowerSpinLock, OldIrql);
+
+    if (Pending)
+        (VOID)IoCancelIrp(DeviceExtension->IdleIrp);
+
+    (VOID)KeWaitForSingleObject(&DeviceExtension->IdleIrpDoneEvent,
+                                Executive,
+                                KernelMode,
+                                FALSE,
+                                NULL);
+
+    /* A failed idle request may have started the idle timeout again */
+    (VOID)KeCancelTimer(&DeviceExtension->IdleTimer);
+    KeFlushQueuedDpcs();
+}
+
+/*
+ * Accounts for a new handle to the port, resuming the device if it was
+ * suspended. Once this returns successfully, the device is in D0 with its
+ * line settings restored.
+ */
+NTSTATUS
+Pl2303OpenPort(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    DEVICE_POWER_STATE State;
+    KIRQL OldIrql;
+
+    PAGED_CODE();
+
+    KeAcquireSpinLock(&DeviceExtension->PowerSpinLock, &OldIrql);
+    DeviceExtension->OpenCount++;
+    KeReleaseSpinLock(&DeviceExtension->PowerSpinLock, OldIrql);
+
+    Pl2303StopIdle(DeviceObject);
+
+    KeAcquireSpinLock(&DeviceExtension->PowerSpinLock, &OldIrql);
+    State = DeviceExtension->DevicePower;
+    KeReleaseSpinLock(&DeviceExtension->PowerSpinLock, OldIrql);
+
+    if (State == PowerDeviceD0)
+        return STATUS_SUCCESS;
+
+    Status = Pl2303RequestDevicePower(DeviceObject, PowerDeviceD0);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. Pl2303RequestDevicePower failed with %08lx\n",
+                    __FUNCTION__, Status);
+        Pl2303ClosePort(DeviceObject);
+        return Status;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+Pl2303ClosePort(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    KIRQL OldIrql;
+    BOOLEAN Closed;
+
+    PAGED_CODE();
+
+    KeAcquireSpinLock(&DeviceExtension->PowerSpinLock, &OldIrql);
+    NT_ASSERT(DeviceExtension->OpenCount > 0);
+    DeviceExtension->OpenCount--;
+    Closed = DeviceExtension->OpenCount == 0;
+    KeReleaseSpinLock(&DeviceExtension->PowerSpinLock, OldIrql);
+
+    if (Closed)
+        Pl2303ShrinkReadBuffer(DeviceObject);
+
+    if (DeviceExtension->PnpState == Started)
+        Pl2303StartIdle(DeviceObject);
+}
+
+_Function_class_(IO_COMPLETION_ROUTINE)
+static
+NTSTATUS
+NTAPI
+Pl2303PowerUpCompletion(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PIRP Irp,
+    _In_reads_(sizeof(KEVENT)) PVOID Context)
+{
+    PKEVENT Event = Context;
+
+    UNREFERENCED_PARAMETER(DeviceObject);
+    UNREFERENCED_PARAMETER(Irp);
+    NT_ASSERT(Event);
+
+    KeSetEvent(Event, IO_NO_INCREMENT, FALSE);
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+/*
+ * The read and status pumps are stopped before the device leaves D0. On the
+ * way back, the device is restored and the pumps restarted only after the
+ * lower drivers have completed the request, and before it is completed to
+ * the requester.
+ */
+static
+NTSTATUS
+Pl2303SetDevicePower(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp,
+    _In_ DEVICE_POWER_STATE State)
+{
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PIO_STACK_LOCATION IoStack;
+    KEVENT Event;
+    KIRQL OldIrql;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p, State=D%d\n",
+                __FUNCTION__, DeviceObject,    Irp,    State - PowerDeviceD0);
+
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+
+    if (State != PowerDeviceD0)
+    {
+        if (DeviceExtension->DevicePower == PowerDeviceD0 &&
+            (DeviceExtension->ReadTransfers || DeviceExtension->StatusTransfer))
+        {
+            Pl2303UsbStopStatusPump(DeviceObject);
+            Pl2303UsbStopReadPump(DeviceObject);
+            DeviceExtension->Suspended = TRUE;
+        }
+
+        KeAcquireSpinLock(&DeviceExtension->PowerSpinLock, &OldIrql);
+        DeviceExtension->DevicePower = State;
+        KeReleaseSpinLock(&DeviceExtension->PowerSpinLock, OldIrql);
+        (VOID)PoSetPowerState(DeviceObject, DevicePowerState, IoStack->Parameters.Power.State);
+
+        PoStartNextPowerIrp(Irp);
+        IoSkipCurrentIrpStackLocation(Irp);
+        return PoCallDriver(DeviceExtension->LowerDevice, Irp);
+    }
+
+    KeInitializeEvent(&Event, NotificationEvent, FALSE);
+    IoCopyCurrentIrpStackLocationToNext(Irp);
+    IoSetCompletionRoutine(Irp,
+                           Pl2303PowerUpCompletion,
+                           &Event,
+                           TRUE,
+                           TRUE,
+                           TRUE);
+    Status = PoCallDriver(DeviceExtension->LowerDevice, Irp);
+    if (Status == STATUS_PENDING)
+    {
+        (VOID)KeWaitForSingleObject(&Event,
+                                    Executive,
+                                    KernelMode,
+                                    FALSE,
+                                    NULL);
+    }
+    Status = Irp->IoStatus.Status;
+
+    /*
+     * A device that did not take back its line settings is not usable, so
+     * fail the request, which also fails an open that asked for it. The
+     * device stays suspended, and the next request to power it up tries
+     * again.
+     */
+    if (NT_SUCCESS(Status) && DeviceExtension->Suspended)
+    {
+        Status = Pl2303RestoreLine(DeviceObject);
+        if (!NT_SUCCESS(Status))
+        {
+            Pl2303Error(         "%s. Pl2303RestoreLine failed with %08lx\n",
+                        __FUNCTION__, Status);
+        }
+        else
+        {
+            DeviceExtension->Suspended = FALSE;
+
+            Status = Pl2303UsbStartReadPump(DeviceObject);
+            if (!NT_SUCCESS(Status))
+            {
+                Pl2303Error(         "%s. Pl2303UsbStartReadPump failed with %08lx\n",
+                            __FUNCTION__, Status);
+            }
+
+            Status = Pl2303UsbStartStatusPump(DeviceObject);
+            if (!NT_SUCCESS(Status))
+            {
+                Pl2303Error(         "%s. Pl2303UsbStartStatusPump failed with %08lx\n",
+                            __FUNCTION__, Status);
+            }
+
+            /* The device is usable even if the pumps could not be started */
+            Status = STATUS_SUCCESS;
+        }
+    }
+
+    if (NT_SUCCESS(Status))
+    {
+        KeAcquireSpinLock(&DeviceExtension->PowerSpinLock, &OldIrql);
+        DeviceExtension->DevicePower = PowerDeviceD0;
+        KeReleaseSpinLock(&DeviceExtension->PowerSpinLock, OldIrql);
+        (VOID)PoSetPowerState(DeviceObject, DevicePowerState, IoStack->Parameters.Power.State);
+
+        Pl2303StartIdle(DeviceObject);
+    }
+    else
+    {
+        Pl2303Error(         "%s. Powering up failed with %08lx\n",
+                    __FUNCTION__, Status);
+    }
+
+    PoStartNextPowerIrp(Irp);
+    Irp->IoStatus.Status = Status;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    return Status;
+}
+
+NTSTATUS
+NTAPI
+Pl2303DispatchPower(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp)
+{
+    NTSTATUS Status;
+    PIO_STACK_LOCATION IoStack;
+    PDEVICE_EXTENSION DeviceExtension;
+
+    PAGED_CODE();
+
+    Pl2303Debug(          "%s. DeviceObject=%p, Irp=%p\n",
+                 __FUNCTION__, DeviceObject,    Irp);
+
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    NT_ASSERT(IoStack->MajorFunction == IRP_MJ_POWER);
+    Pl2303RecordIrp(DeviceObject, Irp);
+
+    DeviceExtension = DeviceObject->DeviceExtension;
+
+    if (DeviceExtension->PnpState == Deleted)
+    {
+        Pl2303Warn(         "%s. Device already deleted\n",
+                   __FUNCTION__);
+        PoStartNextPowerIrp(Irp);
+        Status = STATUS_NO_SUCH_DEVICE;
+        Irp->IoStatus.Status = Status;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        return Status;
+    }
+
+    if (IoStack->MinorFunction == IRP_MN_SET_POWER &&
+        IoStack->Parameters.Power.Type == DevicePowerState)
+    {
+        return Pl2303SetDevicePower(DeviceObject,
+                                    Irp,
+                                    IoStack->Parameters.Power.State.DeviceState);
+    }
+
+    PoStartNextPowerIrp(Irp);
+    IoSkipCurrentIrpStackLocation(Irp);
+    return PoCallDriver(DeviceExtension->LowerDevice, Irp);
+}
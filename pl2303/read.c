@@ -0,0 +1,1060 @@
+/*
+ * PL2303 Driver read request handling
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#define PL2303_TRACE_COMPONENT PL2303_TRACE_READ
+#include "pl2303.h"
+
+/*
+ * The I/O manager's cancel-safe queue keeps its context in the last element
+ * of DriverContext while a read is queued, so the read context must stay
+ * clear of it.
+ */
+typedef struct _READ_CONTEXT
+{
+    ULONG ArrivalTime;
+} READ_CONTEXT, *PREAD_CONTEXT;
+
+C_ASSERT(sizeof(READ_CONTEXT) <= 3 * sizeof(PVOID));
+
+_Function_class_(DRIVER_CANCEL)
+static DRIVER_CANCEL Pl2303CancelCurrentRead;
+_Function_class_(IO_WORKITEM_ROUTINE)
+static IO_WORKITEM_ROUTINE Pl2303GrowReadBuffer;
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, Pl2303ResizeReadBuffer)
+#pragma alloc_text(PAGE, Pl2303ShrinkReadBuffer)
+#pragma alloc_text(PAGE, Pl2303GrowReadBuffer)
+#pragma alloc_text(PAGE, Pl2303WaitForReadBufferGrowth)
+#endif /* defined ALLOC_PRAGMA */
+
+static
+inline
+PREAD_CONTEXT
+Pl2303GetReadContext(
+    _In_ PIRP Irp)
+{
+    return (PREAD_CONTEXT)Irp->Tail.Overlay.DriverContext;
+}
+
+static
+VOID
+Pl2303CompleteRead(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ PIRP Irp,
+    _In_ CCHAR PriorityBoost)
+{
+    Pl2303CountLatency(&DeviceExtension->RequestLatency[PL2303_LATENCY_READ],
+                       Pl2303GetReadContext(Irp)->ArrivalTime);
+    IoCompleteRequest(Irp, PriorityBoost);
+}
+
+static
+ULONG
+Pl2303FillReadIrp(
+    _In_ PIRP Irp,
+    _In_reads_bytes_(Length) const UCHAR *Data,
+    _In_ ULONG Length)
+{
+    PIO_STACK_LOCATION IoStack = IoGetCurrentIrpStackLocation(Irp);
+    ULONG Copy;
+
+    Copy = IoStack->Parameters.Read.Length - (ULONG)Irp->IoStatus.Information;
+    if (Copy > Length)
+        Copy = Length;
+
+    RtlCopyMemory((PUCHAR)Irp->AssociatedIrp.SystemBuffer + Irp->IoStatus.Information,
+                  Data,
+                  Copy);
+    Irp->IoStatus.Information += Copy;
+    return Copy;
+}
+
+static
+ULONG
+Pl2303FillReadIrpFromBuffer(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ PIRP Irp)
+{
+    PIO_STACK_LOCATION IoStack = IoGetCurrentIrpStackLocation(Irp);
+    ULONG Copied;
+
+    Copied = Pl2303RingBufferRead(&DeviceExtension->ReadBuffer,
+                                  (PUCHAR)Irp->AssociatedIrp.SystemBuffer + Irp->IoStatus.Information,
+                                  IoStack->Parameters.Read.Length - (ULONG)Irp->IoStatus.Information);
+    Irp->IoStatus.Information += Copied;
+    return Copied;
+}
+
+#define PL2303_MAX_SCAN_CHARS 5
+
+/*
+ * Returns the offset of the first byte that equals one of Chars, or Length
+ * if there is none. Aligned words are checked a whole word at a time for a
+ * matching byte; only a word that may contain one is looked at bytewise.
+ */
+static
+ULONG
+Pl2303FindChars(
+    _In_reads_bytes_(Length) const UCHAR *Data,
+    _In_ ULONG Length,
+    _In_reads_(CharCount) const UCHAR *Chars,
+    _In_ ULONG CharCount)
+{
+    const ULONG_PTR Ones = (ULONG_PTR)-1 / 0xff;
+    const ULONG_PTR Highs = Ones << 7;
+    ULONG_PTR Patterns[PL2303_MAX_SCAN_CHARS];
+    ULONG_PTR Word;
+    ULONG i = 0;
+    ULONG j;
+
+    NT_ASSERT(CharCount >= 1 && CharCount <= PL2303_MAX_SCAN_CHARS);
+
+    for (j = 0; j < CharCount; j++)
+        Patterns[j] = Ones * Chars[j];
+
+    while (i < Length && ((ULONG_PTR)&Data[i] & (sizeof(ULONG_PTR) - 1)))
+    {
+        for (j = 0; j < CharCount; j++)
+        {
+            if (Data[i] == Chars[j])
+                return i;
+        }
+        i++;
+    }
+
+    /* A byte of Word is zero iff the corresponding bit in (Word - Ones) & ~Word & Highs is set */
+    for (; Length - i >= sizeof(ULONG_PTR); i += sizeof(ULONG_PTR))
+    {
+        for (j = 0; j < CharCount; j++)
+        {
+            Word = *(const ULONG_PTR *)&Data[i] ^ Patterns[j];
+            if ((Word - Ones) & ~Word & Highs)
+                break;
+        }
+        if (j < CharCount)
+            break;
+    }
+
+    for (; i < Length; i++)
+    {
+        for (j = 0; j < CharCount; j++)
+        {
+            if (Data[i] == Chars[j])
+                return i;
+        }
+    }
+
+    return Length;
+}
+
+/*
+ * Once fewer than XoffLimit bytes of the receive buffer are free, the peer is
+ * asked to stop sending: with RTS handshaking by dropping RTS, with automatic
+ * receive flow control by sending XOFF. It may resume once the buffer holds
+ * no more than XonLimit bytes. Returns TRUE if that changed, in which case
+ * the caller calls Pl2303SignalReadThrottle after releasing the lock.
+ */
+_Requires_lock_held_(DeviceExtension->ReadSpinLock)
+static
+BOOLEAN
+Pl2303UpdateReadThrottle(
+    _In_ PDEVICE_EXTENSION DeviceExtension)
+{
+    PRING_BUFFER ReadBuffer = &DeviceExtension->ReadBuffer;
+    BOOLEAN Throttle = DeviceExtension->ReadThrottled;
+
+    if (!DeviceExtension->ReadRtsHandshake && !DeviceExtension->ReadAutoReceive)
+        Throttle = FALSE;
+    else if (ReadBuffer->Size - ReadBuffer->Count < DeviceExtension->ReadXoffLimit)
+        Throttle = TRUE;
+    else if (ReadBuffer->Count <= DeviceExtension->ReadXonLimit)
+        Throttle = FALSE;
+
+    if (Throttle == DeviceExtension->ReadThrottled)
+        return FALSE;
+
+    DeviceExtension->ReadThrottled = Throttle;
+    return TRUE;
+}
+
+static
+VOID
+Pl2303SignalReadThrottle(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+
+    if (DeviceExtension->ReadRtsHandshake)
+        Pl2303UsbUpdateControlLines(DeviceObject);
+    Pl2303SendFlowControlChar(DeviceObject);
+}
+
+/*
+ * Captures the port's timeouts for a read that is about to become the current
+ * read. Only the current read is timed; queued reads wait without a deadline.
+ */
+_Requires_lock_held_(DeviceExtension->ReadSpinLock)
+static
+VOID
+Pl2303SetReadTimeouts(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ PIRP Irp)
+{
+    PIO_STACK_LOCATION IoStack = IoGetCurrentIrpStackLocation(Irp);
+    LINE_STATE LineState;
+    const SERIAL_TIMEOUTS *Timeouts = &LineState.Timeouts;
+    ULONGLONG TotalTimeout;
+
+    Pl2303QueryLineState(DeviceExtension, &LineState);
+
+    DeviceExtension->ReadFlags = 0;
+    DeviceExtension->ReadIntervalTimeout = 0;
+
+    if (Timeouts->ReadIntervalTimeout == MAXULONG)
+    {
+        if (Timeouts->ReadTotalTimeoutMultiplier == 0 &&
+            Timeouts->ReadTotalTimeoutConstant == 0)
+        {
+            DeviceExtension->ReadFlags = PL2303_READ_RETURN_IMMEDIATELY;
+            return;
+        }
+
+        if (Timeouts->ReadTotalTimeoutMultiplier == MAXULONG &&
+            Timeouts->ReadTotalTimeoutConstant != 0 &&
+            Timeouts->ReadTotalTimeoutConstant != MAXULONG)
+        {
+            DeviceExtension->ReadFlags = PL2303_READ_RETURN_ON_DATA |
+                                         PL2303_READ_TOTAL_TIMEOUT;
+            DeviceExtension->ReadTotalDeadline = Pl2303TimeoutToDeadline(Timeouts->ReadTotalTimeoutConstant);
+            return;
+        }
+    }
+    else if (Timeouts->ReadIntervalTimeout != 0)
+    {
+        DeviceExtension->ReadIntervalTimeout = Timeouts->ReadIntervalTimeout;
+    }
+
+    TotalTimeout = (ULONGLONG)Timeouts->ReadTotalTimeoutMultiplier * IoStack->Parameters.Read.Length +
+                   Timeouts->ReadTotalTimeoutConstant;
+    if (TotalTimeout)
+    {
+        DeviceExtension->ReadFlags |= PL2303_READ_TOTAL_TIMEOUT;
+        DeviceExtension->ReadTotalDeadline = Pl2303TimeoutToDeadline(TotalTimeout);
+    }
+}
+
+/*
+ * Restarts the interval timer after the current read received data, and
+ * makes sure the shared timer fires in time for the read's deadlines.
+ */
+_Requires_lock_held_(DeviceExtension->ReadSpinLock)
+static
+VOID
+Pl2303ArmReadTimeouts(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ BOOLEAN DataReceived)
+{
+    if (DataReceived && DeviceExtension->ReadIntervalTimeout)
+    {
+        DeviceExtension->ReadFlags |= PL2303_READ_INTERVAL_TIMEOUT;
+        DeviceExtension->ReadIntervalDeadline = Pl2303TimeoutToDeadline(DeviceExtension->ReadIntervalTimeout);
+    }
+
+    if (DeviceExtension->ReadFlags & PL2303_READ_TOTAL_TIMEOUT)
+        Pl2303ArmTimeoutTimer(DeviceExtension, DeviceExtension->ReadTotalDeadline);
+    if (DeviceExtension->ReadFlags & PL2303_READ_INTERVAL_TIMEOUT)
+        Pl2303ArmTimeoutTimer(DeviceExtension, DeviceExtension->ReadIntervalDeadline);
+}
+
+_Requires_lock_held_(DeviceExtension->ReadSpinLock)
+static
+BOOLEAN
+Pl2303IsReadIrpComplete(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ PIRP Irp)
+{
+    PIO_STACK_LOCATION IoStack = IoGetCurrentIrpStackLocation(Irp);
+
+    if (Irp->IoStatus.Information == IoStack->Parameters.Read.Length)
+        return TRUE;
+    if (DeviceExtension->ReadFlags & PL2303_READ_RETURN_IMMEDIATELY)
+        return TRUE;
+    if ((DeviceExtension->ReadFlags & PL2303_READ_RETURN_ON_DATA) &&
+        Irp->IoStatus.Information != 0)
+        return TRUE;
+    return FALSE;
+}
+
+_Requires_lock_held_(DeviceExtension->ReadSpinLock)
+static
+BOOLEAN
+Pl2303IsReadTimedOut(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ ULONG Now)
+{
+    if ((DeviceExtension->ReadFlags & PL2303_READ_TOTAL_TIMEOUT) &&
+        Pl2303DeadlineExpired(DeviceExtension->ReadTotalDeadline, Now))
+        return TRUE;
+    if ((DeviceExtension->ReadFlags & PL2303_READ_INTERVAL_TIMEOUT) &&
+        Pl2303DeadlineExpired(DeviceExtension->ReadIntervalDeadline, Now))
+        return TRUE;
+    return FALSE;
+}
+
+/*
+ * Tries to make Irp the current read. Returns FALSE if the read could be
+ * finished right away, in which case its final status has been set.
+ */
+_Requires_lock_held_(DeviceExtension->ReadSpinLock)
+static
+BOOLEAN
+Pl2303StartRead(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ PIRP Irp)
+{
+    ULONG Copied;
+
+    NT_ASSERT(DeviceExtension->CurrentReadIrp == NULL);
+
+    Pl2303SetReadTimeouts(DeviceExtension, Irp);
+    Copied = Pl2303FillReadIrpFromBuffer(DeviceExtension, Irp);
+    if (Pl2303IsReadIrpComplete(DeviceExtension, Irp))
+    {
+        Irp->IoStatus.Status = STATUS_SUCCESS;
+        return FALSE;
+    }
+
+    (VOID)IoSetCancelRoutine(Irp, Pl2303CancelCurrentRead);
+    if (Irp->Cancel && IoSetCancelRoutine(Irp, NULL))
+    {
+        Irp->IoStatus.Status = STATUS_CANCELLED;
+        return FALSE;
+    }
+
+    DeviceExtension->CurrentReadIrp = Irp;
+    Pl2303ArmReadTimeouts(DeviceExtension, Copied != 0);
+    return TRUE;
+}
+
+/*
+ * Promotes queued reads to the current read until one of them cannot be
+ * finished right away. Reads that can are moved to CompletionList. Must be
+ * called with the read spin lock held.
+ */
+_Requires_lock_held_(DeviceExtension->ReadSpinLock)
+static
+VOID
+Pl2303StartNextRead(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _Inout_ PLIST_ENTRY CompletionList)
+{
+    PIRP Irp;
+
+    NT_ASSERT(DeviceExtension->CurrentReadIrp == NULL);
+
+    while ((Irp = Pl2303DequeueIrp(&DeviceExtension->ReadQueue)) != NULL)
+    {
+        if (Pl2303StartRead(DeviceExtension, Irp))
+            break;
+
+        InsertTailList(CompletionList, &Irp->Tail.Overlay.ListEntry);
+    }
+}
+
+static
+VOID
+Pl2303CompleteReads(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _Inout_ PLIST_ENTRY CompletionList)
+{
+    PLIST_ENTRY ListEntry;
+    PIRP Irp;
+
+    while (!IsListEmpty(CompletionList))
+    {
+        ListEntry = RemoveHeadList(CompletionList);
+        Irp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+        Pl2303CompleteRead(DeviceExtension, Irp, IO_SERIAL_INCREMENT);
+    }
+}
+
+_Function_class_(DRIVER_CANCEL)
+static
+VOID
+NTAPI
+Pl2303CancelCurrentRead(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PIRP Irp)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    LIST_ENTRY CompletionList;
+    KIRQL OldIrql;
+
+    IoReleaseCancelSpinLock(Irp->CancelIrql);
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                __FUNCTION__, DeviceObject,    Irp);
+
+    InitializeListHead(&CompletionList);
+
+    KeAcquireSpinLock(&DeviceExtension->ReadSpinLock, &OldIrql);
+    NT_ASSERT(DeviceExtension->CurrentReadIrp == Irp);
+    DeviceExtension->CurrentReadIrp = NULL;
+    Pl2303StartNextRead(DeviceExtension, &CompletionList);
+    KeReleaseSpinLock(&DeviceExtension->ReadSpinLock, OldIrql);
+
+    Irp->IoStatus.Status = STATUS_CANCELLED;
+    Pl2303CompleteRead(DeviceExtension, Irp, IO_NO_INCREMENT);
+
+    Pl2303CompleteReads(DeviceExtension, &CompletionList);
+}
+
+NTSTATUS
+Pl2303Read(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PIRP Irp)
+{
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    BOOLEAN Throttle;
+    KIRQL OldIrql;
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                __FUNCTION__, DeviceObject,    Irp);
+
+    Irp->IoStatus.Information = 0;
+    Pl2303GetReadContext(Irp)->ArrivalTime = Pl2303QueryLatencyTime();
+
+    KeAcquireSpinLock(&DeviceExtension->ReadSpinLock, &OldIrql);
+
+    /* Earlier reads are still waiting, so the buffer must be empty */
+    if (DeviceExtension->CurrentReadIrp)
+    {
+        Status = Pl2303QueueIrp(&DeviceExtension->ReadQueue, Irp);
+        KeReleaseSpinLock(&DeviceExtension->ReadSpinLock, OldIrql);
+        return Status;
+    }
+
+    if (Pl2303StartRead(DeviceExtension, Irp))
+    {
+        IoMarkIrpPending(Irp);
+        Throttle = Pl2303UpdateReadThrottle(DeviceExtension);
+        KeReleaseSpinLock(&DeviceExtension->ReadSpinLock, OldIrql);
+        if (Throttle)
+            Pl2303SignalReadThrottle(DeviceObject);
+        return STATUS_PENDING;
+    }
+    Throttle = Pl2303UpdateReadThrottle(DeviceExtension);
+    KeReleaseSpinLock(&DeviceExtension->ReadSpinLock, OldIrql);
+
+    if (Throttle)
+        Pl2303SignalReadThrottle(DeviceObject);
+
+    Status = Irp->IoStatus.Status;
+    Pl2303CompleteRead(DeviceExtension, Irp, NT_SUCCESS(Status) ? IO_SERIAL_INCREMENT : IO_NO_INCREMENT);
+    return Status;
+}
+
+VOID
+Pl2303FlushReads(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ NTSTATUS Status)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    LIST_ENTRY CompletionList;
+    KIRQL OldIrql;
+    PIRP Irp;
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Status=%08lx\n",
+                __FUNCTION__, DeviceObject,    Status);
+
+    InitializeListHead(&CompletionList);
+
+    KeAcquireSpinLock(&DeviceExtension->ReadSpinLock, &OldIrql);
+    Irp = DeviceExtension->CurrentReadIrp;
+    if (Irp && IoSetCancelRoutine(Irp, NULL))
+    {
+        DeviceExtension->CurrentReadIrp = NULL;
+        Irp->IoStatus.Status = Status;
+        InsertTailList(&CompletionList, &Irp->Tail.Overlay.ListEntry);
+    }
+    while ((Irp = Pl2303DequeueIrp(&DeviceExtension->ReadQueue)) != NULL)
+    {
+        Irp->IoStatus.Status = Status;
+        InsertTailList(&CompletionList, &Irp->Tail.Overlay.ListEntry);
+    }
+    KeReleaseSpinLock(&DeviceExtension->ReadSpinLock, OldIrql);
+
+    Pl2303CompleteReads(DeviceExtension, &CompletionList);
+}
+
+VOID
+Pl2303PurgeReadBuffer(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    KIRQL OldIrql;
+    BOOLEAN Throttle;
+
+    Pl2303Debug(         "%s. DeviceObject=%p\n",
+                __FUNCTION__, DeviceObject);
+
+    KeAcquireSpinLock(&DeviceExtension->ReadSpinLock, &OldIrql);
+    Pl2303RingBufferPurge(&DeviceExtension->ReadBuffer);
+    Throttle = Pl2303UpdateReadThrottle(DeviceExtension);
+    KeReleaseSpinLock(&DeviceExtension->ReadSpinLock, OldIrql);
+
+    if (Throttle)
+        Pl2303SignalReadThrottle(DeviceObject);
+}
+
+ULONG
+Pl2303QueryReadBufferCount(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    KIRQL OldIrql;
+    ULONG Count;
+
+    KeAcquireSpinLock(&DeviceExtension->ReadSpinLock, &OldIrql);
+    Count = DeviceExtension->ReadBuffer.Count;
+    KeReleaseSpinLock(&DeviceExtension->ReadSpinLock, OldIrql);
+
+    return Count;
+}
+
+/*
+ * Replaces the receive buffer with one of the given size, keeping its
+ * contents. A buffer is only grown if Grow is set, and only shrunk if it is
+ * not and the contents fit, so concurrent resizes cannot undo each other.
+ */
+NTSTATUS
+Pl2303ResizeReadBuffer(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ ULONG Size,
+    _In_ BOOLEAN Grow)
+{
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PRING_BUFFER ReadBuffer = &DeviceExtension->ReadBuffer;
+    RING_BUFFER NewBuffer;
+    KIRQL OldIrql;
+    BOOLEAN Throttle = FALSE;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Size=%lu, Grow=%u\n",
+                __FUNCTION__, DeviceObject,    Size,     Grow);
+
+    Status = Pl2303InitializeRingBuffer(&NewBuffer, Size);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. Pl2303InitializeRingBuffer failed with %08lx\n",
+                    __FUNCTION__, Status);
+        return Status;
+    }
+
+    KeAcquireSpinLock(&DeviceExtension->ReadSpinLock, &OldIrql);
+    if (Grow ? Size > ReadBuffer->Size
+             : Size < ReadBuffer->Size && Size >= ReadBuffer->Count)
+    {
+        Pl2303RingBufferExchange(ReadBuffer, &NewBuffer);
+        DeviceExtension->ReadBufferHigh = FALSE;
+        Throttle = Pl2303UpdateReadThrottle(DeviceExtension);
+    }
+    KeReleaseSpinLock(&DeviceExtension->ReadSpinLock, OldIrql);
+
+    Pl2303FreeRingBuffer(&NewBuffer);
+
+    if (Throttle)
+        Pl2303SignalReadThrottle(DeviceObject);
+
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Returns the receive buffer to its default size once the port is closed,
+ * so that ports not in use do not hold on to memory grown for earlier
+ * traffic. It stays large enough for the flow control limits, which are
+ * checked against its size under the same mutex.
+ */
+VOID
+Pl2303ShrinkReadBuffer(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    const SERIAL_HANDFLOW *HandFlow;
+    KIRQL OldIrql;
+    ULONG Size;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p\n",
+                __FUNCTION__, DeviceObject);
+
+    ExAcquireFastMutex(&DeviceExtension->LineStateMutex);
+    HandFlow = &DeviceExtension->LineState.HandFlow;
+    Size = DeviceExtension->ReadBufferDefaultSize;
+    Size = max(Size, (ULONG)HandFlow->XonLimit);
+    Size = max(Size, (ULONG)HandFlow->XoffLimit);
+    KeAcquireSpinLock(&DeviceExtension->ReadSpinLock, &OldIrql);
+    DeviceExtension->ReadBufferHighCount = 0;
+    KeReleaseSpinLock(&DeviceExtension->ReadSpinLock, OldIrql);
+    if (DeviceExtension->ReadBuffer.Buffer && Size < DeviceExtension->ReadBuffer.Size)
+        (VOID)Pl2303ResizeReadBuffer(DeviceObject, Size, FALSE);
+    ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
+}
+
+/*
+ * Grows the receive buffer at PASSIVE_LEVEL after the receive path asked
+ * for it, since the new buffer cannot be allocated from the completion.
+ */
+_Function_class_(IO_WORKITEM_ROUTINE)
+static
+VOID
+NTAPI
+Pl2303GrowReadBuffer(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_opt_ PVOID Context)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    KIRQL OldIrql;
+
+    PAGED_CODE();
+    UNREFERENCED_PARAMETER(Context);
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Size=%lu\n",
+                __FUNCTION__, DeviceObject,    DeviceExtension->ReadBufferGrowSize);
+
+    (VOID)Pl2303ResizeReadBuffer(DeviceObject, DeviceExtension->ReadBufferGrowSize, TRUE);
+
+    KeAcquireSpinLock(&DeviceExtension->ReadSpinLock, &OldIrql);
+    DeviceExtension->ReadBufferGrowing = FALSE;
+    KeSetEvent(&DeviceExtension->ReadBufferGrowDoneEvent, IO_NO_INCREMENT, FALSE);
+    KeReleaseSpinLock(&DeviceExtension->ReadSpinLock, OldIrql);
+}
+
+/*
+ * Waits for a pending growth of the receive buffer, so that it can be freed
+ * once the read pump has stopped.
+ */
+VOID
+Pl2303WaitForReadBufferGrowth(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+
+    PAGED_CODE();
+
+    (VOID)KeWaitForSingleObject(&DeviceExtension->ReadBufferGrowDoneEvent,
+                                Executive,
+                                KernelMode,
+                                FALSE,
+                                NULL);
+}
+
+/*
+ * With adaptive sizing, counts how often the receive buffer fills past three
+ * quarters, counting again only after it has drained to half. Once that has
+ * happened often enough, records the size to grow it to in
+ * ReadBufferGrowSize: double the current size, but no more than a second of
+ * data at the current baud rate needs. Returns TRUE if the caller is to
+ * queue the work item that grows it.
+ */
+_Requires_lock_held_(DeviceExtension->ReadSpinLock)
+static
+BOOLEAN
+Pl2303CheckReadBufferGrowth(
+    _In_ PDEVICE_EXTENSION DeviceExtension)
+{
+    PRING_BUFFER ReadBuffer = &DeviceExtension->ReadBuffer;
+    LINE_STATE LineState;
+    ULONG Limit;
+
+    if (!DeviceExtension->ReadBufferAdaptive ||
+        DeviceExtension->ReadBufferGrowing ||
+        !DeviceExtension->ReadBufferWorkItem)
+    {
+        return FALSE;
+    }
+
+    if (ReadBuffer->Count <= ReadBuffer->Size / 2)
+    {
+        DeviceExtension->ReadBufferHigh = FALSE;
+        return FALSE;
+    }
+    if (DeviceExtension->ReadBufferHigh || ReadBuffer->Count < ReadBuffer->Size / 4 * 3)
+        return FALSE;
+
+    DeviceExtension->ReadBufferHigh = TRUE;
+    if (++DeviceExtension->ReadBufferHighCount < PL2303_READ_BUFFER_GROW_COUNT)
+        return FALSE;
+
+    /* Ten bits per character covers start, stop and parity bits */
+    Pl2303QueryLineState(DeviceExtension, &LineState);
+    Limit = LineState.BaudRate / 10;
+    Limit = min(Limit, PL2303_MAX_READ_BUFFER_SIZE);
+    if (ReadBuffer->Size >= Limit)
+        return FALSE;
+
+    DeviceExtension->ReadBufferHighCount = 0;
+    DeviceExtension->ReadBufferGrowing = TRUE;
+    DeviceExtension->ReadBufferGrowSize = min(ReadBuffer->Size * 2, Limit);
+    KeClearEvent(&DeviceExtension->ReadBufferGrowDoneEvent);
+    return TRUE;
+}
+
+static
+VOID
+Pl2303ReportBufferOverrun(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ ULONG Dropped)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+
+    Pl2303Warn(         "%s. Receive buffer overrun, dropped %lu bytes\n",
+               __FUNCTION__, Dropped);
+
+    PL2303_COUNT(DeviceExtension, BufferOverrunErrorCount, Dropped);
+    Pl2303AddErrors(DeviceObject, SERIAL_ERROR_QUEUEOVERRUN);
+}
+
+/*
+ * Passes received data to the current reads and buffers what they do not
+ * take. Returns the number of bytes that did not fit into the buffer.
+ */
+_Requires_lock_held_(DeviceExtension->ReadSpinLock)
+static
+ULONG
+Pl2303StoreReceivedData(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_reads_bytes_(Length) const UCHAR *Data,
+    _In_ ULONG Length,
+    _Inout_ PLIST_ENTRY CompletionList)
+{
+    PIRP Irp;
+    ULONG Copied;
+
+    while (Length && (Irp = DeviceExtension->CurrentReadIrp) != NULL)
+    {
+        Copied = Pl2303FillReadIrp(Irp, Data, Length);
+        Data += Copied;
+        Length -= Copied;
+
+        if (!Pl2303IsReadIrpComplete(DeviceExtension, Irp))
+        {
+            Pl2303ArmReadTimeouts(DeviceExtension, Copied != 0);
+            break;
+        }
+
+        /* If the cancel routine owns the IRP, it will also start the next read */
+        if (!IoSetCancelRoutine(Irp, NULL))
+            break;
+
+        DeviceExtension->CurrentReadIrp = NULL;
+        Irp->IoStatus.Status = STATUS_SUCCESS;
+        InsertTailList(CompletionList, &Irp->Tail.Overlay.ListEntry);
+        Pl2303StartNextRead(DeviceExtension, CompletionList);
+    }
+
+    return Length - Pl2303RingBufferWrite(&DeviceExtension->ReadBuffer, Data, Length);
+}
+
+/*
+ * Collects the characters that need special treatment on receive. If there
+ * are none, received data is passed on as it is, without being scanned.
+ */
+_Requires_lock_held_(DeviceExtension->ReadSpinLock)
+static
+ULONG
+Pl2303GetSpecialChars(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ BOOLEAN EventCharWanted,
+    _Out_writes_(PL2303_MAX_SCAN_CHARS) PUCHAR Chars)
+{
+    ULONG CharCount = 0;
+
+    if (DeviceExtension->ReadAutoTransmit)
+    {
+        Chars[CharCount++] = DeviceExtension->ReadXonChar;
+        Chars[CharCount++] = DeviceExtension->ReadXoffChar;
+    }
+    if (DeviceExtension->ReadNullStripping)
+        Chars[CharCount++] = 0;
+    if (EventCharWanted)
+        Chars[CharCount++] = DeviceExtension->ReadEventChar;
+    if (DeviceExtension->ReadEscapeChar)
+        Chars[CharCount++] = DeviceExtension->ReadEscapeChar;
+
+    NT_ASSERT(CharCount <= PL2303_MAX_SCAN_CHARS);
+    return CharCount;
+}
+
+VOID
+Pl2303ReceiveData(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_reads_bytes_(Length) const UCHAR *Data,
+    _In_ ULONG Length)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    LIST_ENTRY CompletionList;
+    KIRQL OldIrql;
+    UCHAR Chars[PL2303_MAX_SCAN_CHARS];
+    ULONG CharCount;
+    UCHAR Insert[2];
+    ULONG InsertLength;
+    UCHAR Char;
+    ULONG Offset;
+    ULONG Stored = 0;
+    ULONG Dropped = 0;
+    ULONG Events = 0;
+    BOOLEAN EventCharWanted;
+    BOOLEAN FlowChar = FALSE;
+    BOOLEAN Hold = FALSE;
+    BOOLEAN Resume = FALSE;
+    BOOLEAN Throttle;
+    BOOLEAN Grow;
+
+    NT_ASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
+
+    InitializeListHead(&CompletionList);
+    EventCharWanted = Pl2303IsWaitingForEvents(DeviceObject, SERIAL_EV_RXFLAG);
+
+    KeAcquireSpinLock(&DeviceExtension->ReadSpinLock, &OldIrql);
+    CharCount = Pl2303GetSpecialChars(DeviceExtension, EventCharWanted, Chars);
+
+    /* The device reports errors separately, so blame the next byte received */
+    if (Length && DeviceExtension->ReadErrorPending)
+    {
+        DeviceExtension->ReadErrorPending = FALSE;
+        if (DeviceExtension->ReadErrorReplace)
+        {
+            Dropped += Pl2303StoreReceivedData(DeviceExtension, &DeviceExtension->ReadErrorChar, 1, &CompletionList);
+            Stored++;
+            Data++;
+            Length--;
+        }
+    }
+
+    while (Length)
+    {
+        Offset = CharCount ? Pl2303FindChars(Data, Length, Chars, CharCount) : Length;
+        Dropped += Pl2303StoreReceivedData(DeviceExtension, Data, Offset, &CompletionList);
+        Stored += Offset;
+        if (Offset == Length)
+            break;
+
+        Char = Data[Offset];
+        Data += Offset + 1;
+        Length -= Offset + 1;
+
+        /* XON and XOFF are consumed here, and only the last one counts */
+        if (DeviceExtension->ReadAutoTransmit &&
+            (Char == DeviceExtension->ReadXonChar || Char == DeviceExtension->ReadXoffChar))
+        {
+            FlowChar = TRUE;
+            Hold = Char == DeviceExtension->ReadXoffChar;
+            continue;
+        }
+
+        if (DeviceExtension->ReadNullStripping && Char == 0)
+            continue;
+
+        if (EventCharWanted && Char == DeviceExtension->ReadEventChar)
+            Events |= SERIAL_EV_RXFLAG;
+
+        Insert[0] = Char;
+        InsertLength = 1;
+        if (DeviceExtension->ReadEscapeChar && Char == DeviceExtension->ReadEscapeChar)
+            Insert[InsertLength++] = SERIAL_LSRMST_ESCAPE;
+        Dropped += Pl2303StoreReceivedData(DeviceExtension, Insert, InsertLength, &CompletionList);
+        Stored += InsertLength;
+    }
+
+    if (FlowChar)
+        Resume = Pl2303SetWriteHold(DeviceObject, SERIAL_TX_WAITING_FOR_XON, Hold);
+    Throttle = Pl2303UpdateReadThrottle(DeviceExtension);
+    Grow = Pl2303CheckReadBufferGrowth(DeviceExtension);
+    KeReleaseSpinLock(&DeviceExtension->ReadSpinLock, OldIrql);
+
+    if (Resume)
+        Pl2303ResumeWrites(DeviceObject);
+
+    if (Throttle)
+        Pl2303SignalReadThrottle(DeviceObject);
+
+    Pl2303CompleteReads(DeviceExtension, &CompletionList);
+
+    if (Stored)
+        Events |= SERIAL_EV_RXCHAR;
+    if (Events)
+        Pl2303SignalEvents(DeviceObject, Events);
+
+    if (Dropped)
+        Pl2303ReportBufferOverrun(DeviceObject, Dropped);
+
+    if (Grow)
+    {
+        IoQueueWorkItem(DeviceExtension->ReadBufferWorkItem,
+                        Pl2303GrowReadBuffer,
+                        DelayedWorkQueue,
+                        NULL);
+    }
+}
+
+/*
+ * With LSRMST insertion enabled, passes a status change to the application
+ * as an escape sequence within the received data.
+ */
+static
+VOID
+Pl2303InsertStatus(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ UCHAR Type,
+    _In_ UCHAR Value,
+    _In_ BOOLEAN Error)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    LIST_ENTRY CompletionList;
+    KIRQL OldIrql;
+    UCHAR Insert[3];
+    ULONG Stored = 0;
+    ULONG Dropped = 0;
+    BOOLEAN Throttle;
+
+    InitializeListHead(&CompletionList);
+
+    KeAcquireSpinLock(&DeviceExtension->ReadSpinLock, &OldIrql);
+    if (Error)
+        DeviceExtension->ReadErrorPending = TRUE;
+    if (DeviceExtension->ReadEscapeChar)
+    {
+        Insert[0] = DeviceExtension->ReadEscapeChar;
+        Insert[1] = Type;
+        Insert[2] = Value;
+        Dropped = Pl2303StoreReceivedData(DeviceExtension, Insert, sizeof(Insert), &CompletionList);
+        Stored = sizeof(Insert);
+    }
+    Throttle = Pl2303UpdateReadThrottle(DeviceExtension);
+    KeReleaseSpinLock(&DeviceExtension->ReadSpinLock, OldIrql);
+
+    if (Throttle)
+        Pl2303SignalReadThrottle(DeviceObject);
+
+    Pl2303CompleteReads(DeviceExtension, &CompletionList);
+
+    if (Stored)
+        Pl2303SignalEvents(DeviceObject, SERIAL_EV_RXCHAR);
+
+    if (Dropped)
+        Pl2303ReportBufferOverrun(DeviceObject, Dropped);
+}
+
+VOID
+Pl2303ReceiveLineStatus(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ UCHAR LineStatus)
+{
+    Pl2303InsertStatus(DeviceObject,
+                       SERIAL_LSRMST_LSR_NODATA,
+                       LineStatus,
+                       (LineStatus & (SERIAL_LSR_OE | SERIAL_LSR_PE | SERIAL_LSR_FE)) != 0);
+}
+
+VOID
+Pl2303ReceiveModemStatus(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ UCHAR ModemStatus)
+{
+    Pl2303InsertStatus(DeviceObject, SERIAL_LSRMST_MST, ModemStatus, FALSE);
+}
+
+VOID
+Pl2303ReadTimeout(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    LIST_ENTRY CompletionList;
+    KIRQL OldIrql;
+    PIRP Irp;
+
+    InitializeListHead(&CompletionList);
+
+    KeAcquireSpinLock(&DeviceExtension->ReadSpinLock, &OldIrql);
+    Irp = DeviceExtension->CurrentReadIrp;
+    if (Irp)
+    {
+        if (!Pl2303IsReadTimedOut(DeviceExtension, Pl2303QueryTime()))
+        {
+            Pl2303ArmReadTimeouts(DeviceExtension, FALSE);
+        }
+        else if (IoSetCancelRoutine(Irp, NULL))
+        {
+            Pl2303Debug(         "%s. Read %p timed out after %Iu bytes\n",
+                        __FUNCTION__, Irp,  Irp->IoStatus.Information);
+            DeviceExtension->CurrentReadIrp = NULL;
+            Irp->IoStatus.Status = STATUS_TIMEOUT;
+            InsertTailList(&CompletionList, &Irp->Tail.Overlay.ListEntry);
+            Pl2303StartNextRead(DeviceExtension, &CompletionList);
+        }
+    }
+    KeReleaseSpinLock(&DeviceExtension->ReadSpinLock, OldIrql);
+
+    Pl2303CompleteReads(DeviceExtension, &CompletionList);
+}
+
+/*
+ * Captures the receive side's share of the flow control settings. Turning
+ * off automatic transmit flow control releases a transmit held by XOFF.
+ */
+VOID
+Pl2303SetReadFlowControl(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ const SERIAL_HANDFLOW *HandFlow,
+    _In_ const SERIAL_CHARS *Chars)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    BOOLEAN Resume = FALSE;
+    KIRQL OldIrql;
+
+    Pl2303Debug(         "%s. DeviceObject=%p, FlowReplace=0x%lx, XonLimit=%ld, XoffLimit=%ld\n",
+                __FUNCTION__, DeviceObject,    HandFlow->FlowReplace, HandFlow->XonLimit, HandFlow->XoffLimit);
+
+    /* The caller sends the control lines and flow control character afterwards */
+    KeAcquireSpinLock(&DeviceExtension->ReadSpinLock, &OldIrql);
+    DeviceExtension->ReadRtsHandshake = (HandFlow->FlowReplace & SERIAL_RTS_MASK) == SERIAL_RTS_HANDSHAKE;
+    DeviceExtension->ReadAutoReceive = (HandFlow->FlowReplace & SERIAL_AUTO_RECEIVE) != 0;
+    DeviceExtension->ReadAutoTransmit = (HandFlow->FlowReplace & SERIAL_AUTO_TRANSMIT) != 0;
+    DeviceExtension->ReadXonLimit = (ULONG)HandFlow->XonLimit;
+    DeviceExtension->ReadXoffLimit = (ULONG)HandFlow->XoffLimit;
+    DeviceExtension->ReadXonChar = Chars->XonChar;
+    DeviceExtension->ReadXoffChar = Chars->XoffChar;
+    DeviceExtension->ReadNullStripping = (HandFlow->FlowReplace & SERIAL_NULL_STRIPPING) != 0;
+    DeviceExtension->ReadErrorReplace = (HandFlow->FlowReplace & SERIAL_ERROR_CHAR) != 0;
+    DeviceExtension->ReadErrorChar = Chars->ErrorChar;
+    DeviceExtension->ReadEventChar = Chars->EventChar;
+    (VOID)Pl2303UpdateReadThrottle(DeviceExtension);
+    if (!DeviceExtension->ReadAutoTransmit)
+        Resume = Pl2303SetWriteHold(DeviceObject, SERIAL_TX_WAITING_FOR_XON, FALSE);
+    KeReleaseSpinLock(&DeviceExtension->ReadSpinLock, OldIrql);
+
+    if (Resume)
+        Pl2303ResumeWrites(DeviceObject);
+}
@@ -0,0 +1,128 @@
+/*
+ * PL2303 Driver flight recorder routines
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "pl2303.h"
+
+/*
+ * Each device keeps the last PL2303_RECORDER_SIZE events in a ring of
+ * fixed-size binary records, for IOCTL_PL2303_GET_FLIGHT_RECORDER. A writer
+ * claims a slot by incrementing RecorderSequence, so no lock is needed.
+ * The slot's Sequence is zero while its other fields are being written; a
+ * reader that sees it change while copying the record reports the record
+ * as unused instead of returning a torn one.
+ *
+ * Records never contain kernel addresses. Events that belong together share
+ * a cookie instead: the sequence of the record that started the operation.
+ * The caller passes a cookie of zero with that first record, and gets the
+ * record's sequence back in it to pass along with the later ones.
+ */
+
+C_ASSERT((PL2303_RECORDER_SIZE & (PL2303_RECORDER_SIZE - 1)) == 0);
+
+VOID
+Pl2303Record(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ UCHAR Type,
+    _In_ UCHAR Code,
+    _In_ ULONG Size,
+    _In_ ULONG Status,
+    _Inout_opt_ PULONG Cookie,
+    _In_ ULONG Data)
+{
+    ULONG Sequence;
+    PPL2303_RECORD Record;
+
+    Sequence = (ULONG)InterlockedIncrement(&DeviceExtension->RecorderSequence);
+    Record = &DeviceExtension->Recorder[Sequence & (PL2303_RECORDER_SIZE - 1)];
+    if (Cookie && *Cookie == 0)
+        *Cookie = Sequence;
+
+    *(volatile ULONG *)&Record->Sequence = 0;
+    KeMemoryBarrier();
+    Record->Timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+    Record->Type = Type;
+    Record->Code = Code;
+    Record->Size = Size;
+    Record->Status = Status;
+    Record->Object = Cookie ? *Cookie : 0;
+    Record->Data = Data;
+    KeMemoryBarrier();
+    *(volatile ULONG *)&Record->Sequence = Sequence;
+}
+
+VOID
+Pl2303RecordIrp(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PIRP Irp)
+{
+    PIO_STACK_LOCATION IoStack = IoGetCurrentIrpStackLocation(Irp);
+    ULONG Cookie = 0;
+    ULONG Size;
+    ULONG Data;
+
+    switch (IoStack->MajorFunction)
+    {
+        case IRP_MJ_READ:
+            Size = IoStack->Parameters.Read.Length;
+            Data = IoStack->MinorFunction;
+            break;
+        case IRP_MJ_WRITE:
+            Size = IoStack->Parameters.Write.Length;
+            Data = IoStack->MinorFunction;
+            break;
+        case IRP_MJ_DEVICE_CONTROL:
+        case IRP_MJ_INTERNAL_DEVICE_CONTROL:
+            Size = IoStack->Parameters.DeviceIoControl.InputBufferLength;
+            Data = IoStack->Parameters.DeviceIoControl.IoControlCode;
+            break;
+        default:
+            Size = 0;
+            Data = IoStack->MinorFunction;
+    }
+
+    Pl2303Record(DeviceObject->DeviceExtension,
+                 PL2303_RECORD_IRP,
+                 IoStack->MajorFunction,
+                 Size,
+                 0,
+                 &Cookie,
+                 Data);
+}
+
+VOID
+Pl2303CopyRecords(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _Out_writes_(PL2303_RECORDER_SIZE) PPL2303_RECORD Records)
+{
+    PPL2303_RECORD Record;
+    ULONG Sequence;
+    ULONG i;
+
+    for (i = 0; i < PL2303_RECORDER_SIZE; i++)
+    {
+        Record = &DeviceExtension->Recorder[i];
+        Sequence = *(volatile ULONG *)&Record->Sequence;
+        KeMemoryBarrier();
+        Records[i] = *Record;
+        KeMemoryBarrier();
+        if (*(volatile ULONG *)&Record->Sequence != Sequence)
+            Sequence = 0;
+        Records[i].Sequence = Sequence;
+    }
+}
@@ -0,0 +1,199 @@
+/*
+ * PL2303 Driver performance statistics routines
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "pl2303.h"
+
+/*
+ * The counters reported by IOCTL_SERIAL_GET_STATS are updated from the USB
+ * completion routines, which may run on any processor at the same time. Each
+ * processor therefore counts into its own cache-line sized slot, and a query
+ * adds up all slots. The slot is picked by the current processor number, so
+ * a thread that is preempted and resumed elsewhere may still share a slot
+ * with another processor; the updates are interlocked for that reason, but
+ * they stay local to one cache line in the common case.
+ */
+
+C_ASSERT(sizeof(CPU_STATISTICS) == PL2303_CACHE_LINE_SIZE);
+
+/*
+ * Latencies are measured in performance counter ticks shifted right by
+ * Pl2303LatencyShift, which keeps the unit at or above 1/2^24 seconds. That
+ * way the 32-bit time stamps kept with each request only wrap around after
+ * several minutes, whatever the counter frequency.
+ */
+#define PL2303_MAX_LATENCY_FREQUENCY    (1 << 24)
+
+ULONG Pl2303LatencyShift;
+static LONGLONG Pl2303LatencyFrequency;
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(INIT, Pl2303InitializeLatency)
+#pragma alloc_text(PAGE, Pl2303AllocateStatistics)
+#pragma alloc_text(PAGE, Pl2303FreeStatistics)
+#endif /* defined ALLOC_PRAGMA */
+
+NTSTATUS
+Pl2303AllocateStatistics(
+    _In_ PDEVICE_EXTENSION DeviceExtension)
+{
+    ULONG Count;
+    SIZE_T Size;
+    PVOID Buffer;
+
+    PAGED_CODE();
+    NT_ASSERT(DeviceExtension->Statistics == NULL);
+
+    Count = (ULONG)KeNumberProcessors;
+    if (Count == 0)
+        Count = 1;
+    Size = Count * sizeof(CPU_STATISTICS) + PL2303_CACHE_LINE_SIZE - 1;
+
+    Buffer = ExAllocatePoolWithTag(NonPagedPool, Size, PL2303_STATS_TAG);
+    if (!Buffer)
+    {
+        Pl2303Error(         "%s. Allocating statistics for %lu processors failed\n",
+                    __FUNCTION__, Count);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(Buffer, Size);
+
+    DeviceExtension->StatisticsBuffer = Buffer;
+    DeviceExtension->StatisticsCount = Count;
+    DeviceExtension->Statistics = (PCPU_STATISTICS)(((ULONG_PTR)Buffer + PL2303_CACHE_LINE_SIZE - 1) &
+                                                    ~(ULONG_PTR)(PL2303_CACHE_LINE_SIZE - 1));
+
+    Pl2303Debug(         "%s. Statistics=%p, Count=%lu\n",
+                __FUNCTION__, DeviceExtension->Statistics, Count);
+    return STATUS_SUCCESS;
+}
+
+VOID
+Pl2303FreeStatistics(
+    _In_ PDEVICE_EXTENSION DeviceExtension)
+{
+    PAGED_CODE();
+
+    if (DeviceExtension->StatisticsBuffer)
+        ExFreePoolWithTag(DeviceExtension->StatisticsBuffer, PL2303_STATS_TAG);
+    DeviceExtension->StatisticsBuffer = NULL;
+    DeviceExtension->Statistics = NULL;
+    DeviceExtension->StatisticsCount = 0;
+}
+
+VOID
+Pl2303QueryStatistics(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _Out_ PSERIALPERF_STATS Stats)
+{
+    PSERIALPERF_STATS CpuStats;
+    ULONG i;
+
+    RtlZeroMemory(Stats, sizeof(*Stats));
+    if (!DeviceExtension->Statistics)
+        return;
+
+    for (i = 0; i < DeviceExtension->StatisticsCount; i++)
+    {
+        CpuStats = &DeviceExtension->Statistics[i].Stats;
+        Stats->ReceivedCount += *(volatile ULONG *)&CpuStats->ReceivedCount;
+        Stats->TransmittedCount += *(volatile ULONG *)&CpuStats->TransmittedCount;
+        Stats->FrameErrorCount += *(volatile ULONG *)&CpuStats->FrameErrorCount;
+        Stats->SerialOverrunErrorCount += *(volatile ULONG *)&CpuStats->SerialOverrunErrorCount;
+        Stats->BufferOverrunErrorCount += *(volatile ULONG *)&CpuStats->BufferOverrunErrorCount;
+        Stats->ParityErrorCount += *(volatile ULONG *)&CpuStats->ParityErrorCount;
+    }
+}
+
+/*
+ * Counts that are added concurrently with a clear either land before it and
+ * are lost, or after it and are kept, just like with a single counter.
+ */
+VOID
+Pl2303ClearStatistics(
+    _In_ PDEVICE_EXTENSION DeviceExtension)
+{
+    PSERIALPERF_STATS CpuStats;
+    ULONG i;
+
+    if (!DeviceExtension->Statistics)
+        return;
+
+    for (i = 0; i < DeviceExtension->StatisticsCount; i++)
+    {
+        CpuStats = &DeviceExtension->Statistics[i].Stats;
+        (VOID)InterlockedExchange((volatile LONG *)&CpuStats->ReceivedCount, 0);
+        (VOID)InterlockedExchange((volatile LONG *)&CpuStats->TransmittedCount, 0);
+        (VOID)InterlockedExchange((volatile LONG *)&CpuStats->FrameErrorCount, 0);
+        (VOID)InterlockedExchange((volatile LONG *)&CpuStats->SerialOverrunErrorCount, 0);
+        (VOID)InterlockedExchange((volatile LONG *)&CpuStats->BufferOverrunErrorCount, 0);
+        (VOID)InterlockedExchange((volatile LONG *)&CpuStats->ParityErrorCount, 0);
+    }
+}
+
+VOID
+Pl2303InitializeLatency(VOID)
+{
+    LARGE_INTEGER Frequency;
+
+    PAGED_CODE();
+
+    (VOID)KeQueryPerformanceCounter(&Frequency);
+    while ((Frequency.QuadPart >> Pl2303LatencyShift) > PL2303_MAX_LATENCY_FREQUENCY)
+        Pl2303LatencyShift++;
+    Pl2303LatencyFrequency = Frequency.QuadPart >> Pl2303LatencyShift;
+
+    Pl2303Debug(         "%s. Frequency=%I64d, Shift=%lu\n",
+                __FUNCTION__, Frequency.QuadPart, Pl2303LatencyShift);
+}
+
+VOID
+Pl2303QueryLatency(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _Out_ PPL2303_LATENCY_STATISTICS Latency)
+{
+    ULONG i;
+    ULONG j;
+
+    Latency->Frequency = Pl2303LatencyFrequency;
+    for (i = 0; i < PL2303_LATENCY_CLASSES; i++)
+    {
+        for (j = 0; j < PL2303_LATENCY_BUCKETS; j++)
+        {
+            Latency->Request[i].Buckets[j] = *(volatile ULONG *)&DeviceExtension->RequestLatency[i].Buckets[j];
+            Latency->Urb[i].Buckets[j] = *(volatile ULONG *)&DeviceExtension->UrbLatency[i].Buckets[j];
+        }
+    }
+}
+
+VOID
+Pl2303ResetLatency(
+    _In_ PDEVICE_EXTENSION DeviceExtension)
+{
+    ULONG i;
+    ULONG j;
+
+    for (i = 0; i < PL2303_LATENCY_CLASSES; i++)
+    {
+        for (j = 0; j < PL2303_LATENCY_BUCKETS; j++)
+        {
+            (VOID)InterlockedExchange((volatile LONG *)&DeviceExtension->RequestLatency[i].Buckets[j], 0);
+            (VOID)InterlockedExchange((volatile LONG *)&DeviceExtension->UrbLatency[i].Buckets[j], 0);
+        }
+    }
+}
@@ -0,0 +1,183 @@
+/*
+ * PL2303 Driver modem and line status handling
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#define PL2303_TRACE_COMPONENT PL2303_TRACE_EVENT
+#include "pl2303.h"
+
+/*
+ * The state byte of each interrupt-IN notification is translated into the
+ * UART-style modem status register layout used by IOCTL_SERIAL_GET_MODEMSTATUS.
+ * Delta bits accumulate until the status is next queried; receiver errors
+ * accumulate until they are cleared. Both are also passed to the receive
+ * path, for LSRMST insertion and error character replacement.
+ */
+
+#define SERIAL_MSR_LINES (SERIAL_MSR_CTS | SERIAL_MSR_DSR | SERIAL_MSR_RI | SERIAL_MSR_DCD)
+#define SERIAL_MSR_DELTAS (SERIAL_MSR_DCTS | SERIAL_MSR_DDSR | SERIAL_MSR_TERI | SERIAL_MSR_DDCD)
+
+VOID
+Pl2303UpdateStatus(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ UCHAR State)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    ULONG Lines = 0;
+    ULONG Errors = 0;
+    UCHAR LineStatus = 0;
+    ULONG Changed;
+    ULONG Deltas = 0;
+    ULONG Events;
+    KIRQL OldIrql;
+
+    if (State & PL2303_STATE_CTS)
+        Lines |= SERIAL_MSR_CTS;
+    if (State & PL2303_STATE_DSR)
+        Lines |= SERIAL_MSR_DSR;
+    if (State & PL2303_STATE_RING)
+        Lines |= SERIAL_MSR_RI;
+    if (State & PL2303_STATE_DCD)
+        Lines |= SERIAL_MSR_DCD;
+
+    if (State & PL2303_STATE_BREAK)
+    {
+        Errors |= SERIAL_ERROR_BREAK;
+        LineStatus |= SERIAL_LSR_BI;
+    }
+    if (State & PL2303_STATE_FRAMING_ERROR)
+    {
+        Errors |= SERIAL_ERROR_FRAMING;
+        LineStatus |= SERIAL_LSR_FE;
+    }
+    if (State & PL2303_STATE_PARITY_ERROR)
+    {
+        Errors |= SERIAL_ERROR_PARITY;
+        LineStatus |= SERIAL_LSR_PE;
+    }
+    if (State & PL2303_STATE_OVERRUN_ERROR)
+    {
+        Errors |= SERIAL_ERROR_OVERRUN;
+        LineStatus |= SERIAL_LSR_OE;
+    }
+
+    KeAcquireSpinLock(&DeviceExtension->StatusSpinLock, &OldIrql);
+    Changed = (DeviceExtension->ModemStatus ^ Lines) & SERIAL_MSR_LINES;
+    if (Changed & SERIAL_MSR_CTS)
+        Deltas |= SERIAL_MSR_DCTS;
+    if (Changed & SERIAL_MSR_DSR)
+        Deltas |= SERIAL_MSR_DDSR;
+    /* Like a 16550, report only the trailing edge of a ring indication */
+    if ((Changed & SERIAL_MSR_RI) && !(Lines & SERIAL_MSR_RI))
+        Deltas |= SERIAL_MSR_TERI;
+    if (Changed & SERIAL_MSR_DCD)
+        Deltas |= SERIAL_MSR_DDCD;
+    DeviceExtension->ModemStatus = (DeviceExtension->ModemStatus & SERIAL_MSR_DELTAS) |
+                                   Deltas |
+                                   Lines;
+    DeviceExtension->Errors |= Errors;
+    KeReleaseSpinLock(&DeviceExtension->StatusSpinLock, OldIrql);
+
+    if (!Changed && !Errors)
+        return;
+
+    Pl2303Record(DeviceExtension,
+                 PL2303_RECORD_STATUS,
+                 State,
+                 0,
+                 Deltas | Lines,
+                 NULL,
+                 Errors);
+
+    if (Errors & SERIAL_ERROR_FRAMING)
+        PL2303_COUNT(DeviceExtension, FrameErrorCount, 1);
+    if (Errors & SERIAL_ERROR_PARITY)
+        PL2303_COUNT(DeviceExtension, ParityErrorCount, 1);
+    if (Errors & SERIAL_ERROR_OVERRUN)
+        PL2303_COUNT(DeviceExtension, SerialOverrunErrorCount, 1);
+
+    Pl2303Debug(         "%s. State=0x%02x, Changed=0x%lx, Errors=0x%lx\n",
+                __FUNCTION__, State,       Changed,       Errors);
+
+    if (Errors)
+        Pl2303ReceiveLineStatus(DeviceObject, LineStatus);
+    if (Changed)
+        Pl2303ReceiveModemStatus(DeviceObject, (UCHAR)(Deltas | Lines));
+
+    Events = 0;
+    if (Changed & SERIAL_MSR_CTS)
+        Events |= SERIAL_EV_CTS;
+    if (Changed & SERIAL_MSR_DSR)
+        Events |= SERIAL_EV_DSR;
+    if (Changed & SERIAL_MSR_DCD)
+        Events |= SERIAL_EV_RLSD;
+    if (Deltas & SERIAL_MSR_TERI)
+        Events |= SERIAL_EV_RING;
+    if (Errors & SERIAL_ERROR_BREAK)
+        Events |= SERIAL_EV_BREAK;
+    if (Errors & (SERIAL_ERROR_FRAMING | SERIAL_ERROR_PARITY | SERIAL_ERROR_OVERRUN))
+        Events |= SERIAL_EV_ERR;
+    if (Events)
+        Pl2303SignalEvents(DeviceObject, Events);
+}
+
+ULONG
+Pl2303QueryModemStatus(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    ULONG ModemStatus;
+    KIRQL OldIrql;
+
+    KeAcquireSpinLock(&DeviceExtension->StatusSpinLock, &OldIrql);
+    ModemStatus = DeviceExtension->ModemStatus;
+    DeviceExtension->ModemStatus &= ~SERIAL_MSR_DELTAS;
+    KeReleaseSpinLock(&DeviceExtension->StatusSpinLock, OldIrql);
+
+    return ModemStatus;
+}
+
+VOID
+Pl2303AddErrors(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ ULONG Errors)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    KIRQL OldIrql;
+
+    KeAcquireSpinLock(&DeviceExtension->StatusSpinLock, &OldIrql);
+    DeviceExtension->Errors |= Errors;
+    KeReleaseSpinLock(&DeviceExtension->StatusSpinLock, OldIrql);
+}
+
+ULONG
+Pl2303QueryErrors(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ BOOLEAN Clear)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    ULONG Errors;
+    KIRQL OldIrql;
+
+    KeAcquireSpinLock(&DeviceExtension->StatusSpinLock, &OldIrql);
+    Errors = DeviceExtension->Errors;
+    if (Clear)
+        DeviceExtension->Errors = 0;
+    KeReleaseSpinLock(&DeviceExtension->StatusSpinLock, OldIrql);
+
+    return Errors;
+}
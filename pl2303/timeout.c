@@ -0,0 +1,146 @@
+/*
+ * PL2303 Driver request timeout handling
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "pl2303.h"
+
+/*
+ * All timed requests of a port share one timer, which is always armed for
+ * the earliest pending deadline. When it fires, the read and write paths
+ * complete whatever has expired and re-arm the timer for their next
+ * deadline. Times are kept in milliseconds of interrupt time; deadlines are
+ * compared using signed differences, so they may wrap.
+ */
+
+_Function_class_(KDEFERRED_ROUTINE)
+static KDEFERRED_ROUTINE Pl2303TimeoutDpc;
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, Pl2303InitializeTimeouts)
+#pragma alloc_text(PAGE, Pl2303StopTimeouts)
+#endif /* defined ALLOC_PRAGMA */
+
+VOID
+Pl2303InitializeTimeouts(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+
+    PAGED_CODE();
+
+    KeInitializeSpinLock(&DeviceExtension->TimeoutSpinLock);
+    KeInitializeTimer(&DeviceExtension->TimeoutTimer);
+    KeInitializeDpc(&DeviceExtension->TimeoutDpc,
+                    Pl2303TimeoutDpc,
+                    DeviceObject);
+    DeviceExtension->TimeoutTimerArmed = FALSE;
+}
+
+VOID
+Pl2303StopTimeouts(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    KIRQL OldIrql;
+
+    PAGED_CODE();
+
+    KeAcquireSpinLock(&DeviceExtension->TimeoutSpinLock, &OldIrql);
+    (VOID)KeCancelTimer(&DeviceExtension->TimeoutTimer);
+    DeviceExtension->TimeoutTimerArmed = FALSE;
+    KeReleaseSpinLock(&DeviceExtension->TimeoutSpinLock, OldIrql);
+
+    KeFlushQueuedDpcs();
+}
+
+ULONG
+Pl2303QueryTime(VOID)
+{
+    return (ULONG)(KeQueryInterruptTime() / 10000);
+}
+
+ULONG
+Pl2303TimeoutToDeadline(
+    _In_ ULONGLONG Timeout)
+{
+    if (Timeout > MAXLONG)
+        Timeout = MAXLONG;
+    return Pl2303QueryTime() + (ULONG)Timeout;
+}
+
+BOOLEAN
+Pl2303DeadlineExpired(
+    _In_ ULONG Deadline,
+    _In_ ULONG Now)
+{
+    return (LONG)(Deadline - Now) <= 0;
+}
+
+VOID
+Pl2303ArmTimeoutTimer(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ ULONG Deadline)
+{
+    KIRQL OldIrql;
+    LARGE_INTEGER DueTime;
+    LONG Remaining;
+
+    KeAcquireSpinLock(&DeviceExtension->TimeoutSpinLock, &OldIrql);
+    if (!DeviceExtension->TimeoutTimerArmed ||
+        (LONG)(Deadline - DeviceExtension->TimeoutTimerDeadline) < 0)
+    {
+        Remaining = (LONG)(Deadline - Pl2303QueryTime());
+        if (Remaining < 1)
+            Remaining = 1;
+        DueTime.QuadPart = -10000LL * Remaining;
+        DeviceExtension->TimeoutTimerArmed = TRUE;
+        DeviceExtension->TimeoutTimerDeadline = Deadline;
+        (VOID)KeSetTimer(&DeviceExtension->TimeoutTimer,
+                         DueTime,
+                         &DeviceExtension->TimeoutDpc);
+    }
+    KeReleaseSpinLock(&DeviceExtension->TimeoutSpinLock, OldIrql);
+}
+
+_Function_class_(KDEFERRED_ROUTINE)
+static
+VOID
+NTAPI
+Pl2303TimeoutDpc(
+    _In_ PKDPC Dpc,
+    _In_opt_ PVOID DeferredContext,
+    _In_opt_ PVOID SystemArgument1,
+    _In_opt_ PVOID SystemArgument2)
+{
+    PDEVICE_OBJECT DeviceObject = DeferredContext;
+    PDEVICE_EXTENSION DeviceExtension;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+    NT_ASSERT(DeviceObject);
+
+    DeviceExtension = DeviceObject->DeviceExtension;
+
+    KeAcquireSpinLockAtDpcLevel(&DeviceExtension->TimeoutSpinLock);
+    DeviceExtension->TimeoutTimerArmed = FALSE;
+    KeReleaseSpinLockFromDpcLevel(&DeviceExtension->TimeoutSpinLock);
+
+    Pl2303ReadTimeout(DeviceObject);
+    Pl2303WriteTimeout(DeviceObject);
+}
@@ -1,1050 +1,2740 @@
-/*
- * PL2303 Driver USB protocol routines
- * Copyright (C) 2012-2019  Thomas Faber
- *
- * This library is free software; you can redistribute it and/or
- * modify it under the terms of the GNU Lesser General Public
- * License as published by the Free Software Foundation; either
- * version 2.1 of the License, or (at your option) any later version.
- *
- * This library is distributed in the hope that it will be useful,
- * but WITHOUT ANY WARRANTY; without even the implied warranty of
- * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
- * Lesser General Public License for more details.
- *
- * You should have received a copy of the GNU Lesser General Public
- * License along with this library; if not, write to the Free Software
- * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
- */
-
-#include "pl2303.h"
-
-static NTSTATUS Pl2303UsbSubmitUrb(_In_ PDEVICE_OBJECT DeviceObject, _In_ PURB Urb);
-static NTSTATUS Pl2303UsbGetDescriptor(_In_ PDEVICE_OBJECT DeviceObject,
-                                       _In_ UCHAR DescriptorType,
-                                       _Out_ PVOID *Buffer,
-                                       _Inout_ PULONG BufferLength);
-static NTSTATUS Pl2303UsbVendorRead(_In_ PDEVICE_OBJECT DeviceObject,
-                                    _Out_ UCHAR *Buffer,
-                                    _In_ USHORT Value,
-                                    _In_ USHORT Index);
-static NTSTATUS Pl2303UsbVendorWrite(_In_ PDEVICE_OBJECT DeviceObject,
-                                     _In_ USHORT Value,
-                                     _In_ USHORT Index);
-static NTSTATUS Pl2303UsbConfigureDevice(_In_ PDEVICE_OBJECT DeviceObject,
-                                         _In_ PUSB_CONFIGURATION_DESCRIPTOR ConfigDescriptor,
-                                         _In_ PUSB_INTERFACE_DESCRIPTOR InterfaceDescriptor);
-static NTSTATUS Pl2303UsbUnconfigureDevice(_In_ PDEVICE_OBJECT DeviceObject);
-_Function_class_(IO_COMPLETION_ROUTINE)
-static NTSTATUS NTAPI Pl2303UsbReadCompletion(_In_ PDEVICE_OBJECT DeviceObject,
-                                              _In_ PIRP Irp,
-                                              _In_reads_(sizeof(URB)) PVOID Context);
-_Function_class_(IO_COMPLETION_ROUTINE)
-static NTSTATUS NTAPI Pl2303UsbWriteCompletion(_In_ PDEVICE_OBJECT DeviceObject,
-                                               _In_ PIRP Irp,
-                                               _In_reads_(sizeof(URB)) PVOID Context);
-
-#ifdef ALLOC_PRAGMA
-#pragma alloc_text(PAGE, Pl2303UsbSubmitUrb)
-#pragma alloc_text(PAGE, Pl2303UsbGetDescriptor)
-#pragma alloc_text(PAGE, Pl2303UsbVendorRead)
-#pragma alloc_text(PAGE, Pl2303UsbVendorWrite)
-#pragma alloc_text(PAGE, Pl2303UsbConfigureDevice)
-#pragma alloc_text(PAGE, Pl2303UsbUnconfigureDevice)
-#pragma alloc_text(PAGE, Pl2303UsbStart)
-#pragma alloc_text(PAGE, Pl2303UsbStop)
-#pragma alloc_text(PAGE, Pl2303UsbSetLine)
-#pragma alloc_text(PAGE, Pl2303UsbRead)
-#pragma alloc_text(PAGE, Pl2303UsbWrite)
-#endif /* defined ALLOC_PRAGMA */
-
-static
-NTSTATUS
-Pl2303UsbSubmitUrb(
-    _In_ PDEVICE_OBJECT DeviceObject,
-    _In_ PURB Urb)
-{
-    NTSTATUS Status;
-    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
-    PIRP Irp;
-    IO_STATUS_BLOCK IoStatus;
-    PIO_STACK_LOCATION IoStack;
-    KEVENT Event;
-
-    PAGED_CODE();
-
-    Pl2303Debug(         "%s. DeviceObject=%p, Urb=%p\n",
-                __FUNCTION__, DeviceObject,    Urb);
-
-    KeInitializeEvent(&Event, NotificationEvent, FALSE);
-
-    Irp = IoBuildDeviceIoControlRequest(IOCTL_INTERNAL_USB_SUBMIT_URB,
-                                        DeviceExtension->LowerDevice,
-                                        NULL,
-                                        0,
-                                        NULL,
-                                        0,
-                                        TRUE,
-                                        &Event,
-                                        &IoStatus);
-    if (!Irp)
-    {
-        Pl2303Error(         "%s. Allocating IRP for submitting URB failed\n",
-                    __FUNCTION__);
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
-
-    IoStack = IoGetNextIrpStackLocation(Irp);
-    NT_ASSERT(IoStack->MajorFunction == IRP_MJ_INTERNAL_DEVICE_CONTROL);
-    IoStack->Parameters.Others.Argument1 = Urb;
-
-    Status = IoCallDriver(DeviceExtension->LowerDevice, Irp);
-
-    if (Status == STATUS_PENDING)
-    {
-        Status = KeWaitForSingleObject(&Event, Executive, KernelMode, FALSE, NULL);
-        NT_ASSERT(Status == STATUS_SUCCESS);
-        Status = IoStatus.Status;
-    }
-
-    return Status;
-}
-
-static
-NTSTATUS
-Pl2303UsbGetDescriptor(
-    _In_ PDEVICE_OBJECT DeviceObject,
-    _In_ UCHAR DescriptorType,
-    _Out_ PVOID *Buffer,
-    _Inout_ PULONG BufferLength)
-{
-    NTSTATUS Status;
-    PURB Urb;
-
-    PAGED_CODE();
-    NT_ASSERT(Buffer);
-    NT_ASSERT(BufferLength);
-    NT_ASSERT(*BufferLength > 0);
-
-    Pl2303Debug(         "%s. DeviceObject=%p, DescriptorType=%u, Buffer=%p, BufferLength=%p\n",
-                __FUNCTION__, DeviceObject,    DescriptorType,    Buffer,    BufferLength);
-
-    Urb = ExAllocatePoolWithTag(NonPagedPool,
-                                sizeof(struct _URB_CONTROL_DESCRIPTOR_REQUEST),
-                                PL2303_URB_TAG);
-    if (!Urb)
-    {
-        Pl2303Error(         "%s. Allocating URB failed\n",
-                    __FUNCTION__);
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
-
-    *Buffer = ExAllocatePoolWithTag(NonPagedPool, *BufferLength, PL2303_TAG);
-    if (!*Buffer)
-    {
-        Pl2303Error(         "%s. Allocating URB transfer buffer of size %lu failed\n",
-                    __FUNCTION__, *BufferLength);
-        ExFreePoolWithTag(Urb, PL2303_URB_TAG);
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
-
-    UsbBuildGetDescriptorRequest(Urb,
-                                 sizeof(struct _URB_CONTROL_DESCRIPTOR_REQUEST),
-                                 DescriptorType,
-                                 0,
-                                 0,
-                                 *Buffer,
-                                 NULL,
-                                 *BufferLength,
-                                 NULL);
-
-    Status = Pl2303UsbSubmitUrb(DeviceObject, Urb);
-    if (!NT_SUCCESS(Status))
-    {
-        Pl2303Error(         "%s. Pl2303UsbSubmitUrb failed with %08lx, %08lx\n",
-                    __FUNCTION__, Status, Urb->UrbHeader.Status);
-        ExFreePoolWithTag(*Buffer, PL2303_TAG);
-        *Buffer = NULL;
-        ExFreePoolWithTag(Urb, PL2303_URB_TAG);
-        *BufferLength = 0;
-        return Status;
-    }
-    if (!USBD_SUCCESS(Urb->UrbHeader.Status))
-    {
-        Pl2303Error(         "%s. Urb failed with %08lx\n",
-                    __FUNCTION__, Urb->UrbHeader.Status);
-        Status = Urb->UrbHeader.Status;
-        ExFreePoolWithTag(*Buffer, PL2303_TAG);
-        *Buffer = NULL;
-        ExFreePoolWithTag(Urb, PL2303_URB_TAG);
-        *BufferLength = 0;
-        return Status;
-    }
-
-    *BufferLength = Urb->UrbControlDescriptorRequest.TransferBufferLength;
-    ExFreePoolWithTag(Urb, PL2303_URB_TAG);
-
-    return Status;
-}
-
-static
-NTSTATUS
-Pl2303UsbVendorRead(
-    _In_ PDEVICE_OBJECT DeviceObject,
-    _Out_ UCHAR *Buffer,
-    _In_ USHORT Value,
-    _In_ USHORT Index)
-{
-    NTSTATUS Status;
-    PURB Urb;
-
-    PAGED_CODE();
-
-    Pl2303Debug(         "%s. DeviceObject=%p, Buffer=%p, Value=0x%x, Index=0x%x\n",
-                __FUNCTION__, DeviceObject,    Buffer,    Value,      Index);
-
-    Urb = ExAllocatePoolWithTag(NonPagedPool,
-                                sizeof(struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST),
-                                PL2303_URB_TAG);
-    if (!Urb)
-    {
-        Pl2303Error(         "%s. Allocating URB failed\n",
-                    __FUNCTION__);
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
-
-    UsbBuildVendorRequest(Urb,
-                          URB_FUNCTION_VENDOR_DEVICE,
-                          sizeof(struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST),
-                          USBD_TRANSFER_DIRECTION_IN | USBD_SHORT_TRANSFER_OK,
-                          0,
-                          PL2303_VENDOR_READ_REQUEST,
-                          Value,
-                          Index,
-                          Buffer,
-                          NULL,
-                          1,
-                          NULL);
-
-    Status = Pl2303UsbSubmitUrb(DeviceObject, Urb);
-    if (!NT_SUCCESS(Status))
-    {
-        Pl2303Error(         "%s. Pl2303UsbSubmitUrb failed with %08lx, %08lx\n",
-                    __FUNCTION__, Status, Urb->UrbHeader.Status);
-        ExFreePoolWithTag(Urb, PL2303_URB_TAG);
-        return Status;
-    }
-    if (!USBD_SUCCESS(Urb->UrbHeader.Status))
-    {
-        Pl2303Error(         "%s. URB failed with %08lx\n",
-                    __FUNCTION__, Urb->UrbHeader.Status);
-        Status = Urb->UrbHeader.Status;
-        ExFreePoolWithTag(Urb, PL2303_URB_TAG);
-        return Status;
-    }
-
-    Pl2303Debug(         "%s. Vendor Read 0x%x/0x%x returned length %lu: 0x%x\n",
-                __FUNCTION__, Value,
-                              Index,
-                              Urb->UrbControlVendorClassRequest.TransferBufferLength,
-                              Buffer[0]);
-
-    ExFreePoolWithTag(Urb, PL2303_URB_TAG);
-
-    return Status;
-}
-
-static
-NTSTATUS
-Pl2303UsbVendorWrite(
-    _In_ PDEVICE_OBJECT DeviceObject,
-    _In_ USHORT Value,
-    _In_ USHORT Index)
-{
-    NTSTATUS Status;
-    PURB Urb;
-
-    PAGED_CODE();
-
-    Pl2303Debug(         "%s. DeviceObject=%p, Value=0x%x, Index=0x%x\n",
-                __FUNCTION__, DeviceObject,    Value,      Index);
-
-    Urb = ExAllocatePoolWithTag(NonPagedPool,
-                                sizeof(struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST),
-                                PL2303_URB_TAG);
-    if (!Urb)
-    {
-        Pl2303Error(         "%s. Allocating URB failed\n",
-                    __FUNCTION__);
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
-
-    UsbBuildVendorRequest(Urb,
-                          URB_FUNCTION_VENDOR_DEVICE,
-                          sizeof(struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST),
-                          USBD_TRANSFER_DIRECTION_OUT,
-                          0,
-                          PL2303_VENDOR_WRITE_REQUEST,
-                          Value,
-                          Index,
-                          NULL,
-                          NULL,
-                          0,
-                          NULL);
-
-    Status = Pl2303UsbSubmitUrb(DeviceObject, Urb);
-    if (!NT_SUCCESS(Status))
-    {
-        Pl2303Error(         "%s. Pl2303UsbSubmitUrb failed with %08lx, %08lx\n",
-                    __FUNCTION__, Status, Urb->UrbHeader.Status);
-        ExFreePoolWithTag(Urb, PL2303_URB_TAG);
-        return Status;
-    }
-    if (!USBD_SUCCESS(Urb->UrbHeader.Status))
-    {
-        Pl2303Error(         "%s. URB failed with %08lx\n",
-                    __FUNCTION__, Urb->UrbHeader.Status);
-        Status = Urb->UrbHeader.Status;
-        ExFreePoolWithTag(Urb, PL2303_URB_TAG);
-        return Status;
-    }
-    ExFreePoolWithTag(Urb, PL2303_URB_TAG);
-
-    return Status;
-}
-
-static
-NTSTATUS
-Pl2303UsbConfigureDevice(
-    _In_ PDEVICE_OBJECT DeviceObject,
-    _In_ PUSB_CONFIGURATION_DESCRIPTOR ConfigDescriptor,
-    _In_ PUSB_INTERFACE_DESCRIPTOR InterfaceDescriptor)
-{
-    NTSTATUS Status;
-    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
-    PURB Urb;
-    USBD_INTERFACE_LIST_ENTRY InterfaceList[2];
-    ULONG i;
-    PUSBD_PIPE_INFORMATION PipeInfo;
-
-    PAGED_CODE();
-
-    Pl2303Debug(         "%s. DeviceObject=%p, ConfigDescriptor=%p, InterfaceDescriptor=%p\n",
-                __FUNCTION__, DeviceObject,    ConfigDescriptor,    InterfaceDescriptor);
-
-    RtlZeroMemory(InterfaceList, sizeof(InterfaceList));
-    InterfaceList[0].InterfaceDescriptor = InterfaceDescriptor;
-
-    Urb = USBD_CreateConfigurationRequestEx(ConfigDescriptor,
-                                            InterfaceList);
-    if (!Urb)
-    {
-        Pl2303Error(         "%s. USBD_CreateConfigurationRequestEx failed\n",
-                    __FUNCTION__);
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
-
-    Status = Pl2303UsbSubmitUrb(DeviceObject, Urb);
-    if (!NT_SUCCESS(Status))
-    {
-        Pl2303Error(         "%s. Pl2303UsbSubmitUrb failed with %08lx, %08lx\n",
-                    __FUNCTION__, Status, Urb->UrbHeader.Status);
-        ExFreePoolWithTag(Urb, 0);
-        return Status;
-    }
-
-    Pl2303Debug(         "%s. NumberOfPipes=%u\n",
-                    __FUNCTION__, Urb->UrbSelectConfiguration.Interface.NumberOfPipes);
-
-    for (i = 0; i < Urb->UrbSelectConfiguration.Interface.NumberOfPipes; i++)
-    {
-        PipeInfo = &Urb->UrbSelectConfiguration.Interface.Pipes[i];
-
-        if (PipeInfo->PipeType == UsbdPipeTypeBulk &&
-            USB_ENDPOINT_DIRECTION_IN(PipeInfo->EndpointAddress) &&
-            !DeviceExtension->BulkInPipe)
-        {
-            DeviceExtension->BulkInPipe = PipeInfo->PipeHandle;
-        }
-
-        if (PipeInfo->PipeType == UsbdPipeTypeBulk &&
-            USB_ENDPOINT_DIRECTION_OUT(PipeInfo->EndpointAddress) &&
-            !DeviceExtension->BulkOutPipe)
-        {
-            DeviceExtension->BulkOutPipe = PipeInfo->PipeHandle;
-        }
-
-        if (PipeInfo->PipeType == UsbdPipeTypeInterrupt &&
-            USB_ENDPOINT_DIRECTION_IN(PipeInfo->EndpointAddress) &&
-            !DeviceExtension->InterruptInPipe)
-        {
-            DeviceExtension->InterruptInPipe = PipeInfo->PipeHandle;
-        }
-    }
-
-    if (!DeviceExtension->BulkInPipe ||
-        !DeviceExtension->BulkOutPipe ||
-        !DeviceExtension->InterruptInPipe)
-    {
-        Pl2303Error(         "%s. Invalid endpoint combination\n",
-                    __FUNCTION__, Status);
-        NT_ASSERT(DeviceExtension->BulkInPipe &&
-                  DeviceExtension->BulkOutPipe &&
-                  DeviceExtension-> InterruptInPipe);
-        ExFreePoolWithTag(Urb, 0);
-        return STATUS_DEVICE_CONFIGURATION_ERROR;
-    }
-
-    ExFreePoolWithTag(Urb, 0);
-
-    return Status;
-}
-
-static
-NTSTATUS
-Pl2303UsbUnconfigureDevice(
-    _In_ PDEVICE_OBJECT DeviceObject)
-{
-    NTSTATUS Status;
-    PURB Urb;
-
-    PAGED_CODE();
-
-    Pl2303Debug(         "%s. DeviceObject=%p\n",
-                __FUNCTION__, DeviceObject);
-
-    Urb = ExAllocatePoolWithTag(NonPagedPool,
-                                sizeof(struct _URB_SELECT_CONFIGURATION),
-                                PL2303_URB_TAG);
-    if (!Urb)
-    {
-        Pl2303Error(         "%s. Allocating URB failed\n",
-                    __FUNCTION__);
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
-
-    UsbBuildSelectConfigurationRequest(Urb,
-                                       sizeof(struct _URB_SELECT_CONFIGURATION),
-                                       NULL);
-
-    Status = Pl2303UsbSubmitUrb(DeviceObject, Urb);
-    if (!NT_SUCCESS(Status))
-    {
-        Pl2303Error(         "%s. Pl2303UsbSubmitUrb failed with %08lx, %08lx\n",
-                    __FUNCTION__, Status, Urb->UrbHeader.Status);
-        ExFreePoolWithTag(Urb, PL2303_URB_TAG);
-        return Status;
-    }
-    ExFreePoolWithTag(Urb, PL2303_URB_TAG);
-
-    return Status;
-}
-
-NTSTATUS
-Pl2303UsbStart(
-    _In_ PDEVICE_OBJECT DeviceObject)
-{
-    NTSTATUS Status;
-    PVOID Descriptor;
-    ULONG DescriptorLength;
-    PUSB_DEVICE_DESCRIPTOR DeviceDescriptor;
-    PUSB_CONFIGURATION_DESCRIPTOR ConfigDescriptor;
-    PUSB_INTERFACE_DESCRIPTOR InterfaceDescriptor;
-    UCHAR Buffer[1];
-    PDEVICE_EXTENSION DeviceExtension;
-
-    PAGED_CODE();
-
-    Pl2303Debug(         "%s. DeviceObject=%p\n",
-                __FUNCTION__, DeviceObject);
-
-    DeviceExtension = DeviceObject->DeviceExtension;
-
-    DescriptorLength = sizeof(USB_DEVICE_DESCRIPTOR);
-    Status = Pl2303UsbGetDescriptor(DeviceObject,
-                                    USB_DEVICE_DESCRIPTOR_TYPE,
-                                    &Descriptor,
-                                    &DescriptorLength);
-    if (!NT_SUCCESS(Status))
-    {
-        Pl2303Error(         "%s. Pl2303UsbGetDescriptor failed with %08lx\n",
-                    __FUNCTION__, Status);
-        return Status;
-    }
-    NT_ASSERT(DescriptorLength == sizeof(USB_DEVICE_DESCRIPTOR));
-
-    DeviceDescriptor = Descriptor;
-
-    Pl2303Debug(         "%s. Device descriptor: "
-                                               "bLength=%u, "
-                                               "bDescriptorType=%u, "
-                                               "bcdUSB=0x%x, "
-                                               "bDeviceClass=0x%x, "
-                                               "bDeviceSubClass=0x%x, "
-                                               "bDeviceProtocol=0x%x, "
-                                               "bMaxPacketSize0=%u, "
-                                               "idVendor=0x%x, "
-                                               "idProduct=0x%x, "
-                                               "bcdDevice=0x%x, "
-                                               "iManufacturer=%u, "
-                                               "iProduct=%u, "
-                                               "iSerialNumber=%u, "
-                                               "bNumConfigurations=%u\n",
-                __FUNCTION__, DeviceDescriptor->bLength,
-                              DeviceDescriptor->bDescriptorType,
-                              DeviceDescriptor->bcdUSB,
-                              DeviceDescriptor->bDeviceClass,
-                              DeviceDescriptor->bDeviceSubClass,
-                              DeviceDescriptor->bDeviceProtocol,
-                              DeviceDescriptor->bMaxPacketSize0,
-                              DeviceDescriptor->idVendor,
-                              DeviceDescriptor->idProduct,
-                              DeviceDescriptor->bcdDevice,
-                              DeviceDescriptor->iManufacturer,
-                              DeviceDescriptor->iProduct,
-                              DeviceDescriptor->iSerialNumber,
-                              DeviceDescriptor->bNumConfigurations);
-
-    /* We only support PL2303 HX right now */
-    NT_ASSERT(DeviceDescriptor->bDeviceClass != USB_DEVICE_CLASS_COMMUNICATIONS);
-    NT_ASSERT(DeviceDescriptor->bMaxPacketSize0 == 64);
-
-    ExFreePoolWithTag(Descriptor, PL2303_TAG);
-
-    DescriptorLength = sizeof(USB_CONFIGURATION_DESCRIPTOR);
-    Status = Pl2303UsbGetDescriptor(DeviceObject,
-                                    USB_CONFIGURATION_DESCRIPTOR_TYPE,
-                                    &Descriptor,
-                                    &DescriptorLength);
-    if (!NT_SUCCESS(Status))
-    {
-        Pl2303Error(         "%s. Pl2303UsbGetDescriptor failed with %08lx\n",
-                    __FUNCTION__, Status);
-        return Status;
-    }
-    NT_ASSERT(DescriptorLength == sizeof(USB_CONFIGURATION_DESCRIPTOR));
-
-    ConfigDescriptor = Descriptor;
-    NT_ASSERT(ConfigDescriptor->wTotalLength != 0);
-    DescriptorLength = ConfigDescriptor->wTotalLength;
-    ExFreePoolWithTag(Descriptor, PL2303_TAG);
-    Status = Pl2303UsbGetDescriptor(DeviceObject,
-                                    USB_CONFIGURATION_DESCRIPTOR_TYPE,
-                                    &Descriptor,
-                                    &DescriptorLength);
-    if (!NT_SUCCESS(Status))
-    {
-        Pl2303Error(         "%s. Pl2303UsbGetDescriptor failed with %08lx\n",
-                    __FUNCTION__, Status);
-        return Status;
-    }
-
-    ConfigDescriptor = Descriptor;
-    NT_ASSERT(DescriptorLength == ConfigDescriptor->wTotalLength);
-
-    Pl2303Debug(         "%s. Config descriptor: "
-                                               "bLength=%u, "
-                                               "bDescriptorType=%u, "
-                                               "wTotalLength=%u, "
-                                               "bNumInterfaces=%u, "
-                                               "bConfigurationValue=%u, "
-                                               "iConfiguration=%u, "
-                                               "bmAttributes=0x%x, "
-                                               "MaxPower=%u\n",
-                __FUNCTION__, ConfigDescriptor->bLength,
-                              ConfigDescriptor->bDescriptorType,
-                              ConfigDescriptor->wTotalLength,
-                              ConfigDescriptor->bNumInterfaces,
-                              ConfigDescriptor->bConfigurationValue,
-                              ConfigDescriptor->iConfiguration,
-                              ConfigDescriptor->bmAttributes,
-                              ConfigDescriptor->MaxPower);
-
-    if (ConfigDescriptor->bNumInterfaces != 1)
-    {
-        Pl2303Error(         "%s. Configuration contains %u interfaces, expected one\n",
-                    __FUNCTION__, ConfigDescriptor->bNumInterfaces);
-        ExFreePoolWithTag(Descriptor, PL2303_TAG);
-        return STATUS_DEVICE_CONFIGURATION_ERROR;
-    }
-
-    InterfaceDescriptor = USBD_ParseConfigurationDescriptorEx(ConfigDescriptor,
-                                                              ConfigDescriptor,
-                                                              -1,
-                                                              -1,
-                                                              -1,
-                                                              -1,
-                                                              -1);
-    if (!InterfaceDescriptor)
-    {
-        Pl2303Error(         "%s. USBD_ParseConfigurationDescriptorEx failed\n",
-                    __FUNCTION__);
-        ExFreePoolWithTag(Descriptor, PL2303_TAG);
-        return STATUS_DEVICE_CONFIGURATION_ERROR;
-    }
-
-    Pl2303Debug(         "%s. Interface descriptor: "
-                                                  "bLength=%u, "
-                                                  "bDescriptorType=%u, "
-                                                  "bInterfaceNumber=%u, "
-                                                  "bAlternateSetting=%u, "
-                                                  "bNumEndpoints=%u, "
-                                                  "bInterfaceClass=0x%x, "
-                                                  "bInterfaceSubClass=0x%x, "
-                                                  "bInterfaceProtocol=0x%x, "
-                                                  "iInterface=%u\n",
-                __FUNCTION__, InterfaceDescriptor->bLength,
-                              InterfaceDescriptor->bDescriptorType,
-                              InterfaceDescriptor->bInterfaceNumber,
-                              InterfaceDescriptor->bAlternateSetting,
-                              InterfaceDescriptor->bNumEndpoints,
-                              InterfaceDescriptor->bInterfaceClass,
-                              InterfaceDescriptor->bInterfaceSubClass,
-                              InterfaceDescriptor->bInterfaceProtocol,
-                              InterfaceDescriptor->iInterface);
-
-    Status = Pl2303UsbConfigureDevice(DeviceObject, ConfigDescriptor, InterfaceDescriptor);
-    if (!NT_SUCCESS(Status))
-    {
-        Pl2303Error(         "%s. Pl2303UsbConfigureDevice failed with %08lx\n",
-                    __FUNCTION__, Status);
-        ExFreePoolWithTag(Descriptor, PL2303_TAG);
-        return Status;
-    }
-    ExFreePoolWithTag(Descriptor, PL2303_TAG);
-
-    /* TODO: Buffer should probably be nonpaged */
-    Status = Pl2303UsbVendorRead(DeviceObject, Buffer, 0x8484, 0); // expect: 2
-    if (!NT_SUCCESS(Status))
-    {
-        Pl2303Error(         "%s. Pl2303UsbVendorRead[1] failed with %08lx\n",
-                    __FUNCTION__, Status);
-        return Status;
-    }
-    Status = Pl2303UsbVendorWrite(DeviceObject, 0x0404, 0);
-    if (!NT_SUCCESS(Status))
-    {
-        Pl2303Error(         "%s. Pl2303UsbVendorWrite[2] failed with %08lx\n",
-                    __FUNCTION__, Status);
-        return Status;
-    }
-    Status = Pl2303UsbVendorRead(DeviceObject, Buffer, 0x8484, 0); // expect: 2
-    if (!NT_SUCCESS(Status))
-    {
-        Pl2303Error(         "%s. Pl2303UsbVendorRead[3] failed with %08lx\n",
-                    __FUNCTION__, Status);
-        return Status;
-    }
-    Status = Pl2303UsbVendorRead(DeviceObject, Buffer, 0x8383, 0); // expect: 0
-    if (!NT_SUCCESS(Status))
-    {
-        Pl2303Error(         "%s. Pl2303UsbVendorRead[4] failed with %08lx\n",
-                    __FUNCTION__, Status);
-        return Status;
-    }
-    Status = Pl2303UsbVendorRead(DeviceObject, Buffer, 0x8484, 0); // expect: 2
-    if (!NT_SUCCESS(Status))
-    {
-        Pl2303Error(         "%s. Pl2303UsbVendorRead[5] failed with %08lx\n",
-                    __FUNCTION__, Status);
-        return Status;
-    }
-    Status = Pl2303UsbVendorWrite(DeviceObject, 0x0404, 0);
-    if (!NT_SUCCESS(Status))
-    {
-        Pl2303Error(         "%s. Pl2303UsbVendorWrite[6] failed with %08lx\n",
-                    __FUNCTION__, Status);
-        return Status;
-    }
-    Status = Pl2303UsbVendorRead(DeviceObject, Buffer, 0x8484, 0); // expect: 2
-    if (!NT_SUCCESS(Status))
-    {
-        Pl2303Error(         "%s. Pl2303UsbVendorRead[7] failed with %08lx\n",
-                    __FUNCTION__, Status);
-        return Status;
-    }
-    Status = Pl2303UsbVendorRead(DeviceObject, Buffer, 0x8383, 0); // expect: 0
-    if (!NT_SUCCESS(Status))
-    {
-        Pl2303Error(         "%s. Pl2303UsbVendorRead[8] failed with %08lx\n",
-                    __FUNCTION__, Status);
-        return Status;
-    }
-    Status = Pl2303UsbVendorWrite(DeviceObject, 0, 1);
-    if (!NT_SUCCESS(Status))
-    {
-        Pl2303Error(         "%s. Pl2303UsbVendorWrite[9] failed with %08lx\n",
-                    __FUNCTION__, Status);
-        return Status;
-    }
-    Status = Pl2303UsbVendorWrite(DeviceObject, 1, 0);
-    if (!NT_SUCCESS(Status))
-    {
-        Pl2303Error(         "%s. Pl2303UsbVendorWrite[10] failed with %08lx\n",
-                    __FUNCTION__, Status);
-        return Status;
-    }
-    Status = Pl2303UsbVendorWrite(DeviceObject, 2, 0x44); // non-HX has 0x24 here instead of 0x44
-    if (!NT_SUCCESS(Status))
-    {
-        Pl2303Error(         "%s. Pl2303UsbVendorWrite[11] failed with %08lx\n",
-                    __FUNCTION__, Status);
-        return Status;
-    }
-
-    return Status;
-}
-
-NTSTATUS
-Pl2303UsbStop(
-    _In_ PDEVICE_OBJECT DeviceObject)
-{
-    NTSTATUS Status;
-
-    PAGED_CODE();
-
-    Pl2303Debug(         "%s. DeviceObject=%p\n",
-                __FUNCTION__, DeviceObject);
-
-    Status = Pl2303UsbUnconfigureDevice(DeviceObject);
-
-    return Status;
-}
-
-NTSTATUS
-Pl2303UsbSetLine(
-    _In_ PDEVICE_OBJECT DeviceObject,
-    _In_ ULONG BaudRate,
-    _In_ UCHAR StopBits,
-    _In_ UCHAR Parity,
-    _In_ UCHAR DataBits)
-{
-    NTSTATUS Status;
-    struct _LINE
-    {
-        ULONG BaudRate;
-        UCHAR StopBits;
-        UCHAR Parity;
-        UCHAR DataBits;
-    } Line;
-    PURB Urb;
-
-    PAGED_CODE();
-
-    Pl2303Debug(         "%s. DeviceObject=%p, BaudRate=%lu, StopBits=%u, Parity=%u, "
-                             "DataBits=%u\n",
-                __FUNCTION__, DeviceObject,    BaudRate,     StopBits,    Parity,
-                              DataBits);
-
-    Urb = ExAllocatePoolWithTag(NonPagedPool,
-                                sizeof(struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST),
-                                PL2303_URB_TAG);
-    if (!Urb)
-    {
-        Pl2303Error(         "%s. Allocating URB failed\n",
-                    __FUNCTION__);
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
-
-    UsbBuildVendorRequest(Urb,
-                          URB_FUNCTION_CLASS_DEVICE,
-                          sizeof(struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST),
-                          USBD_TRANSFER_DIRECTION_OUT,
-                          0,
-                          PL2303_SET_LINE_REQUEST,
-                          0,
-                          0,
-                          &Line,
-                          NULL,
-                          sizeof(Line),
-                          NULL);
-
-    /* TODO: this should probably be nonpaged */
-    Line.BaudRate = BaudRate;
-    Line.StopBits = StopBits;
-    Line.Parity = Parity;
-    Line.DataBits = DataBits;
-
-    Status = Pl2303UsbSubmitUrb(DeviceObject, Urb);
-    if (!NT_SUCCESS(Status))
-    {
-        Pl2303Error(         "%s. Pl2303UsbSubmitUrb failed with %08lx, %08lx\n",
-                    __FUNCTION__, Status, Urb->UrbHeader.Status);
-        ExFreePoolWithTag(Urb, PL2303_URB_TAG);
-        return Status;
-    }
-    if (!USBD_SUCCESS(Urb->UrbHeader.Status))
-    {
-        Pl2303Error(         "%s. URB failed with %08lx\n",
-                    __FUNCTION__, Urb->UrbHeader.Status);
-        Status = Urb->UrbHeader.Status;
-        ExFreePoolWithTag(Urb, PL2303_URB_TAG);
-        return Status;
-    }
-    ExFreePoolWithTag(Urb, PL2303_URB_TAG);
-
-    return Status;
-}
-
-NTSTATUS
-Pl2303UsbSetControlLines(
-    _In_ PDEVICE_OBJECT DeviceObject,
-    _In_ USHORT DtrRts)
-{
-    NTSTATUS Status;
-    PURB Urb;
-
-    PAGED_CODE();
-
-    Pl2303Debug(         "%s. DeviceObject=%p, DtrRts=%u\n",
-                __FUNCTION__, DeviceObject,    DtrRts);
-
-    Urb = ExAllocatePoolWithTag(NonPagedPool,
-                                sizeof(struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST),
-                                PL2303_URB_TAG);
-    if (!Urb)
-    {
-        Pl2303Error(         "%s. Allocating URB failed\n",
-                    __FUNCTION__);
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
-
-    NT_ASSERT((DtrRts & ~(SERIAL_DTR_STATE | SERIAL_RTS_STATE)) == 0);
-    UsbBuildVendorRequest(Urb,
-                          URB_FUNCTION_CLASS_DEVICE,
-                          sizeof(struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST),
-                          USBD_TRANSFER_DIRECTION_OUT,
-                          0,
-                          PL2303_SET_CONTROL_REQUEST,
-                          DtrRts,
-                          0,
-                          NULL,
-                          NULL,
-                          0,
-                          NULL);
-
-    Status = Pl2303UsbSubmitUrb(DeviceObject, Urb);
-    if (!NT_SUCCESS(Status))
-    {
-        Pl2303Error(         "%s. Pl2303UsbSubmitUrb failed with %08lx, %08lx\n",
-                    __FUNCTION__, Status, Urb->UrbHeader.Status);
-        ExFreePoolWithTag(Urb, PL2303_URB_TAG);
-        return Status;
-    }
-    if (!USBD_SUCCESS(Urb->UrbHeader.Status))
-    {
-        Pl2303Error(         "%s. URB failed with %08lx\n",
-                    __FUNCTION__, Urb->UrbHeader.Status);
-        Status = Urb->UrbHeader.Status;
-        ExFreePoolWithTag(Urb, PL2303_URB_TAG);
-        return Status;
-    }
-    ExFreePoolWithTag(Urb, PL2303_URB_TAG);
-
-    return Status;
-}
-
-_Function_class_(IO_COMPLETION_ROUTINE)
-static
-NTSTATUS
-NTAPI
-Pl2303UsbReadCompletion(
-    _In_ PDEVICE_OBJECT DeviceObject,
-    _In_ PIRP Irp,
-    _In_reads_(sizeof(URB)) PVOID Context)
-{
-    PURB Urb = Context;
-
-    NT_ASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
-
-    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p, Context=%p\n",
-                __FUNCTION__, DeviceObject,    Irp,    Context);
-
-    if (NT_SUCCESS(Irp->IoStatus.Status))
-    {
-        if (USBD_SUCCESS(Urb->UrbHeader.Status))
-            Irp->IoStatus.Information = Urb->UrbBulkOrInterruptTransfer.TransferBufferLength;
-        else
-            Pl2303Warn(         "%s. URB failed with %08lx\n",
-                       __FUNCTION__, Urb->UrbHeader.Status);
-    }
-    else
-    {
-        Pl2303Warn(         "%s. IRP failed with %08lx\n",
-                   __FUNCTION__, Irp->IoStatus.Status);
-    }
-
-    ExFreePoolWithTag(Urb, PL2303_URB_TAG);
-
-    return STATUS_CONTINUE_COMPLETION;
-}
-
-NTSTATUS
-Pl2303UsbRead(
-    _In_ PDEVICE_OBJECT DeviceObject,
-    _In_ PIRP Irp)
-{
-    NTSTATUS Status;
-    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
-    PURB Urb;
-    PIO_STACK_LOCATION IoStack;
-
-    PAGED_CODE();
-
-    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
-                __FUNCTION__, DeviceObject,    Irp);
-
-    Urb = ExAllocatePoolWithTag(NonPagedPool,
-                                sizeof(struct _URB_BULK_OR_INTERRUPT_TRANSFER),
-                                PL2303_URB_TAG);
-    if (!Urb)
-    {
-        Pl2303Error(         "%s. Allocating URB failed\n",
-                    __FUNCTION__);
-        Status = STATUS_INSUFFICIENT_RESOURCES;
-        Irp->IoStatus.Information = 0;
-        Irp->IoStatus.Status = Status;
-        IoCompleteRequest(Irp, IO_NO_INCREMENT);
-        return Status;
-    }
-
-    IoStack = IoGetCurrentIrpStackLocation(Irp);
-    UsbBuildInterruptOrBulkTransferRequest(Urb,
-                                           sizeof(struct _URB_BULK_OR_INTERRUPT_TRANSFER),
-                                           DeviceExtension->BulkInPipe,
-                                           Irp->AssociatedIrp.SystemBuffer,
-                                           NULL,
-                                           IoStack->Parameters.Read.Length,
-                                           USBD_TRANSFER_DIRECTION_IN | USBD_SHORT_TRANSFER_OK,
-                                           NULL);
-
-    IoStack = IoGetNextIrpStackLocation(Irp);
-    IoStack->MajorFunction = IRP_MJ_INTERNAL_DEVICE_CONTROL;
-    IoStack->Parameters.DeviceIoControl.IoControlCode = IOCTL_INTERNAL_USB_SUBMIT_URB;
-    IoStack->Parameters.Others.Argument1 = Urb;
-
-    Status = IoSetCompletionRoutineEx(DeviceObject,
-                                      Irp,
-                                      Pl2303UsbReadCompletion,
-                                      Urb,
-                                      TRUE,
-                                      TRUE,
-                                      TRUE);
-    if (!NT_SUCCESS(Status))
-    {
-        Pl2303Error(         "%s. IoSetCompletionRoutineEx failed with %08lx\n",
-                    __FUNCTION__, Status);
-        Irp->IoStatus.Information = 0;
-        Irp->IoStatus.Status = Status;
-        IoCompleteRequest(Irp, IO_NO_INCREMENT);
-        return Status;
-    }
-
-    IoMarkIrpPending(Irp);
-    (VOID)IoCallDriver(DeviceExtension->LowerDevice, Irp);
-
-    return STATUS_PENDING;
-}
-
-
-_Function_class_(IO_COMPLETION_ROUTINE)
-static
-NTSTATUS
-NTAPI
-Pl2303UsbWriteCompletion(
-    _In_ PDEVICE_OBJECT DeviceObject,
-    _In_ PIRP Irp,
-    _In_reads_(sizeof(URB)) PVOID Context)
-{
-    PURB Urb = Context;
-
-    NT_ASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
-
-    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p, Context=%p\n",
-                __FUNCTION__, DeviceObject,    Irp,    Context);
-
-    if (NT_SUCCESS(Irp->IoStatus.Status))
-    {
-        if (USBD_SUCCESS(Urb->UrbHeader.Status))
-            Irp->IoStatus.Information = Urb->UrbBulkOrInterruptTransfer.TransferBufferLength;
-        else
-            Pl2303Warn(         "%s. URB failed with %08lx\n",
-                       __FUNCTION__, Urb->UrbHeader.Status);
-    }
-    else
-    {
-        Pl2303Warn(         "%s. IRP failed with %08lx\n",
-                   __FUNCTION__, Irp->IoStatus.Status);
-    }
-
-    ExFreePoolWithTag(Urb, PL2303_URB_TAG);
-
-    return STATUS_CONTINUE_COMPLETION;
-}
-
-NTSTATUS
-Pl2303UsbWrite(
-    _In_ PDEVICE_OBJECT DeviceObject,
-    _In_ PIRP Irp)
-{
-    NTSTATUS Status;
-    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
-    PURB Urb;
-    PIO_STACK_LOCATION IoStack;
-
-    PAGED_CODE();
-
-    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
-                __FUNCTION__, DeviceObject,    Irp);
-
-    Urb = ExAllocatePoolWithTag(NonPagedPool,
-                                sizeof(struct _URB_BULK_OR_INTERRUPT_TRANSFER),
-                                PL2303_URB_TAG);
-    if (!Urb)
-    {
-        Pl2303Error(         "%s. Allocating URB failed\n",
-                    __FUNCTION__);
-        Status = STATUS_INSUFFICIENT_RESOURCES;
-        Irp->IoStatus.Information = 0;
-        Irp->IoStatus.Status = Status;
-        IoCompleteRequest(Irp, IO_NO_INCREMENT);
-        return Status;
-    }
-
-    IoStack = IoGetCurrentIrpStackLocation(Irp);
-    UsbBuildInterruptOrBulkTransferRequest(Urb,
-                                           sizeof(struct _URB_BULK_OR_INTERRUPT_TRANSFER),
-                                           DeviceExtension->BulkOutPipe,
-                                           Irp->AssociatedIrp.SystemBuffer,
-                                           NULL,
-                                           IoStack->Parameters.Write.Length,
-                                           USBD_TRANSFER_DIRECTION_OUT,
-                                           NULL);
-
-    IoStack = IoGetNextIrpStackLocation(Irp);
-    IoStack->MajorFunction = IRP_MJ_INTERNAL_DEVICE_CONTROL;
-    IoStack->Parameters.DeviceIoControl.IoControlCode = IOCTL_INTERNAL_USB_SUBMIT_URB;
-    IoStack->Parameters.Others.Argument1 = Urb;
-
-    Status = IoSetCompletionRoutineEx(DeviceObject,
-                                      Irp,
-                                      Pl2303UsbWriteCompletion,
-                                      Urb,
-                                      TRUE,
-                                      TRUE,
-                                      TRUE);
-    if (!NT_SUCCESS(Status))
-    {
-        Pl2303Error(         "%s. IoSetCompletionRoutineEx failed with %08lx\n",
-                    __FUNCTION__, Status);
-        Irp->IoStatus.Information = 0;
-        Irp->IoStatus.Status = Status;
-        IoCompleteRequest(Irp, IO_NO_INCREMENT);
-        return Status;
-    }
-
-    IoMarkIrpPending(Irp);
-    (VOID)IoCallDriver(DeviceExtension->LowerDevice, Irp);
-
-    return STATUS_PENDING;
+/*
+ * PL2303 Driver USB protocol routines
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#define PL2303_TRACE_COMPONENT PL2303_TRACE_USB
+#include "pl2303.h"
+
+static NTSTATUS Pl2303UsbMapUsbdStatus(_In_ USBD_STATUS UsbdStatus);
+static NTSTATUS Pl2303UsbInitializeControlRequest(_In_ PDEVICE_OBJECT DeviceObject,
+                                                  _Out_ PCONTROL_REQUEST Request);
+static PCONTROL_REQUEST Pl2303UsbAllocateControlRequest(_In_ PDEVICE_OBJECT DeviceObject);
+static VOID Pl2303UsbFreeControlRequest(_In_ PDEVICE_OBJECT DeviceObject,
+                                        _In_ PCONTROL_REQUEST Request);
+static VOID Pl2303UsbStartControlRequests(_In_ PDEVICE_OBJECT DeviceObject);
+_Function_class_(IO_COMPLETION_ROUTINE)
+static NTSTATUS NTAPI Pl2303UsbControlCompletion(_In_ PDEVICE_OBJECT DeviceObject,
+                                                 _In_ PIRP Irp,
+                                                 _In_reads_(sizeof(CONTROL_REQUEST)) PVOID Context);
+static VOID Pl2303UsbQueueControlRequest(_In_ PCONTROL_REQUEST Request,
+                                         _In_ PURB Urb,
+                                         _In_opt_ PIRP CallerIrp);
+static NTSTATUS Pl2303UsbSubmitUrb(_In_ PDEVICE_OBJECT DeviceObject,
+                                   _In_ PCONTROL_REQUEST Request,
+                                   _In_ PURB Urb);
+static NTSTATUS Pl2303UsbWaitControlRequest(_In_ PCONTROL_REQUEST Request);
+static ULONG Pl2303UsbGetUrbTransferLength(_In_ PURB Urb);
+static NTSTATUS Pl2303UsbGetDescriptor(_In_ PDEVICE_OBJECT DeviceObject,
+                                       _In_ UCHAR DescriptorType,
+                                       _Out_ PVOID *Buffer,
+                                       _Inout_ PULONG BufferLength);
+static VOID Pl2303UsbBuildVendorRead(_In_ PCONTROL_REQUEST Request,
+                                     _In_ UCHAR VendorRequest,
+                                     _In_ USHORT Value,
+                                     _In_ USHORT Index);
+static VOID Pl2303UsbBuildVendorWrite(_In_ PCONTROL_REQUEST Request,
+                                      _In_ UCHAR VendorRequest,
+                                      _In_ USHORT Value,
+                                      _In_ USHORT Index);
+static NTSTATUS Pl2303UsbVendorRead(_In_ PDEVICE_OBJECT DeviceObject,
+                                    _In_ USHORT Value,
+                                    _In_ USHORT Index,
+                                    _Out_ PUCHAR Data);
+static NTSTATUS Pl2303UsbVendorWrite(_In_ PDEVICE_OBJECT DeviceObject,
+                                     _In_ USHORT Value,
+                                     _In_ USHORT Index);
+static NTSTATUS Pl2303UsbProbeHxStatus(_In_ PDEVICE_OBJECT DeviceObject,
+                                       _Out_ PBOOLEAN HxStatus);
+static NTSTATUS Pl2303UsbVendorSequence(_In_ PDEVICE_OBJECT DeviceObject,
+                                        _In_reads_(Count) const PL2303_VENDOR_STEP *Steps,
+                                        _In_ ULONG Count);
+static VOID Pl2303UsbBuildSetLine(_In_ PCONTROL_REQUEST Request,
+                                  _In_ const LINE_CODING *LineCoding);
+static VOID Pl2303UsbBuildSetControlLines(_In_ PCONTROL_REQUEST Request);
+static NTSTATUS Pl2303UsbGetFlowControlValue(_In_ PDEVICE_OBJECT DeviceObject,
+                                            _In_ BOOLEAN Enable,
+                                            _Out_ PUSHORT Value);
+static NTSTATUS Pl2303UsbConfigureDevice(_In_ PDEVICE_OBJECT DeviceObject,
+                                         _In_ PUSB_CONFIGURATION_DESCRIPTOR ConfigDescriptor,
+                                         _In_ PUSB_INTERFACE_DESCRIPTOR InterfaceDescriptor);
+static NTSTATUS Pl2303UsbUnconfigureDevice(_In_ PDEVICE_OBJECT DeviceObject);
+static VOID Pl2303UsbPrepareTransfer(_In_ PPIPE_TRANSFER Transfer,
+                                     _In_ USBD_PIPE_HANDLE PipeHandle,
+                                     _In_ PVOID Buffer,
+                                     _In_ ULONG Length,
+                                     _In_ ULONG TransferFlags,
+                                     _In_ PIO_COMPLETION_ROUTINE CompletionRoutine);
+static NTSTATUS Pl2303UsbResetPipe(_In_ PDEVICE_OBJECT DeviceObject,
+                                   _In_ USBD_PIPE_HANDLE PipeHandle);
+static BOOLEAN Pl2303UsbIsTransferRecoverable(_In_ PPIPE_TRANSFER Transfer);
+static VOID Pl2303UsbScheduleReset(_In_ PKTIMER Timer,
+                                   _In_ PKDPC Dpc,
+                                   _In_ ULONG Count);
+static VOID Pl2303UsbReportPipeFailure(_In_ PDEVICE_OBJECT DeviceObject);
+static VOID Pl2303UsbPrepareReadTransfer(_In_ PPIPE_TRANSFER Transfer);
+_Function_class_(KDEFERRED_ROUTINE)
+static KDEFERRED_ROUTINE Pl2303UsbReadResetDpc;
+_Function_class_(IO_WORKITEM_ROUTINE)
+static IO_WORKITEM_ROUTINE Pl2303UsbResetReadPipe;
+_Function_class_(IO_COMPLETION_ROUTINE)
+static NTSTATUS NTAPI Pl2303UsbReadCompletion(_In_ PDEVICE_OBJECT DeviceObject,
+                                              _In_ PIRP Irp,
+                                              _In_reads_(sizeof(PIPE_TRANSFER)) PVOID Context);
+static VOID Pl2303UsbPrepareStatusTransfer(_In_ PPIPE_TRANSFER Transfer);
+_Function_class_(KDEFERRED_ROUTINE)
+static KDEFERRED_ROUTINE Pl2303UsbStatusResetDpc;
+_Function_class_(IO_WORKITEM_ROUTINE)
+static IO_WORKITEM_ROUTINE Pl2303UsbResetStatusPipe;
+_Function_class_(IO_COMPLETION_ROUTINE)
+static NTSTATUS NTAPI Pl2303UsbStatusCompletion(_In_ PDEVICE_OBJECT DeviceObject,
+                                                _In_ PIRP Irp,
+                                                _In_reads_(sizeof(PIPE_TRANSFER)) PVOID Context);
+_Function_class_(IO_COMPLETION_ROUTINE)
+static NTSTATUS NTAPI Pl2303UsbWriteCompletion(_In_ PDEVICE_OBJECT DeviceObject,
+                                               _In_ PIRP Irp,
+                                               _In_reads_(sizeof(PIPE_TRANSFER)) PVOID Context);
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, Pl2303UsbAllocateControlPool)
+#pragma alloc_text(PAGE, Pl2303UsbFreeControlPool)
+#pragma alloc_text(PAGE, Pl2303UsbSubmitUrb)
+#pragma alloc_text(PAGE, Pl2303UsbWaitControlRequest)
+#pragma alloc_text(PAGE, Pl2303UsbGetDescriptor)
+#pragma alloc_text(PAGE, Pl2303UsbVendorRead)
+#pragma alloc_text(PAGE, Pl2303UsbVendorWrite)
+#pragma alloc_text(PAGE, Pl2303UsbProbeHxStatus)
+#pragma alloc_text(PAGE, Pl2303UsbVendorSequence)
+#pragma alloc_text(PAGE, Pl2303UsbConfigureDevice)
+#pragma alloc_text(PAGE, Pl2303UsbUnconfigureDevice)
+#pragma alloc_text(PAGE, Pl2303UsbStart)
+#pragma alloc_text(PAGE, Pl2303UsbStop)
+#pragma alloc_text(PAGE, Pl2303UsbGetFlowControlValue)
+#pragma alloc_text(PAGE, Pl2303UsbSetFlowControl)
+#pragma alloc_text(PAGE, Pl2303UsbRestoreLine)
+#pragma alloc_text(PAGE, Pl2303UsbAllocateTransfers)
+#pragma alloc_text(PAGE, Pl2303UsbFreeTransfers)
+#pragma alloc_text(PAGE, Pl2303UsbResetPipe)
+#pragma alloc_text(PAGE, Pl2303UsbReportPipeFailure)
+#pragma alloc_text(PAGE, Pl2303UsbResetReadPipe)
+#pragma alloc_text(PAGE, Pl2303UsbResetStatusPipe)
+#pragma alloc_text(PAGE, Pl2303UsbStartReadPump)
+#pragma alloc_text(PAGE, Pl2303UsbStopReadPump)
+#pragma alloc_text(PAGE, Pl2303UsbStartStatusPump)
+#pragma alloc_text(PAGE, Pl2303UsbStopStatusPump)
+#endif /* defined ALLOC_PRAGMA */
+
+
+/*
+ * A URB can fail while its IRP succeeds. The USBD status is logged where the
+ * failure is found, but only an NTSTATUS may be passed on to callers.
+ */
+static
+NTSTATUS
+Pl2303UsbMapUsbdStatus(
+    _In_ USBD_STATUS UsbdStatus)
+{
+    NT_ASSERT(!USBD_SUCCESS(UsbdStatus));
+
+    switch (UsbdStatus)
+    {
+        case USBD_STATUS_DEVICE_GONE:
+            return STATUS_NO_SUCH_DEVICE;
+        case USBD_STATUS_CANCELED:
+            return STATUS_CANCELLED;
+        case USBD_STATUS_TIMEOUT:
+            return STATUS_IO_TIMEOUT;
+        default:
+            return STATUS_UNSUCCESSFUL;
+    }
+}
+
+/*
+ * Control transfers use requests from a small per-device pool, each with its
+ * own URB, IRP and data buffer. The pool is allocated when the device is
+ * first started; if it is exhausted, a request is allocated on demand and
+ * freed again when it is released. Requests may be allocated, sent and freed
+ * at up to DISPATCH_LEVEL.
+ */
+static
+NTSTATUS
+Pl2303UsbInitializeControlRequest(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Out_ PCONTROL_REQUEST Request)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+
+    RtlZeroMemory(Request, sizeof(*Request));
+    Request->DeviceObject = DeviceObject;
+    Request->Irp = IoAllocateIrp(DeviceExtension->LowerDevice->StackSize, FALSE);
+    if (!Request->Irp)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    KeInitializeEvent(&Request->Event, NotificationEvent, FALSE);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+Pl2303UsbAllocateControlPool(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PCONTROL_REQUEST Requests;
+    KIRQL OldIrql;
+    ULONG i;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p\n",
+                __FUNCTION__, DeviceObject);
+
+    NT_ASSERT(DeviceExtension->ControlRequests == NULL);
+
+    Requests = ExAllocatePoolWithTag(NonPagedPool,
+                                     PL2303_CONTROL_REQUEST_COUNT * sizeof(*Requests),
+                                     PL2303_URB_TAG);
+    if (!Requests)
+    {
+        Pl2303Error(         "%s. Allocating control requests failed\n",
+                    __FUNCTION__);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    for (i = 0; i < PL2303_CONTROL_REQUEST_COUNT; i++)
+    {
+        Status = Pl2303UsbInitializeControlRequest(DeviceObject, &Requests[i]);
+        if (!NT_SUCCESS(Status))
+        {
+            Pl2303Error(         "%s. Initializing control request %lu failed with %08lx\n",
+                        __FUNCTION__, i,                                    Status);
+            while (i--)
+                IoFreeIrp(Requests[i].Irp);
+            ExFreePoolWithTag(Requests, PL2303_URB_TAG);
+            return Status;
+        }
+        Requests[i].Preallocated = TRUE;
+    }
+
+    KeAcquireSpinLock(&DeviceExtension->ControlSpinLock, &OldIrql);
+    for (i = 0; i < PL2303_CONTROL_REQUEST_COUNT; i++)
+        InsertTailList(&DeviceExtension->ControlPool, &Requests[i].ListEntry);
+    DeviceExtension->ControlRequests = Requests;
+    DeviceExtension->ControlPoolStatistics.ControlRequests = PL2303_CONTROL_REQUEST_COUNT;
+    KeReleaseSpinLock(&DeviceExtension->ControlSpinLock, OldIrql);
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+Pl2303UsbFreeControlPool(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PCONTROL_REQUEST Requests;
+    KIRQL OldIrql;
+    ULONG i;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p\n",
+                __FUNCTION__, DeviceObject);
+
+    KeAcquireSpinLock(&DeviceExtension->ControlSpinLock, &OldIrql);
+    Requests = DeviceExtension->ControlRequests;
+    DeviceExtension->ControlRequests = NULL;
+    InitializeListHead(&DeviceExtension->ControlPool);
+    DeviceExtension->ControlPoolStatistics.ControlRequests = 0;
+    KeReleaseSpinLock(&DeviceExtension->ControlSpinLock, OldIrql);
+
+    if (!Requests)
+        return;
+
+    for (i = 0; i < PL2303_CONTROL_REQUEST_COUNT; i++)
+        IoFreeIrp(Requests[i].Irp);
+    ExFreePoolWithTag(Requests, PL2303_URB_TAG);
+}
+
+static
+PCONTROL_REQUEST
+Pl2303UsbAllocateControlRequest(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PPL2303_POOL_STATISTICS Statistics = &DeviceExtension->ControlPoolStatistics;
+    PCONTROL_REQUEST Request = NULL;
+    PLIST_ENTRY ListEntry;
+    KIRQL OldIrql;
+
+    KeAcquireSpinLock(&DeviceExtension->ControlSpinLock, &OldIrql);
+    if (!IsListEmpty(&DeviceExtension->ControlPool))
+    {
+        ListEntry = RemoveHeadList(&DeviceExtension->ControlPool);
+        Request = CONTAINING_RECORD(ListEntry, CONTROL_REQUEST, ListEntry);
+        Statistics->ControlRequestHits++;
+    }
+    else
+    {
+        Statistics->ControlRequestMisses++;
+    }
+    KeReleaseSpinLock(&DeviceExtension->ControlSpinLock, OldIrql);
+
+    if (Request)
+    {
+        Request->SetsLine = FALSE;
+        Request->SetsControlLines = FALSE;
+        Request->Detached = FALSE;
+        return Request;
+    }
+
+    Request = ExAllocatePoolWithTag(NonPagedPool, sizeof(*Request), PL2303_URB_TAG);
+    if (Request &&
+        !NT_SUCCESS(Pl2303UsbInitializeControlRequest(DeviceObject, Request)))
+    {
+        ExFreePoolWithTag(Request, PL2303_URB_TAG);
+        Request = NULL;
+    }
+
+    if (!Request)
+    {
+        Pl2303Error(         "%s. Allocating control request failed\n",
+                    __FUNCTION__);
+        KeAcquireSpinLock(&DeviceExtension->ControlSpinLock, &OldIrql);
+        Statistics->ControlRequestFailures++;
+        KeReleaseSpinLock(&DeviceExtension->ControlSpinLock, OldIrql);
+    }
+
+    return Request;
+}
+
+static
+VOID
+Pl2303UsbFreeControlRequest(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PCONTROL_REQUEST Request)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    KIRQL OldIrql;
+
+    if (!Request->Preallocated)
+    {
+        IoFreeIrp(Request->Irp);
+        ExFreePoolWithTag(Request, PL2303_URB_TAG);
+        return;
+    }
+
+    KeAcquireSpinLock(&DeviceExtension->ControlSpinLock, &OldIrql);
+    InsertHeadList(&DeviceExtension->ControlPool, &Request->ListEntry);
+    KeReleaseSpinLock(&DeviceExtension->ControlSpinLock, OldIrql);
+}
+
+/*
+ * Returns the length of the data stage of a URB sent on the control pipe,
+ * which lives in a different member for each kind of request.
+ */
+static
+ULONG
+Pl2303UsbGetUrbTransferLength(
+    _In_ PURB Urb)
+{
+    switch (Urb->UrbHeader.Function)
+    {
+        case URB_FUNCTION_VENDOR_DEVICE:
+        case URB_FUNCTION_CLASS_DEVICE:
+            return Urb->UrbControlVendorClassRequest.TransferBufferLength;
+        case URB_FUNCTION_GET_DESCRIPTOR_FROM_DEVICE:
+            return Urb->UrbControlDescriptorRequest.TransferBufferLength;
+        default:
+            /* Select configuration, pipe reset: no data stage */
+            return 0;
+    }
+}
+
+/*
+ * Control requests are sent one at a time, in the order they were queued.
+ * Whoever finds the pipe idle starts the next request; a request that
+ * completes synchronously inside IoCallDriver is followed up by the caller
+ * already in the loop instead of recursing from the completion routine.
+ */
+static
+VOID
+Pl2303UsbStartControlRequests(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PCONTROL_REQUEST Request;
+    PLIST_ENTRY ListEntry;
+    USHORT DtrRts;
+    KIRQL OldIrql;
+
+    KeAcquireSpinLock(&DeviceExtension->ControlSpinLock, &OldIrql);
+    if (!DeviceExtension->ControlStarting)
+    {
+        DeviceExtension->ControlStarting = TRUE;
+        while (!DeviceExtension->ControlBusy &&
+               !IsListEmpty(&DeviceExtension->ControlQueue))
+        {
+            ListEntry = RemoveHeadList(&DeviceExtension->ControlQueue);
+            Request = CONTAINING_RECORD(ListEntry, CONTROL_REQUEST, ListEntry);
+            Request->Started = TRUE;
+            DeviceExtension->ControlBusy = TRUE;
+            /* Send the control line state as of now rather than as of queueing */
+            if (Request->SetsControlLines)
+            {
+                DtrRts = DeviceExtension->DtrRts;
+                if (DeviceExtension->ReadRtsHandshake && DeviceExtension->ReadThrottled)
+                    DtrRts &= ~SERIAL_RTS_STATE;
+                Request->SubmitUrb->UrbControlVendorClassRequest.Value = DtrRts;
+            }
+            KeReleaseSpinLock(&DeviceExtension->ControlSpinLock, OldIrql);
+
+            Request->RecordCookie = 0;
+            Pl2303Record(DeviceExtension,
+                         PL2303_RECORD_URB_SUBMIT,
+                         PL2303_RECORD_PIPE_CONTROL,
+                         Pl2303UsbGetUrbTransferLength(Request->SubmitUrb),
+                         0,
+                         &Request->RecordCookie,
+                         Request->SubmitUrb->UrbHeader.Function);
+            Request->SubmitTime = Pl2303QueryLatencyTime();
+            (VOID)IoCallDriver(DeviceExtension->LowerDevice, Request->Irp);
+
+            KeAcquireSpinLock(&DeviceExtension->ControlSpinLock, &OldIrql);
+        }
+        DeviceExtension->ControlStarting = FALSE;
+    }
+    KeReleaseSpinLock(&DeviceExtension->ControlSpinLock, OldIrql);
+}
+
+_Function_class_(IO_COMPLETION_ROUTINE)
+static
+NTSTATUS
+NTAPI
+Pl2303UsbControlCompletion(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PIRP Irp,
+    _In_reads_(sizeof(CONTROL_REQUEST)) PVOID Context)
+{
+    PCONTROL_REQUEST Request = Context;
+    PDEVICE_EXTENSION DeviceExtension;
+    LIST_ENTRY CallerIrps;
+    PLIST_ENTRY ListEntry;
+    PIRP CallerIrp;
+    NTSTATUS Status;
+    KIRQL OldIrql;
+    ULONG LatencyClass;
+
+    NT_ASSERT(Request);
+    DeviceObject = Request->DeviceObject;
+    DeviceExtension = DeviceObject->DeviceExtension;
+
+    Pl2303Record(DeviceExtension,
+                 PL2303_RECORD_URB_COMPLETE,
+                 PL2303_RECORD_PIPE_CONTROL,
+                 Pl2303UsbGetUrbTransferLength(Request->SubmitUrb),
+                 Request->SubmitUrb->UrbHeader.Status,
+                 &Request->RecordCookie,
+                 Irp->IoStatus.Status);
+
+    if (Request->SetsLine)
+        LatencyClass = PL2303_LATENCY_SET_LINE;
+    else if (Request->SetsControlLines)
+        LatencyClass = PL2303_LATENCY_SET_CONTROL_LINES;
+    else
+        LatencyClass = PL2303_LATENCY_VENDOR;
+    Pl2303CountLatency(&DeviceExtension->UrbLatency[LatencyClass], Request->SubmitTime);
+    Pl2303CountLatency(&DeviceExtension->RequestLatency[LatencyClass], Request->QueueTime);
+
+    Status = Irp->IoStatus.Status;
+    Request->Status = Status;
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Warn(         "%s. Control request failed with %08lx, %08lx\n",
+                   __FUNCTION__, Status, Request->SubmitUrb->UrbHeader.Status);
+    }
+    else if (!USBD_SUCCESS(Request->SubmitUrb->UrbHeader.Status))
+    {
+        Pl2303Warn(         "%s. URB failed with %08lx\n",
+                   __FUNCTION__, Request->SubmitUrb->UrbHeader.Status);
+        Status = Pl2303UsbMapUsbdStatus(Request->SubmitUrb->UrbHeader.Status);
+    }
+
+    KeAcquireSpinLock(&DeviceExtension->ControlSpinLock, &OldIrql);
+    DeviceExtension->ControlBusy = FALSE;
+    if (Request->SetsLine)
+    {
+        if (DeviceExtension->LineRequest == Request)
+            DeviceExtension->LineRequest = NULL;
+        /* If this failed, we no longer know what the device is set to */
+        RtlCopyMemory(&DeviceExtension->LineCoding,
+                      Request->Buffer,
+                      sizeof(DeviceExtension->LineCoding));
+        DeviceExtension->LineCodingValid = NT_SUCCESS(Status);
+    }
+    if (DeviceExtension->ControlLinesRequest == Request)
+        DeviceExtension->ControlLinesRequest = NULL;
+    KeReleaseSpinLock(&DeviceExtension->ControlSpinLock, OldIrql);
+
+    /* Merging into this request ended with clearing LineRequest above */
+    if (Request->Detached)
+    {
+        Pl2303UsbFreeControlRequest(DeviceObject, Request);
+    }
+    else if (!IsListEmpty(&Request->CallerIrps))
+    {
+        InitializeListHead(&CallerIrps);
+        while (!IsListEmpty(&Request->CallerIrps))
+        {
+            ListEntry = RemoveHeadList(&Request->CallerIrps);
+            InsertTailList(&CallerIrps, ListEntry);
+        }
+        Pl2303UsbFreeControlRequest(DeviceObject, Request);
+
+        while (!IsListEmpty(&CallerIrps))
+        {
+            ListEntry = RemoveHeadList(&CallerIrps);
+            CallerIrp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+            CallerIrp->IoStatus.Status = Status;
+            CallerIrp->IoStatus.Information = 0;
+            IoCompleteRequest(CallerIrp, IO_NO_INCREMENT);
+        }
+    }
+    else
+    {
+        /* The waiter owns the request again once this is signaled */
+        KeSetEvent(&Request->Event, IO_NO_INCREMENT, FALSE);
+    }
+
+    Pl2303UsbStartControlRequests(DeviceObject);
+
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+/*
+ * Queues Urb to be sent with Request's IRP. If CallerIrp is given, it is
+ * marked pending and completed with the result, along with any IRPs merged
+ * into the request later. A detached request is freed once it completes;
+ * otherwise Request's event is signaled.
+ */
+static
+VOID
+Pl2303UsbQueueControlRequest(
+    _In_ PCONTROL_REQUEST Request,
+    _In_ PURB Urb,
+    _In_opt_ PIRP CallerIrp)
+{
+    PDEVICE_EXTENSION DeviceExtension = Request->DeviceObject->DeviceExtension;
+    PIRP Irp = Request->Irp;
+    PIO_STACK_LOCATION IoStack;
+    KIRQL OldIrql;
+
+    IoReuseIrp(Irp, STATUS_NOT_SUPPORTED);
+    KeClearEvent(&Request->Event);
+    Request->SubmitUrb = Urb;
+    Request->QueueTime = Pl2303QueryLatencyTime();
+    Request->Started = FALSE;
+    InitializeListHead(&Request->CallerIrps);
+
+    IoStack = IoGetNextIrpStackLocation(Irp);
+    IoStack->MajorFunction = IRP_MJ_INTERNAL_DEVICE_CONTROL;
+    IoStack->Parameters.DeviceIoControl.IoControlCode = IOCTL_INTERNAL_USB_SUBMIT_URB;
+    IoStack->Parameters.Others.Argument1 = Urb;
+    IoSetCompletionRoutine(Irp,
+                           Pl2303UsbControlCompletion,
+                           Request,
+                           TRUE,
+                           TRUE,
+                           TRUE);
+
+    if (CallerIrp)
+    {
+        IoMarkIrpPending(CallerIrp);
+        InsertTailList(&Request->CallerIrps, &CallerIrp->Tail.Overlay.ListEntry);
+    }
+
+    KeAcquireSpinLock(&DeviceExtension->ControlSpinLock, &OldIrql);
+    InsertTailList(&DeviceExtension->ControlQueue, &Request->ListEntry);
+    if (Request->SetsLine)
+        DeviceExtension->LineRequest = Request;
+    if (Request->SetsControlLines)
+        DeviceExtension->ControlLinesRequest = Request;
+    KeReleaseSpinLock(&DeviceExtension->ControlSpinLock, OldIrql);
+
+    Pl2303UsbStartControlRequests(Request->DeviceObject);
+}
+
+static
+NTSTATUS
+Pl2303UsbSubmitUrb(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PCONTROL_REQUEST Request,
+    _In_ PURB Urb)
+{
+    NTSTATUS Status;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Urb=%p\n",
+                __FUNCTION__, DeviceObject,    Urb);
+
+    Pl2303UsbQueueControlRequest(Request, Urb, NULL);
+
+    Status = KeWaitForSingleObject(&Request->Event, Executive, KernelMode, FALSE, NULL);
+    NT_ASSERT(Status == STATUS_SUCCESS);
+
+    return Request->Status;
+}
+
+/*
+ * Waits for a request queued without a caller IRP, and returns its result
+ * with a failed URB mapped to an NTSTATUS.
+ */
+static
+NTSTATUS
+Pl2303UsbWaitControlRequest(
+    _In_ PCONTROL_REQUEST Request)
+{
+    PAGED_CODE();
+
+    (VOID)KeWaitForSingleObject(&Request->Event, Executive, KernelMode, FALSE, NULL);
+
+    if (NT_SUCCESS(Request->Status) &&
+        !USBD_SUCCESS(Request->SubmitUrb->UrbHeader.Status))
+    {
+        return Pl2303UsbMapUsbdStatus(Request->SubmitUrb->UrbHeader.Status);
+    }
+    return Request->Status;
+}
+
+static
+NTSTATUS
+Pl2303UsbGetDescriptor(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ UCHAR DescriptorType,
+    _Out_ PVOID *Buffer,
+    _Inout_ PULONG BufferLength)
+{
+    NTSTATUS Status;
+    PCONTROL_REQUEST Request;
+    PURB Urb;
+
+    PAGED_CODE();
+    NT_ASSERT(Buffer);
+    NT_ASSERT(BufferLength);
+    NT_ASSERT(*BufferLength > 0);
+
+    Pl2303Debug(         "%s. DeviceObject=%p, DescriptorType=%u, Buffer=%p, BufferLength=%p\n",
+                __FUNCTION__, DeviceObject,    DescriptorType,    Buffer,    BufferLength);
+
+    Request = Pl2303UsbAllocateControlRequest(DeviceObject);
+    if (!Request)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    Urb = &Request->Urb;
+
+    *Buffer = ExAllocatePoolWithTag(NonPagedPool, *BufferLength, PL2303_TAG);
+    if (!*Buffer)
+    {
+        Pl2303Error(         "%s. Allocating URB transfer buffer of size %lu failed\n",
+                    __FUNCTION__, *BufferLength);
+        Pl2303UsbFreeControlRequest(DeviceObject, Request);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    UsbBuildGetDescriptorRequest(Urb,
+                                 sizeof(struct _URB_CONTROL_DESCRIPTOR_REQUEST),
+                                 DescriptorType,
+                                 0,
+                                 0,
+                                 *Buffer,
+                                 NULL,
+                                 *BufferLength,
+                                 NULL);
+
+    Status = Pl2303UsbSubmitUrb(DeviceObject, Request, Urb);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. Pl2303UsbSubmitUrb failed with %08lx, %08lx\n",
+                    __FUNCTION__, Status, Urb->UrbHeader.Status);
+        ExFreePoolWithTag(*Buffer, PL2303_TAG);
+        *Buffer = NULL;
+        Pl2303UsbFreeControlRequest(DeviceObject, Request);
+        *BufferLength = 0;
+        return Status;
+    }
+    if (!USBD_SUCCESS(Urb->UrbHeader.Status))
+    {
+        Pl2303Error(         "%s. Urb failed with %08lx\n",
+                    __FUNCTION__, Urb->UrbHeader.Status);
+        Status = Pl2303UsbMapUsbdStatus(Urb->UrbHeader.Status);
+        ExFreePoolWithTag(*Buffer, PL2303_TAG);
+        *Buffer = NULL;
+        Pl2303UsbFreeControlRequest(DeviceObject, Request);
+        *BufferLength = 0;
+        return Status;
+    }
+
+    *BufferLength = Urb->UrbControlDescriptorRequest.TransferBufferLength;
+    Pl2303UsbFreeControlRequest(DeviceObject, Request);
+
+    return Status;
+}
+
+static
+VOID
+Pl2303UsbBuildVendorRead(
+    _In_ PCONTROL_REQUEST Request,
+    _In_ UCHAR VendorRequest,
+    _In_ USHORT Value,
+    _In_ USHORT Index)
+{
+    UsbBuildVendorRequest(&Request->Urb,
+                          URB_FUNCTION_VENDOR_DEVICE,
+                          sizeof(struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST),
+                          USBD_TRANSFER_DIRECTION_IN | USBD_SHORT_TRANSFER_OK,
+                          0,
+                          VendorRequest,
+                          Value,
+                          Index,
+                          Request->Buffer,
+                          NULL,
+                          1,
+                          NULL);
+}
+
+static
+VOID
+Pl2303UsbBuildVendorWrite(
+    _In_ PCONTROL_REQUEST Request,
+    _In_ UCHAR VendorRequest,
+    _In_ USHORT Value,
+    _In_ USHORT Index)
+{
+    UsbBuildVendorRequest(&Request->Urb,
+                          URB_FUNCTION_VENDOR_DEVICE,
+                          sizeof(struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST),
+                          USBD_TRANSFER_DIRECTION_OUT,
+                          0,
+                          VendorRequest,
+                          Value,
+                          Index,
+                          NULL,
+                          NULL,
+                          0,
+                          NULL);
+}
+
+static
+NTSTATUS
+Pl2303UsbVendorRead(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ USHORT Value,
+    _In_ USHORT Index,
+    _Out_ PUCHAR Data)
+{
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PCONTROL_REQUEST Request;
+    PURB Urb;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Value=0x%x, Index=0x%x\n",
+                __FUNCTION__, DeviceObject,    Value,      Index);
+
+    *Data = 0;
+
+    Request = Pl2303UsbAllocateControlRequest(DeviceObject);
+    if (!Request)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    Urb = &Request->Urb;
+
+    Pl2303UsbBuildVendorRead(Request, DeviceExtension->Chip->VendorReadRequest, Value, Index);
+
+    Status = Pl2303UsbSubmitUrb(DeviceObject, Request, Urb);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. Pl2303UsbSubmitUrb failed with %08lx, %08lx\n",
+                    __FUNCTION__, Status, Urb->UrbHeader.Status);
+        Pl2303UsbFreeControlRequest(DeviceObject, Request);
+        return Status;
+    }
+    if (!USBD_SUCCESS(Urb->UrbHeader.Status))
+    {
+        Pl2303Error(         "%s. URB failed with %08lx\n",
+                    __FUNCTION__, Urb->UrbHeader.Status);
+        Status = Pl2303UsbMapUsbdStatus(Urb->UrbHeader.Status);
+        Pl2303UsbFreeControlRequest(DeviceObject, Request);
+        return Status;
+    }
+    if (Urb->UrbControlVendorClassRequest.TransferBufferLength < 1)
+    {
+        Pl2303Error(         "%s. Vendor read returned no data\n",
+                    __FUNCTION__);
+        Pl2303UsbFreeControlRequest(DeviceObject, Request);
+        return STATUS_DEVICE_PROTOCOL_ERROR;
+    }
+    *Data = Request->Buffer[0];
+    Pl2303UsbFreeControlRequest(DeviceObject, Request);
+
+    return Status;
+}
+
+static
+NTSTATUS
+Pl2303UsbVendorWrite(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ USHORT Value,
+    _In_ USHORT Index)
+{
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PCONTROL_REQUEST Request;
+    PURB Urb;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Value=0x%x, Index=0x%x\n",
+                __FUNCTION__, DeviceObject,    Value,      Index);
+
+    Request = Pl2303UsbAllocateControlRequest(DeviceObject);
+    if (!Request)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    Urb = &Request->Urb;
+
+    Pl2303UsbBuildVendorWrite(Request, DeviceExtension->Chip->VendorWriteRequest, Value, Index);
+
+    Status = Pl2303UsbSubmitUrb(DeviceObject, Request, Urb);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. Pl2303UsbSubmitUrb failed with %08lx, %08lx\n",
+                    __FUNCTION__, Status, Urb->UrbHeader.Status);
+        Pl2303UsbFreeControlRequest(DeviceObject, Request);
+        return Status;
+    }
+    if (!USBD_SUCCESS(Urb->UrbHeader.Status))
+    {
+        Pl2303Error(         "%s. URB failed with %08lx\n",
+                    __FUNCTION__, Urb->UrbHeader.Status);
+        Status = Pl2303UsbMapUsbdStatus(Urb->UrbHeader.Status);
+        Pl2303UsbFreeControlRequest(DeviceObject, Request);
+        return Status;
+    }
+    Pl2303UsbFreeControlRequest(DeviceObject, Request);
+
+    return Status;
+}
+
+/*
+ * TA and TB chips answer reads of the HX status register, while the G series
+ * parts sharing their revisions stall the legacy vendor request. HxStatus
+ * tells which happened. Any other failure leaves the variant unknown and is
+ * returned, rather than driving an HX part that glitched with the G protocol.
+ */
+static
+NTSTATUS
+Pl2303UsbProbeHxStatus(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Out_ PBOOLEAN HxStatus)
+{
+    NTSTATUS Status;
+    PCONTROL_REQUEST Request;
+    PURB Urb;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p\n",
+                __FUNCTION__, DeviceObject);
+
+    *HxStatus = FALSE;
+
+    Request = Pl2303UsbAllocateControlRequest(DeviceObject);
+    if (!Request)
+    {
+        Pl2303Error(         "%s. Allocating control request failed\n",
+                    __FUNCTION__);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    Urb = &Request->Urb;
+
+    Pl2303UsbBuildVendorRead(Request,
+                             PL2303_VENDOR_READ_REQUEST,
+                             PL2303_HX_STATUS_REGISTER,
+                             0);
+    /* Pooled requests keep the status of their last use */
+    Urb->UrbHeader.Status = USBD_STATUS_SUCCESS;
+
+    Status = Pl2303UsbSubmitUrb(DeviceObject, Request, Urb);
+    switch (Urb->UrbHeader.Status)
+    {
+        case USBD_STATUS_SUCCESS:
+            if (NT_SUCCESS(Status))
+            {
+                *HxStatus = TRUE;
+                break;
+            }
+            Pl2303Error(         "%s. Pl2303UsbSubmitUrb failed with %08lx\n",
+                        __FUNCTION__, Status);
+            break;
+        case USBD_STATUS_STALL_PID:
+        case USBD_STATUS_ENDPOINT_HALTED:
+        case USBD_STATUS_REQUEST_FAILED:
+            /* The device rejected the request, which is the answer */
+            Pl2303Debug(         "%s. URB failed with %08lx\n",
+                        __FUNCTION__, Urb->UrbHeader.Status);
+            Status = STATUS_SUCCESS;
+            break;
+        default:
+            Pl2303Error(         "%s. Pl2303UsbSubmitUrb failed with %08lx, %08lx\n",
+                        __FUNCTION__, Status, Urb->UrbHeader.Status);
+            if (NT_SUCCESS(Status))
+                Status = Pl2303UsbMapUsbdStatus(Urb->UrbHeader.Status);
+            break;
+    }
+    Pl2303UsbFreeControlRequest(DeviceObject, Request);
+
+    return Status;
+}
+
+/*
+ * Sends a sequence of vendor requests that do not depend on each other's
+ * results. Requests are queued without waiting for the previous ones, so the
+ * control pipe goes from one to the next without a round trip through this
+ * thread; only once as many are in flight as the pool holds, the oldest is
+ * waited for. Values read are discarded.
+ */
+static
+NTSTATUS
+Pl2303UsbVendorSequence(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_reads_(Count) const PL2303_VENDOR_STEP *Steps,
+    _In_ ULONG Count)
+{
+    NTSTATUS Status = STATUS_SUCCESS;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PCONTROL_REQUEST Requests[PL2303_CONTROL_REQUEST_COUNT];
+    PCONTROL_REQUEST Request;
+    ULONG Queued = 0;
+    ULONG Completed = 0;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Steps=%p, Count=%lu\n",
+                __FUNCTION__, DeviceObject,    Steps,    Count);
+
+    while (Completed < Count)
+    {
+        if (NT_SUCCESS(Status) &&
+            Queued < Count &&
+            Queued - Completed < RTL_NUMBER_OF(Requests))
+        {
+            Request = Pl2303UsbAllocateControlRequest(DeviceObject);
+            if (Request)
+            {
+                if (Steps[Queued].Read)
+                    Pl2303UsbBuildVendorRead(Request,
+                                             DeviceExtension->Chip->VendorReadRequest,
+                                             Steps[Queued].Value,
+                                             Steps[Queued].Index);
+                else
+                    Pl2303UsbBuildVendorWrite(Request,
+                                              DeviceExtension->Chip->VendorWriteRequest,
+                                              Steps[Queued].Value,
+                                              Steps[Queued].Index);
+                Pl2303UsbQueueControlRequest(Request, &Request->Urb, NULL);
+                Requests[Queued % RTL_NUMBER_OF(Requests)] = Request;
+                Queued++;
+                continue;
+            }
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        /* Whatever was queued must be waited for before its request is reused */
+        if (Completed == Queued)
+            break;
+        Request = Requests[Completed % RTL_NUMBER_OF(Requests)];
+        (VOID)KeWaitForSingleObject(&Request->Event, Executive, KernelMode, FALSE, NULL);
+        if (NT_SUCCESS(Status) &&
+            (!NT_SUCCESS(Request->Status) || !USBD_SUCCESS(Request->Urb.UrbHeader.Status)))
+        {
+            Pl2303Error(         "%s. Vendor %s 0x%x/0x%x (step %lu) failed with %08lx, %08lx\n",
+                        __FUNCTION__, Steps[Completed].Read ? "read" : "write",
+                                      Steps[Completed].Value,
+                                      Steps[Completed].Index,
+                                      Completed,
+                                      Request->Status,
+                                      Request->Urb.UrbHeader.Status);
+            Status = NT_SUCCESS(Request->Status) ? Pl2303UsbMapUsbdStatus(Request->Urb.UrbHeader.Status)
+                                                 : Request->Status;
+        }
+        Pl2303UsbFreeControlRequest(DeviceObject, Request);
+        Completed++;
+    }
+
+    return Status;
+}
+
+static
+NTSTATUS
+Pl2303UsbConfigureDevice(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PUSB_CONFIGURATION_DESCRIPTOR ConfigDescriptor,
+    _In_ PUSB_INTERFACE_DESCRIPTOR InterfaceDescriptor)
+{
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PCONTROL_REQUEST Request;
+    PURB Urb;
+    USBD_INTERFACE_LIST_ENTRY InterfaceList[2];
+    ULONG i;
+    PUSBD_PIPE_INFORMATION PipeInfo;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p, ConfigDescriptor=%p, InterfaceDescriptor=%p\n",
+                __FUNCTION__, DeviceObject,    ConfigDescriptor,    InterfaceDescriptor);
+
+    RtlZeroMemory(InterfaceList, sizeof(InterfaceList));
+    InterfaceList[0].InterfaceDescriptor = InterfaceDescriptor;
+
+    Urb = USBD_CreateConfigurationRequestEx(ConfigDescriptor,
+                                            InterfaceList);
+    if (!Urb)
+    {
+        Pl2303Error(         "%s. USBD_CreateConfigurationRequestEx failed\n",
+                    __FUNCTION__);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    Request = Pl2303UsbAllocateControlRequest(DeviceObject);
+    if (!Request)
+    {
+        ExFreePoolWithTag(Urb, 0);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    Status = Pl2303UsbSubmitUrb(DeviceObject, Request, Urb);
+    Pl2303UsbFreeControlRequest(DeviceObject, Request);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. Pl2303UsbSubmitUrb failed with %08lx, %08lx\n",
+                    __FUNCTION__, Status, Urb->UrbHeader.Status);
+        ExFreePoolWithTag(Urb, 0);
+        return Status;
+    }
+
+    Pl2303Debug(         "%s. NumberOfPipes=%u\n",
+                    __FUNCTION__, Urb->UrbSelectConfiguration.Interface.NumberOfPipes);
+
+    for (i = 0; i < Urb->UrbSelectConfiguration.Interface.NumberOfPipes; i++)
+    {
+        PipeInfo = &Urb->UrbSelectConfiguration.Interface.Pipes[i];
+
+        if (PipeInfo->PipeType == UsbdPipeTypeBulk &&
+            USB_ENDPOINT_DIRECTION_IN(PipeInfo->EndpointAddress) &&
+            !DeviceExtension->BulkInPipe)
+        {
+            DeviceExtension->BulkInPipe = PipeInfo->PipeHandle;
+        }
+
+        if (PipeInfo->PipeType == UsbdPipeTypeBulk &&
+            USB_ENDPOINT_DIRECTION_OUT(PipeInfo->EndpointAddress) &&
+            !DeviceExtension->BulkOutPipe)
+        {
+            DeviceExtension->BulkOutPipe = PipeInfo->PipeHandle;
+            DeviceExtension->WriteMaxPacketSize = PipeInfo->MaximumPacketSize;
+            DeviceExtension->WriteTransferSize = PipeInfo->MaximumTransferSize;
+            if (!DeviceExtension->WriteTransferSize)
+                DeviceExtension->WriteTransferSize = PAGE_SIZE;
+        }
+
+        if (PipeInfo->PipeType == UsbdPipeTypeInterrupt &&
+            USB_ENDPOINT_DIRECTION_IN(PipeInfo->EndpointAddress) &&
+            !DeviceExtension->InterruptInPipe)
+        {
+            DeviceExtension->InterruptInPipe = PipeInfo->PipeHandle;
+        }
+    }
+
+    if (!DeviceExtension->BulkInPipe ||
+        !DeviceExtension->BulkOutPipe ||
+        !DeviceExtension->InterruptInPipe)
+    {
+        Pl2303Error(         "%s. Invalid endpoint combination\n",
+                    __FUNCTION__, Status);
+        NT_ASSERT(DeviceExtension->BulkInPipe &&
+                  DeviceExtension->BulkOutPipe &&
+                  DeviceExtension-> InterruptInPipe);
+        ExFreePoolWithTag(Urb, 0);
+        return STATUS_DEVICE_CONFIGURATION_ERROR;
+    }
+
+    ExFreePoolWithTag(Urb, 0);
+
+    return Status;
+}
+
+static
+NTSTATUS
+Pl2303UsbUnconfigureDevice(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    NTSTATUS Status;
+    PCONTROL_REQUEST Request;
+    PURB Urb;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p\n",
+                __FUNCTION__, DeviceObject);
+
+    Request = Pl2303UsbAllocateControlRequest(DeviceObject);
+    if (!Request)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    Urb = &Request->Urb;
+
+    UsbBuildSelectConfigurationRequest(Urb,
+                                       sizeof(struct _URB_SELECT_CONFIGURATION),
+                                       NULL);
+
+    Status = Pl2303UsbSubmitUrb(DeviceObject, Request, Urb);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. Pl2303UsbSubmitUrb failed with %08lx, %08lx\n",
+                    __FUNCTION__, Status, Urb->UrbHeader.Status);
+        Pl2303UsbFreeControlRequest(DeviceObject, Request);
+        return Status;
+    }
+    Pl2303UsbFreeControlRequest(DeviceObject, Request);
+
+    return Status;
+}
+
+NTSTATUS
+Pl2303UsbStart(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    NTSTATUS Status;
+    PVOID Descriptor;
+    ULONG DescriptorLength;
+    PUSB_DEVICE_DESCRIPTOR DeviceDescriptor;
+    PUSB_CONFIGURATION_DESCRIPTOR ConfigDescriptor;
+    PUSB_INTERFACE_DESCRIPTOR InterfaceDescriptor;
+    PDEVICE_EXTENSION DeviceExtension;
+    PL2303_CHIP_TYPE ChipType;
+    BOOLEAN HxStatus;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p\n",
+                __FUNCTION__, DeviceObject);
+
+    DeviceExtension = DeviceObject->DeviceExtension;
+
+    /* The chip is reinitialized below, so forget its line settings */
+    DeviceExtension->LineCodingValid = FALSE;
+    DeviceExtension->FlowControlValid = FALSE;
+    DeviceExtension->PipeFailed = FALSE;
+
+    DescriptorLength = sizeof(USB_DEVICE_DESCRIPTOR);
+    Status = Pl2303UsbGetDescriptor(DeviceObject,
+                                    USB_DEVICE_DESCRIPTOR_TYPE,
+                                    &Descriptor,
+                                    &DescriptorLength);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. Pl2303UsbGetDescriptor failed with %08lx\n",
+                    __FUNCTION__, Status);
+        return Status;
+    }
+    NT_ASSERT(DescriptorLength == sizeof(USB_DEVICE_DESCRIPTOR));
+
+    DeviceDescriptor = Descriptor;
+
+    Pl2303Debug(         "%s. Device descriptor: "
+                                               "bLength=%u, "
+                                               "bDescriptorType=%u, "
+                                               "bcdUSB=0x%x, "
+                                               "bDeviceClass=0x%x, "
+                                               "bDeviceSubClass=0x%x, "
+                                               "bDeviceProtocol=0x%x, "
+                                               "bMaxPacketSize0=%u, "
+                                               "idVendor=0x%x, "
+                                               "idProduct=0x%x, "
+                                               "bcdDevice=0x%x, "
+                                               "iManufacturer=%u, "
+                                               "iProduct=%u, "
+                                               "iSerialNumber=%u, "
+                                               "bNumConfigurations=%u\n",
+                __FUNCTION__, DeviceDescriptor->bLength,
+                              DeviceDescriptor->bDescriptorType,
+                              DeviceDescriptor->bcdUSB,
+                              DeviceDescriptor->bDeviceClass,
+                              DeviceDescriptor->bDeviceSubClass,
+                              DeviceDescriptor->bDeviceProtocol,
+                              DeviceDescriptor->bMaxPacketSize0,
+                              DeviceDescriptor->idVendor,
+                              DeviceDescriptor->idProduct,
+                              DeviceDescriptor->bcdDevice,
+                              DeviceDescriptor->iManufacturer,
+                              DeviceDescriptor->iProduct,
+                              DeviceDescriptor->iSerialNumber,
+                              DeviceDescriptor->bNumConfigurations);
+
+    ChipType = Pl2303ClassifyChip(DeviceDescriptor);
+
+    ExFreePoolWithTag(Descriptor, PL2303_TAG);
+
+    /*
+     * Ask for enough to get the whole configuration in one request. Only if
+     * the device's is larger than expected, it is fetched again in full.
+     */
+    DescriptorLength = PL2303_CONFIG_DESCRIPTOR_SIZE;
+    Status = Pl2303UsbGetDescriptor(DeviceObject,
+                                    USB_CONFIGURATION_DESCRIPTOR_TYPE,
+                                    &Descriptor,
+                                    &DescriptorLength);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. Pl2303UsbGetDescriptor failed with %08lx\n",
+                    __FUNCTION__, Status);
+        return Status;
+    }
+    if (DescriptorLength < sizeof(USB_CONFIGURATION_DESCRIPTOR))
+    {
+        Pl2303Error(         "%s. Configuration descriptor too short (%lu)\n",
+                    __FUNCTION__, DescriptorLength);
+        ExFreePoolWithTag(Descriptor, PL2303_TAG);
+        return STATUS_DEVICE_CONFIGURATION_ERROR;
+    }
+
+    ConfigDescriptor = Descriptor;
+    if (ConfigDescriptor->wTotalLength > DescriptorLength)
+    {
+        DescriptorLength = ConfigDescriptor->wTotalLength;
+        ExFreePoolWithTag(Descriptor, PL2303_TAG);
+        Status = Pl2303UsbGetDescriptor(DeviceObject,
+                                        USB_CONFIGURATION_DESCRIPTOR_TYPE,
+                                        &Descriptor,
+                                        &DescriptorLength);
+        if (!NT_SUCCESS(Status))
+        {
+            Pl2303Error(         "%s. Pl2303UsbGetDescriptor failed with %08lx\n",
+                        __FUNCTION__, Status);
+            return Status;
+        }
+        ConfigDescriptor = Descriptor;
+    }
+    NT_ASSERT(DescriptorLength >= ConfigDescriptor->wTotalLength);
+
+    Pl2303Debug(         "%s. Config descriptor: "
+                                               "bLength=%u, "
+                                               "bDescriptorType=%u, "
+                                               "wTotalLength=%u, "
+                                               "bNumInterfaces=%u, "
+                                               "bConfigurationValue=%u, "
+                                               "iConfiguration=%u, "
+                                               "bmAttributes=0x%x, "
+                                               "MaxPower=%u\n",
+                __FUNCTION__, ConfigDescriptor->bLength,
+                              ConfigDescriptor->bDescriptorType,
+                              ConfigDescriptor->wTotalLength,
+                              ConfigDescriptor->bNumInterfaces,
+                              ConfigDescriptor->bConfigurationValue,
+                              ConfigDescriptor->iConfiguration,
+                              ConfigDescriptor->bmAttributes,
+                              ConfigDescriptor->MaxPower);
+
+    if (ConfigDescriptor->bNumInterfaces != 1)
+    {
+        Pl2303Error(         "%s. Configuration contains %u interfaces, expected one\n",
+                    __FUNCTION__, ConfigDescriptor->bNumInterfaces);
+        ExFreePoolWithTag(Descriptor, PL2303_TAG);
+        return STATUS_DEVICE_CONFIGURATION_ERROR;
+    }
+
+    InterfaceDescriptor = USBD_ParseConfigurationDescriptorEx(ConfigDescriptor,
+                                                              ConfigDescriptor,
+                                                              -1,
+                                                              -1,
+                                                              -1,
+                                                              -1,
+                                                              -1);
+    if (!InterfaceDescriptor)
+    {
+        Pl2303Error(         "%s. USBD_ParseConfigurationDescriptorEx failed\n",
+                    __FUNCTION__);
+        ExFreePoolWithTag(Descriptor, PL2303_TAG);
+        return STATUS_DEVICE_CONFIGURATION_ERROR;
+    }
+
+    Pl2303Debug(         "%s. Interface descriptor: "
+                                                  "bLength=%u, "
+                                                  "bDescriptorType=%u, "
+                                                  "bInterfaceNumber=%u, "
+                                                  "bAlternateSetting=%u, "
+                                                  "bNumEndpoints=%u, "
+                                                  "bInterfaceClass=0x%x, "
+                                                  "bInterfaceSubClass=0x%x, "
+                                                  "bInterfaceProtocol=0x%x, "
+                                                  "iInterface=%u\n",
+                __FUNCTION__, InterfaceDescriptor->bLength,
+                              InterfaceDescriptor->bDescriptorType,
+                              InterfaceDescriptor->bInterfaceNumber,
+                              InterfaceDescriptor->bAlternateSetting,
+                              InterfaceDescriptor->bNumEndpoints,
+                              InterfaceDescriptor->bInterfaceClass,
+                              InterfaceDescriptor->bInterfaceSubClass,
+                              InterfaceDescriptor->bInterfaceProtocol,
+                              InterfaceDescriptor->iInterface);
+
+    Status = Pl2303UsbConfigureDevice(DeviceObject, ConfigDescriptor, InterfaceDescriptor);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. Pl2303UsbConfigureDevice failed with %08lx\n",
+                    __FUNCTION__, Status);
+        ExFreePoolWithTag(Descriptor, PL2303_TAG);
+        return Status;
+    }
+    ExFreePoolWithTag(Descriptor, PL2303_TAG);
+
+    if (ChipType == Pl2303ChipTa || ChipType == Pl2303ChipTb)
+    {
+        Status = Pl2303UsbProbeHxStatus(DeviceObject, &HxStatus);
+        if (!NT_SUCCESS(Status))
+        {
+            Pl2303Error(         "%s. Pl2303UsbProbeHxStatus failed with %08lx\n",
+                        __FUNCTION__, Status);
+            return Status;
+        }
+        if (!HxStatus)
+            ChipType = Pl2303ChipG;
+    }
+    DeviceExtension->Chip = &Pl2303Chips[ChipType];
+
+    Pl2303Debug(         "%s. Chip type %s\n",
+                __FUNCTION__, DeviceExtension->Chip->Name);
+
+    Status = Pl2303UsbVendorSequence(DeviceObject,
+                                     DeviceExtension->Chip->InitSequence,
+                                     DeviceExtension->Chip->InitSequenceLength);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. Pl2303UsbVendorSequence failed with %08lx\n",
+                    __FUNCTION__, Status);
+        return Status;
+    }
+
+    return Status;
+}
+
+NTSTATUS
+Pl2303UsbStop(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    NTSTATUS Status;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p\n",
+                __FUNCTION__, DeviceObject);
+
+    Pl2303UsbStopStatusPump(DeviceObject);
+    Pl2303UsbStopReadPump(DeviceObject);
+
+    Status = Pl2303UsbUnconfigureDevice(DeviceObject);
+
+    return Status;
+}
+
+NTSTATUS
+Pl2303UsbSetLine(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_opt_ PIRP Irp,
+    _In_ ULONG BaudRate,
+    _In_ UCHAR StopBits,
+    _In_ UCHAR Parity,
+    _In_ UCHAR DataBits)
+{
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    LINE_CODING LineCoding;
+    PCONTROL_REQUEST Request;
+    PLINE_CODING Line;
+    KIRQL OldIrql;
+    PURB Urb;
+
+    NT_ASSERT(Irp || KeGetCurrentIrql() <= APC_LEVEL);
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p, BaudRate=%lu, StopBits=%u, Parity=%u, "
+                             "DataBits=%u\n",
+                __FUNCTION__, DeviceObject,    Irp,    BaudRate,     StopBits,    Parity,
+                              DataBits);
+
+    RtlZeroMemory(&LineCoding, sizeof(LineCoding));
+    LineCoding.BaudRate = Pl2303EncodeBaudRate(DeviceExtension->Chip, BaudRate, NULL);
+    LineCoding.StopBits = StopBits;
+    LineCoding.Parity = Parity;
+    LineCoding.DataBits = DataBits;
+
+    /*
+     * An asynchronous change is merged into the last queued SET_LINE request
+     * if that has not been sent yet, or if it is being sent with the same
+     * settings. Without such a request, a change to the settings the device
+     * already has is not sent at all. Callers serialize changes, so nothing
+     * can be queued between this check and queueing a new request below.
+     */
+    KeAcquireSpinLock(&DeviceExtension->ControlSpinLock, &OldIrql);
+    Request = DeviceExtension->LineRequest;
+    if (Irp && Request && !IsListEmpty(&Request->CallerIrps))
+    {
+        Line = (PLINE_CODING)Request->Buffer;
+        if (!Request->Started ||
+            RtlEqualMemory(Line, &LineCoding, sizeof(LineCoding)))
+        {
+            RtlCopyMemory(Line, &LineCoding, sizeof(*Line));
+            IoMarkIrpPending(Irp);
+            InsertTailList(&Request->CallerIrps, &Irp->Tail.Overlay.ListEntry);
+            KeReleaseSpinLock(&DeviceExtension->ControlSpinLock, OldIrql);
+            Pl2303Debug(         "%s. Merged into request %p\n",
+                        __FUNCTION__, Request);
+            return STATUS_PENDING;
+        }
+    }
+    else if (!Request &&
+             DeviceExtension->LineCodingValid &&
+             RtlEqualMemory(&DeviceExtension->LineCoding, &LineCoding, sizeof(LineCoding)))
+    {
+        KeReleaseSpinLock(&DeviceExtension->ControlSpinLock, OldIrql);
+        Pl2303Debug(         "%s. Line settings unchanged\n",
+                    __FUNCTION__);
+        return STATUS_SUCCESS;
+    }
+    KeReleaseSpinLock(&DeviceExtension->ControlSpinLock, OldIrql);
+
+    Request = Pl2303UsbAllocateControlRequest(DeviceObject);
+    if (!Request)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    Urb = &Request->Urb;
+
+    Pl2303UsbBuildSetLine(Request, &LineCoding);
+
+    if (Irp)
+    {
+        Pl2303UsbQueueControlRequest(Request, Urb, Irp);
+        return STATUS_PENDING;
+    }
+
+    Status = Pl2303UsbSubmitUrb(DeviceObject, Request, Urb);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. Pl2303UsbSubmitUrb failed with %08lx, %08lx\n",
+                    __FUNCTION__, Status, Urb->UrbHeader.Status);
+        Pl2303UsbFreeControlRequest(DeviceObject, Request);
+        return Status;
+    }
+    if (!USBD_SUCCESS(Urb->UrbHeader.Status))
+    {
+        Pl2303Error(         "%s. URB failed with %08lx\n",
+                    __FUNCTION__, Urb->UrbHeader.Status);
+        Status = Pl2303UsbMapUsbdStatus(Urb->UrbHeader.Status);
+        Pl2303UsbFreeControlRequest(DeviceObject, Request);
+        return Status;
+    }
+    Pl2303UsbFreeControlRequest(DeviceObject, Request);
+
+    return Status;
+}
+
+static
+VOID
+Pl2303UsbBuildSetLine(
+    _In_ PCONTROL_REQUEST Request,
+    _In_ const LINE_CODING *LineCoding)
+{
+    PLINE_CODING Line;
+
+    UsbBuildVendorRequest(&Request->Urb,
+                          URB_FUNCTION_CLASS_DEVICE,
+                          sizeof(struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST),
+                          USBD_TRANSFER_DIRECTION_OUT,
+                          0,
+                          PL2303_SET_LINE_REQUEST,
+                          0,
+                          0,
+                          Request->Buffer,
+                          NULL,
+                          sizeof(*Line),
+                          NULL);
+
+    C_ASSERT(sizeof(*Line) <= RTL_FIELD_SIZE(CONTROL_REQUEST, Buffer));
+    Line = (PLINE_CODING)Request->Buffer;
+    RtlCopyMemory(Line, LineCoding, sizeof(*Line));
+    Request->SetsLine = TRUE;
+}
+
+static
+VOID
+Pl2303UsbBuildSetControlLines(
+    _In_ PCONTROL_REQUEST Request)
+{
+    /* The line state itself is filled in when the request is started */
+    UsbBuildVendorRequest(&Request->Urb,
+                          URB_FUNCTION_CLASS_DEVICE,
+                          sizeof(struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST),
+                          USBD_TRANSFER_DIRECTION_OUT,
+                          0,
+                          PL2303_SET_CONTROL_REQUEST,
+                          0,
+                          0,
+                          NULL,
+                          NULL,
+                          0,
+                          NULL);
+    Request->SetsControlLines = TRUE;
+}
+
+NTSTATUS
+Pl2303UsbSetControlLines(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_opt_ PIRP Irp)
+{
+    NTSTATUS Status;
+    PCONTROL_REQUEST Request;
+    PURB Urb;
+
+    NT_ASSERT(Irp || KeGetCurrentIrql() <= APC_LEVEL);
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                __FUNCTION__, DeviceObject,    Irp);
+
+    Request = Pl2303UsbAllocateControlRequest(DeviceObject);
+    if (!Request)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    Urb = &Request->Urb;
+
+    Pl2303UsbBuildSetControlLines(Request);
+
+    if (Irp)
+    {
+        Pl2303UsbQueueControlRequest(Request, Urb, Irp);
+        return STATUS_PENDING;
+    }
+
+    Status = Pl2303UsbSubmitUrb(DeviceObject, Request, Urb);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. Pl2303UsbSubmitUrb failed with %08lx, %08lx\n",
+                    __FUNCTION__, Status, Urb->UrbHeader.Status);
+        Pl2303UsbFreeControlRequest(DeviceObject, Request);
+        return Status;
+    }
+    if (!USBD_SUCCESS(Urb->UrbHeader.Status))
+    {
+        Pl2303Error(         "%s. URB failed with %08lx\n",
+                    __FUNCTION__, Urb->UrbHeader.Status);
+        Status = Pl2303UsbMapUsbdStatus(Urb->UrbHeader.Status);
+        Pl2303UsbFreeControlRequest(DeviceObject, Request);
+        return Status;
+    }
+    Pl2303UsbFreeControlRequest(DeviceObject, Request);
+
+    return Status;
+}
+
+/*
+ * Sends the current control line state without waiting for the result.
+ * Used from the receive path to throttle the peer, so it may be called at
+ * DISPATCH_LEVEL. A request that is queued but not yet started already
+ * picks up the new state, so no further one is queued in that case.
+ */
+VOID
+Pl2303UsbUpdateControlLines(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PCONTROL_REQUEST Request;
+    KIRQL OldIrql;
+
+    NT_ASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
+
+    KeAcquireSpinLock(&DeviceExtension->ControlSpinLock, &OldIrql);
+    Request = DeviceExtension->ControlLinesRequest;
+    if (Request && !Request->Started)
+    {
+        KeReleaseSpinLock(&DeviceExtension->ControlSpinLock, OldIrql);
+        return;
+    }
+    KeReleaseSpinLock(&DeviceExtension->ControlSpinLock, OldIrql);
+
+    Request = Pl2303UsbAllocateControlRequest(DeviceObject);
+    if (!Request)
+    {
+        Pl2303Warn(         "%s. Unable to update control lines\n",
+                   __FUNCTION__);
+        return;
+    }
+
+    Pl2303UsbBuildSetControlLines(Request);
+    Request->Detached = TRUE;
+    Pl2303UsbQueueControlRequest(Request, &Request->Urb, NULL);
+}
+
+/*
+ * Computes the flow control register value for the given mode. Where the
+ * mode only takes part of the register, the register is read so that the
+ * other bits are written back unchanged.
+ */
+static
+NTSTATUS
+Pl2303UsbGetFlowControlValue(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ BOOLEAN Enable,
+    _Out_ PUSHORT Value)
+{
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    const PL2303_CHIP_INFO *Chip = DeviceExtension->Chip;
+    USHORT Bits;
+    UCHAR Data;
+
+    PAGED_CODE();
+
+    Bits = Enable ? Chip->FlowControlRtsCts : Chip->FlowControlNone;
+    NT_ASSERT((Bits & ~Chip->FlowControlMask) == 0);
+    *Value = Bits;
+    if (Chip->FlowControlMask == PL2303_FLOW_CONTROL_MASK)
+        return STATUS_SUCCESS;
+
+    Status = Pl2303UsbVendorRead(DeviceObject, Chip->FlowControlRegister, 0, &Data);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. Pl2303UsbVendorRead failed with %08lx\n",
+                    __FUNCTION__, Status);
+        return Status;
+    }
+
+    *Value = (Data & ~Chip->FlowControlMask) | Bits;
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Selects the chip's RTS/CTS mode. The mode last written is remembered, so
+ * a handshake change that leaves it alone does not reach the device. Called
+ * with the line state mutex held, which serializes access to that state.
+ */
+NTSTATUS
+Pl2303UsbSetFlowControl(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ BOOLEAN Enable)
+{
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    USHORT Value;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Enable=%u\n",
+                __FUNCTION__, DeviceObject,    Enable);
+
+    if (DeviceExtension->FlowControlValid &&
+        DeviceExtension->FlowControlEnabled == Enable)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    DeviceExtension->FlowControlValid = FALSE;
+    Status = Pl2303UsbGetFlowControlValue(DeviceObject, Enable, &Value);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    Status = Pl2303UsbVendorWrite(DeviceObject,
+                                  DeviceExtension->Chip->FlowControlRegister,
+                                  Value);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. Pl2303UsbVendorWrite failed with %08lx\n",
+                    __FUNCTION__, Status);
+        return Status;
+    }
+
+    DeviceExtension->FlowControlEnabled = Enable;
+    DeviceExtension->FlowControlValid = TRUE;
+    return Status;
+}
+
+/*
+ * Sends the line settings, flow control mode and control line state to a
+ * device that may have lost them, such as after resuming from suspend. The
+ * three requests are queued back to back and then waited for in order; if
+ * any of them fails, so does the restore. The line settings are sent even
+ * if they match the cached ones.
+ */
+NTSTATUS
+Pl2303UsbRestoreLine(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ ULONG BaudRate,
+    _In_ UCHAR StopBits,
+    _In_ UCHAR Parity,
+    _In_ UCHAR DataBits,
+    _In_ BOOLEAN FlowControl)
+{
+    NTSTATUS Status;
+    NTSTATUS LineStatus;
+    NTSTATUS FlowStatus;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    LINE_CODING LineCoding;
+    PCONTROL_REQUEST LineRequest;
+    PCONTROL_REQUEST FlowRequest;
+    PCONTROL_REQUEST Request;
+    USHORT FlowValue;
+    KIRQL OldIrql;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p, BaudRate=%lu, StopBits=%u, Parity=%u, DataBits=%u, "
+                             "FlowControl=%u\n",
+                __FUNCTION__, DeviceObject,    BaudRate,     StopBits,    Parity,    DataBits,
+                              FlowControl);
+
+    /* Done first, since it may have to read the register */
+    Status = Pl2303UsbGetFlowControlValue(DeviceObject, FlowControl, &FlowValue);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    LineRequest = Pl2303UsbAllocateControlRequest(DeviceObject);
+    FlowRequest = Pl2303UsbAllocateControlRequest(DeviceObject);
+    Request = Pl2303UsbAllocateControlRequest(DeviceObject);
+    if (!LineRequest || !FlowRequest || !Request)
+    {
+        if (LineRequest)
+            Pl2303UsbFreeControlRequest(DeviceObject, LineRequest);
+        if (FlowRequest)
+            Pl2303UsbFreeControlRequest(DeviceObject, FlowRequest);
+        if (Request)
+            Pl2303UsbFreeControlRequest(DeviceObject, Request);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    KeAcquireSpinLock(&DeviceExtension->ControlSpinLock, &OldIrql);
+    DeviceExtension->LineCodingValid = FALSE;
+    KeReleaseSpinLock(&DeviceExtension->ControlSpinLock, OldIrql);
+    DeviceExtension->FlowControlValid = FALSE;
+
+    /*
+     * The line request has no caller IRPs, so nothing is merged into it and
+     * its completion signals the event instead of freeing it.
+     */
+    RtlZeroMemory(&LineCoding, sizeof(LineCoding));
+    LineCoding.BaudRate = Pl2303EncodeBaudRate(DeviceExtension->Chip, BaudRate, NULL);
+    LineCoding.StopBits = StopBits;
+    LineCoding.Parity = Parity;
+    LineCoding.DataBits = DataBits;
+    Pl2303UsbBuildSetLine(LineRequest, &LineCoding);
+    Pl2303UsbQueueControlRequest(LineRequest, &LineRequest->Urb, NULL);
+
+    Pl2303UsbBuildVendorWrite(FlowRequest,
+                              DeviceExtension->Chip->VendorWriteRequest,
+                              DeviceExtension->Chip->FlowControlRegister,
+                              FlowValue);
+    Pl2303UsbQueueControlRequest(FlowRequest, &FlowRequest->Urb, NULL);
+
+    Pl2303UsbBuildSetControlLines(Request);
+    Pl2303UsbQueueControlRequest(Request, &Request->Urb, NULL);
+
+    LineStatus = Pl2303UsbWaitControlRequest(LineRequest);
+    FlowStatus = Pl2303UsbWaitControlRequest(FlowRequest);
+    Status = Pl2303UsbWaitControlRequest(Request);
+    Pl2303UsbFreeControlRequest(DeviceObject, LineRequest);
+    Pl2303UsbFreeControlRequest(DeviceObject, FlowRequest);
+    Pl2303UsbFreeControlRequest(DeviceObject, Request);
+
+    if (!NT_SUCCESS(LineStatus))
+    {
+        Pl2303Error(         "%s. Restoring the line settings failed with %08lx\n",
+                    __FUNCTION__, LineStatus);
+        return LineStatus;
+    }
+
+    if (!NT_SUCCESS(FlowStatus))
+    {
+        Pl2303Error(         "%s. Restoring the flow control mode failed with %08lx\n",
+                    __FUNCTION__, FlowStatus);
+        return FlowStatus;
+    }
+    DeviceExtension->FlowControlEnabled = FlowControl;
+    DeviceExtension->FlowControlValid = TRUE;
+
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. Restoring the control lines failed with %08lx\n",
+                    __FUNCTION__, Status);
+    }
+
+    return Status;
+}
+
+NTSTATUS
+Pl2303UsbAllocateTransfers(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ ULONG Count,
+    _In_ ULONG BufferSize,
+    _Out_ PPIPE_TRANSFER *Transfers)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PPIPE_TRANSFER Transfer;
+    PUCHAR Buffers = NULL;
+    ULONG i;
+
+    PAGED_CODE();
+    NT_ASSERT(Count != 0);
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Count=%lu, BufferSize=%lu\n",
+                __FUNCTION__, DeviceObject,    Count,     BufferSize);
+
+    *Transfers = NULL;
+
+    Transfer = ExAllocatePoolWithTag(NonPagedPool,
+                                     Count * sizeof(*Transfer),
+                                     PL2303_URB_TAG);
+    if (!Transfer)
+    {
+        Pl2303Error(         "%s. Allocating transfers failed\n",
+                    __FUNCTION__);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(Transfer, Count * sizeof(*Transfer));
+
+    if (BufferSize)
+    {
+        Buffers = ExAllocatePoolWithTag(NonPagedPool,
+                                        Count * BufferSize,
+                                        PL2303_BUFFER_TAG);
+        if (!Buffers)
+        {
+            Pl2303Error(         "%s. Allocating transfer buffers failed\n",
+                        __FUNCTION__);
+            ExFreePoolWithTag(Transfer, PL2303_URB_TAG);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    for (i = 0; i < Count; i++)
+    {
+        Transfer[i].DeviceObject = DeviceObject;
+        Transfer[i].Buffer = Buffers ? Buffers + i * BufferSize : NULL;
+        Transfer[i].Irp = IoAllocateIrp(DeviceExtension->LowerDevice->StackSize, FALSE);
+        if (!Transfer[i].Irp)
+        {
+            Pl2303Error(         "%s. Allocating transfer IRP %lu failed\n",
+                        __FUNCTION__, i);
+            while (i--)
+                IoFreeIrp(Transfer[i].Irp);
+            if (Buffers)
+                ExFreePoolWithTag(Buffers, PL2303_BUFFER_TAG);
+            ExFreePoolWithTag(Transfer, PL2303_URB_TAG);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    *Transfers = Transfer;
+    return STATUS_SUCCESS;
+}
+
+VOID
+Pl2303UsbFreeTransfers(
+    _In_ PPIPE_TRANSFER Transfers,
+    _In_ ULONG Count)
+{
+    ULONG i;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. Transfers=%p, Count=%lu\n",
+                __FUNCTION__, Transfers,    Count);
+
+    for (i = 0; i < Count; i++)
+        IoFreeIrp(Transfers[i].Irp);
+    if (Transfers[0].Buffer)
+        ExFreePoolWithTag(Transfers[0].Buffer, PL2303_BUFFER_TAG);
+    ExFreePoolWithTag(Transfers, PL2303_URB_TAG);
+}
+
+static
+VOID
+Pl2303UsbRecordTransfer(
+    _In_ PPIPE_TRANSFER Transfer,
+    _In_ UCHAR Type)
+{
+    PDEVICE_EXTENSION DeviceExtension = Transfer->DeviceObject->DeviceExtension;
+    UCHAR Pipe;
+
+    if (Transfer->Urb.PipeHandle == DeviceExtension->BulkInPipe)
+        Pipe = PL2303_RECORD_PIPE_BULK_IN;
+    else if (Transfer->Urb.PipeHandle == DeviceExtension->BulkOutPipe)
+        Pipe = PL2303_RECORD_PIPE_BULK_OUT;
+    else
+        Pipe = PL2303_RECORD_PIPE_INTERRUPT_IN;
+
+    if (Type == PL2303_RECORD_URB_SUBMIT)
+    {
+        Transfer->RecordCookie = 0;
+        Pl2303Record(DeviceExtension,
+                     Type,
+                     Pipe,
+                     Transfer->Urb.TransferBufferLength,
+                     0,
+                     &Transfer->RecordCookie,
+                     Transfer->Urb.Hdr.Function);
+    }
+    else
+    {
+        Pl2303Record(DeviceExtension,
+                     Type,
+                     Pipe,
+                     Transfer->Urb.TransferBufferLength,
+                     Transfer->Urb.Hdr.Status,
+                     &Transfer->RecordCookie,
+                     Transfer->Irp->IoStatus.Status);
+    }
+}
+
+VOID
+Pl2303UsbSubmitTransfer(
+    _In_ PPIPE_TRANSFER Transfer)
+{
+    PDEVICE_EXTENSION DeviceExtension = Transfer->DeviceObject->DeviceExtension;
+
+    NT_ASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
+
+    Pl2303UsbRecordTransfer(Transfer, PL2303_RECORD_URB_SUBMIT);
+    Transfer->SubmitTime = Pl2303QueryLatencyTime();
+    (VOID)IoCallDriver(DeviceExtension->LowerDevice, Transfer->Irp);
+}
+
+static
+VOID
+Pl2303UsbPrepareTransfer(
+    _In_ PPIPE_TRANSFER Transfer,
+    _In_ USBD_PIPE_HANDLE PipeHandle,
+    _In_ PVOID Buffer,
+    _In_ ULONG Length,
+    _In_ ULONG TransferFlags,
+    _In_ PIO_COMPLETION_ROUTINE CompletionRoutine)
+{
+    PIO_STACK_LOCATION IoStack;
+
+    IoReuseIrp(Transfer->Irp, STATUS_NOT_SUPPORTED);
+
+    UsbBuildInterruptOrBulkTransferRequest((PURB)&Transfer->Urb,
+                                           sizeof(Transfer->Urb),
+                                           PipeHandle,
+                                           Buffer,
+                                           NULL,
+                                           Length,
+                                           TransferFlags,
+                                           NULL);
+
+    IoStack = IoGetNextIrpStackLocation(Transfer->Irp);
+    IoStack->MajorFunction = IRP_MJ_INTERNAL_DEVICE_CONTROL;
+    IoStack->Parameters.DeviceIoControl.IoControlCode = IOCTL_INTERNAL_USB_SUBMIT_URB;
+    IoStack->Parameters.Others.Argument1 = &Transfer->Urb;
+
+    IoSetCompletionRoutine(Transfer->Irp,
+                           CompletionRoutine,
+                           Transfer,
+                           TRUE,
+                           TRUE,
+                           TRUE);
+}
+
+/*
+ * Clears a halt on the given pipe after a transfer on it has failed, so that
+ * transfers can be submitted to it again.
+ */
+static
+NTSTATUS
+Pl2303UsbResetPipe(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ USBD_PIPE_HANDLE PipeHandle)
+{
+    NTSTATUS Status;
+    PCONTROL_REQUEST Request;
+    PURB Urb;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p, PipeHandle=%p\n",
+                __FUNCTION__, DeviceObject,    PipeHandle);
+
+    Request = Pl2303UsbAllocateControlRequest(DeviceObject);
+    if (!Request)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    Urb = &Request->Urb;
+
+    RtlZeroMemory(Urb, sizeof(*Urb));
+    Urb->UrbHeader.Length = sizeof(struct _URB_PIPE_REQUEST);
+    Urb->UrbHeader.Function = URB_FUNCTION_SYNC_RESET_PIPE_AND_CLEAR_STALL;
+    Urb->UrbPipeRequest.PipeHandle = PipeHandle;
+
+    Status = Pl2303UsbSubmitUrb(DeviceObject, Request, Urb);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. Pl2303UsbSubmitUrb failed with %08lx, %08lx\n",
+                    __FUNCTION__, Status, Urb->UrbHeader.Status);
+    }
+    else if (!USBD_SUCCESS(Urb->UrbHeader.Status))
+    {
+        Pl2303Error(         "%s. URB failed with %08lx\n",
+                    __FUNCTION__, Urb->UrbHeader.Status);
+        Status = Pl2303UsbMapUsbdStatus(Urb->UrbHeader.Status);
+    }
+    Pl2303UsbFreeControlRequest(DeviceObject, Request);
+
+    return Status;
+}
+
+/*
+ * A failed transfer is sent again once its pipe has been reset, unless it
+ * was cancelled or the device is gone.
+ */
+static
+BOOLEAN
+Pl2303UsbIsTransferRecoverable(
+    _In_ PPIPE_TRANSFER Transfer)
+{
+    PDEVICE_EXTENSION DeviceExtension = Transfer->DeviceObject->DeviceExtension;
+    NTSTATUS Status = Transfer->Irp->IoStatus.Status;
+
+    return Status != STATUS_CANCELLED &&
+           Status != STATUS_NO_SUCH_DEVICE &&
+           Status != STATUS_DEVICE_NOT_CONNECTED &&
+           DeviceExtension->PnpState != SurpriseRemovePending;
+}
+
+/*
+ * A pipe is reset after PL2303_PIPE_RESET_DELAY ms, twice that after the
+ * next failure in a row, and so on, so a device that keeps failing is not
+ * flooded with resets. Count is the number of failures in a row.
+ */
+static
+VOID
+Pl2303UsbScheduleReset(
+    _In_ PKTIMER Timer,
+    _In_ PKDPC Dpc,
+    _In_ ULONG Count)
+{
+    LARGE_INTEGER DueTime;
+
+    NT_ASSERT(Count >= 1);
+    if (Count > PL2303_PIPE_RESET_LIMIT)
+        Count = PL2303_PIPE_RESET_LIMIT;
+    DueTime.QuadPart = -10000LL * (PL2303_PIPE_RESET_DELAY << (Count - 1));
+    (VOID)KeSetTimer(Timer, DueTime, Dpc);
+}
+
+/*
+ * Called when a pump has given up on its pipe. The PnP manager is asked to
+ * query the device state again, and is told that the device has failed.
+ */
+static
+VOID
+Pl2303UsbReportPipeFailure(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+
+    PAGED_CODE();
+
+    DeviceExtension->PipeFailed = TRUE;
+    IoInvalidateDeviceState(DeviceExtension->PhysicalDevice);
+}
+
+static
+VOID
+Pl2303UsbPrepareReadTransfer(
+    _In_ PPIPE_TRANSFER Transfer)
+{
+    PDEVICE_EXTENSION DeviceExtension = Transfer->DeviceObject->DeviceExtension;
+
+    Pl2303UsbPrepareTransfer(Transfer,
+                             DeviceExtension->BulkInPipe,
+                             Transfer->Buffer,
+                             PL2303_READ_TRANSFER_SIZE,
+                             USBD_TRANSFER_DIRECTION_IN | USBD_SHORT_TRANSFER_OK,
+                             Pl2303UsbReadCompletion);
+}
+
+_Function_class_(IO_COMPLETION_ROUTINE)
+static
+NTSTATUS
+NTAPI
+Pl2303UsbReadCompletion(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PIRP Irp,
+    _In_reads_(sizeof(PIPE_TRANSFER)) PVOID Context)
+{
+    PPIPE_TRANSFER Transfer = Context;
+    PDEVICE_EXTENSION DeviceExtension = Transfer->DeviceObject->DeviceExtension;
+    BOOLEAN Resubmit = FALSE;
+    BOOLEAN Reset = FALSE;
+    BOOLEAN QueueReset = FALSE;
+    ULONG ResetCount = 0;
+    KIRQL OldIrql;
+
+    UNREFERENCED_PARAMETER(DeviceObject);
+    NT_ASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
+    NT_ASSERT(Irp == Transfer->Irp);
+
+    Pl2303Debug(         "%s. Irp=%p, Context=%p\n",
+                __FUNCTION__, Irp,    Context);
+
+    Pl2303CountLatency(&DeviceExtension->UrbLatency[PL2303_LATENCY_READ], Transfer->SubmitTime);
+    Pl2303UsbRecordTransfer(Transfer, PL2303_RECORD_URB_COMPLETE);
+
+    if (NT_SUCCESS(Irp->IoStatus.Status) &&
+        USBD_SUCCESS(Transfer->Urb.Hdr.Status))
+    {
+        if (Transfer->Urb.TransferBufferLength)
+        {
+            PL2303_COUNT(DeviceExtension, ReceivedCount, Transfer->Urb.TransferBufferLength);
+            Pl2303ReceiveData(Transfer->DeviceObject,
+                              Transfer->Buffer,
+                              Transfer->Urb.TransferBufferLength);
+        }
+        Resubmit = TRUE;
+    }
+    else if (Pl2303UsbIsTransferRecoverable(Transfer))
+    {
+        Pl2303Warn(         "%s. Read transfer failed with %08lx, %08lx\n",
+                   __FUNCTION__, Irp->IoStatus.Status, Transfer->Urb.Hdr.Status);
+        Reset = TRUE;
+    }
+
+    /*
+     * Prepare the IRP under the lock so that a concurrent stop can cancel it.
+     * A failed transfer waits for the pipe to be reset at PASSIVE_LEVEL, and
+     * still counts as pending until then. Transfers that fail while a reset
+     * is scheduled wait for that one.
+     */
+    KeAcquireSpinLock(&DeviceExtension->ReadSpinLock, &OldIrql);
+    Resubmit = Resubmit && DeviceExtension->ReadPumpRunning;
+    Reset = Reset && DeviceExtension->ReadPumpRunning;
+    if (Resubmit)
+    {
+        DeviceExtension->ReadResetCount = 0;
+        Pl2303UsbPrepareReadTransfer(Transfer);
+    }
+    else if (Reset)
+    {
+        InsertTailList(&DeviceExtension->ReadResetList, &Transfer->ListEntry);
+        QueueReset = !DeviceExtension->ReadResetQueued;
+        DeviceExtension->ReadResetQueued = TRUE;
+        if (QueueReset)
+            ResetCount = ++DeviceExtension->ReadResetCount;
+    }
+    KeReleaseSpinLock(&DeviceExtension->ReadSpinLock, OldIrql);
+
+    if (Resubmit)
+    {
+        Pl2303UsbSubmitTransfer(Transfer);
+    }
+    else if (Reset)
+    {
+        if (QueueReset)
+        {
+            Pl2303UsbScheduleReset(&DeviceExtension->ReadResetTimer,
+                                   &DeviceExtension->ReadResetDpc,
+                                   ResetCount);
+        }
+    }
+    else if (InterlockedDecrement(&DeviceExtension->ReadTransfersPending) == 0)
+    {
+        KeSetEvent(&DeviceExtension->ReadPumpStoppedEvent, IO_NO_INCREMENT, FALSE);
+    }
+
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+_Function_class_(KDEFERRED_ROUTINE)
+static
+VOID
+NTAPI
+Pl2303UsbReadResetDpc(
+    _In_ PKDPC Dpc,
+    _In_opt_ PVOID DeferredContext,
+    _In_opt_ PVOID SystemArgument1,
+    _In_opt_ PVOID SystemArgument2)
+{
+    PDEVICE_OBJECT DeviceObject = DeferredContext;
+    PDEVICE_EXTENSION DeviceExtension;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+    NT_ASSERT(DeviceObject);
+
+    DeviceExtension = DeviceObject->DeviceExtension;
+    IoQueueWorkItem(DeviceExtension->ReadResetWorkItem,
+                    Pl2303UsbResetReadPipe,
+                    DelayedWorkQueue,
+                    NULL);
+}
+
+/*
+ * Resets the bulk-IN pipe and sends the transfers that failed on it again.
+ * If the pump is being stopped or the reset fails, they are retired instead.
+ * After PL2303_PIPE_RESET_LIMIT resets in a row without a transfer getting
+ * through, the pump stops and the device is reported as failed.
+ */
+_Function_class_(IO_WORKITEM_ROUTINE)
+static
+VOID
+NTAPI
+Pl2303UsbResetReadPipe(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_opt_ PVOID Context)
+{
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    LIST_ENTRY Transfers;
+    PLIST_ENTRY ListEntry;
+    PPIPE_TRANSFER Transfer;
+    BOOLEAN Running;
+    BOOLEAN Resubmit;
+    BOOLEAN Failed;
+    ULONG ResetCount;
+    KIRQL OldIrql;
+
+    PAGED_CODE();
+    UNREFERENCED_PARAMETER(Context);
+
+    Pl2303Debug(         "%s. DeviceObject=%p\n",
+                __FUNCTION__, DeviceObject);
+
+    KeAcquireSpinLock(&DeviceExtension->ReadSpinLock, &OldIrql);
+    Running = DeviceExtension->ReadPumpRunning;
+    ResetCount = DeviceExtension->ReadResetCount;
+    KeReleaseSpinLock(&DeviceExtension->ReadSpinLock, OldIrql);
+
+    if (!Running)
+    {
+        Status = STATUS_CANCELLED;
+    }
+    else if (ResetCount > PL2303_PIPE_RESET_LIMIT)
+    {
+        Pl2303Error(         "%s. Giving up after %lu failures in a row\n",
+                    __FUNCTION__, ResetCount);
+        Status = STATUS_UNSUCCESSFUL;
+    }
+    else
+    {
+        Status = Pl2303UsbResetPipe(DeviceObject, DeviceExtension->BulkInPipe);
+    }
+
+    InitializeListHead(&Transfers);
+    KeAcquireSpinLock(&DeviceExtension->ReadSpinLock, &OldIrql);
+    while (!IsListEmpty(&DeviceExtension->ReadResetList))
+    {
+        ListEntry = RemoveHeadList(&DeviceExtension->ReadResetList);
+        InsertTailList(&Transfers, ListEntry);
+    }
+    DeviceExtension->ReadResetQueued = FALSE;
+    Resubmit = NT_SUCCESS(Status) && DeviceExtension->ReadPumpRunning;
+    /* Let the transfers still out retire as they complete */
+    Failed = !NT_SUCCESS(Status) && DeviceExtension->ReadPumpRunning;
+    if (Failed)
+        DeviceExtension->ReadPumpRunning = FALSE;
+    if (Resubmit)
+    {
+        for (ListEntry = Transfers.Flink; ListEntry != &Transfers; ListEntry = ListEntry->Flink)
+        {
+            Transfer = CONTAINING_RECORD(ListEntry, PIPE_TRANSFER, ListEntry);
+            Pl2303UsbPrepareReadTransfer(Transfer);
+        }
+    }
+    KeReleaseSpinLock(&DeviceExtension->ReadSpinLock, OldIrql);
+
+    while (!IsListEmpty(&Transfers))
+    {
+        ListEntry = RemoveHeadList(&Transfers);
+        Transfer = CONTAINING_RECORD(ListEntry, PIPE_TRANSFER, ListEntry);
+        if (Resubmit)
+            Pl2303UsbSubmitTransfer(Transfer);
+        else if (InterlockedDecrement(&DeviceExtension->ReadTransfersPending) == 0)
+            KeSetEvent(&DeviceExtension->ReadPumpStoppedEvent, IO_NO_INCREMENT, FALSE);
+    }
+
+    if (Failed)
+        Pl2303UsbReportPipeFailure(DeviceObject);
+}
+
+NTSTATUS
+Pl2303UsbStartReadPump(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PPIPE_TRANSFER Transfers;
+    KIRQL OldIrql;
+    ULONG i;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p\n",
+                __FUNCTION__, DeviceObject);
+
+    NT_ASSERT(DeviceExtension->ReadTransfers == NULL);
+
+    DeviceExtension->ReadResetWorkItem = IoAllocateWorkItem(DeviceObject);
+    if (!DeviceExtension->ReadResetWorkItem)
+    {
+        Pl2303Error(         "%s. IoAllocateWorkItem failed\n",
+                    __FUNCTION__);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    Status = Pl2303UsbAllocateTransfers(DeviceObject,
+                                        PL2303_READ_TRANSFER_COUNT,
+                                        PL2303_READ_TRANSFER_SIZE,
+                                        &Transfers);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. Pl2303UsbAllocateTransfers failed with %08lx\n",
+                    __FUNCTION__, Status);
+        IoFreeWorkItem(DeviceExtension->ReadResetWorkItem);
+        DeviceExtension->ReadResetWorkItem = NULL;
+        return Status;
+    }
+
+    KeInitializeEvent(&DeviceExtension->ReadPumpStoppedEvent, NotificationEvent, FALSE);
+    KeInitializeTimer(&DeviceExtension->ReadResetTimer);
+    KeInitializeDpc(&DeviceExtension->ReadResetDpc,
+                    Pl2303UsbReadResetDpc,
+                    DeviceObject);
+    DeviceExtension->ReadResetCount = 0;
+    InitializeListHead(&DeviceExtension->ReadResetList);
+    DeviceExtension->ReadResetQueued = FALSE;
+    DeviceExtension->ReadTransfersPending = PL2303_READ_TRANSFER_COUNT;
+    DeviceExtension->ReadTransfers = Transfers;
+
+    KeAcquireSpinLock(&DeviceExtension->ReadSpinLock, &OldIrql);
+    DeviceExtension->ReadPumpRunning = TRUE;
+    for (i = 0; i < PL2303_READ_TRANSFER_COUNT; i++)
+        Pl2303UsbPrepareReadTransfer(&Transfers[i]);
+    KeReleaseSpinLock(&DeviceExtension->ReadSpinLock, OldIrql);
+
+    for (i = 0; i < PL2303_READ_TRANSFER_COUNT; i++)
+        Pl2303UsbSubmitTransfer(&Transfers[i]);
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+Pl2303UsbStopReadPump(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PPIPE_TRANSFER Transfers = DeviceExtension->ReadTransfers;
+    KIRQL OldIrql;
+    ULONG i;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p\n",
+                __FUNCTION__, DeviceObject);
+
+    if (!Transfers)
+        return;
+
+    KeAcquireSpinLock(&DeviceExtension->ReadSpinLock, &OldIrql);
+    DeviceExtension->ReadPumpRunning = FALSE;
+    KeReleaseSpinLock(&DeviceExtension->ReadSpinLock, OldIrql);
+
+    for (i = 0; i < PL2303_READ_TRANSFER_COUNT; i++)
+        (VOID)IoCancelIrp(Transfers[i].Irp);
+
+    /* Transfers waiting for a pipe reset are retired by the work item */
+    if (KeCancelTimer(&DeviceExtension->ReadResetTimer))
+    {
+        IoQueueWorkItem(DeviceExtension->ReadResetWorkItem,
+                        Pl2303UsbResetReadPipe,
+                        DelayedWorkQueue,
+                        NULL);
+    }
+
+    (VOID)KeWaitForSingleObject(&DeviceExtension->ReadPumpStoppedEvent,
+                                Executive,
+                                KernelMode,
+                                FALSE,
+                                NULL);
+
+    DeviceExtension->ReadTransfers = NULL;
+    Pl2303UsbFreeTransfers(Transfers, PL2303_READ_TRANSFER_COUNT);
+    IoFreeWorkItem(DeviceExtension->ReadResetWorkItem);
+    DeviceExtension->ReadResetWorkItem = NULL;
+}
+
+/*
+ * The interrupt-IN pipe carries a notification whenever the modem input
+ * lines or the receiver error flags change. A single transfer is kept
+ * pending on it for as long as the device is started, so that the current
+ * line state is always available without a request to the device.
+ */
+static
+VOID
+Pl2303UsbPrepareStatusTransfer(
+    _In_ PPIPE_TRANSFER Transfer)
+{
+    PDEVICE_EXTENSION DeviceExtension = Transfer->DeviceObject->DeviceExtension;
+
+    Pl2303UsbPrepareTransfer(Transfer,
+                             DeviceExtension->InterruptInPipe,
+                             Transfer->Buffer,
+                             PL2303_STATUS_TRANSFER_SIZE,
+                             USBD_TRANSFER_DIRECTION_IN | USBD_SHORT_TRANSFER_OK,
+                             Pl2303UsbStatusCompletion);
+}
+
+_Function_class_(IO_COMPLETION_ROUTINE)
+static
+NTSTATUS
+NTAPI
+Pl2303UsbStatusCompletion(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PIRP Irp,
+    _In_reads_(sizeof(PIPE_TRANSFER)) PVOID Context)
+{
+    PPIPE_TRANSFER Transfer = Context;
+    PDEVICE_EXTENSION DeviceExtension = Transfer->DeviceObject->DeviceExtension;
+    BOOLEAN Resubmit = FALSE;
+    BOOLEAN Reset = FALSE;
+    ULONG ResetCount = 0;
+    KIRQL OldIrql;
+
+    UNREFERENCED_PARAMETER(DeviceObject);
+    NT_ASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
+    NT_ASSERT(Irp == Transfer->Irp);
+
+    Pl2303Debug(         "%s. Irp=%p, Context=%p\n",
+                __FUNCTION__, Irp,    Context);
+
+    Pl2303UsbRecordTransfer(Transfer, PL2303_RECORD_URB_COMPLETE);
+
+    if (NT_SUCCESS(Irp->IoStatus.Status) &&
+        USBD_SUCCESS(Transfer->Urb.Hdr.Status))
+    {
+        if (Transfer->Urb.TransferBufferLength > PL2303_STATUS_STATE_INDEX)
+        {
+            Pl2303UpdateStatus(Transfer->DeviceObject,
+                               Transfer->Buffer[PL2303_STATUS_STATE_INDEX]);
+        }
+        Resubmit = TRUE;
+    }
+    else if (Pl2303UsbIsTransferRecoverable(Transfer))
+    {
+        Pl2303Warn(         "%s. Status transfer failed with %08lx, %08lx\n",
+                   __FUNCTION__, Irp->IoStatus.Status, Transfer->Urb.Hdr.Status);
+        Reset = TRUE;
+    }
+
+    KeAcquireSpinLock(&DeviceExtension->StatusSpinLock, &OldIrql);
+    Resubmit = Resubmit && DeviceExtension->StatusPumpRunning;
+    Reset = Reset && DeviceExtension->StatusPumpRunning;
+    if (Resubmit)
+    {
+        DeviceExtension->StatusResetCount = 0;
+        Pl2303UsbPrepareStatusTransfer(Transfer);
+    }
+    else if (Reset)
+    {
+        ResetCount = ++DeviceExtension->StatusResetCount;
+    }
+    KeReleaseSpinLock(&DeviceExtension->StatusSpinLock, OldIrql);
+
+    if (Resubmit)
+    {
+        Pl2303UsbSubmitTransfer(Transfer);
+    }
+    else if (Reset)
+    {
+        Pl2303UsbScheduleReset(&DeviceExtension->StatusResetTimer,
+                               &DeviceExtension->StatusResetDpc,
+                               ResetCount);
+    }
+    else
+    {
+        KeSetEvent(&DeviceExtension->StatusPumpStoppedEvent, IO_NO_INCREMENT, FALSE);
+    }
+
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+_Function_class_(KDEFERRED_ROUTINE)
+static
+VOID
+NTAPI
+Pl2303UsbStatusResetDpc(
+    _In_ PKDPC Dpc,
+    _In_opt_ PVOID DeferredContext,
+    _In_opt_ PVOID SystemArgument1,
+    _In_opt_ PVOID SystemArgument2)
+{
+    PDEVICE_OBJECT DeviceObject = DeferredContext;
+    PDEVICE_EXTENSION DeviceExtension;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+    NT_ASSERT(DeviceObject);
+
+    DeviceExtension = DeviceObject->DeviceExtension;
+    IoQueueWorkItem(DeviceExtension->StatusResetWorkItem,
+                    Pl2303UsbResetStatusPipe,
+                    DelayedWorkQueue,
+                    DeviceExtension->StatusTransfer);
+}
+
+/*
+ * Resets the interrupt-IN pipe and sends the status transfer that failed on
+ * it again, unless the pump is being stopped or the reset fails. Like the
+ * read pump, it gives up after PL2303_PIPE_RESET_LIMIT resets in a row.
+ */
+_Function_class_(IO_WORKITEM_ROUTINE)
+static
+VOID
+NTAPI
+Pl2303UsbResetStatusPipe(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_opt_ PVOID Context)
+{
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PPIPE_TRANSFER Transfer = Context;
+    BOOLEAN Running;
+    BOOLEAN Resubmit;
+    BOOLEAN Failed;
+    ULONG ResetCount;
+    KIRQL OldIrql;
+
+    PAGED_CODE();
+    NT_ASSERT(Transfer != NULL);
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Transfer=%p\n",
+                __FUNCTION__, DeviceObject,    Transfer);
+
+    KeAcquireSpinLock(&DeviceExtension->StatusSpinLock, &OldIrql);
+    Running = DeviceExtension->StatusPumpRunning;
+    ResetCount = DeviceExtension->StatusResetCount;
+    KeReleaseSpinLock(&DeviceExtension->StatusSpinLock, OldIrql);
+
+    if (!Running)
+    {
+        Status = STATUS_CANCELLED;
+    }
+    else if (ResetCount > PL2303_PIPE_RESET_LIMIT)
+    {
+        Pl2303Error(         "%s. Giving up after %lu failures in a row\n",
+                    __FUNCTION__, ResetCount);
+        Status = STATUS_UNSUCCESSFUL;
+    }
+    else
+    {
+        Status = Pl2303UsbResetPipe(DeviceObject, DeviceExtension->InterruptInPipe);
+    }
+
+    KeAcquireSpinLock(&DeviceExtension->StatusSpinLock, &OldIrql);
+    Resubmit = NT_SUCCESS(Status) && DeviceExtension->StatusPumpRunning;
+    Failed = !NT_SUCCESS(Status) && DeviceExtension->StatusPumpRunning;
+    if (Failed)
+        DeviceExtension->StatusPumpRunning = FALSE;
+    if (Resubmit)
+        Pl2303UsbPrepareStatusTransfer(Transfer);
+    KeReleaseSpinLock(&DeviceExtension->StatusSpinLock, OldIrql);
+
+    if (Resubmit)
+        Pl2303UsbSubmitTransfer(Transfer);
+    else
+        KeSetEvent(&DeviceExtension->StatusPumpStoppedEvent, IO_NO_INCREMENT, FALSE);
+
+    if (Failed)
+        Pl2303UsbReportPipeFailure(DeviceObject);
+}
+
+NTSTATUS
+Pl2303UsbStartStatusPump(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PPIPE_TRANSFER Transfer;
+    KIRQL OldIrql;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p\n",
+                __FUNCTION__, DeviceObject);
+
+    NT_ASSERT(DeviceExtension->StatusTransfer == NULL);
+
+    DeviceExtension->StatusResetWorkItem = IoAllocateWorkItem(DeviceObject);
+    if (!DeviceExtension->StatusResetWorkItem)
+    {
+        Pl2303Error(         "%s. IoAllocateWorkItem failed\n",
+                    __FUNCTION__);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    Status = Pl2303UsbAllocateTransfers(DeviceObject,
+                                        1,
+                                        PL2303_STATUS_TRANSFER_SIZE,
+                                        &Transfer);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. Pl2303UsbAllocateTransfers failed with %08lx\n",
+                    __FUNCTION__, Status);
+        IoFreeWorkItem(DeviceExtension->StatusResetWorkItem);
+        DeviceExtension->StatusResetWorkItem = NULL;
+        return Status;
+    }
+
+    KeInitializeEvent(&DeviceExtension->StatusPumpStoppedEvent, NotificationEvent, FALSE);
+    KeInitializeTimer(&DeviceExtension->StatusResetTimer);
+    KeInitializeDpc(&DeviceExtension->StatusResetDpc,
+                    Pl2303UsbStatusResetDpc,
+                    DeviceObject);
+    DeviceExtension->StatusResetCount = 0;
+    DeviceExtension->StatusTransfer = Transfer;
+
+    KeAcquireSpinLock(&DeviceExtension->StatusSpinLock, &OldIrql);
+    DeviceExtension->ModemStatus = 0;
+    DeviceExtension->Errors = 0;
+    DeviceExtension->StatusPumpRunning = TRUE;
+    Pl2303UsbPrepareStatusTransfer(Transfer);
+    KeReleaseSpinLock(&DeviceExtension->StatusSpinLock, OldIrql);
+
+    Pl2303UsbSubmitTransfer(Transfer);
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+Pl2303UsbStopStatusPump(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PPIPE_TRANSFER Transfer = DeviceExtension->StatusTransfer;
+    KIRQL OldIrql;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p\n",
+                __FUNCTION__, DeviceObject);
+
+    if (!Transfer)
+        return;
+
+    KeAcquireSpinLock(&DeviceExtension->StatusSpinLock, &OldIrql);
+    DeviceExtension->StatusPumpRunning = FALSE;
+    KeReleaseSpinLock(&DeviceExtension->StatusSpinLock, OldIrql);
+
+    (VOID)IoCancelIrp(Transfer->Irp);
+
+    /* A transfer waiting for a pipe reset is retired by the work item */
+    if (KeCancelTimer(&DeviceExtension->StatusResetTimer))
+    {
+        IoQueueWorkItem(DeviceExtension->StatusResetWorkItem,
+                        Pl2303UsbResetStatusPipe,
+                        DelayedWorkQueue,
+                        Transfer);
+    }
+
+    (VOID)KeWaitForSingleObject(&DeviceExtension->StatusPumpStoppedEvent,
+                                Executive,
+                                KernelMode,
+                                FALSE,
+                                NULL);
+
+    DeviceExtension->StatusTransfer = NULL;
+    Pl2303UsbFreeTransfers(Transfer, 1);
+    IoFreeWorkItem(DeviceExtension->StatusResetWorkItem);
+    DeviceExtension->StatusResetWorkItem = NULL;
+}
+
+_Function_class_(IO_COMPLETION_ROUTINE)
+static
+NTSTATUS
+NTAPI
+Pl2303UsbWriteCompletion(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PIRP Irp,
+    _In_reads_(sizeof(PIPE_TRANSFER)) PVOID Context)
+{
+    PPIPE_TRANSFER Transfer = Context;
+    PDEVICE_EXTENSION DeviceExtension = Transfer->DeviceObject->DeviceExtension;
+    NTSTATUS Status = Irp->IoStatus.Status;
+    ULONG Length = 0;
+
+    UNREFERENCED_PARAMETER(DeviceObject);
+    NT_ASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
+    NT_ASSERT(Irp == Transfer->Irp);
+
+    Pl2303Debug(         "%s. Irp=%p, Context=%p\n",
+                __FUNCTION__, Irp,    Context);
+
+    Pl2303CountLatency(&DeviceExtension->UrbLatency[PL2303_LATENCY_WRITE], Transfer->SubmitTime);
+    Pl2303UsbRecordTransfer(Transfer, PL2303_RECORD_URB_COMPLETE);
+
+    if (NT_SUCCESS(Status))
+    {
+        if (USBD_SUCCESS(Transfer->Urb.Hdr.Status))
+        {
+            Length = Transfer->Urb.TransferBufferLength;
+        }
+        else
+        {
+            Pl2303Warn(         "%s. URB failed with %08lx\n",
+                       __FUNCTION__, Transfer->Urb.Hdr.Status);
+            Status = Pl2303UsbMapUsbdStatus(Transfer->Urb.Hdr.Status);
+        }
+    }
+    else if (Status != STATUS_CANCELLED)
+    {
+        Pl2303Warn(         "%s. IRP failed with %08lx\n",
+                   __FUNCTION__, Status);
+    }
+
+    PL2303_COUNT(DeviceExtension, TransmittedCount, Length);
+    Pl2303WriteTransferComplete(Transfer, Status, Length);
+
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+VOID
+Pl2303UsbPrepareWriteTransfer(
+    _In_ PPIPE_TRANSFER Transfer,
+    _In_reads_bytes_(Length) PVOID Buffer,
+    _In_ ULONG Length)
+{
+    PDEVICE_EXTENSION DeviceExtension = Transfer->DeviceObject->DeviceExtension;
+
+    Pl2303UsbPrepareTransfer(Transfer,
+                             DeviceExtension->BulkOutPipe,
+                             Buffer,
+                             Length,
+                             USBD_TRANSFER_DIRECTION_OUT,
+                             Pl2303UsbWriteCompletion);
 }
\ No newline at end of file
@@ -0,0 +1,1146 @@
+/*
+ * PL2303 Driver write request handling
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#define PL2303_TRACE_COMPONENT PL2303_TRACE_WRITE
+#include "pl2303.h"
+
+/*
+ * Writes are split into chunks of at most WriteTransferSize bytes, which are
+ * sent on a fixed set of driver-owned bulk-OUT transfers. Started writes are
+ * kept on ActiveWrites in the order they were received; only the first one
+ * that still has unsent bytes is sent from, so byte order is preserved while
+ * the next write starts filling free transfers as soon as the previous one
+ * has been handed out completely. Writes are completed from the head of
+ * ActiveWrites only, so they also complete in order.
+ *
+ * While a write is active, its IoStatus.Status is STATUS_PENDING until it
+ * fails or is aborted, and IoStatus.Information counts the bytes the device
+ * has accepted. A transfer's References count the outstanding USB request
+ * plus any IoCancelIrp calls still in progress on it; a transfer is only
+ * reused or freed once they drop to zero.
+ *
+ * Prepared transfers are put on WriteSubmitList and passed down by a single
+ * submitter at a time, so they reach the bus in the order they were
+ * prepared even when several threads prepare transfers concurrently.
+ *
+ * When write coalescing is enabled, writes of at most WriteCoalesceSize bytes
+ * are not sent from directly. Instead they are copied into the buffer of the
+ * staging transfer, which is submitted once it is full, once a write that
+ * does not fit must be sent, or once WriteCoalesceTimeout has passed since it
+ * was opened. Each staged write records its transfer in its context flags and
+ * only counts as sent when that transfer completes. A staged write that is
+ * aborted cannot take back its bytes; the shared transfer is only cancelled
+ * (or, if not yet submitted, dropped) once none of its writes is pending
+ * anymore.
+ *
+ * While WriteHoldReasons is non-zero (e.g. after the peer sent XOFF), no new
+ * transfers are prepared. Transfers that were already prepared are still
+ * sent, and writes may still be aborted or time out. XON/XOFF characters that
+ * the driver sends for receive flow control use the separate
+ * WriteFlowTransfer, which bypasses both the hold and WriteSubmitList.
+ */
+
+/*
+ * The write context lives in the IRP's DriverContext. The cancel-safe queue
+ * keeps its own context in the last element of DriverContext, so the write
+ * context must stay clear of it. The deadline does not fit next to it on
+ * 32-bit systems and is kept in the Key of our own stack location instead,
+ * which serial writes do not use.
+ */
+typedef struct _WRITE_CONTEXT
+{
+    ULONG ArrivalTime;
+    ULONG BytesSent;
+    USHORT TransfersPending;
+    USHORT Flags;
+} WRITE_CONTEXT, *PWRITE_CONTEXT;
+
+#define WRITE_CANCEL_ROUTINE_RAN    0x01
+#define WRITE_TIMEOUT_SET           0x02
+/* One-based index of the transfer a coalesced write was copied into */
+#define WRITE_STAGED_MASK           0xff00
+#define WRITE_STAGED_SHIFT          8
+
+C_ASSERT(PL2303_MAX_WRITE_TRANSFER_COUNT < (WRITE_STAGED_MASK >> WRITE_STAGED_SHIFT));
+
+C_ASSERT(sizeof(WRITE_CONTEXT) <= 3 * sizeof(PVOID));
+C_ASSERT(RTL_FIELD_SIZE(IO_STACK_LOCATION, Parameters.Write.Key) == sizeof(ULONG));
+
+_Function_class_(DRIVER_CANCEL)
+static DRIVER_CANCEL Pl2303CancelWrite;
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, Pl2303StartWrites)
+#pragma alloc_text(PAGE, Pl2303StopWrites)
+#endif /* defined ALLOC_PRAGMA */
+
+static
+inline
+PWRITE_CONTEXT
+Pl2303GetWriteContext(
+    _In_ PIRP Irp)
+{
+    return (PWRITE_CONTEXT)Irp->Tail.Overlay.DriverContext;
+}
+
+static
+inline
+PULONG
+Pl2303GetWriteDeadline(
+    _In_ PIRP Irp)
+{
+    return &IoGetCurrentIrpStackLocation(Irp)->Parameters.Write.Key;
+}
+
+static
+inline
+ULONG
+Pl2303GetWriteLength(
+    _In_ PIRP Irp)
+{
+    return IoGetCurrentIrpStackLocation(Irp)->Parameters.Write.Length;
+}
+
+static
+inline
+USHORT
+Pl2303GetStagedFlag(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ PPIPE_TRANSFER Transfer)
+{
+    return (USHORT)((Transfer - DeviceExtension->WriteTransfers + 1) << WRITE_STAGED_SHIFT);
+}
+
+_Requires_lock_held_(DeviceExtension->WriteSpinLock)
+static
+VOID
+Pl2303ReferenceWriteTransfer(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ PPIPE_TRANSFER Transfer)
+{
+    Transfer->References++;
+    if (DeviceExtension->WriteTransferReferences++ == 0)
+        KeClearEvent(&DeviceExtension->WriteIdleEvent);
+}
+
+_Requires_lock_held_(DeviceExtension->WriteSpinLock)
+static
+VOID
+Pl2303DereferenceWriteTransfer(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ PPIPE_TRANSFER Transfer)
+{
+    NT_ASSERT(Transfer->References > 0);
+    NT_ASSERT(DeviceExtension->WriteTransferReferences > 0);
+    Transfer->References--;
+    if (--DeviceExtension->WriteTransferReferences == 0)
+        KeSetEvent(&DeviceExtension->WriteIdleEvent, IO_NO_INCREMENT, FALSE);
+}
+
+/*
+ * Makes Irp an active write. Returns FALSE if the write was cancelled
+ * before that happened, in which case its status has been set.
+ */
+_Requires_lock_held_(DeviceExtension->WriteSpinLock)
+static
+BOOLEAN
+Pl2303StartWrite(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ PIRP Irp)
+{
+    PWRITE_CONTEXT Context = Pl2303GetWriteContext(Irp);
+    LINE_STATE LineState;
+    const SERIAL_TIMEOUTS *Timeouts = &LineState.Timeouts;
+    ULONGLONG TotalTimeout;
+
+    (VOID)IoSetCancelRoutine(Irp, Pl2303CancelWrite);
+    if (Irp->Cancel && IoSetCancelRoutine(Irp, NULL))
+    {
+        Irp->IoStatus.Status = STATUS_CANCELLED;
+        return FALSE;
+    }
+
+    Irp->IoStatus.Status = STATUS_PENDING;
+    Context->BytesSent = 0;
+    Context->TransfersPending = 0;
+    Context->Flags = 0;
+
+    Pl2303QueryLineState(DeviceExtension, &LineState);
+    TotalTimeout = (ULONGLONG)Timeouts->WriteTotalTimeoutMultiplier * Pl2303GetWriteLength(Irp) +
+                   Timeouts->WriteTotalTimeoutConstant;
+    if (TotalTimeout)
+    {
+        Context->Flags |= WRITE_TIMEOUT_SET;
+        *Pl2303GetWriteDeadline(Irp) = Pl2303TimeoutToDeadline(TotalTimeout);
+        Pl2303ArmTimeoutTimer(DeviceExtension, *Pl2303GetWriteDeadline(Irp));
+    }
+
+    InsertTailList(&DeviceExtension->ActiveWrites, &Irp->Tail.Overlay.ListEntry);
+    return TRUE;
+}
+
+/*
+ * Returns the active write that bytes should be sent from next, starting
+ * queued writes as needed. Queued writes that were cancelled before they
+ * could be started are moved to CompletionList.
+ */
+_Requires_lock_held_(DeviceExtension->WriteSpinLock)
+static
+PIRP
+Pl2303GetSendingWrite(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _Inout_ PLIST_ENTRY CompletionList)
+{
+    PLIST_ENTRY ListEntry;
+    PIRP Irp;
+
+    for (ListEntry = DeviceExtension->ActiveWrites.Flink;
+         ListEntry != &DeviceExtension->ActiveWrites;
+         ListEntry = ListEntry->Flink)
+    {
+        Irp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+        if (Irp->IoStatus.Status == STATUS_PENDING &&
+            Pl2303GetWriteContext(Irp)->BytesSent < Pl2303GetWriteLength(Irp))
+        {
+            return Irp;
+        }
+    }
+
+    while ((Irp = Pl2303DequeueIrp(&DeviceExtension->WriteQueue)) != NULL)
+    {
+        if (Pl2303StartWrite(DeviceExtension, Irp))
+            return Irp;
+
+        InsertTailList(CompletionList, &Irp->Tail.Overlay.ListEntry);
+    }
+
+    return NULL;
+}
+
+_Requires_lock_held_(DeviceExtension->WriteSpinLock)
+static
+PPIPE_TRANSFER
+Pl2303GetFreeWriteTransfer(
+    _In_ PDEVICE_EXTENSION DeviceExtension)
+{
+    ULONG i;
+
+    for (i = 0; i < DeviceExtension->WriteTransferCount; i++)
+    {
+        if (DeviceExtension->WriteTransfers[i].References == 0)
+            return &DeviceExtension->WriteTransfers[i];
+    }
+
+    return NULL;
+}
+
+/*
+ * Accounts a coalesced transfer that has finished or is being dropped to
+ * every write staged in it. The bytes that were sent are attributed to the
+ * writes in the order they were copied.
+ */
+_Requires_lock_held_(DeviceExtension->WriteSpinLock)
+static
+VOID
+Pl2303CompleteStagedWrites(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ PPIPE_TRANSFER Transfer,
+    _In_ NTSTATUS Status,
+    _In_ ULONG Length)
+{
+    ULONG StagedFlag = Pl2303GetStagedFlag(DeviceExtension, Transfer);
+    PLIST_ENTRY ListEntry;
+    PWRITE_CONTEXT Context;
+    ULONG WriteLength;
+    PIRP Irp;
+
+    for (ListEntry = &Transfer->Request->Tail.Overlay.ListEntry;
+         ListEntry != &DeviceExtension->ActiveWrites;
+         ListEntry = ListEntry->Flink)
+    {
+        Irp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+        Context = Pl2303GetWriteContext(Irp);
+        if ((Context->Flags & WRITE_STAGED_MASK) != StagedFlag)
+            continue;
+
+        NT_ASSERT(Context->TransfersPending == 1);
+        Context->Flags &= ~WRITE_STAGED_MASK;
+        Context->TransfersPending--;
+
+        WriteLength = min(Pl2303GetWriteLength(Irp), Length);
+        Irp->IoStatus.Information += WriteLength;
+        Length -= WriteLength;
+
+        if (!NT_SUCCESS(Status) && Irp->IoStatus.Status == STATUS_PENDING)
+            Irp->IoStatus.Status = Status;
+    }
+
+    Transfer->Request = NULL;
+    Pl2303DereferenceWriteTransfer(DeviceExtension, Transfer);
+}
+
+/*
+ * Returns TRUE if a write staged in Transfer has not been aborted.
+ */
+_Requires_lock_held_(DeviceExtension->WriteSpinLock)
+static
+BOOLEAN
+Pl2303IsStagingTransferInUse(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ PPIPE_TRANSFER Transfer)
+{
+    ULONG StagedFlag = Pl2303GetStagedFlag(DeviceExtension, Transfer);
+    PLIST_ENTRY ListEntry;
+    PIRP Irp;
+
+    for (ListEntry = &Transfer->Request->Tail.Overlay.ListEntry;
+         ListEntry != &DeviceExtension->ActiveWrites;
+         ListEntry = ListEntry->Flink)
+    {
+        Irp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+        if ((Pl2303GetWriteContext(Irp)->Flags & WRITE_STAGED_MASK) == StagedFlag &&
+            Irp->IoStatus.Status == STATUS_PENDING)
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/*
+ * Closes the staging transfer, if any, and queues it for submission.
+ */
+_Requires_lock_held_(DeviceExtension->WriteSpinLock)
+static
+VOID
+Pl2303FlushStagedWrites(
+    _In_ PDEVICE_EXTENSION DeviceExtension)
+{
+    PPIPE_TRANSFER Transfer = DeviceExtension->WriteStaging;
+
+    if (!Transfer)
+        return;
+
+    DeviceExtension->WriteStaging = NULL;
+    Pl2303UsbPrepareWriteTransfer(Transfer,
+                                  Transfer->Buffer,
+                                  DeviceExtension->WriteStagedLength);
+    InsertTailList(&DeviceExtension->WriteSubmitList, &Transfer->ListEntry);
+}
+
+/*
+ * Copies a small write into the staging transfer, opening a new one as
+ * needed. Returns FALSE if there is no free transfer to open.
+ */
+_Requires_lock_held_(DeviceExtension->WriteSpinLock)
+static
+BOOLEAN
+Pl2303StageWrite(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ PIRP Irp)
+{
+    PWRITE_CONTEXT Context = Pl2303GetWriteContext(Irp);
+    ULONG Length = Pl2303GetWriteLength(Irp);
+    PPIPE_TRANSFER Transfer;
+
+    NT_ASSERT(Length <= DeviceExtension->WriteCoalesceSize);
+
+    if (DeviceExtension->WriteStaging &&
+        DeviceExtension->WriteStagedLength + Length > DeviceExtension->WriteCoalesceSize)
+    {
+        Pl2303FlushStagedWrites(DeviceExtension);
+    }
+
+    Transfer = DeviceExtension->WriteStaging;
+    if (!Transfer)
+    {
+        Transfer = Pl2303GetFreeWriteTransfer(DeviceExtension);
+        if (!Transfer)
+            return FALSE;
+
+        Transfer->Request = Irp;
+        Pl2303ReferenceWriteTransfer(DeviceExtension, Transfer);
+        DeviceExtension->WriteStaging = Transfer;
+        DeviceExtension->WriteStagedLength = 0;
+        DeviceExtension->WriteStagingDeadline = Pl2303TimeoutToDeadline(DeviceExtension->WriteCoalesceTimeout);
+        Pl2303ArmTimeoutTimer(DeviceExtension, DeviceExtension->WriteStagingDeadline);
+    }
+
+    RtlCopyMemory(Transfer->Buffer + DeviceExtension->WriteStagedLength,
+                  Irp->AssociatedIrp.SystemBuffer,
+                  Length);
+    DeviceExtension->WriteStagedLength += Length;
+    Context->BytesSent = Length;
+    Context->TransfersPending++;
+    Context->Flags |= Pl2303GetStagedFlag(DeviceExtension, Transfer);
+
+    if (DeviceExtension->WriteStagedLength == DeviceExtension->WriteCoalesceSize)
+        Pl2303FlushStagedWrites(DeviceExtension);
+
+    return TRUE;
+}
+
+/*
+ * Hands out as many chunks as there are free transfers, queueing them on
+ * WriteSubmitList. Pl2303SubmitWriteTransfers must be called once the write
+ * spin lock has been released.
+ */
+_Requires_lock_held_(DeviceExtension->WriteSpinLock)
+static
+VOID
+Pl2303PrepareWriteTransfers(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _Inout_ PLIST_ENTRY CompletionList)
+{
+    PPIPE_TRANSFER Transfer;
+    PWRITE_CONTEXT Context;
+    ULONG Length;
+    PIRP Irp;
+
+    if (!DeviceExtension->WritesRunning || DeviceExtension->WriteHoldReasons)
+        return;
+
+    for (;;)
+    {
+        if (!DeviceExtension->WriteStaging &&
+            !Pl2303GetFreeWriteTransfer(DeviceExtension))
+        {
+            break;
+        }
+
+        Irp = Pl2303GetSendingWrite(DeviceExtension, CompletionList);
+        if (!Irp)
+            break;
+
+        Context = Pl2303GetWriteContext(Irp);
+        Length = Pl2303GetWriteLength(Irp) - Context->BytesSent;
+        if (Context->BytesSent == 0 && Length <= DeviceExtension->WriteCoalesceSize)
+        {
+            if (!Pl2303StageWrite(DeviceExtension, Irp))
+                break;
+            continue;
+        }
+
+        /* Staged bytes were written first, so they must be sent first */
+        Pl2303FlushStagedWrites(DeviceExtension);
+
+        Transfer = Pl2303GetFreeWriteTransfer(DeviceExtension);
+        if (!Transfer)
+            break;
+
+        if (Length > DeviceExtension->WriteTransferSize)
+            Length = DeviceExtension->WriteTransferSize;
+
+        Pl2303UsbPrepareWriteTransfer(Transfer,
+                                      (PUCHAR)Irp->AssociatedIrp.SystemBuffer + Context->BytesSent,
+                                      Length);
+        Transfer->Request = Irp;
+        Pl2303ReferenceWriteTransfer(DeviceExtension, Transfer);
+        Context->BytesSent += Length;
+        Context->TransfersPending++;
+        InsertTailList(&DeviceExtension->WriteSubmitList, &Transfer->ListEntry);
+    }
+}
+
+/*
+ * Passes the queued transfers to the bus driver. Only one caller does so at a
+ * time; transfers queued by others meanwhile, including from completion
+ * routines of the transfers submitted here, are picked up by that caller.
+ */
+static
+VOID
+Pl2303SubmitWriteTransfers(
+    _In_ PDEVICE_EXTENSION DeviceExtension)
+{
+    PPIPE_TRANSFER Transfer;
+    PLIST_ENTRY ListEntry;
+    KIRQL OldIrql;
+
+    KeAcquireSpinLock(&DeviceExtension->WriteSpinLock, &OldIrql);
+    if (!DeviceExtension->WriteSubmitting)
+    {
+        DeviceExtension->WriteSubmitting = TRUE;
+        while (!IsListEmpty(&DeviceExtension->WriteSubmitList))
+        {
+            ListEntry = RemoveHeadList(&DeviceExtension->WriteSubmitList);
+            Transfer = CONTAINING_RECORD(ListEntry, PIPE_TRANSFER, ListEntry);
+            KeReleaseSpinLock(&DeviceExtension->WriteSpinLock, OldIrql);
+
+            Pl2303UsbSubmitTransfer(Transfer);
+
+            KeAcquireSpinLock(&DeviceExtension->WriteSpinLock, &OldIrql);
+        }
+        DeviceExtension->WriteSubmitting = FALSE;
+    }
+    KeReleaseSpinLock(&DeviceExtension->WriteSpinLock, OldIrql);
+}
+
+/*
+ * Moves writes that are done from the head of ActiveWrites to
+ * CompletionList. A write whose cancel routine is about to run is left for
+ * the cancel routine, which calls this again.
+ */
+_Requires_lock_held_(DeviceExtension->WriteSpinLock)
+static
+VOID
+Pl2303FinishWrites(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _Inout_ PLIST_ENTRY CompletionList)
+{
+    PWRITE_CONTEXT Context;
+    PIRP Irp;
+
+    while (!IsListEmpty(&DeviceExtension->ActiveWrites))
+    {
+        Irp = CONTAINING_RECORD(DeviceExtension->ActiveWrites.Flink, IRP, Tail.Overlay.ListEntry);
+        Context = Pl2303GetWriteContext(Irp);
+
+        if (Context->TransfersPending)
+            break;
+        if (Irp->IoStatus.Status == STATUS_PENDING)
+        {
+            if (Context->BytesSent < Pl2303GetWriteLength(Irp))
+                break;
+            Irp->IoStatus.Status = STATUS_SUCCESS;
+        }
+        if (!(Context->Flags & WRITE_CANCEL_ROUTINE_RAN) && !IoSetCancelRoutine(Irp, NULL))
+            break;
+
+        RemoveHeadList(&DeviceExtension->ActiveWrites);
+        InsertTailList(CompletionList, &Irp->Tail.Overlay.ListEntry);
+    }
+}
+
+/*
+ * Fails an active write with Status. Returns a mask of the transfers that
+ * must be cancelled once the write spin lock has been released. A coalesced
+ * transfer is only cancelled, or dropped if it is still being filled, once
+ * all writes staged in it have been aborted.
+ */
+_Requires_lock_held_(DeviceExtension->WriteSpinLock)
+static
+ULONG
+Pl2303AbortWrite(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ PIRP Irp,
+    _In_ NTSTATUS Status)
+{
+    PPIPE_TRANSFER Transfer;
+    ULONG CancelMask = 0;
+    ULONG StagedFlag;
+    ULONG i;
+
+    if (Irp->IoStatus.Status != STATUS_PENDING)
+        return 0;
+
+    Irp->IoStatus.Status = Status;
+
+    if (!DeviceExtension->WriteTransfers)
+        return 0;
+
+    StagedFlag = Pl2303GetWriteContext(Irp)->Flags & WRITE_STAGED_MASK;
+    if (StagedFlag)
+    {
+        i = (StagedFlag >> WRITE_STAGED_SHIFT) - 1;
+        Transfer = &DeviceExtension->WriteTransfers[i];
+        if (Pl2303IsStagingTransferInUse(DeviceExtension, Transfer))
+            return 0;
+
+        if (Transfer == DeviceExtension->WriteStaging)
+        {
+            DeviceExtension->WriteStaging = NULL;
+            Pl2303CompleteStagedWrites(DeviceExtension, Transfer, STATUS_CANCELLED, 0);
+            return 0;
+        }
+
+        Pl2303ReferenceWriteTransfer(DeviceExtension, Transfer);
+        return 1UL << i;
+    }
+
+    for (i = 0; i < DeviceExtension->WriteTransferCount; i++)
+    {
+        Transfer = &DeviceExtension->WriteTransfers[i];
+        if (Transfer->Request == Irp)
+        {
+            Pl2303ReferenceWriteTransfer(DeviceExtension, Transfer);
+            CancelMask |= 1UL << i;
+        }
+    }
+
+    return CancelMask;
+}
+
+static
+VOID
+Pl2303CompleteWrites(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _Inout_ PLIST_ENTRY CompletionList)
+{
+    PLIST_ENTRY ListEntry;
+    PIRP Irp;
+
+    while (!IsListEmpty(CompletionList))
+    {
+        ListEntry = RemoveHeadList(CompletionList);
+        Irp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+        Pl2303CountLatency(&DeviceExtension->RequestLatency[PL2303_LATENCY_WRITE],
+                           Pl2303GetWriteContext(Irp)->ArrivalTime);
+        IoCompleteRequest(Irp, IO_SERIAL_INCREMENT);
+    }
+}
+
+static
+VOID
+Pl2303CancelWriteTransfers(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ ULONG CancelMask)
+{
+    LIST_ENTRY CompletionList;
+    PPIPE_TRANSFER Transfer;
+    KIRQL OldIrql;
+    ULONG i;
+
+    if (!CancelMask)
+        return;
+
+    for (i = 0; i < DeviceExtension->WriteTransferCount; i++)
+    {
+        if (CancelMask & (1UL << i))
+            (VOID)IoCancelIrp(DeviceExtension->WriteTransfers[i].Irp);
+    }
+
+    InitializeListHead(&CompletionList);
+
+    KeAcquireSpinLock(&DeviceExtension->WriteSpinLock, &OldIrql);
+    for (i = 0; i < DeviceExtension->WriteTransferCount; i++)
+    {
+        Transfer = &DeviceExtension->WriteTransfers[i];
+        if (CancelMask & (1UL << i))
+            Pl2303DereferenceWriteTransfer(DeviceExtension, Transfer);
+    }
+    Pl2303PrepareWriteTransfers(DeviceExtension, &CompletionList);
+    KeReleaseSpinLock(&DeviceExtension->WriteSpinLock, OldIrql);
+
+    Pl2303SubmitWriteTransfers(DeviceExtension);
+    Pl2303CompleteWrites(DeviceExtension, &CompletionList);
+}
+
+_Function_class_(DRIVER_CANCEL)
+static
+VOID
+NTAPI
+Pl2303CancelWrite(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PIRP Irp)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    LIST_ENTRY CompletionList;
+    ULONG CancelMask;
+    KIRQL OldIrql;
+
+    IoReleaseCancelSpinLock(Irp->CancelIrql);
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                __FUNCTION__, DeviceObject,    Irp);
+
+    InitializeListHead(&CompletionList);
+
+    KeAcquireSpinLock(&DeviceExtension->WriteSpinLock, &OldIrql);
+    Pl2303GetWriteContext(Irp)->Flags |= WRITE_CANCEL_ROUTINE_RAN;
+    CancelMask = Pl2303AbortWrite(DeviceExtension, Irp, STATUS_CANCELLED);
+    Pl2303FinishWrites(DeviceExtension, &CompletionList);
+    Pl2303PrepareWriteTransfers(DeviceExtension, &CompletionList);
+    KeReleaseSpinLock(&DeviceExtension->WriteSpinLock, OldIrql);
+
+    Pl2303CancelWriteTransfers(DeviceExtension, CancelMask);
+    Pl2303SubmitWriteTransfers(DeviceExtension);
+    Pl2303CompleteWrites(DeviceExtension, &CompletionList);
+}
+
+NTSTATUS
+Pl2303Write(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PIRP Irp)
+{
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    LIST_ENTRY CompletionList;
+    KIRQL OldIrql;
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                __FUNCTION__, DeviceObject,    Irp);
+
+    Irp->IoStatus.Information = 0;
+    Pl2303GetWriteContext(Irp)->ArrivalTime = Pl2303QueryLatencyTime();
+
+    InitializeListHead(&CompletionList);
+
+    KeAcquireSpinLock(&DeviceExtension->WriteSpinLock, &OldIrql);
+    Status = Pl2303QueueIrp(&DeviceExtension->WriteQueue, Irp);
+    Pl2303PrepareWriteTransfers(DeviceExtension, &CompletionList);
+    KeReleaseSpinLock(&DeviceExtension->WriteSpinLock, OldIrql);
+
+    Pl2303SubmitWriteTransfers(DeviceExtension);
+    Pl2303CompleteWrites(DeviceExtension, &CompletionList);
+
+    return Status;
+}
+
+/*
+ * Sets or clears one of the SERIAL_TX_WAITING_* reasons for holding the
+ * transmit. Returns TRUE if that released the hold, in which case the caller
+ * calls Pl2303ResumeWrites once it has released its locks.
+ */
+BOOLEAN
+Pl2303SetWriteHold(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ ULONG Reason,
+    _In_ BOOLEAN Hold)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    ULONG OldReasons;
+    ULONG NewReasons;
+    KIRQL OldIrql;
+
+    KeAcquireSpinLock(&DeviceExtension->WriteSpinLock, &OldIrql);
+    OldReasons = DeviceExtension->WriteHoldReasons;
+    if (Hold)
+        NewReasons = OldReasons | Reason;
+    else
+        NewReasons = OldReasons & ~Reason;
+    DeviceExtension->WriteHoldReasons = NewReasons;
+    KeReleaseSpinLock(&DeviceExtension->WriteSpinLock, OldIrql);
+
+    if (OldReasons != NewReasons)
+    {
+        Pl2303Debug(         "%s. DeviceObject=%p, HoldReasons=0x%lx\n",
+                    __FUNCTION__, DeviceObject,    NewReasons);
+    }
+
+    return OldReasons && !NewReasons;
+}
+
+/*
+ * Reports the current hold reasons and the number of bytes that were
+ * written by the application but not yet accepted by the device.
+ */
+VOID
+Pl2303QueryWriteStatus(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Out_ PULONG HoldReasons,
+    _Out_ PULONG AmountInOutQueue)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PLIST_ENTRY ListEntry;
+    PIRP Irp;
+    ULONG Amount = 0;
+    KIRQL OldIrql;
+
+    KeAcquireSpinLock(&DeviceExtension->WriteSpinLock, &OldIrql);
+    *HoldReasons = DeviceExtension->WriteHoldReasons;
+    for (ListEntry = DeviceExtension->ActiveWrites.Flink;
+         ListEntry != &DeviceExtension->ActiveWrites;
+         ListEntry = ListEntry->Flink)
+    {
+        Irp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+        if (Irp->IoStatus.Status == STATUS_PENDING)
+            Amount += Pl2303GetWriteLength(Irp) - (ULONG)Irp->IoStatus.Information;
+    }
+    Amount += Pl2303QueryQueueLength(&DeviceExtension->WriteQueue);
+    KeReleaseSpinLock(&DeviceExtension->WriteSpinLock, OldIrql);
+
+    *AmountInOutQueue = Amount;
+}
+
+VOID
+Pl2303ResumeWrites(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    LIST_ENTRY CompletionList;
+    KIRQL OldIrql;
+
+    InitializeListHead(&CompletionList);
+
+    KeAcquireSpinLock(&DeviceExtension->WriteSpinLock, &OldIrql);
+    Pl2303PrepareWriteTransfers(DeviceExtension, &CompletionList);
+    KeReleaseSpinLock(&DeviceExtension->WriteSpinLock, OldIrql);
+
+    Pl2303SubmitWriteTransfers(DeviceExtension);
+    Pl2303CompleteWrites(DeviceExtension, &CompletionList);
+}
+
+/*
+ * Sends XOFF or XON if the receive throttle state differs from what the peer
+ * was last told. Only one such character is in flight at a time; when it
+ * completes, this is called again to catch up with any further change.
+ */
+VOID
+Pl2303SendFlowControlChar(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PPIPE_TRANSFER Transfer;
+    BOOLEAN Xoff;
+    KIRQL OldIrql;
+
+    NT_ASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
+
+    KeAcquireSpinLock(&DeviceExtension->ReadSpinLock, &OldIrql);
+    KeAcquireSpinLockAtDpcLevel(&DeviceExtension->WriteSpinLock);
+    Transfer = DeviceExtension->WriteFlowTransfer;
+    Xoff = DeviceExtension->ReadAutoReceive && DeviceExtension->ReadThrottled;
+    if (!DeviceExtension->WritesRunning || !Transfer ||
+        DeviceExtension->WriteFlowBusy || Transfer->References ||
+        Xoff == DeviceExtension->WriteXoffSent)
+    {
+        KeReleaseSpinLockFromDpcLevel(&DeviceExtension->WriteSpinLock);
+        KeReleaseSpinLock(&DeviceExtension->ReadSpinLock, OldIrql);
+        return;
+    }
+
+    DeviceExtension->WriteFlowBusy = TRUE;
+    DeviceExtension->WriteXoffSent = Xoff;
+    Transfer->Buffer[0] = Xoff ? DeviceExtension->ReadXoffChar : DeviceExtension->ReadXonChar;
+    Pl2303ReferenceWriteTransfer(DeviceExtension, Transfer);
+    Pl2303UsbPrepareWriteTransfer(Transfer, Transfer->Buffer, 1);
+    KeReleaseSpinLockFromDpcLevel(&DeviceExtension->WriteSpinLock);
+    KeReleaseSpinLock(&DeviceExtension->ReadSpinLock, OldIrql);
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Xoff=%u\n",
+                __FUNCTION__, DeviceObject,    Xoff);
+
+    Pl2303UsbSubmitTransfer(Transfer);
+}
+
+static
+VOID
+Pl2303FlowControlCharComplete(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PPIPE_TRANSFER Transfer,
+    _In_ NTSTATUS Status)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    KIRQL OldIrql;
+
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Warn(         "%s. Sending flow control character failed with %08lx\n",
+                   __FUNCTION__, Status);
+    }
+
+    KeAcquireSpinLock(&DeviceExtension->WriteSpinLock, &OldIrql);
+    /* A flush cancelled the character; send it again if writes go on */
+    if (Status == STATUS_CANCELLED)
+        DeviceExtension->WriteXoffSent = !DeviceExtension->WriteXoffSent;
+    DeviceExtension->WriteFlowBusy = FALSE;
+    Pl2303DereferenceWriteTransfer(DeviceExtension, Transfer);
+    KeReleaseSpinLock(&DeviceExtension->WriteSpinLock, OldIrql);
+
+    Pl2303SendFlowControlChar(DeviceObject);
+}
+
+VOID
+Pl2303WriteTransferComplete(
+    _In_ PPIPE_TRANSFER Transfer,
+    _In_ NTSTATUS Status,
+    _In_ ULONG Length)
+{
+    PDEVICE_OBJECT DeviceObject = Transfer->DeviceObject;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    LIST_ENTRY CompletionList;
+    PWRITE_CONTEXT Context;
+    ULONG CancelMask = 0;
+    BOOLEAN TxEmpty;
+    KIRQL OldIrql;
+    PIRP Irp;
+
+    NT_ASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
+
+    if (Transfer == DeviceExtension->WriteFlowTransfer)
+    {
+        Pl2303FlowControlCharComplete(DeviceObject, Transfer, Status);
+        return;
+    }
+
+    InitializeListHead(&CompletionList);
+
+    KeAcquireSpinLock(&DeviceExtension->WriteSpinLock, &OldIrql);
+    Irp = Transfer->Request;
+    NT_ASSERT(Irp);
+    Context = Pl2303GetWriteContext(Irp);
+    NT_ASSERT(Context->TransfersPending > 0);
+
+    if ((Context->Flags & WRITE_STAGED_MASK) == Pl2303GetStagedFlag(DeviceExtension, Transfer))
+    {
+        Pl2303CompleteStagedWrites(DeviceExtension, Transfer, Status, Length);
+    }
+    else
+    {
+        Transfer->Request = NULL;
+        Pl2303DereferenceWriteTransfer(DeviceExtension, Transfer);
+        Context->TransfersPending--;
+        Irp->IoStatus.Information += Length;
+
+        /* Don't let later chunks of a failed write reach the device */
+        if (!NT_SUCCESS(Status))
+            CancelMask = Pl2303AbortWrite(DeviceExtension, Irp, Status);
+    }
+
+    Pl2303FinishWrites(DeviceExtension, &CompletionList);
+    Pl2303PrepareWriteTransfers(DeviceExtension, &CompletionList);
+    TxEmpty = DeviceExtension->WriteTransferReferences == 0 &&
+              IsListEmpty(&DeviceExtension->ActiveWrites);
+    KeReleaseSpinLock(&DeviceExtension->WriteSpinLock, OldIrql);
+
+    Pl2303CancelWriteTransfers(DeviceExtension, CancelMask);
+    Pl2303SubmitWriteTransfers(DeviceExtension);
+    Pl2303CompleteWrites(DeviceExtension, &CompletionList);
+
+    if (TxEmpty)
+        Pl2303SignalEvents(DeviceObject, SERIAL_EV_TXEMPTY);
+}
+
+VOID
+Pl2303WriteTimeout(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    LIST_ENTRY CompletionList;
+    PLIST_ENTRY ListEntry;
+    PWRITE_CONTEXT Context;
+    ULONG CancelMask = 0;
+    KIRQL OldIrql;
+    ULONG Now;
+    PIRP Irp;
+
+    InitializeListHead(&CompletionList);
+
+    KeAcquireSpinLock(&DeviceExtension->WriteSpinLock, &OldIrql);
+    Now = Pl2303QueryTime();
+    if (DeviceExtension->WriteStaging)
+    {
+        if (Pl2303DeadlineExpired(DeviceExtension->WriteStagingDeadline, Now))
+            Pl2303FlushStagedWrites(DeviceExtension);
+        else
+            Pl2303ArmTimeoutTimer(DeviceExtension, DeviceExtension->WriteStagingDeadline);
+    }
+    for (ListEntry = DeviceExtension->ActiveWrites.Flink;
+         ListEntry != &DeviceExtension->ActiveWrites;
+         ListEntry = ListEntry->Flink)
+    {
+        Irp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+        Context = Pl2303GetWriteContext(Irp);
+        if (!(Context->Flags & WRITE_TIMEOUT_SET) ||
+            Irp->IoStatus.Status != STATUS_PENDING)
+        {
+            continue;
+        }
+
+        if (!Pl2303DeadlineExpired(*Pl2303GetWriteDeadline(Irp), Now))
+        {
+            Pl2303ArmTimeoutTimer(DeviceExtension, *Pl2303GetWriteDeadline(Irp));
+            continue;
+        }
+
+        Pl2303Debug(         "%s. Write %p timed out\n",
+                    __FUNCTION__, Irp);
+        CancelMask |= Pl2303AbortWrite(DeviceExtension, Irp, STATUS_TIMEOUT);
+    }
+    Pl2303FinishWrites(DeviceExtension, &CompletionList);
+    Pl2303PrepareWriteTransfers(DeviceExtension, &CompletionList);
+    KeReleaseSpinLock(&DeviceExtension->WriteSpinLock, OldIrql);
+
+    Pl2303CancelWriteTransfers(DeviceExtension, CancelMask);
+    Pl2303SubmitWriteTransfers(DeviceExtension);
+    Pl2303CompleteWrites(DeviceExtension, &CompletionList);
+}
+
+VOID
+Pl2303FlushWrites(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ NTSTATUS Status)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    LIST_ENTRY CompletionList;
+    PLIST_ENTRY ListEntry;
+    PPIPE_TRANSFER FlowTransfer = NULL;
+    ULONG CancelMask = 0;
+    KIRQL OldIrql;
+    PIRP Irp;
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Status=%08lx\n",
+                __FUNCTION__, DeviceObject,    Status);
+
+    InitializeListHead(&CompletionList);
+
+    KeAcquireSpinLock(&DeviceExtension->WriteSpinLock, &OldIrql);
+    for (ListEntry = DeviceExtension->ActiveWrites.Flink;
+         ListEntry != &DeviceExtension->ActiveWrites;
+         ListEntry = ListEntry->Flink)
+    {
+        Irp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+        CancelMask |= Pl2303AbortWrite(DeviceExtension, Irp, Status);
+    }
+    Pl2303FinishWrites(DeviceExtension, &CompletionList);
+    while ((Irp = Pl2303DequeueIrp(&DeviceExtension->WriteQueue)) != NULL)
+    {
+        Irp->IoStatus.Status = Status;
+        InsertTailList(&CompletionList, &Irp->Tail.Overlay.ListEntry);
+    }
+    if (DeviceExtension->WriteFlowBusy)
+    {
+        FlowTransfer = DeviceExtension->WriteFlowTransfer;
+        Pl2303ReferenceWriteTransfer(DeviceExtension, FlowTransfer);
+    }
+    KeReleaseSpinLock(&DeviceExtension->WriteSpinLock, OldIrql);
+
+    /* An XON/XOFF character in flight also keeps WriteIdleEvent from being set */
+    if (FlowTransfer)
+    {
+        (VOID)IoCancelIrp(FlowTransfer->Irp);
+        KeAcquireSpinLock(&DeviceExtension->WriteSpinLock, &OldIrql);
+        Pl2303DereferenceWriteTransfer(DeviceExtension, FlowTransfer);
+        KeReleaseSpinLock(&DeviceExtension->WriteSpinLock, OldIrql);
+        Pl2303SendFlowControlChar(DeviceObject);
+    }
+
+    Pl2303CancelWriteTransfers(DeviceExtension, CancelMask);
+    Pl2303CompleteWrites(DeviceExtension, &CompletionList);
+}
+
+NTSTATUS
+Pl2303StartWrites(
+    _In_ PDEVICE_OBJECT DeviceObject)
+{
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PPIPE_TRANSFER Transfers;
+    PPIPE_TRANSFER FlowTransfer;
+    LIST_ENTRY CompletionList;
+    ULONG CoalesceSize;
+    KIRQL OldIrql;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p\n",
+                __FUNCTION__, DeviceObject);
+
+    NT_ASSERT(DeviceExtension->WriteTransfers == NULL);
+    NT_ASSERT(DeviceExtension->WriteTransferCount >= 1 &&
+              DeviceExtension->WriteTransferCount <= PL2303_MAX_WRITE_TRANSFER_COUNT);
+
+    switch (DeviceExtension->WriteCoalescing)
+    {
+        case PL2303_WRITE_COALESCE_PACKET:
+            CoalesceSize = DeviceExtension->WriteMaxPacketSize;
+            break;
+        case PL2303_WRITE_COALESCE_TRANSFER:
+            CoalesceSize = DeviceExtension->WriteTransferSize;
+            break;
+        default:
+            CoalesceSize = 0;
+            break;
+    }
+    if (CoalesceSize > DeviceExtension->WriteTransferSize)
+        CoalesceSize = DeviceExtension->WriteTransferSize;
+
+    Status = Pl2303UsbAllocateTransfers(DeviceObject,
+                                        DeviceExtension->WriteTransferCount,
+                                        CoalesceSize,
+                                        &Transfers);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. Pl2303UsbAllocateTransfers failed with %08lx\n",
+                    __FUNCTION__, Status);
+        return Status;
+    }
+
+    Status = Pl2303UsbAllocateTransfers(DeviceObject, 1, 1, &FlowTransfer);
+    if (!NT_SUCCESS(Status))
+    {
+        Pl2303Error(         "%s. Pl2303UsbAllocateTransfers failed with %08lx\n",
+                    __FUNCTION__, Status);
+        Pl2303UsbFreeTransfers(Transfers, DeviceExtension->WriteTransferCount);
+        return Status;
+    }
+
+    KeInitializeEvent(&DeviceExtension->WriteIdleEvent, NotificationEvent, TRUE);
+    InitializeListHead(&CompletionList);
+
+    KeAcquireSpinLock(&DeviceExtension->WriteSpinLock, &OldIrql);
+    DeviceExtension->WriteTransfers = Transfers;
+    DeviceExtension->WriteTransferReferences = 0;
+    DeviceExtension->WriteCoalesceSize = CoalesceSize;
+    DeviceExtension->WriteStaging = NULL;
+    DeviceExtension->WriteFlowTransfer = FlowTransfer;
+    DeviceExtension->WriteFlowBusy = FALSE;
+    DeviceExtension->WriteXoffSent = FALSE;
+    DeviceExtension->WriteHoldReasons = 0;
+    DeviceExtension->WritesRunning = TRUE;
+    Pl2303PrepareWriteTransfers(DeviceExtension, &CompletionList);
+    KeReleaseSpinLock(&DeviceExtension->WriteSpinLock, OldIrql);
+
+    /* Send writes that arrived while the device was stopped */
+    Pl2303SubmitWriteTransfers(DeviceExtension);
+    Pl2303CompleteWrites(DeviceExtension, &CompletionList);
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+Pl2303StopWrites(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ NTSTATUS Status)
+{
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PPIPE_TRANSFER Transfers;
+    PPIPE_TRANSFER FlowTransfer;
+    KIRQL OldIrql;
+
+    PAGED_CODE();
+
+    Pl2303Debug(         "%s. DeviceObject=%p, Status=%08lx\n",
+                __FUNCTION__, DeviceObject,    Status);
+
+    KeAcquireSpinLock(&DeviceExtension->WriteSpinLock, &OldIrql);
+    DeviceExtension->WritesRunning = FALSE;
+    KeReleaseSpinLock(&DeviceExtension->WriteSpinLock, OldIrql);
+
+    Pl2303FlushWrites(DeviceObject, Status);
+
+    Transfers = DeviceExtension->WriteTransfers;
+    if (!Transfers)
+        return;
+
+    (VOID)KeWaitForSingleObject(&DeviceExtension->WriteIdleEvent,
+                                Executive,
+                                KernelMode,
+                                FALSE,
+                                NULL);
+
+    KeAcquireSpinLock(&DeviceExtension->WriteSpinLock, &OldIrql);
+    DeviceExtension->WriteTransfers = NULL;
+    FlowTransfer = DeviceExtension->WriteFlowTransfer;
+    DeviceExtension->WriteFlowTransfer = NULL;
+    KeReleaseSpinLock(&DeviceExtension->WriteSpinLock, OldIrql);
+    Pl2303UsbFreeTransfers(Transfers, DeviceExtension->WriteTransferCount);
+    Pl2303UsbFreeTransfers(FlowTransfer, 1);
+}
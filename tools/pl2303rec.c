@@ -0,0 +1,378 @@
+/*
+ * PL2303 Driver flight recorder decoder
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Usage:
+ *   pl2303rec \\.\Pl2303Control0            print the recorder as a timeline
+ *   pl2303rec \\.\Pl2303Control0 dump.bin   save the recorder to dump.bin
+ *   pl2303rec -d dump.bin                   print a saved recorder as a timeline
+ *
+ * Every port has a control device \\.\Pl2303Control<n> serving the private
+ * IOCTLs, so the port can stay open in another application meanwhile. Only
+ * administrators can open it.
+ */
+
+#include <windows.h>
+#include <winioctl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "../pl2303/pl2303ioctl.h"
+
+static
+PPL2303_FLIGHT_RECORDER
+ReadRecorderFromDevice(
+    _In_ PCSTR DeviceName,
+    _Out_ PULONG Length)
+{
+    HANDLE DeviceHandle;
+    PL2303_FLIGHT_RECORDER Header;
+    PPL2303_FLIGHT_RECORDER Recorder;
+    DWORD BytesReturned;
+
+    DeviceHandle = CreateFileA(DeviceName,
+                               GENERIC_READ | GENERIC_WRITE,
+                               FILE_SHARE_READ | FILE_SHARE_WRITE,
+                               NULL,
+                               OPEN_EXISTING,
+                               0,
+                               NULL);
+    if (DeviceHandle == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "Opening %s failed with %lu\n", DeviceName, GetLastError());
+        return NULL;
+    }
+
+    /* Ask for the header first to learn the number of records */
+    if (!DeviceIoControl(DeviceHandle,
+                         IOCTL_PL2303_GET_FLIGHT_RECORDER,
+                         NULL,
+                         0,
+                         &Header,
+                         FIELD_OFFSET(PL2303_FLIGHT_RECORDER, Records),
+                         &BytesReturned,
+                         NULL) &&
+        GetLastError() != ERROR_MORE_DATA)
+    {
+        fprintf(stderr, "IOCTL_PL2303_GET_FLIGHT_RECORDER failed with %lu\n", GetLastError());
+        CloseHandle(DeviceHandle);
+        return NULL;
+    }
+
+    *Length = FIELD_OFFSET(PL2303_FLIGHT_RECORDER, Records[Header.RecordCount]);
+    Recorder = malloc(*Length);
+    if (!Recorder)
+    {
+        fprintf(stderr, "Allocating %lu bytes failed\n", *Length);
+        CloseHandle(DeviceHandle);
+        return NULL;
+    }
+
+    if (!DeviceIoControl(DeviceHandle,
+                         IOCTL_PL2303_GET_FLIGHT_RECORDER,
+                         NULL,
+                         0,
+                         Recorder,
+                         *Length,
+                         &BytesReturned,
+                         NULL))
+    {
+        fprintf(stderr, "IOCTL_PL2303_GET_FLIGHT_RECORDER failed with %lu\n", GetLastError());
+        free(Recorder);
+        CloseHandle(DeviceHandle);
+        return NULL;
+    }
+
+    CloseHandle(DeviceHandle);
+    return Recorder;
+}
+
+static
+PPL2303_FLIGHT_RECORDER
+ReadRecorderFromFile(
+    _In_ PCSTR FileName,
+    _Out_ PULONG Length)
+{
+    FILE *File;
+    long FileSize;
+    PL2303_FLIGHT_RECORDER Header;
+    PPL2303_FLIGHT_RECORDER Recorder;
+
+    File = fopen(FileName, "rb");
+    if (!File)
+    {
+        fprintf(stderr, "Opening %s failed\n", FileName);
+        return NULL;
+    }
+
+    if (fseek(File, 0, SEEK_END) ||
+        (FileSize = ftell(File)) < 0 ||
+        fseek(File, 0, SEEK_SET))
+    {
+        fprintf(stderr, "Determining the size of %s failed\n", FileName);
+        fclose(File);
+        return NULL;
+    }
+
+    if (fread(&Header, FIELD_OFFSET(PL2303_FLIGHT_RECORDER, Records), 1, File) != 1)
+    {
+        fprintf(stderr, "%s is not a recorder dump\n", FileName);
+        fclose(File);
+        return NULL;
+    }
+
+    /* The record count comes from the file, so it must fit in the file */
+    if (Header.RecordCount > ((ULONG)FileSize - FIELD_OFFSET(PL2303_FLIGHT_RECORDER, Records)) /
+                             sizeof(PL2303_RECORD))
+    {
+        fprintf(stderr, "%s is truncated\n", FileName);
+        fclose(File);
+        return NULL;
+    }
+
+    *Length = FIELD_OFFSET(PL2303_FLIGHT_RECORDER, Records[Header.RecordCount]);
+    Recorder = malloc(*Length);
+    if (!Recorder)
+    {
+        fprintf(stderr, "Allocating %lu bytes failed\n", *Length);
+        fclose(File);
+        return NULL;
+    }
+
+    *Recorder = Header;
+    if (fread(Recorder->Records, sizeof(PL2303_RECORD), Header.RecordCount, File) != Header.RecordCount)
+    {
+        fprintf(stderr, "%s is truncated\n", FileName);
+        free(Recorder);
+        fclose(File);
+        return NULL;
+    }
+
+    fclose(File);
+    return Recorder;
+}
+
+static
+int
+__cdecl
+CompareRecords(
+    _In_ const void *Left,
+    _In_ const void *Right)
+{
+    const PL2303_RECORD *LeftRecord = Left;
+    const PL2303_RECORD *RightRecord = Right;
+
+    /* Sequence numbers may wrap around, compare their distance */
+    return (LONG)(LeftRecord->Sequence - RightRecord->Sequence);
+}
+
+static
+PCSTR
+GetMajorFunctionName(
+    _In_ UCHAR MajorFunction)
+{
+    switch (MajorFunction)
+    {
+        case 0x00: return "CREATE";
+        case 0x02: return "CLOSE";
+        case 0x03: return "READ";
+        case 0x04: return "WRITE";
+        case 0x0e: return "DEVICE_CONTROL";
+        case 0x0f: return "INTERNAL_DEVICE_CONTROL";
+        case 0x16: return "POWER";
+        case 0x17: return "SYSTEM_CONTROL";
+        case 0x1b: return "PNP";
+        default: return "?";
+    }
+}
+
+static
+PCSTR
+GetPipeName(
+    _In_ UCHAR Pipe)
+{
+    switch (Pipe)
+    {
+        case PL2303_RECORD_PIPE_CONTROL: return "control";
+        case PL2303_RECORD_PIPE_BULK_IN: return "bulk-in";
+        case PL2303_RECORD_PIPE_BULK_OUT: return "bulk-out";
+        case PL2303_RECORD_PIPE_INTERRUPT_IN: return "interrupt-in";
+        default: return "?";
+    }
+}
+
+static
+PCSTR
+GetPnpStateName(
+    _In_ ULONG PnpState)
+{
+    static const PCSTR Names[] =
+    {
+        "NotStarted",
+        "Started",
+        "StopPending",
+        "Stopped",
+        "RemovePending",
+        "SurpriseRemovePending",
+        "Deleted",
+    };
+
+    if (PnpState < RTL_NUMBER_OF(Names))
+        return Names[PnpState];
+    return "?";
+}
+
+/*
+ * Prints one line per record with the time since the first record and since
+ * the previous one, in microseconds. URB completions also show the time
+ * since the matching submit, which is what latency outliers show up in.
+ */
+static
+VOID
+PrintTimeline(
+    _Inout_ PPL2303_FLIGHT_RECORDER Recorder)
+{
+    PPL2303_RECORD Records = Recorder->Records;
+    ULONG Count = Recorder->RecordCount;
+    ULONG First;
+    ULONG i;
+    ULONG j;
+    double Scale;
+    PL2303_RECORD *Record;
+
+    if (!Recorder->Frequency)
+    {
+        fprintf(stderr, "Invalid timestamp frequency\n");
+        return;
+    }
+    Scale = 1000000.0 / (double)Recorder->Frequency;
+
+    qsort(Records, Count, sizeof(Records[0]), CompareRecords);
+    for (First = 0; First < Count && !Records[First].Sequence; First++)
+        ;
+
+    printf("%10s %12s %10s  %s\n", "Sequence", "Time (us)", "Delta", "Event");
+    for (i = First; i < Count; i++)
+    {
+        Record = &Records[i];
+        printf("%10lu %12.1f %10.1f  ",
+               Record->Sequence,
+               (Record->Timestamp - Records[First].Timestamp) * Scale,
+               i > First ? (Record->Timestamp - Records[i - 1].Timestamp) * Scale : 0.0);
+
+        switch (Record->Type)
+        {
+            case PL2303_RECORD_IRP:
+                printf("IRP #%lu %s size=%lu data=0x%lx\n",
+                       Record->Object,
+                       GetMajorFunctionName(Record->Code),
+                       Record->Size,
+                       Record->Data);
+                break;
+            case PL2303_RECORD_URB_SUBMIT:
+                printf("URB #%lu submit %s size=%lu function=0x%lx\n",
+                       Record->Object,
+                       GetPipeName(Record->Code),
+                       Record->Size,
+                       Record->Data);
+                break;
+            case PL2303_RECORD_URB_COMPLETE:
+                printf("URB #%lu complete %s size=%lu usbd=%08lx status=%08lx",
+                       Record->Object,
+                       GetPipeName(Record->Code),
+                       Record->Size,
+                       Record->Status,
+                       Record->Data);
+                for (j = i; j-- > First; )
+                {
+                    if (Records[j].Object == Record->Object &&
+                        Records[j].Type == PL2303_RECORD_URB_SUBMIT)
+                    {
+                        printf(" latency=%.1f",
+                               (Record->Timestamp - Records[j].Timestamp) * Scale);
+                        break;
+                    }
+                }
+                printf("\n");
+                break;
+            case PL2303_RECORD_STATUS:
+                printf("STATUS state=0x%02x modem=0x%02lx errors=0x%lx\n",
+                       Record->Code,
+                       Record->Status,
+                       Record->Data);
+                break;
+            case PL2303_RECORD_PNP:
+                printf("PNP minor=0x%02x state=%s\n",
+                       Record->Code,
+                       GetPnpStateName(Record->Data));
+                break;
+            default:
+                printf("Unknown record type %u\n", Record->Type);
+        }
+    }
+}
+
+int
+__cdecl
+main(
+    _In_ int argc,
+    _In_reads_(argc) char **argv)
+{
+    PPL2303_FLIGHT_RECORDER Recorder;
+    ULONG Length;
+    FILE *File;
+
+    if (argc == 3 && !strcmp(argv[1], "-d"))
+    {
+        Recorder = ReadRecorderFromFile(argv[2], &Length);
+    }
+    else if (argc == 2 || argc == 3)
+    {
+        Recorder = ReadRecorderFromDevice(argv[1], &Length);
+    }
+    else
+    {
+        fprintf(stderr, "Usage: %s <device> [dump file]\n"
+                        "       %s -d <dump file>\n", argv[0], argv[0]);
+        return 1;
+    }
+
+    if (!Recorder)
+        return 1;
+
+    if (argc == 3 && strcmp(argv[1], "-d"))
+    {
+        File = fopen(argv[2], "wb");
+        if (!File || fwrite(Recorder, Length, 1, File) != 1)
+        {
+            fprintf(stderr, "Writing %s failed\n", argv[2]);
+            if (File)
+                fclose(File);
+            free(Recorder);
+            return 1;
+        }
+        fclose(File);
+    }
+    else
+    {
+        PrintTimeline(Recorder);
+    }
+
+    free(Recorder);
+    return 0;
+}